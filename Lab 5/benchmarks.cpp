@@ -0,0 +1,1056 @@
+#include "benchmarks.h"
+#include "entities.h"
+#include "frustum_culling.h"
+#include "instancing.h"
+#include "job_system.h"
+#include "mesh_bvh.h"
+#include "occlusion_culling.h"
+#include "particles.h"
+#include "projectiles.h"
+#include "render_queue.h"
+#include "spatial_hash.h"
+#include <algorithm>
+#include <chrono>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+typedef std::chrono::high_resolution_clock bench_clock;
+
+static double elapsed_ms (bench_clock::time_point start) {
+	return std::chrono::duration<double, std::milli> (bench_clock::now () - start).count ();
+}
+
+// Workers for the benchmarks that spread their work out, big enough not to
+// want on the stack and only one exists at a time
+static JobSystem bench_job_system;
+
+// optional count argument following the flag
+static int arg_count (int argc, char** argv, int i, int fallback) {
+	if (i + 1 < argc && atoi (argv[i + 1]) > 0) {
+		return atoi (argv[i + 1]);
+	}
+	return fallback;
+}
+
+bool run_benchmark (int argc, char** argv) {
+	bool ran = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp (argv[i], "--bench-render-queue") == 0) {
+			bench_render_queue (arg_count (argc, argv, i, 10000));
+			ran = true;
+		}
+		if (strcmp (argv[i], "--bench-instancing") == 0) {
+			bool has_trees = arg_count (argc, argv, i, 0) > 0;
+			bench_instancing (arg_count (argc, argv, i, 50000), has_trees ? arg_count (argc, argv, i + 1, 10000) : 10000);
+			ran = true;
+		}
+		if (strcmp (argv[i], "--bench-occlusion") == 0) {
+			bool has_trees = arg_count (argc, argv, i, 0) > 0;
+			bench_occlusion (arg_count (argc, argv, i, 2000), has_trees ? arg_count (argc, argv, i + 1, 2000) : 2000);
+			ran = true;
+		}
+		if (strcmp (argv[i], "--bench-particles") == 0) {
+			bench_particles (arg_count (argc, argv, i, 1000000));
+			ran = true;
+		}
+		if (strcmp (argv[i], "--bench-entities") == 0) {
+			bench_entities (arg_count (argc, argv, i, 100000));
+			ran = true;
+		}
+		if (strcmp (argv[i], "--bench-broadphase") == 0) {
+			bench_broadphase (arg_count (argc, argv, i, 100000));
+			ran = true;
+		}
+		if (strcmp (argv[i], "--bench-bvh") == 0) {
+			bench_bvh (arg_count (argc, argv, i, 100000));
+			ran = true;
+		}
+		if (strcmp (argv[i], "--bench-projectiles") == 0) {
+			bench_projectiles (arg_count (argc, argv, i, 100000));
+			ran = true;
+		}
+		if (strcmp (argv[i], "--bench-jobs") == 0) {
+			bool has_snowmen = arg_count (argc, argv, i, 0) > 0;
+			bench_jobs (arg_count (argc, argv, i, 100000), has_snowmen ? arg_count (argc, argv, i + 1, 0) : 0);
+			ran = true;
+		}
+		if (strcmp (argv[i], "--bench-frustum-culling") == 0) {
+			bench_frustum_culling (arg_count (argc, argv, i, 1000000));
+			ran = true;
+		}
+	}
+	return ran;
+}
+
+/*-----------------------------------RENDER QUEUE-------------------------------------*/
+
+void bench_render_queue (int packet_count) {
+	const int iterations = 200;
+	RenderQueue queue;
+	queue.far_plane = 200.0f;
+	srand (1234);
+
+	// a scene's worth of packets in random submission order
+	for (int i = 0; i < packet_count; i++) {
+		DrawPacket p;
+		p.program = 1 + rand () % 4;
+		p.texture = 1 + rand () % 64;
+		p.vao = 1 + rand () % 32;
+		p.first = 0;
+		p.count = 36;
+		p.indexed = false;
+		p.instance_count = 0;
+		p.first_instance = 0;
+		p.depth = (rand () % 20000) * 0.01f;
+		p.material = rand () % 8;
+		p.layer = (rand () % 10 == 0) ? RENDER_LAYER_TRANSPARENT : RENDER_LAYER_OPAQUE;
+		p.transform = push_transform (queue, identity_mat4 ());
+		submit_packet (queue, p);
+	}
+
+	double total_ms = 0.0, best_ms = 1e9;
+	for (int it = 0; it < iterations; it++) {
+		sort_render_queue (queue);
+		total_ms += queue.stats.sort_ms;
+		best_ms = std::min (best_ms, queue.stats.sort_ms);
+	}
+
+	// reference: comparison sort of the same keys
+	std::vector<unsigned long long> reference (queue.packets.size ());
+	double std_sort_ms = 0.0;
+	for (int it = 0; it < iterations; it++) {
+		for (size_t i = 0; i < reference.size (); i++) {
+			reference[i] = make_sort_key (queue.packets[i], queue.far_plane);
+		}
+		bench_clock::time_point start = bench_clock::now ();
+		std::sort (reference.begin (), reference.end ());
+		std_sort_ms += elapsed_ms (start);
+	}
+	bool sorted_ok = reference == queue.keys;
+
+	int unsorted = count_unsorted_state_changes (queue);
+	int sorted = count_state_changes (queue, queue.order);
+
+	printf ("Render queue, %d packets, %d iterations\n", packet_count, iterations);
+	printf ("  radix sort:  %.3f ms avg, %.3f ms best\n", total_ms / iterations, best_ms);
+	printf ("  std::sort:   %.3f ms avg (reference)%s\n", std_sort_ms / iterations, sorted_ok ? "" : "  ** ORDER MISMATCH **");
+	printf ("  state changes: %d unsorted, %d sorted, %d avoided (%.1f%%)\n",
+		unsorted, sorted, unsorted - sorted, 100.0 * (unsorted - sorted) / (unsorted > 0 ? unsorted : 1));
+}
+
+/*-----------------------------------INSTANCING---------------------------------------*/
+
+// CPU side of the instanced path: the static forest is built once, the crowd
+// (one body and two waving arms each) is rebuilt every frame. main then draws
+// the same counts through the headless path, which gives the frame time.
+void bench_instancing (int tree_count, int snowman_count) {
+	const int iterations = 100;
+	srand (1234);
+	InstanceBatch trees, snowmen, arms;
+	trees.dirty = snowmen.dirty = arms.dirty = false;
+	trees.local_bounds.center = snowmen.local_bounds.center = arms.local_bounds.center = vec3 (0.0f, 0.0f, 0.0f);
+	trees.local_bounds.radius = snowmen.local_bounds.radius = arms.local_bounds.radius = 1.0f;
+
+	bench_clock::time_point start = bench_clock::now ();
+	for (int i = 0; i < tree_count; i++) {
+		mat4 tree = identity_mat4 ();
+		tree = rotate_x_deg (tree, -90);
+		tree = scale (tree, vec3 (2.0f, 2.0f, 2.0f));
+		tree = translate (tree, vec3 ((float)(rand () % 380 - 190), 0.0f, (float)(rand () % 380 - 190)));
+		add_instance (trees, tree);
+	}
+	double forest_ms = elapsed_ms (start);
+
+	std::vector<vec3> positions (snowman_count);
+	for (int i = 0; i < snowman_count; i++) {
+		positions[i] = vec3 ((float)(rand () % 380 - 190), 0.0f, (float)(rand () % 380 - 190));
+	}
+	mat4 arm_base = identity_mat4 ();
+	arm_base = scale (arm_base, vec3 (0.2f, 0.2f, 0.2f));
+	arm_base = translate (arm_base, vec3 (0.8f, 2.5f, 0.0f));
+
+	double crowd_ms = 0.0;
+	for (int it = 0; it < iterations; it++) {
+		start = bench_clock::now ();
+		clear_instances (snowmen);
+		clear_instances (arms);
+		for (int i = 0; i < snowman_count; i++) {
+			mat4 body = identity_mat4 ();
+			body.m[12] = positions[i].v[0];
+			body.m[14] = positions[i].v[2];
+			add_instance (snowmen, body);
+			add_instance (arms, body * arm_base, (float)((it + i) % 90));
+			add_instance (arms, body * arm_base, (float)(90 - (it + i) % 90));
+		}
+		crowd_ms += elapsed_ms (start);
+	}
+
+	size_t stream_bytes = (snowmen.instances.size () + arms.instances.size ()) * sizeof (InstanceData);
+	printf ("Instancing, %d trees, %d snowmen (%d arms), %d iterations\n", tree_count, snowman_count, snowman_count * 2, iterations);
+	printf ("  static forest build:  %.3f ms once, %.2f MB uploaded once\n", forest_ms, trees.instances.size () * sizeof (InstanceData) / (1024.0 * 1024.0));
+	printf ("  crowd rebuild:        %.3f ms per frame, %.2f MB streamed per frame\n", crowd_ms / iterations, stream_bytes / (1024.0 * 1024.0));
+}
+
+/*-----------------------------------FRUSTUM CULLING----------------------------------*/
+
+// Spheres scattered over the whole 400x400 ground with the scene's camera in
+// the middle, so roughly the fraction in front of the camera survives.
+void bench_frustum_culling (int sphere_count) {
+	const int iterations = 50;
+	srand (1234);
+	SphereSoA spheres;
+	for (int i = 0; i < sphere_count; i++) {
+		BoundingSphere s;
+		s.center = vec3 ((float)(rand () % 400 - 200), (float)(rand () % 20), (float)(rand () % 400 - 200));
+		s.radius = 0.5f + (rand () % 100) * 0.03f;
+		add_sphere (spheres, s);
+	}
+	vec3 eye (0.0f, 1.0f, 5.0f);
+	mat4 view = look_at (eye, eye + vec3 (0.0f, 0.0f, 1.0f), vec3 (0.0f, 1.0f, 0.0f));
+	mat4 proj = perspective (45.0f, 16.0f / 9.0f, 0.1f, 200.0f);
+	Frustum frustum = extract_frustum (proj * view);
+
+	std::vector<unsigned int> visible, visible_scalar;
+	int count = 0, count_scalar = 0;
+	double simd_ms = 1e9, scalar_ms = 1e9;
+	for (int it = 0; it < iterations; it++) {
+		bench_clock::time_point start = bench_clock::now ();
+		count = cull_spheres (frustum, spheres, visible);
+		simd_ms = std::min (simd_ms, elapsed_ms (start));
+
+		start = bench_clock::now ();
+		count_scalar = cull_spheres_scalar (frustum, spheres, visible_scalar);
+		scalar_ms = std::min (scalar_ms, elapsed_ms (start));
+	}
+	bool same = visible == visible_scalar;
+
+	printf ("Frustum culling, %d spheres, best of %d iterations\n", sphere_count, iterations);
+	printf ("  SIMD (%d wide): %.3f ms, %.0f spheres/us\n", cull_simd_width (), simd_ms, sphere_count / (simd_ms * 1000.0));
+	printf ("  scalar:        %.3f ms, %.0f spheres/us (reference)%s\n", scalar_ms, sphere_count / (scalar_ms * 1000.0), same ? "" : "  ** RESULT MISMATCH **");
+	printf ("  %d visible, %d culled (%d visible scalar)\n", count, sphere_count - count, count_scalar);
+}
+
+/*-----------------------------------OCCLUSION CULLING--------------------------------*/
+
+// A dense forest around the scene's camera with snowmen hiding among the
+// trees. The trees near the camera are drawn as occluders, then every tree
+// and snowman in the frustum is tested. Writes occlusion.png.
+void bench_occlusion (int tree_count, int snowman_count) {
+	const int iterations = 20;
+	const float occluder_distance = 40.0f;
+	srand (1234);
+	vec3 eye (0.0f, 2.0f, -15.0f);
+	mat4 view = look_at (eye, eye + vec3 (0.0f, 0.0f, 1.0f), vec3 (0.0f, 1.0f, 0.0f));
+	mat4 proj = perspective (45.0f, 1200.0f / 800.0f, 0.1f, 200.0f);
+	mat4 view_proj = proj * view;
+	Frustum frustum = extract_frustum (view_proj);
+
+	// same meshes and bounds as the scene: trees are z up and stood upright by their matrix
+	BoundingSphere tree_bounds, snowman_bounds;
+	tree_bounds.center = vec3 (0.0f, 0.0f, 1.06f);
+	tree_bounds.radius = 1.15f;
+	snowman_bounds.center = vec3 (-0.02f, 1.97f, -0.01f);
+	snowman_bounds.radius = 1.95f;
+	InstanceBatch trees, snowmen;
+	trees.local_bounds = tree_bounds;
+	snowmen.local_bounds = snowman_bounds;
+	for (int i = 0; i < tree_count; i++) {
+		mat4 tree = identity_mat4 ();
+		tree = rotate_x_deg (tree, -90);
+		tree = scale (tree, vec3 (2.0f, 2.0f, 2.0f));
+		tree = translate (tree, vec3 ((rand () % 2000 - 1000) * 0.1f, 0.0f, (rand () % 2000 - 1000) * 0.1f));
+		add_instance (trees, tree);
+	}
+	for (int i = 0; i < snowman_count; i++) {
+		mat4 body = identity_mat4 ();
+		body = translate (body, vec3 ((rand () % 2000 - 1000) * 0.1f, 0.0f, (rand () % 2000 - 1000) * 0.1f));
+		add_instance (snowmen, body);
+	}
+	OccluderMesh tree_occluder;
+	make_tree_occluder (tree_occluder);
+
+	int max_threads = (int)std::thread::hardware_concurrency ();
+	if (max_threads < 1) {
+		max_threads = 1;
+	}
+	OcclusionBuffer buffer;
+	printf ("Occlusion culling, %d trees, %d snowmen, %d iterations\n", tree_count, snowman_count, iterations);
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		create_job_system (bench_job_system, threads);
+		create_occlusion_buffer (buffer, 300, 200, 0.1f, &bench_job_system);
+		double setup_ms = 0.0, raster_ms = 0.0, test_ms = 0.0;
+		CullStats stats;
+		for (int it = 0; it < iterations; it++) {
+			bench_clock::time_point start = bench_clock::now ();
+			begin_occlusion_frame (buffer, view_proj);
+			for (size_t i = 0; i < trees.instances.size (); i++) {
+				float dx = trees.bounds.x[i] - eye.v[0], dz = trees.bounds.z[i] - eye.v[2];
+				if (dx * dx + dz * dz > occluder_distance * occluder_distance || !sphere_in_frustum (frustum, sphere_at (trees.bounds, (int)i))) {
+					continue;
+				}
+				mat4 model;
+				memcpy (model.m, trees.instances[i].model, sizeof (model.m));
+				add_occluder (buffer, tree_occluder, model);
+			}
+			setup_ms += elapsed_ms (start);
+			rasterize_occluders (buffer);
+			raster_ms += buffer.stats.raster_ms;
+
+			start = bench_clock::now ();
+			stats.tested = stats.visible = 0;
+			stats.kernel_ms = 0.0;
+			cull_instances (trees, &frustum, &buffer, stats);
+			cull_instances (snowmen, &frustum, &buffer, stats);
+			test_ms += elapsed_ms (start);
+		}
+		printf ("  %d thread%s: setup %.3f ms, raster %.3f ms, cull %.3f ms per frame\n",
+			threads, threads > 1 ? "s" : " ", setup_ms / iterations, raster_ms / iterations, test_ms / iterations);
+		destroy_job_system (bench_job_system);
+		if (threads * 2 > max_threads) {
+			printf ("  %d occluders (%d triangles), %d in the frustum, %d occluded, %d drawn (%d snowmen)\n",
+				buffer.stats.occluders, buffer.stats.triangles, buffer.stats.tested, buffer.stats.occluded,
+				(int)(trees.visible_instances.size () + snowmen.visible_instances.size ()), (int)snowmen.visible_instances.size ());
+		}
+	}
+	if (write_occlusion_png (buffer, "occlusion.png", OCCLUSION_DUMP_DEPTH)) {
+		printf ("  wrote occlusion.png\n");
+	}
+}
+
+/*-----------------------------------PARTICLES----------------------------------------*/
+
+// The scene's snowfall at 60 Hz: a box of snow that never dies and wraps
+// around, so every particle is moved every frame. The kernel is timed on 1,
+// 2, 4... threads against the one at a time reference.
+void bench_particles (int particle_count) {
+	const int iterations = 100;
+	const float dt = 1.0f / 60.0f;
+	ParticlePool pool, reference;
+	create_particle_pool (pool, particle_count);
+	pool.wrap = true;
+	pool.wrap_min = vec3 (-60.0f, 0.0f, -60.0f);
+	pool.wrap_size = vec3 (120.0f, 30.0f, 120.0f);
+	ParticleEmitter snow;
+	snow.position = vec3 (0.0f, 15.0f, 0.0f);
+	snow.spread = vec3 (60.0f, 15.0f, 60.0f);
+	snow.velocity = vec3 (0.3f, -1.5f, 0.1f);
+	snow.velocity_spread = vec3 (0.3f, 0.5f, 0.3f);
+	snow.life_min = snow.life_max = 0.0f;
+	snow.size_min = 0.03f;
+	snow.size_max = 0.06f;
+	snow.rate = 0.0f;
+	snow.accumulator = 0.0f;
+	fill_particles (pool, snow, particle_count);
+	reference = pool;
+
+	// one step each, the results should match exactly
+	update_particles (pool, dt, NULL);
+	update_particles_scalar (reference, dt);
+	bool same = pool.x == reference.x && pool.y == reference.y && pool.z == reference.z && pool.vy == reference.vy;
+
+	bench_clock::time_point start = bench_clock::now ();
+	for (int it = 0; it < iterations; it++) {
+		update_particles_scalar (reference, dt);
+	}
+	double scalar_ms = elapsed_ms (start) / iterations;
+
+	int max_threads = (int)std::thread::hardware_concurrency ();
+	if (max_threads < 1) {
+		max_threads = 1;
+	}
+	printf ("Particles, %d snow, %d iterations at %.1f ms per frame\n", pool.count, iterations, dt * 1000.0f);
+	printf ("  scalar:         %.3f ms, %.0f particles/us (reference)%s\n", scalar_ms, particle_count / (scalar_ms * 1000.0), same ? "" : "  ** RESULT MISMATCH **");
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		double total_ms = 0.0, best_ms = 1e9;
+		create_job_system (bench_job_system, threads);
+		for (int it = 0; it < iterations; it++) {
+			update_particles (pool, dt, &bench_job_system);
+			total_ms += pool.update_ms;
+			best_ms = std::min (best_ms, pool.update_ms);
+		}
+		printf ("  SIMD (%d wide), %d thread%s: %.3f ms avg, %.3f ms best, %.0f particles/us, %.0f%% of a 60 Hz frame\n",
+			particle_simd_width (), threads, threads > 1 ? "s" : " ", total_ms / iterations, best_ms,
+			particle_count / (best_ms * 1000.0), 100.0 * total_ms / iterations / (dt * 1000.0f));
+		destroy_job_system (bench_job_system);
+	}
+	printf ("  stream upload: %.2f MB per frame\n", pool.count * 5 * sizeof (float) / (1024.0 * 1024.0));
+}
+
+/*-----------------------------------ENTITIES-----------------------------------------*/
+
+// The old layout: one object with every field, whether it uses them or not
+struct BenchObject {
+	vec3 position;
+	float rotation;
+	vec3 velocity;
+	AIState ai;
+	MeshComponent mesh;
+	bool walks;
+};
+
+// The scene's walker AI: back away from the player when close, otherwise march
+static void bench_walk (vec3& position, vec3& velocity, AIState& ai, const vec3& player) {
+	float dx = position.v[0] - player.v[0], dz = position.v[2] - player.v[2];
+	float dist_sq = dx * dx + dz * dz;
+	if (dist_sq < 100.0f && dist_sq > 0.0f) {
+		float inv = 0.003f / sqrtf (dist_sq);
+		velocity = vec3 (dx * inv, 0.0f, dz * inv);
+	}
+	else {
+		velocity = vec3 (0.0f, 0.0f, ai.march_forward ? 0.002f : -0.002f);
+		ai.march_distance += velocity.v[2];
+		if (ai.march_distance > 20.0f) {
+			ai.march_forward = false;
+		}
+		if (ai.march_distance < 0.0f) {
+			ai.march_forward = true;
+		}
+	}
+	position.v[0] += velocity.v[0];
+	position.v[2] += velocity.v[2];
+}
+
+// A crowd where every other snowman walks and the rest only stand and wave,
+// as the scene has it. One AI tick over the walkers through a query of the
+// archetype arrays, against the same tick over one big array of objects
+// with every field. Then a tenth of the entities are destroyed and remade
+// each iteration, checking the stale ids are refused.
+void bench_entities (int entity_count) {
+	const int iterations = 100;
+	srand (1234);
+	vec3 player (0.0f, 2.0f, -15.0f);
+	EntityWorld world;
+	clear_entity_world (world);
+	std::vector<BenchObject> objects (entity_count);
+	std::vector<EntityId> ids (entity_count);
+	for (int i = 0; i < entity_count; i++) {
+		bool walks = (i & 1) == 0;
+		vec3 position ((rand () % 2000 - 1000) * 0.1f, 0.0f, (rand () % 2000 - 1000) * 0.1f);
+		unsigned int mask = COMPONENT_POSITION | COMPONENT_AI | COMPONENT_MESH;
+		if (walks) {
+			mask |= COMPONENT_ROTATION | COMPONENT_VELOCITY;
+		}
+		ids[i] = create_entity (world, mask);
+		int row;
+		Archetype& a = entity_archetype (world, ids[i], row);
+		a.position[row] = position;
+		a.ai[row].behaviour = walks ? AI_MARCH : AI_STAND;
+		BenchObject& o = objects[i];
+		o.position = position;
+		o.rotation = 0.0f;
+		o.velocity = vec3 (0.0f, 0.0f, 0.0f);
+		o.ai = a.ai[row];
+		o.mesh = a.mesh[row];
+		o.walks = walks;
+	}
+	EntityQuery walkers;
+	create_entity_query (walkers, COMPONENT_POSITION | COMPONENT_VELOCITY | COMPONENT_AI, 0);
+	refresh_entity_query (walkers, world);
+
+	double soa_ms = 1e9, aos_ms = 1e9;
+	for (int it = 0; it < iterations; it++) {
+		bench_clock::time_point start = bench_clock::now ();
+		for (size_t q = 0; q < walkers.archetypes.size (); q++) {
+			Archetype& a = world.archetypes[walkers.archetypes[q]];
+			size_t count = a.id.size ();
+			for (size_t i = 0; i < count; i++) {
+				bench_walk (a.position[i], a.velocity[i], a.ai[i], player);
+			}
+		}
+		soa_ms = std::min (soa_ms, elapsed_ms (start));
+
+		start = bench_clock::now ();
+		for (int i = 0; i < entity_count; i++) {
+			BenchObject& o = objects[i];
+			if (o.walks) {
+				bench_walk (o.position, o.velocity, o.ai, player);
+			}
+		}
+		aos_ms = std::min (aos_ms, elapsed_ms (start));
+	}
+
+	// both layouts ran the same ticks on the same snowmen
+	bool same = true;
+	for (int i = 0; i < entity_count; i++) {
+		int row;
+		Archetype& a = entity_archetype (world, ids[i], row);
+		same = same && a.position[row].v[0] == objects[i].position.v[0] && a.position[row].v[2] == objects[i].position.v[2];
+	}
+
+	// churn: destroy a tenth at random and make as many again, with or without the walker components
+	int churn = entity_count / 10;
+	int stale_accepted = 0;
+	double churn_ms = 0.0;
+	for (int it = 0; it < 10; it++) {
+		bench_clock::time_point start = bench_clock::now ();
+		std::vector<EntityId> gone;
+		for (int k = 0; k < churn; k++) {
+			int i = (int)(((unsigned int)rand () * 32768u + (unsigned int)rand ()) % (unsigned int)entity_count);
+			if (entity_alive (world, ids[i])) {
+				destroy_entity (world, ids[i]);
+				gone.push_back (ids[i]);
+				unsigned int mask = COMPONENT_POSITION | COMPONENT_AI | COMPONENT_MESH;
+				if (k & 1) {
+					mask |= COMPONENT_ROTATION | COMPONENT_VELOCITY;
+				}
+				ids[i] = create_entity (world, mask);
+			}
+		}
+		churn_ms += elapsed_ms (start);
+		for (size_t k = 0; k < gone.size (); k++) {
+			stale_accepted += entity_alive (world, gone[k]) ? 1 : 0;
+		}
+	}
+	refresh_entity_query (walkers, world);
+
+	int walker_count = entity_query_count (walkers, world);
+	printf ("Entities, %d snowmen (%d walking) in %d archetypes, best of %d iterations\n", world.live, walker_count, (int)world.archetypes.size (), iterations);
+	printf ("  query over archetype arrays: %.3f ms per tick, %.0f walkers/us\n", soa_ms, (entity_count / 2) / (soa_ms * 1000.0));
+	printf ("  array of whole objects:      %.3f ms per tick, %.0f walkers/us (reference)%s\n", aos_ms, (entity_count / 2) / (aos_ms * 1000.0), same ? "" : "  ** RESULT MISMATCH **");
+	printf ("  churn: %d destroyed and remade per iteration, %.3f ms, %s\n", churn, churn_ms / 10, stale_accepted == 0 ? "every stale id refused" : "** STALE ID ACCEPTED **");
+}
+
+/*-----------------------------------BROADPHASE---------------------------------------*/
+
+// Agents wandering over a square sized for one per ten square units, a
+// little denser than the scene's crowd. Each tick every agent moves, the
+// hash is rebuilt, then every agent asks for its neighbours within the
+// scene's snowman reach and for its nearest neighbour. A sample of the
+// queries is checked against testing every agent, which is also timed to
+// show what all pairs would cost.
+void bench_broadphase (int agent_count) {
+	const int iterations = 20;
+	const int sample = 1000;
+	const float reach = 2.0f;
+	const float nearest_reach = 8.0f;
+	srand (1234);
+	float side = sqrtf (agent_count * 10.0f);
+	std::vector<float> x (agent_count), z (agent_count), vx (agent_count), vz (agent_count);
+	for (int i = 0; i < agent_count; i++) {
+		x[i] = side * (rand () % 10000) * 0.0001f;
+		z[i] = side * (rand () % 10000) * 0.0001f;
+		vx[i] = (rand () % 200 - 100) * 0.0005f;
+		vz[i] = (rand () % 200 - 100) * 0.0005f;
+	}
+	SpatialHash hash;
+	create_spatial_hash (hash, 4.0f);
+	std::vector<unsigned int> found;
+	found.reserve (64);
+
+	double build_ms = 0.0, query_ms = 0.0, nearest_ms = 0.0;
+	long long neighbours = 0;
+	for (int it = 0; it < iterations; it++) {
+		for (int i = 0; i < agent_count; i++) {
+			x[i] += vx[i];
+			z[i] += vz[i];
+		}
+		bench_clock::time_point start = bench_clock::now ();
+		begin_spatial_hash (hash);
+		for (int i = 0; i < agent_count; i++) {
+			add_to_spatial_hash (hash, x[i], z[i], (unsigned int)i);
+		}
+		finish_spatial_hash (hash);
+		build_ms += elapsed_ms (start);
+
+		start = bench_clock::now ();
+		for (int i = 0; i < agent_count; i++) {
+			found.clear ();
+			neighbours += query_spatial_hash (hash, x[i], z[i], reach, found);
+		}
+		query_ms += elapsed_ms (start);
+
+		start = bench_clock::now ();
+		for (int i = 0; i < agent_count; i++) {
+			nearest_in_spatial_hash (hash, x[i], z[i], nearest_reach, (unsigned int)i, NULL);
+		}
+		nearest_ms += elapsed_ms (start);
+	}
+
+	// every agent against a sample, the hash has to agree
+	int mismatches = 0;
+	bench_clock::time_point start = bench_clock::now ();
+	for (int s = 0; s < sample; s++) {
+		int q = (int)(((unsigned int)rand () * 32768u + (unsigned int)rand ()) % (unsigned int)agent_count);
+		int count = 0;
+		int nearest = -1;
+		float nearest_sq = nearest_reach * nearest_reach;
+		for (int i = 0; i < agent_count; i++) {
+			float dx = x[i] - x[q], dz = z[i] - z[q];
+			float d_sq = dx * dx + dz * dz;
+			count += d_sq < reach * reach ? 1 : 0;
+			if (i != q && d_sq < nearest_sq) {
+				nearest_sq = d_sq;
+				nearest = i;
+			}
+		}
+		found.clear ();
+		float distance;
+		unsigned int hashed_nearest = nearest_in_spatial_hash (hash, x[q], z[q], nearest_reach, (unsigned int)q, &distance);
+		bool nearest_same = nearest < 0 ? hashed_nearest == SPATIAL_HASH_NONE : distance == sqrtf (nearest_sq);
+		if (query_spatial_hash (hash, x[q], z[q], reach, found) != count || !nearest_same) {
+			mismatches++;
+		}
+	}
+	double brute_ms = elapsed_ms (start) / sample * agent_count;
+
+	double queries = (double)agent_count * iterations;
+	printf ("Broadphase, %d moving agents over %.0f x %.0f, %d iterations\n", agent_count, side, side, iterations);
+	printf ("  rebuild:            %.3f ms per tick, %d buckets\n", build_ms / iterations, (int)hash.bucket_mask + 1);
+	printf ("  radius %.0f queries:  %.3f ms per tick, %.1f queries/us, %.2f neighbours each (self included)\n",
+		reach, query_ms / iterations, queries / (query_ms * 1000.0), (double)neighbours / queries);
+	printf ("  nearest within %.0f: %.3f ms per tick, %.1f queries/us\n", nearest_reach, nearest_ms / iterations, queries / (nearest_ms * 1000.0));
+	printf ("  all pairs:          %.1f ms per tick (from %d sampled)%s\n", brute_ms, sample, mismatches == 0 ? "" : "  ** RESULT MISMATCH **");
+}
+
+/*-----------------------------------MESH BVH-----------------------------------------*/
+
+// Closest hit by testing every triangle, for checking the BVH
+static bool bench_ray_all (const std::vector<float>& vp, int triangle_count, const vec3& o, const vec3& d, float& best_t) {
+	bool found = false;
+	best_t = FLT_MAX;
+	for (int t = 0; t < triangle_count; t++) {
+		const float* a = &vp[t * 9];
+		vec3 e1 (a[3] - a[0], a[4] - a[1], a[5] - a[2]);
+		vec3 e2 (a[6] - a[0], a[7] - a[1], a[8] - a[2]);
+		vec3 p = cross (d, e2);
+		float det = dot (e1, p);
+		if (fabsf (det) < 1e-12f) {
+			continue;
+		}
+		vec3 s (o.v[0] - a[0], o.v[1] - a[1], o.v[2] - a[2]);
+		float u = dot (s, p) / det;
+		vec3 q = cross (s, e1);
+		float v = dot (d, q) / det;
+		float hit_t = dot (e2, q) / det;
+		if (u >= 0.0f && u <= 1.0f && v >= 0.0f && u + v <= 1.0f && hit_t >= 0.0f && hit_t < best_t) {
+			best_t = hit_t;
+			found = true;
+		}
+	}
+	return found;
+}
+
+// A lumpy ball about the size of a snowman, tessellated into roughly the
+// asked for number of triangles, with the triangles in a scrambled order as
+// an exporter might leave them. Rays come in from all round aimed near the
+// middle, about one in five missing. They are cast in the mesh's space with
+// the SIMD and one box at a time traversals, and through a scaled, turned
+// and moved instance, then snowball sized spheres are swept along the same
+// paths. A sample is checked against testing every triangle.
+void bench_bvh (int triangle_count) {
+	const int ray_count = 200000;
+	const int sample = 500;
+	int rings = std::max (4, (int)sqrtf (triangle_count * 0.5f));
+	// the last column is the first again, so the seam has no cracks for rays to slip through
+	std::vector<float> grid ((rings + 1) * rings * 3);
+	for (int i = 0; i <= rings; i++) {
+		for (int j = 0; j < rings; j++) {
+			float theta = 3.14159265f * i / rings, phi = 2.0f * 3.14159265f * j / rings;
+			float r = 1.0f + 0.08f * sinf (theta * 7.0f) * cosf (phi * 5.0f) + 0.03f * sinf (phi * 23.0f + theta * 11.0f);
+			// sinf of pi is not quite zero, the poles have to close exactly too
+			float ring = (i == 0 || i == rings) ? 0.0f : r * sinf (theta);
+			float* out = &grid[(i * rings + j) * 3];
+			out[0] = ring * cosf (phi);
+			out[1] = 1.0f + r * cosf (theta);
+			out[2] = ring * sinf (phi);
+		}
+	}
+	std::vector<float> vp;
+	for (int i = 0; i < rings; i++) {
+		for (int j = 0; j < rings; j++) {
+			int next = (j + 1) % rings;
+			int corners[6] = { i * rings + j, (i + 1) * rings + j, i * rings + next,
+				i * rings + next, (i + 1) * rings + j, (i + 1) * rings + next };
+			for (int k = 0; k < 6; k++) {
+				vp.insert (vp.end (), &grid[corners[k] * 3], &grid[corners[k] * 3] + 3);
+			}
+		}
+	}
+	srand (1234);
+	int count = (int)vp.size () / 9;
+	for (int t = count - 1; t > 0; t--) {
+		int other = (int)(((unsigned int)rand () * 32768u + (unsigned int)rand ()) % (unsigned int)(t + 1));
+		std::swap_ranges (vp.begin () + t * 9, vp.begin () + t * 9 + 9, vp.begin () + other * 9);
+	}
+
+	MeshBVH bvh;
+	build_mesh_bvh (bvh, vp, count * 3);
+
+	std::vector<vec3> origin (ray_count), direction (ray_count);
+	for (int i = 0; i < ray_count; i++) {
+		float theta = 3.14159265f * (rand () % 10000) * 0.0001f, phi = 2.0f * 3.14159265f * (rand () % 10000) * 0.0001f;
+		origin[i] = vec3 (4.0f * sinf (theta) * cosf (phi), 1.0f + 4.0f * cosf (theta), 4.0f * sinf (theta) * sinf (phi));
+		vec3 target ((rand () % 2000 - 1000) * 0.0012f, 1.0f + (rand () % 2000 - 1000) * 0.0012f, (rand () % 2000 - 1000) * 0.0012f);
+		direction[i] = target - origin[i];
+	}
+	mat4 model = translate (rotate_y_deg (scale (identity_mat4 (), vec3 (2.0f, 2.0f, 2.0f)), 30.0f), vec3 (10.0f, 0.0f, -5.0f));
+	mat4 inverse_model = inverse (model);
+	std::vector<vec3> world_origin (ray_count), world_direction (ray_count);
+	for (int i = 0; i < ray_count; i++) {
+		world_origin[i] = vec3 (model * vec4 (origin[i], 1.0f));
+		world_direction[i] = vec3 (model * vec4 (direction[i], 0.0f));
+	}
+
+	std::vector<float> simd_t (ray_count, -1.0f), scalar_t (ray_count, -1.0f), instance_t (ray_count, -1.0f);
+	BVHHit hit;
+	int hits = 0;
+	bench_clock::time_point start = bench_clock::now ();
+	for (int i = 0; i < ray_count; i++) {
+		if (raycast_bvh (bvh, origin[i], direction[i], 2.0f, hit)) {
+			simd_t[i] = hit.t;
+			hits++;
+		}
+	}
+	double simd_ms = elapsed_ms (start);
+	start = bench_clock::now ();
+	for (int i = 0; i < ray_count; i++) {
+		if (raycast_bvh_scalar (bvh, origin[i], direction[i], 2.0f, hit)) {
+			scalar_t[i] = hit.t;
+		}
+	}
+	double scalar_ms = elapsed_ms (start);
+	start = bench_clock::now ();
+	for (int i = 0; i < ray_count; i++) {
+		if (raycast_instance (bvh, model, inverse_model, world_origin[i], world_direction[i], 2.0f, hit)) {
+			instance_t[i] = hit.t;
+		}
+	}
+	double instance_ms = elapsed_ms (start);
+	int sweep_hits = 0;
+	start = bench_clock::now ();
+	for (int i = 0; i < ray_count; i++) {
+		vec3 end = world_origin[i] + world_direction[i];
+		sweep_hits += sweep_sphere_instance (bvh, model, inverse_model, world_origin[i], end, 0.1f, hit) ? 1 : 0;
+	}
+	double sweep_ms = elapsed_ms (start);
+
+	// the traversals must agree exactly. The instance's ray is rounded a little
+	// differently on the way into the mesh's space, and a ray grazing a shared
+	// edge can slip between its triangles, so where it disagrees it is checked
+	// against every triangle instead. Then every triangle on a sample.
+	int mismatches = 0, edge_slips = 0;
+	for (int i = 0; i < ray_count; i++) {
+		if (scalar_t[i] != simd_t[i]) {
+			mismatches++;
+		}
+		if (fabsf (instance_t[i] - simd_t[i]) > 1e-4f) {
+			vec3 local_origin = vec3 (inverse_model * vec4 (world_origin[i], 1.0f));
+			vec3 local_direction = vec3 (inverse_model * vec4 (world_direction[i], 0.0f));
+			float t;
+			bool found = bench_ray_all (vp, count, local_origin, local_direction, t) && t < 2.0f;
+			if (found != (instance_t[i] >= 0.0f) || (found && fabsf (t - instance_t[i]) > 1e-5f)) {
+				mismatches++;
+			}
+			edge_slips++;
+		}
+	}
+	start = bench_clock::now ();
+	for (int s = 0; s < sample; s++) {
+		float t;
+		bool found = bench_ray_all (vp, count, origin[s], direction[s], t) && t < 2.0f;
+		if (found != (simd_t[s] >= 0.0f) || (found && fabsf (t - simd_t[s]) > 1e-5f)) {
+			mismatches++;
+		}
+	}
+	double brute_ms = elapsed_ms (start) / sample * ray_count;
+
+	printf ("Mesh BVH, %d triangles, %d rays (%d hit)\n", count, ray_count, hits);
+	printf ("  build:             %.2f ms, %d nodes of %d, depth %d\n", bvh.build_ms, (int)bvh.nodes.size (), bvh_simd_width (), bvh.depth);
+	printf ("  rays, SSE boxes:   %.2f ms, %.2f M rays/s\n", simd_ms, ray_count / (simd_ms * 1000.0));
+	printf ("  rays, one box:     %.2f ms, %.2f M rays/s\n", scalar_ms, ray_count / (scalar_ms * 1000.0));
+	printf ("  rays, instance:    %.2f ms, %.2f M rays/s, %d through a shared edge\n", instance_ms, ray_count / (instance_ms * 1000.0), edge_slips);
+	printf ("  spheres, instance: %.2f ms, %.2f M sweeps/s (%d hit)\n", sweep_ms, ray_count / (sweep_ms * 1000.0), sweep_hits);
+	printf ("  every triangle:    %.1f ms (from %d sampled), %.4f M rays/s%s\n", brute_ms, sample,
+		ray_count / (brute_ms * 1000.0), mismatches == 0 ? "" : "  ** RESULT MISMATCH **");
+}
+
+/*-----------------------------------PROJECTILES--------------------------------------*/
+
+// A snowball the way the scene used to fly one, nudged along each tick
+struct BenchStepped {
+	vec3 position, velocity;
+};
+
+static void bench_launch (ProjectilePool& pool, std::vector<BenchStepped>& stepped, float side, double time) {
+	vec3 position = vec3 (side * (rand () % 10000) * 0.0001f, 2.0f, side * (rand () % 10000) * 0.0001f);
+	vec3 velocity = vec3 ((rand () % 200 - 100) * 0.03f, (rand () % 100) * 0.03f, (rand () % 200 - 100) * 0.03f);
+	launch_projectile (pool, position, velocity, 0, time);
+	BenchStepped s = { position, velocity };
+	stepped.push_back (s);
+}
+
+// Big enough not to want on the stack
+static HitEventRing bench_hit_events;
+
+struct BenchRecorder {
+	HitEventRing* ring;
+	unsigned int thrower;
+	int count;
+	int retries;
+};
+
+// Records count events numbered in order, trying again whenever the ring is full
+static void bench_record_hits (BenchRecorder* recorder) {
+	HitEvent event;
+	event.thrower = recorder->thrower;
+	event.point = vec3 (0.0f, 0.0f, 0.0f);
+	for (int i = 0; i < recorder->count; i++) {
+		event.target = (unsigned int)i;
+		while (!record_hit_event (*recorder->ring, event)) {
+			recorder->retries++;
+			std::this_thread::yield ();
+		}
+	}
+}
+
+// A pool kept full of snowballs thrown across a field, stepped at 60 Hz
+// for two seconds, refilled as they land. The same flights are stepped the
+// old way, adding velocity and gravity every tick, to show the cost and how
+// far from the true arc it drifts. A second pool stepped straight to the
+// end time in one step has to land in exactly the same places. Then the
+// hit event ring, with every other core recording into it while this one
+// takes them out, checking nothing is lost and each thrower's hits come
+// out in order.
+void bench_projectiles (int projectile_count) {
+	const int ticks = 120;
+	const float dt = 1.0f / 60.0f;
+	const float gravity = 9.8f;
+	srand (1234);
+	float side = sqrtf (projectile_count * 10.0f);
+	ProjectilePool pool, one_step;
+	create_projectile_pool (pool, projectile_count, gravity, 0.2f);
+	create_projectile_pool (one_step, projectile_count, gravity, 0.2f);
+	std::vector<BenchStepped> stepped;
+	stepped.reserve (projectile_count);
+	for (int i = 0; i < projectile_count; i++) {
+		bench_launch (pool, stepped, side, 0.0);
+	}
+
+	// the first second without refills, for the comparisons
+	double step_ms = 0.0, stepped_ms = 0.0;
+	double time = 0.0;
+	for (int t = 0; t < ticks / 2; t++) {
+		time += dt;
+		bench_clock::time_point start = bench_clock::now ();
+		step_projectiles (pool, time, -1e30f);
+		step_ms += elapsed_ms (start);
+		start = bench_clock::now ();
+		for (int i = 0; i < projectile_count; i++) {
+			stepped[i].position = stepped[i].position + stepped[i].velocity * dt;
+			stepped[i].velocity.v[1] -= gravity * dt;
+		}
+		stepped_ms += elapsed_ms (start);
+	}
+	for (int i = 0; i < projectile_count; i++) {
+		launch_projectile (one_step, vec3 (pool.launch_x[i], pool.launch_y[i], pool.launch_z[i]),
+			vec3 (pool.velocity_x[i], pool.velocity_y[i], pool.velocity_z[i]), 0, 0.0);
+	}
+	step_projectiles (one_step, time, -1e30f);
+	int mismatches = 0;
+	float drift = 0.0f;
+	for (int i = 0; i < projectile_count; i++) {
+		if (one_step.x[i] != pool.x[i] || one_step.y[i] != pool.y[i] || one_step.z[i] != pool.z[i]) {
+			mismatches++;
+		}
+		drift = std::max (drift, length (stepped[i].position - vec3 (pool.x[i], pool.y[i], pool.z[i])));
+	}
+
+	// the second second with the floor, refilling what lands
+	int landed = 0;
+	double floor_ms = 0.0, refill_ms = 0.0;
+	for (int t = ticks / 2; t < ticks; t++) {
+		time += dt;
+		bench_clock::time_point start = bench_clock::now ();
+		int fell = pool.fell;
+		step_projectiles (pool, time, 0.0f);
+		floor_ms += elapsed_ms (start);
+		landed += pool.fell - fell;
+		start = bench_clock::now ();
+		stepped.clear ();
+		while (pool.count < pool.capacity) {
+			bench_launch (pool, stepped, side, time);
+		}
+		refill_ms += elapsed_ms (start);
+	}
+
+	// the hit event ring
+	const int events_each = 200000;
+	int producers = std::max (1, (int)std::thread::hardware_concurrency () - 1);
+	HitEventRing* ring = &bench_hit_events;
+	create_hit_event_ring (*ring);
+	std::vector<BenchRecorder> recorders (producers);
+	std::vector<int> next (producers, 0);
+	std::vector<std::thread> threads;
+	bench_clock::time_point start = bench_clock::now ();
+	for (int p = 0; p < producers; p++) {
+		BenchRecorder r = { ring, (unsigned int)p, events_each, 0 };
+		recorders[p] = r;
+	}
+	for (int p = 0; p < producers; p++) {
+		threads.push_back (std::thread (bench_record_hits, &recorders[p]));
+	}
+	int taken = 0, out_of_order = 0;
+	HitEvent event;
+	while (taken < producers * events_each) {
+		if (!take_hit_event (*ring, event)) {
+			continue;
+		}
+		if (event.thrower >= (unsigned int)producers || (int)event.target != next[event.thrower]) {
+			out_of_order++;
+		}
+		else {
+			next[event.thrower]++;
+		}
+		taken++;
+	}
+	for (int p = 0; p < producers; p++) {
+		threads[p].join ();
+	}
+	double ring_ms = elapsed_ms (start);
+	int retries = 0;
+	for (int p = 0; p < producers; p++) {
+		retries += recorders[p].retries;
+	}
+	bool left_over = take_hit_event (*ring, event);
+
+	printf ("Projectiles, %d in the air over %.0f x %.0f, %d ticks at %.0f Hz\n", projectile_count, side, side, ticks, 1.0f / dt);
+	printf ("  pool step:        %.3f ms per tick, %.1f projectiles/us, %.3f ms with the floor\n",
+		step_ms / (ticks / 2), (double)projectile_count * (ticks / 2) / (step_ms * 1000.0), floor_ms / (ticks / 2));
+	printf ("  stepped per tick: %.3f ms per tick, %.1f projectiles/us, %.3f from the arc after a second\n",
+		stepped_ms / (ticks / 2), (double)projectile_count * (ticks / 2) / (stepped_ms * 1000.0), drift);
+	printf ("  one step:         same place as %d ticks%s\n", ticks / 2, mismatches == 0 ? "" : "  ** RESULT MISMATCH **");
+	printf ("  landed:           %d in the second second, refilled in %.3f ms per tick\n", landed, refill_ms / (ticks / 2));
+	printf ("  hit events:       %d threads recording %d each, %.2f ms, %.1f M events/s, %d waits for room%s\n",
+		producers, events_each, ring_ms, producers * events_each / (ring_ms * 1000.0), retries,
+		out_of_order == 0 && !left_over ? "" : "  ** RESULT MISMATCH **");
+}
+
+/*-----------------------------------JOB SYSTEM---------------------------------------*/
+
+struct BenchCrowd {
+	Archetype* snowmen;
+	SpatialHash* hash;
+	std::vector<unsigned int> target;
+	std::vector<vec3> target_position;  // where it was when picked
+	vec3 player;
+};
+
+// The scene's throwers: the nearest other snowman in range
+static void bench_pick_targets (void* data, int begin, int end) {
+	BenchCrowd& crowd = *(BenchCrowd*)data;
+	Archetype& a = *crowd.snowmen;
+	for (int i = begin; i < end; i++) {
+		unsigned int t = nearest_in_spatial_hash (*crowd.hash, a.position[i].v[0], a.position[i].v[2], 25.0f, (unsigned int)i, NULL);
+		crowd.target[i] = t;
+		if (t != SPATIAL_HASH_NONE) {
+			crowd.target_position[i] = a.position[t];
+		}
+	}
+}
+
+// The scene's walkers, turned a little towards their target
+static void bench_walk_crowd (void* data, int begin, int end) {
+	BenchCrowd& crowd = *(BenchCrowd*)data;
+	Archetype& a = *crowd.snowmen;
+	for (int i = begin; i < end; i++) {
+		bench_walk (a.position[i], a.velocity[i], a.ai[i], crowd.player);
+		if (crowd.target[i] != SPATIAL_HASH_NONE) {
+			vec3 to = crowd.target_position[i] - a.position[i];
+			a.rotation[i] = atan2f (to.v[0], to.v[2]);
+		}
+	}
+}
+
+// A crowd of marching snowmen, each tick rehashed on one thread and then
+// two passes shared out as jobs: every snowman picks the nearest other as
+// its target, then walks and turns to it, the walk held back by the
+// targets' counter rather than a wait. The walk moves snowmen another may
+// be picking, so it has to follow every target, not just its own rows.
+// The same ticks from the same start on 1 up to every core (or max_workers
+// when given), each checked against the single worker's result.
+void bench_jobs (int snowman_count, int max_workers) {
+	const int ticks = 20;
+	const int grain = 256;
+	srand (1234);
+	float side = sqrtf (snowman_count * 10.0f);
+	EntityWorld world;
+	clear_entity_world (world);
+	for (int i = 0; i < snowman_count; i++) {
+		EntityId id = create_entity (world, COMPONENT_POSITION | COMPONENT_ROTATION | COMPONENT_VELOCITY | COMPONENT_AI);
+		int row;
+		Archetype& a = entity_archetype (world, id, row);
+		a.position[row] = vec3 (side * (rand () % 10000) * 0.0001f, 0.0f, side * (rand () % 10000) * 0.0001f);
+		a.ai[row].behaviour = AI_MARCH;
+		a.ai[row].march_distance = (rand () % 2000) * 0.01f;
+	}
+	Archetype& snowmen = world.archetypes[world.records[0].archetype];
+	std::vector<vec3> start_position = snowmen.position;
+	std::vector<AIState> start_ai = snowmen.ai;
+	SpatialHash hash;
+	create_spatial_hash (hash, 4.0f);
+	BenchCrowd crowd;
+	crowd.snowmen = &snowmen;
+	crowd.hash = &hash;
+	crowd.target.assign (snowman_count, SPATIAL_HASH_NONE);
+	crowd.target_position.assign (snowman_count, vec3 (0.0f, 0.0f, 0.0f));
+	crowd.player = vec3 (side * 0.5f, 2.0f, side * 0.5f);
+
+	int cores = std::min ((int)std::thread::hardware_concurrency (), JOB_MAX_WORKERS);
+	cores = std::max (cores, 1);
+	int most = max_workers > 0 ? std::min (max_workers, JOB_MAX_WORKERS) : cores;
+	std::vector<vec3> single_position;
+	std::vector<float> single_rotation;
+	double single_ms = 0.0;
+	printf ("Job system, %d snowmen over %.0f x %.0f, %d ticks, %d snowmen per job, %d cores\n", snowman_count, side, side, ticks, grain, cores);
+	for (int workers = 1; workers <= most; workers++) {
+		snowmen.position = start_position;
+		snowmen.ai = start_ai;
+		std::fill (snowmen.rotation.begin (), snowmen.rotation.end (), 0.0f);
+		create_job_system (bench_job_system, workers);
+		double hash_ms = 0.0, jobs_ms = 0.0;
+		int stolen = 0, run = 0;
+		take_job_stats (bench_job_system);
+		for (int t = 0; t < ticks; t++) {
+			bench_clock::time_point start = bench_clock::now ();
+			begin_spatial_hash (hash);
+			for (int i = 0; i < snowman_count; i++) {
+				add_to_spatial_hash (hash, snowmen.position[i].v[0], snowmen.position[i].v[2], (unsigned int)i);
+			}
+			finish_spatial_hash (hash);
+			hash_ms += elapsed_ms (start);
+
+			start = bench_clock::now ();
+			JobCounter targets, walked;
+			create_job_counter (targets);
+			create_job_counter (walked);
+			submit_parallel_for (bench_job_system, snowman_count, grain, bench_pick_targets, &crowd, &targets);
+			submit_parallel_for_after (bench_job_system, targets, snowman_count, grain, bench_walk_crowd, &crowd, &walked);
+			wait_for_counter (bench_job_system, walked);
+			wait_for_counter (bench_job_system, targets);
+			jobs_ms += elapsed_ms (start);
+			JobStats stats = take_job_stats (bench_job_system);
+			stolen += stats.stolen;
+			run += stats.run;
+		}
+		destroy_job_system (bench_job_system);
+
+		bool same = true;
+		if (workers == 1) {
+			single_position = snowmen.position;
+			single_rotation = snowmen.rotation;
+			single_ms = jobs_ms;
+		}
+		else {
+			for (int i = 0; i < snowman_count; i++) {
+				same = same && snowmen.position[i].v[0] == single_position[i].v[0] && snowmen.position[i].v[2] == single_position[i].v[2]
+					&& snowmen.rotation[i] == single_rotation[i];
+			}
+		}
+		printf ("  %2d worker%s %.3f ms per tick (%.3f rehashing on one), %.2fx, %d jobs, %d stolen%s\n", workers, workers == 1 ? ": " : "s:",
+			jobs_ms / ticks, hash_ms / ticks, single_ms / jobs_ms, run / ticks, stolen / ticks, same ? "" : "  ** RESULT MISMATCH **");
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef _BENCHMARKS_H_
+#define _BENCHMARKS_H_
+
+/*----------------------------------------------------------------------------
+                   HEADLESS BENCHMARKS
+  ----------------------------------------------------------------------------*/
+// Run from the command line, no window or GL context is created. The
+// instancing one then renders the forest and crowd headless, so it needs a
+// build with HEADLESS_EGL:
+//   "Lab 5.exe" --bench-render-queue [packets]
+//   "Lab 5.exe" --bench-instancing [trees] [snowmen]
+//   "Lab 5.exe" --bench-frustum-culling [spheres]
+//   "Lab 5.exe" --bench-occlusion [trees] [snowmen]
+//   "Lab 5.exe" --bench-particles [particles]
+//   "Lab 5.exe" --bench-entities [entities]
+//   "Lab 5.exe" --bench-broadphase [agents]
+//   "Lab 5.exe" --bench-bvh [triangles]
+//   "Lab 5.exe" --bench-projectiles [projectiles]
+//   "Lab 5.exe" --bench-jobs [snowmen] [workers]
+
+// Runs the benchmark named on the command line, returns false if none was asked for
+bool run_benchmark (int argc, char** argv);
+
+void bench_render_queue (int packet_count);
+void bench_instancing (int tree_count, int snowman_count);
+void bench_frustum_culling (int sphere_count);
+void bench_occlusion (int tree_count, int snowman_count);
+void bench_particles (int particle_count);
+void bench_entities (int entity_count);
+void bench_broadphase (int agent_count);
+void bench_bvh (int triangle_count);
+void bench_projectiles (int projectile_count);
+void bench_jobs (int snowman_count, int max_workers);
+
+#endif
@@ -0,0 +1,253 @@
+#include "clustered_lighting.h"
+#include "gl_state.h"
+#include <xmmintrin.h> // SSE
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+/*-----------------------------------CLUSTER BOUNDS-----------------------------------*/
+
+// distance from the camera to the near side of depth slice k
+static float slice_depth (const LightClusterGrid& grid, int k) {
+	return grid.near * pow (grid.far / grid.near, (float)k / (float)CLUSTER_Z);
+}
+
+static int depth_to_slice (const LightClusterGrid& grid, float depth) {
+	if (depth <= grid.near) {
+		return 0;
+	}
+	int k = (int)floor (log (depth / grid.near) / log (grid.far / grid.near) * CLUSTER_Z);
+	return k < CLUSTER_Z - 1 ? k : CLUSTER_Z - 1;
+}
+
+void build_cluster_bounds (LightClusterGrid& grid, float fovy, float aspect, float near, float far) {
+	grid.near = near;
+	grid.far = far;
+	grid.aspect = aspect;
+	grid.tan_half_fovy = tan (fovy * ONE_DEG_IN_RAD * 0.5f);
+	float tan_half_fovx = grid.tan_half_fovy * aspect;
+
+	grid.min_x.resize (CLUSTER_COUNT);
+	grid.min_y.resize (CLUSTER_COUNT);
+	grid.min_z.resize (CLUSTER_COUNT);
+	grid.max_x.resize (CLUSTER_COUNT);
+	grid.max_y.resize (CLUSTER_COUNT);
+	grid.max_z.resize (CLUSTER_COUNT);
+	grid.cluster_counts.resize (CLUSTER_COUNT);
+	grid.cluster_scratch.resize (CLUSTER_COUNT * MAX_LIGHTS_PER_CLUSTER);
+	grid.offsets_counts.resize (CLUSTER_COUNT * 2);
+
+	for (int k = 0; k < CLUSTER_Z; k++) {
+		float d0 = slice_depth (grid, k);
+		float d1 = slice_depth (grid, k + 1);
+		for (int j = 0; j < CLUSTER_Y; j++) {
+			// tile edges in normalised device coordinates
+			float y0 = -1.0f + 2.0f * j / CLUSTER_Y;
+			float y1 = -1.0f + 2.0f * (j + 1) / CLUSTER_Y;
+			for (int i = 0; i < CLUSTER_X; i++) {
+				float x0 = -1.0f + 2.0f * i / CLUSTER_X;
+				float x1 = -1.0f + 2.0f * (i + 1) / CLUSTER_X;
+				int c = i + CLUSTER_X * (j + CLUSTER_Y * k);
+				// the tile widens with depth so take the extreme corner of either end
+				grid.min_x[c] = fmin (x0 * d0, x0 * d1) * tan_half_fovx;
+				grid.max_x[c] = fmax (x1 * d0, x1 * d1) * tan_half_fovx;
+				grid.min_y[c] = fmin (y0 * d0, y0 * d1) * grid.tan_half_fovy;
+				grid.max_y[c] = fmax (y1 * d0, y1 * d1) * grid.tan_half_fovy;
+				// camera looks down -z
+				grid.min_z[c] = -d1;
+				grid.max_z[c] = -d0;
+			}
+		}
+	}
+}
+
+/*-----------------------------------LIGHT BINNING------------------------------------*/
+
+// Bins every light into the clusters of slices [first_slice, last_slice).
+// Each worker owns a disjoint range of slices so no locking is needed.
+static void bin_slices (LightClusterGrid* grid, int light_count, int first_slice, int last_slice) {
+	const __m128 zero = _mm_setzero_ps ();
+
+	for (int l = 0; l < light_count; l++) {
+		int k0 = grid->slice_first[l] > first_slice ? grid->slice_first[l] : first_slice;
+		int k1 = grid->slice_last[l] < last_slice - 1 ? grid->slice_last[l] : last_slice - 1;
+		if (k0 > k1) {
+			continue;
+		}
+		const float* s = &grid->view_lights[l * 4];
+		__m128 cx = _mm_set1_ps (s[0]);
+		__m128 cy = _mm_set1_ps (s[1]);
+		__m128 cz = _mm_set1_ps (s[2]);
+		__m128 r2 = _mm_set1_ps (s[3] * s[3]);
+
+		for (int k = k0; k <= k1; k++) {
+			int slice_base = k * CLUSTERS_PER_SLICE;
+			// sphere vs AABB, four clusters per iteration
+			for (int c = slice_base; c < slice_base + CLUSTERS_PER_SLICE; c += 4) {
+				__m128 dx = _mm_max_ps (_mm_sub_ps (_mm_loadu_ps (&grid->min_x[c]), cx), _mm_sub_ps (cx, _mm_loadu_ps (&grid->max_x[c])));
+				__m128 dy = _mm_max_ps (_mm_sub_ps (_mm_loadu_ps (&grid->min_y[c]), cy), _mm_sub_ps (cy, _mm_loadu_ps (&grid->max_y[c])));
+				__m128 dz = _mm_max_ps (_mm_sub_ps (_mm_loadu_ps (&grid->min_z[c]), cz), _mm_sub_ps (cz, _mm_loadu_ps (&grid->max_z[c])));
+				dx = _mm_max_ps (dx, zero);
+				dy = _mm_max_ps (dy, zero);
+				dz = _mm_max_ps (dz, zero);
+				__m128 d2 = _mm_add_ps (_mm_add_ps (_mm_mul_ps (dx, dx), _mm_mul_ps (dy, dy)), _mm_mul_ps (dz, dz));
+				int hits = _mm_movemask_ps (_mm_cmple_ps (d2, r2));
+				while (hits) {
+					int lane = hits & 1 ? 0 : hits & 2 ? 1 : hits & 4 ? 2 : 3;
+					hits &= hits - 1;
+					unsigned int& count = grid->cluster_counts[c + lane];
+					if (count < MAX_LIGHTS_PER_CLUSTER) {
+						grid->cluster_scratch[(c + lane) * MAX_LIGHTS_PER_CLUSTER + count] = l;
+					}
+					count++;
+				}
+			}
+		}
+	}
+}
+
+struct BinJob {
+	LightClusterGrid* grid;
+	int light_count;
+};
+
+static void bin_slice_job (void* data, int begin, int end) {
+	BinJob* bin = (BinJob*)data;
+	bin_slices (bin->grid, bin->light_count, begin, end);
+}
+
+void assign_lights_to_clusters (LightClusterGrid& grid, const std::vector<PointLight>& lights, const mat4& view, JobSystem* jobs) {
+	int light_count = (int)lights.size ();
+	if (light_count > MAX_POINT_LIGHTS) {
+		light_count = MAX_POINT_LIGHTS;
+	}
+	grid.view_lights.resize (light_count * 4);
+	grid.slice_first.resize (light_count);
+	grid.slice_last.resize (light_count);
+	grid.lights_visible = 0;
+
+	// move the lights into view space and find the depth slices each one spans
+	mat4 v = view;
+	for (int l = 0; l < light_count; l++) {
+		vec4 p = v * vec4 (lights[l].position, 1.0f);
+		float r = lights[l].radius;
+		grid.view_lights[l * 4 + 0] = p.v[0];
+		grid.view_lights[l * 4 + 1] = p.v[1];
+		grid.view_lights[l * 4 + 2] = p.v[2];
+		grid.view_lights[l * 4 + 3] = r;
+		float nearest = -p.v[2] - r;
+		float furthest = -p.v[2] + r;
+		if (furthest < grid.near || nearest > grid.far) {
+			grid.slice_first[l] = 1;  // empty range, light is entirely in front of or behind the frustum
+			grid.slice_last[l] = 0;
+			continue;
+		}
+		grid.slice_first[l] = depth_to_slice (grid, nearest);
+		grid.slice_last[l] = depth_to_slice (grid, furthest);
+		grid.lights_visible++;
+	}
+
+	for (int c = 0; c < CLUSTER_COUNT; c++) {
+		grid.cluster_counts[c] = 0;
+	}
+
+	// small light counts are not worth waking the workers for
+	if (!jobs || jobs->worker_count == 1 || light_count < 64) {
+		bin_slices (&grid, light_count, 0, CLUSTER_Z);
+	}
+	else {
+		// two runs of slices per worker, so a worker that finishes early can steal
+		BinJob bin = { &grid, light_count };
+		int grain = CLUSTER_Z / (2 * jobs->worker_count);
+		parallel_for (*jobs, CLUSTER_Z, grain > 1 ? grain : 1, bin_slice_job, &bin);
+	}
+
+	// compact the per cluster lists into one index array
+	grid.indices.clear ();
+	grid.overflowed_clusters = 0;
+	grid.max_lights_in_cluster = 0;
+	for (int c = 0; c < CLUSTER_COUNT; c++) {
+		unsigned int count = grid.cluster_counts[c];
+		if ((int)count > grid.max_lights_in_cluster) {
+			grid.max_lights_in_cluster = count;
+		}
+		if (count > MAX_LIGHTS_PER_CLUSTER) {
+			grid.overflowed_clusters++;
+			count = MAX_LIGHTS_PER_CLUSTER;
+		}
+		grid.offsets_counts[c * 2 + 0] = (unsigned int)grid.indices.size ();
+		grid.offsets_counts[c * 2 + 1] = count;
+		const unsigned int* list = &grid.cluster_scratch[c * MAX_LIGHTS_PER_CLUSTER];
+		grid.indices.insert (grid.indices.end (), list, list + count);
+	}
+}
+
+/*-----------------------------------GPU BUFFERS--------------------------------------*/
+
+static void create_texture_buffer (GLuint& buffer, GLuint& texture, GLenum format) {
+	glGenBuffers (1, &buffer);
+	glBindBuffer (GL_TEXTURE_BUFFER, buffer);
+	glBufferData (GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+	glGenTextures (1, &texture);
+	glBindTexture (GL_TEXTURE_BUFFER, texture);
+	glTexBuffer (GL_TEXTURE_BUFFER, format, buffer);
+}
+
+void create_light_cluster_buffers (LightClusterGPU& gpu) {
+	create_texture_buffer (gpu.light_buffer, gpu.light_texture, GL_RGBA32F);
+	create_texture_buffer (gpu.grid_buffer, gpu.grid_texture, GL_RG32UI);
+	create_texture_buffer (gpu.index_buffer, gpu.index_texture, GL_R32UI);
+	glBindBuffer (GL_TEXTURE_BUFFER, 0);
+	glBindTexture (GL_TEXTURE_BUFFER, 0);
+}
+
+void upload_light_clusters (const LightClusterGrid& grid, const std::vector<PointLight>& lights, LightClusterGPU& gpu) {
+	// two texels per light: view space position + radius, then colour
+	int light_count = (int)grid.view_lights.size () / 4;
+	std::vector<float> light_data (light_count * 8 + 8, 0.0f);
+	for (int l = 0; l < light_count; l++) {
+		for (int i = 0; i < 4; i++) {
+			light_data[l * 8 + i] = grid.view_lights[l * 4 + i];
+		}
+		light_data[l * 8 + 4] = lights[l].colour.v[0];
+		light_data[l * 8 + 5] = lights[l].colour.v[1];
+		light_data[l * 8 + 6] = lights[l].colour.v[2];
+	}
+
+	// orphan the old storage each frame so the driver does not stall on the previous draw
+	glBindBuffer (GL_TEXTURE_BUFFER, gpu.light_buffer);
+	glBufferData (GL_TEXTURE_BUFFER, light_data.size () * sizeof (float), &light_data[0], GL_STREAM_DRAW);
+	glBindBuffer (GL_TEXTURE_BUFFER, gpu.grid_buffer);
+	glBufferData (GL_TEXTURE_BUFFER, grid.offsets_counts.size () * sizeof (unsigned int), &grid.offsets_counts[0], GL_STREAM_DRAW);
+	glBindBuffer (GL_TEXTURE_BUFFER, gpu.index_buffer);
+	if (grid.indices.empty ()) {
+		unsigned int dummy = 0;
+		glBufferData (GL_TEXTURE_BUFFER, sizeof (unsigned int), &dummy, GL_STREAM_DRAW);
+	}
+	else {
+		glBufferData (GL_TEXTURE_BUFFER, grid.indices.size () * sizeof (unsigned int), &grid.indices[0], GL_STREAM_DRAW);
+	}
+	glBindBuffer (GL_TEXTURE_BUFFER, 0);
+}
+
+void bind_light_clusters (const LightClusterGPU& gpu) {
+	gls_active_texture (GL_TEXTURE0 + LIGHT_DATA_TEXTURE_UNIT);
+	gls_bind_texture (GL_TEXTURE_BUFFER, gpu.light_texture);
+	gls_active_texture (GL_TEXTURE0 + CLUSTER_GRID_TEXTURE_UNIT);
+	gls_bind_texture (GL_TEXTURE_BUFFER, gpu.grid_texture);
+	gls_active_texture (GL_TEXTURE0 + LIGHT_INDEX_TEXTURE_UNIT);
+	gls_bind_texture (GL_TEXTURE_BUFFER, gpu.index_texture);
+	gls_active_texture (GL_TEXTURE0);  // leave unit 0 active for the mesh textures
+}
+
+void set_light_cluster_samplers (GLuint program) {
+	glUniform1i (glGetUniformLocation (program, "light_data"), LIGHT_DATA_TEXTURE_UNIT);
+	glUniform1i (glGetUniformLocation (program, "cluster_grid"), CLUSTER_GRID_TEXTURE_UNIT);
+	glUniform1i (glGetUniformLocation (program, "light_indices"), LIGHT_INDEX_TEXTURE_UNIT);
+}
+
+void set_light_cluster_uniforms (GLuint program, const LightClusterGrid& grid, int screen_width, int screen_height) {
+	glUniform3i (glGetUniformLocation (program, "cluster_dims"), CLUSTER_X, CLUSTER_Y, CLUSTER_Z);
+	glUniform2f (glGetUniformLocation (program, "screen_size"), (float)screen_width, (float)screen_height);
+	glUniform1f (glGetUniformLocation (program, "cluster_near"), grid.near);
+	glUniform1f (glGetUniformLocation (program, "cluster_far"), grid.far);
+}
@@ -0,0 +1,86 @@
+#ifndef _CLUSTERED_LIGHTING_H_
+#define _CLUSTERED_LIGHTING_H_
+
+#include <GL/glew.h>
+#include <vector>
+#include "job_system.h"
+#include "maths_funcs.h"
+
+/*----------------------------------------------------------------------------
+                   CLUSTERED FORWARD LIGHTING
+  ----------------------------------------------------------------------------*/
+// The view frustum is split into a grid of clusters ("froxels"): CLUSTER_X by
+// CLUSTER_Y screen tiles, each cut into CLUSTER_Z exponentially spaced depth
+// slices. Every frame the CPU bins each point light into the clusters its
+// sphere of influence touches, and the fragment shader only loops over the
+// lights of the cluster it falls in.
+
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTERS_PER_SLICE (CLUSTER_X * CLUSTER_Y)
+#define CLUSTER_COUNT (CLUSTERS_PER_SLICE * CLUSTER_Z)
+#define MAX_LIGHTS_PER_CLUSTER 128
+#define MAX_POINT_LIGHTS 4096
+
+// Texture units the cluster buffers are bound to (unit 0 is the diffuse texture)
+#define LIGHT_DATA_TEXTURE_UNIT 1
+#define CLUSTER_GRID_TEXTURE_UNIT 2
+#define LIGHT_INDEX_TEXTURE_UNIT 3
+
+struct PointLight {
+	vec3 position;  // world space
+	float radius;   // no contribution beyond this distance
+	vec3 colour;    // already multiplied by intensity
+};
+
+struct LightClusterGrid {
+	float near, far;
+	float tan_half_fovy, aspect;
+
+	// view space AABB of every cluster, structure of arrays so four clusters
+	// can be tested against a light at once. Slice k occupies
+	// [k * CLUSTERS_PER_SLICE, (k + 1) * CLUSTERS_PER_SLICE).
+	std::vector<float> min_x, min_y, min_z;
+	std::vector<float> max_x, max_y, max_z;
+
+	// per light, filled by assign_lights_to_clusters
+	std::vector<float> view_lights;  // x, y, z, radius in view space
+	std::vector<int> slice_first, slice_last;
+
+	// per cluster scratch lists, MAX_LIGHTS_PER_CLUSTER entries per cluster
+	std::vector<unsigned int> cluster_counts;
+	std::vector<unsigned int> cluster_scratch;
+
+	// compacted output uploaded to the GPU
+	std::vector<unsigned int> offsets_counts;  // (offset, count) per cluster
+	std::vector<unsigned int> indices;
+
+	// stats for the last frame
+	int lights_visible;
+	int overflowed_clusters;
+	int max_lights_in_cluster;
+};
+
+struct LightClusterGPU {
+	GLuint light_buffer, light_texture;
+	GLuint grid_buffer, grid_texture;
+	GLuint index_buffer, index_texture;
+};
+
+// Precompute the cluster bounds for a symmetric perspective projection
+void build_cluster_bounds (LightClusterGrid& grid, float fovy, float aspect, float near, float far);
+// Bin the lights into the grid for the given view matrix, spread over the job workers (NULL for the calling thread)
+void assign_lights_to_clusters (LightClusterGrid& grid, const std::vector<PointLight>& lights, const mat4& view, JobSystem* jobs);
+
+// GL side: texture buffers read by the toon fragment shader
+void create_light_cluster_buffers (LightClusterGPU& gpu);
+void upload_light_clusters (const LightClusterGrid& grid, const std::vector<PointLight>& lights, LightClusterGPU& gpu);
+void bind_light_clusters (const LightClusterGPU& gpu);
+// Points the buffer samplers at their texture units, program must be in use.
+// Needed before validation: samplers of different types may not share a unit.
+void set_light_cluster_samplers (GLuint program);
+// Sets the grid uniforms, program must be in use
+void set_light_cluster_uniforms (GLuint program, const LightClusterGrid& grid, int screen_width, int screen_height);
+
+#endif
@@ -0,0 +1,134 @@
+#include "dynamic_resolution.h"
+#include "gl_state.h"
+#include <math.h>
+
+/*-----------------------------------SETUP--------------------------------------------*/
+
+static int aligned_size (float size, int limit) {
+	int aligned = (int)(size / DYNAMIC_RES_ALIGN + 0.5f) * DYNAMIC_RES_ALIGN;
+	aligned = aligned < DYNAMIC_RES_ALIGN ? DYNAMIC_RES_ALIGN : aligned;
+	return aligned < limit ? aligned : limit;
+}
+
+void create_dynamic_resolution (DynamicResolution& res, GLuint program, int window_width, int window_height,
+	float min_scale, float max_scale, float target_ms) {
+	res.window_width = window_width;
+	res.window_height = window_height;
+	res.min_scale = min_scale;
+	res.max_scale = max_scale > min_scale ? max_scale : min_scale;
+	res.target_ms = target_ms;
+
+	// Tuned on the crowd scene: about ten frames to settle after a jump in load
+	res.kp = 0.15f;
+	res.ki = 0.05f;
+	res.kd = 0.05f;
+	res.scale = res.max_scale;
+	res.integral = res.max_scale * res.max_scale / res.ki;
+	res.previous_error = 0.0f;
+	res.sharpness = 0.3f;
+
+	res.target_width = (int)ceilf (window_width * res.max_scale);
+	res.target_height = (int)ceilf (window_height * res.max_scale);
+	res.width = aligned_size (window_width * res.scale, res.target_width);
+	res.height = aligned_size (window_height * res.scale, res.target_height);
+
+	glGenTextures (1, &res.colour_texture);
+	glBindTexture (GL_TEXTURE_2D, res.colour_texture);
+	glTexStorage2D (GL_TEXTURE_2D, 1, GL_RGBA8, res.target_width, res.target_height);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture (GL_TEXTURE_2D, 0);
+	glGenRenderbuffers (1, &res.depth_renderbuffer);
+	glBindRenderbuffer (GL_RENDERBUFFER, res.depth_renderbuffer);
+	glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, res.target_width, res.target_height);
+	glBindRenderbuffer (GL_RENDERBUFFER, 0);
+
+	GLint previous_fbo;
+	glGetIntegerv (GL_FRAMEBUFFER_BINDING, &previous_fbo);
+	glGenFramebuffers (1, &res.fbo);
+	glBindFramebuffer (GL_FRAMEBUFFER, res.fbo);
+	glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, res.colour_texture, 0);
+	glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, res.depth_renderbuffer);
+	glBindFramebuffer (GL_FRAMEBUFFER, previous_fbo);
+
+	res.program = program;
+	glGenVertexArrays (1, &res.empty_vao);
+	glGenQueries (DYNAMIC_RES_QUERY_FRAMES * 2, &res.queries[0][0]);
+	res.query_index = 0;
+	res.queries_issued = 0;
+	res.gpu_ms = 0.0;
+	gls_invalidate ();
+}
+
+/*-----------------------------------CONTROLLER---------------------------------------*/
+
+static void update_scale (DynamicResolution& res, double gpu_ms) {
+	float error = (float)((res.target_ms - gpu_ms) / res.target_ms);
+	float derivative = error - res.previous_error;
+	res.previous_error = error;
+
+	float min_area = res.min_scale * res.min_scale;
+	float max_area = res.max_scale * res.max_scale;
+	float area = res.kp * error + res.ki * (res.integral + error) + res.kd * derivative;
+	// Only integrate while the output is inside its bounds
+	if (area > min_area && area < max_area) {
+		res.integral += error;
+	}
+	area = area < min_area ? min_area : (area > max_area ? max_area : area);
+	res.scale = sqrtf (area);
+}
+
+/*-----------------------------------FRAME--------------------------------------------*/
+
+void begin_dynamic_resolution (DynamicResolution& res) {
+	res.width = aligned_size (res.window_width * res.scale, res.target_width);
+	res.height = aligned_size (res.window_height * res.scale, res.target_height);
+	glGetIntegerv (GL_FRAMEBUFFER_BINDING, &res.previous_fbo);
+	glBindFramebuffer (GL_FRAMEBUFFER, res.fbo);
+	glViewport (0, 0, res.width, res.height);
+	glQueryCounter (res.queries[res.query_index][0], GL_TIMESTAMP);
+}
+
+void end_dynamic_resolution (DynamicResolution& res) {
+	glBindFramebuffer (GL_FRAMEBUFFER, res.previous_fbo);
+	glViewport (0, 0, res.window_width, res.window_height);
+
+	GLuint program = res.program;
+	gls_use_program (program);
+	gls_disable (GL_DEPTH_TEST);
+	gls_active_texture (GL_TEXTURE0);
+	gls_bind_texture (GL_TEXTURE_2D, res.colour_texture);
+	gls_uniform1i (glGetUniformLocation (program, "scene"), 0);
+	float tw = (float)res.target_width, th = (float)res.target_height;
+	glUniform2f (glGetUniformLocation (program, "uv_scale"), res.width / tw, res.height / th);
+	glUniform2f (glGetUniformLocation (program, "texel_size"), 1.0f / tw, 1.0f / th);
+	glUniform2f (glGetUniformLocation (program, "uv_max"), (res.width - 0.5f) / tw, (res.height - 0.5f) / th);
+	// Nothing to win back when nothing was lost
+	bool upscaled = res.width < res.window_width || res.height < res.window_height;
+	glUniform1f (glGetUniformLocation (program, "sharpness"), upscaled ? res.sharpness : 0.0f);
+	gls_bind_vertex_array (res.empty_vao);
+	glDrawArrays (GL_TRIANGLES, 0, 3);
+	gls_enable (GL_DEPTH_TEST);
+
+	glQueryCounter (res.queries[res.query_index][1], GL_TIMESTAMP);
+	res.query_index = (res.query_index + 1) % DYNAMIC_RES_QUERY_FRAMES;
+	if (res.queries_issued < DYNAMIC_RES_QUERY_FRAMES) {
+		res.queries_issued++;
+	}
+
+	// The slot about to be reused is the oldest frame, its result is normally ready
+	if (res.queries_issued == DYNAMIC_RES_QUERY_FRAMES) {
+		GLuint* pair = res.queries[res.query_index];
+		GLint available = 0;
+		glGetQueryObjectiv (pair[1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 start, end;
+			glGetQueryObjectui64v (pair[0], GL_QUERY_RESULT, &start);
+			glGetQueryObjectui64v (pair[1], GL_QUERY_RESULT, &end);
+			res.gpu_ms = (end - start) / 1000000.0;
+			update_scale (res, res.gpu_ms);
+		}
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef _DYNAMIC_RESOLUTION_H_
+#define _DYNAMIC_RESOLUTION_H_
+
+#include <GL/glew.h>
+
+/*----------------------------------------------------------------------------
+                   DYNAMIC RESOLUTION
+  ----------------------------------------------------------------------------*/
+// The scene is drawn into the bottom left corner of an offscreen colour and
+// depth target, then stretched over the window by UpscaleFragmentShader.txt
+// (bilinear plus a light sharpen). The target is allocated once at the
+// largest scale, only the viewport changes.
+//
+// The GPU time of each frame is measured with a pair of timestamp queries,
+// read DYNAMIC_RES_QUERY_FRAMES frames later so the CPU never waits on them.
+// A PID controller on the normalised error (target - measured) / target sets
+// the fraction of pixels drawn, since GPU time follows the pixel count more
+// closely than the width. The integral term holds the steady state, and it
+// stops integrating once the scale hits a bound so it does not wind up.
+
+#define DYNAMIC_RES_QUERY_FRAMES 4  // frames between issuing a timer query and reading it
+#define DYNAMIC_RES_ALIGN 8  // render sizes are multiples of this
+
+struct DynamicResolution {
+	int window_width, window_height;
+	float min_scale, max_scale;  // per axis
+	float target_ms;
+
+	// PID on the pixel fraction (scale squared)
+	float kp, ki, kd;
+	float integral, previous_error;
+	float scale;  // per axis, for the next frame
+	int width, height;  // drawn this frame
+
+	GLuint fbo, colour_texture, depth_renderbuffer;
+	int target_width, target_height;  // at max_scale
+	GLuint program, empty_vao;  // UpscaleVertexShader.txt and UpscaleFragmentShader.txt
+	float sharpness;
+	GLint previous_fbo;  // where the upscaled frame goes
+
+	GLuint queries[DYNAMIC_RES_QUERY_FRAMES][2];  // start and end timestamps
+	int query_index;
+	int queries_issued;
+	double gpu_ms;  // latest measured frame
+};
+
+// Scales are per axis and may go above 1 to supersample. Starts at max_scale.
+void create_dynamic_resolution (DynamicResolution& res, GLuint program, int window_width, int window_height,
+	float min_scale, float max_scale, float target_ms);
+// Bind the offscreen target at this frame's size and start timing. Call
+// before the frame's clear.
+void begin_dynamic_resolution (DynamicResolution& res);
+// Upscale to the framebuffer that was bound before begin, stop timing and
+// pick the next frame's scale from whichever frame's timing is ready
+void end_dynamic_resolution (DynamicResolution& res);
+
+#endif
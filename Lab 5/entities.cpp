@@ -0,0 +1,173 @@
+#include "entities.h"
+#include <assert.h>
+
+void clear_entity_world (EntityWorld& world) {
+	world.archetypes.clear ();
+	world.records.clear ();
+	world.free_indices.clear ();
+	world.live = 0;
+}
+
+static EntityId make_id (unsigned int index, unsigned int generation) {
+	return (generation << ENTITY_INDEX_BITS) | index;
+}
+
+static unsigned int id_index (EntityId id) {
+	return id & ENTITY_INDEX_MASK;
+}
+
+/*-----------------------------------ARCHETYPES---------------------------------------*/
+
+static int find_archetype (EntityWorld& world, unsigned int mask) {
+	for (size_t i = 0; i < world.archetypes.size (); i++) {
+		if (world.archetypes[i].mask == mask) {
+			return (int)i;
+		}
+	}
+	Archetype archetype;
+	archetype.mask = mask;
+	world.archetypes.push_back (archetype);
+	return (int)world.archetypes.size () - 1;
+}
+
+// Append a zeroed row, returns its index
+static int push_row (Archetype& a, EntityId id) {
+	a.id.push_back (id);
+	if (a.mask & COMPONENT_POSITION) {
+		a.position.push_back (vec3 (0.0f, 0.0f, 0.0f));
+	}
+	if (a.mask & COMPONENT_ROTATION) {
+		a.rotation.push_back (0.0f);
+	}
+	if (a.mask & COMPONENT_VELOCITY) {
+		a.velocity.push_back (vec3 (0.0f, 0.0f, 0.0f));
+	}
+	if (a.mask & COMPONENT_AI) {
+		AIState ai = { AI_STAND, false, true, 0.0f, 0.0f, 0.0f, 0.0f, false, ENTITY_NONE };
+		a.ai.push_back (ai);
+	}
+	if (a.mask & COMPONENT_MESH) {
+		MeshComponent mesh = { 0, 1.0f, -1 };
+		a.mesh.push_back (mesh);
+	}
+	return (int)a.id.size () - 1;
+}
+
+// Move the last row into row and drop the last, fixing up the moved entity's record
+static void remove_row (EntityWorld& world, int archetype, int row) {
+	Archetype& a = world.archetypes[archetype];
+	int last = (int)a.id.size () - 1;
+	if (row != last) {
+		a.id[row] = a.id[last];
+		if (a.mask & COMPONENT_POSITION) a.position[row] = a.position[last];
+		if (a.mask & COMPONENT_ROTATION) a.rotation[row] = a.rotation[last];
+		if (a.mask & COMPONENT_VELOCITY) a.velocity[row] = a.velocity[last];
+		if (a.mask & COMPONENT_AI) a.ai[row] = a.ai[last];
+		if (a.mask & COMPONENT_MESH) a.mesh[row] = a.mesh[last];
+		world.records[id_index (a.id[row])].row = row;
+	}
+	a.id.pop_back ();
+	if (a.mask & COMPONENT_POSITION) a.position.pop_back ();
+	if (a.mask & COMPONENT_ROTATION) a.rotation.pop_back ();
+	if (a.mask & COMPONENT_VELOCITY) a.velocity.pop_back ();
+	if (a.mask & COMPONENT_AI) a.ai.pop_back ();
+	if (a.mask & COMPONENT_MESH) a.mesh.pop_back ();
+}
+
+/*-----------------------------------ENTITIES-----------------------------------------*/
+
+EntityId create_entity (EntityWorld& world, unsigned int mask) {
+	unsigned int index;
+	if (!world.free_indices.empty ()) {
+		index = world.free_indices.back ();
+		world.free_indices.pop_back ();
+	}
+	else {
+		index = (unsigned int)world.records.size ();
+		assert (index < ENTITY_INDEX_MASK);
+		EntityRecord record = { 0, -1, 0 };
+		world.records.push_back (record);
+	}
+	EntityRecord& record = world.records[index];
+	EntityId id = make_id (index, record.generation);
+	record.archetype = find_archetype (world, mask);
+	record.row = push_row (world.archetypes[record.archetype], id);
+	world.live++;
+	return id;
+}
+
+bool entity_alive (const EntityWorld& world, EntityId id) {
+	unsigned int index = id_index (id);
+	return id != ENTITY_NONE && index < world.records.size () && world.records[index].archetype >= 0
+		&& make_id (index, world.records[index].generation) == id;
+}
+
+void destroy_entity (EntityWorld& world, EntityId id) {
+	if (!entity_alive (world, id)) {
+		return;
+	}
+	unsigned int index = id_index (id);
+	EntityRecord& record = world.records[index];
+	remove_row (world, record.archetype, record.row);
+	record.archetype = -1;
+	// the generation wraps at 12 bits, the last index is never handed out so no id spells ENTITY_NONE
+	record.generation = (record.generation + 1) & (0xffffffffu >> ENTITY_INDEX_BITS);
+	world.free_indices.push_back (index);
+	world.live--;
+}
+
+void set_entity_components (EntityWorld& world, EntityId id, unsigned int mask) {
+	assert (entity_alive (world, id));
+	EntityRecord& record = world.records[id_index (id)];
+	int from = record.archetype;
+	if (world.archetypes[from].mask == mask) {
+		return;
+	}
+	int to = find_archetype (world, mask);
+	// find_archetype may have grown the array, take the references after it
+	Archetype& src = world.archetypes[from];
+	Archetype& dst = world.archetypes[to];
+	int row = push_row (dst, id);
+	unsigned int both = src.mask & dst.mask;
+	if (both & COMPONENT_POSITION) dst.position[row] = src.position[record.row];
+	if (both & COMPONENT_ROTATION) dst.rotation[row] = src.rotation[record.row];
+	if (both & COMPONENT_VELOCITY) dst.velocity[row] = src.velocity[record.row];
+	if (both & COMPONENT_AI) dst.ai[row] = src.ai[record.row];
+	if (both & COMPONENT_MESH) dst.mesh[row] = src.mesh[record.row];
+	remove_row (world, from, record.row);
+	record.archetype = to;
+	record.row = row;
+}
+
+Archetype& entity_archetype (EntityWorld& world, EntityId id, int& row) {
+	assert (entity_alive (world, id));
+	const EntityRecord& record = world.records[id_index (id)];
+	row = record.row;
+	return world.archetypes[record.archetype];
+}
+
+/*-----------------------------------QUERIES------------------------------------------*/
+
+void create_entity_query (EntityQuery& query, unsigned int all, unsigned int none) {
+	query.all = all;
+	query.none = none;
+	query.seen = 0;
+	query.archetypes.clear ();
+}
+
+void refresh_entity_query (EntityQuery& query, const EntityWorld& world) {
+	for (; query.seen < world.archetypes.size (); query.seen++) {
+		unsigned int mask = world.archetypes[query.seen].mask;
+		if ((mask & query.all) == query.all && (mask & query.none) == 0) {
+			query.archetypes.push_back ((int)query.seen);
+		}
+	}
+}
+
+int entity_query_count (const EntityQuery& query, const EntityWorld& world) {
+	int count = 0;
+	for (size_t i = 0; i < query.archetypes.size (); i++) {
+		count += (int)world.archetypes[query.archetypes[i]].id.size ();
+	}
+	return count;
+}
@@ -0,0 +1,114 @@
+#ifndef _ENTITIES_H_
+#define _ENTITIES_H_
+
+#include <stddef.h>
+#include <vector>
+#include "maths_funcs.h"
+
+/*----------------------------------------------------------------------------
+                   ENTITIES
+  ----------------------------------------------------------------------------*/
+// Scene objects are entities, each made of a set of components. Entities
+// with the same set share an archetype, which keeps every component it has
+// in its own dense array (structure of arrays), one row per entity. Systems
+// are plain loops over those arrays: a query lists the archetypes holding
+// every component it asks for (and none it excludes), and the caller walks
+// each archetype's rows.
+//
+// An entity id is an index into the entity records plus a generation in
+// the top bits. Destroying an entity moves the last row of its archetype
+// into the hole and frees the index, which comes back with the next
+// generation, so a stale id fails entity_alive instead of reaching someone
+// else's components.
+//
+// Adding or removing components moves the entity's row to the matching
+// archetype. Rows move, so references into the arrays only last until the
+// next create, destroy or component change. Archetypes are never removed,
+// so a query only has to look at the ones made since its last refresh.
+
+#define ENTITY_INDEX_BITS 20  // a million entities, the generation gets the other 12 bits
+#define ENTITY_INDEX_MASK ((1u << ENTITY_INDEX_BITS) - 1)
+#define ENTITY_NONE 0xffffffffu
+
+typedef unsigned int EntityId;
+
+enum ComponentBits {
+	COMPONENT_POSITION = 1,
+	COMPONENT_ROTATION = 2,  // about y, degrees
+	COMPONENT_VELOCITY = 4,  // distance per reference tick, set by the AI before moving
+	COMPONENT_AI = 8,
+	COMPONENT_MESH = 16
+};
+
+// What the AI system does each tick, see simulateStep in main.cpp
+enum AIBehaviour {
+	AI_STAND = 0,  // only waves
+	AI_MARCH = 1  // marches back and forth, backs away from the player when close
+};
+
+struct AIState {
+	unsigned char behaviour;
+	bool flees;  // runs from the player while the snowmen are scared
+	bool march_forward;
+	float march_distance;
+	float spin;  // degrees per reference tick
+	float wave_phase;  // degrees added to the arm swing
+	float throw_cooldown;  // seconds until it can throw a snowball
+	bool retaliating;  // throws back at throw_at as soon as it can
+	EntityId throw_at;  // ENTITY_NONE for the player
+};
+
+// What is drawn for the entity, the caller decides what model means
+struct MeshComponent {
+	int model;
+	float scale;
+	int node;  // in the scene graph, -1 until the renderer makes one
+};
+
+struct Archetype {
+	unsigned int mask;  // components present, the arrays of the others stay empty
+	std::vector<EntityId> id;
+	std::vector<vec3> position;
+	std::vector<float> rotation;
+	std::vector<vec3> velocity;
+	std::vector<AIState> ai;
+	std::vector<MeshComponent> mesh;
+};
+
+struct EntityRecord {
+	unsigned int generation;
+	int archetype;  // -1 while the index is free
+	int row;
+};
+
+struct EntityWorld {
+	std::vector<Archetype> archetypes;
+	std::vector<EntityRecord> records;  // by id index
+	std::vector<unsigned int> free_indices;
+	int live;
+};
+
+struct EntityQuery {
+	unsigned int all;  // components an archetype must have
+	unsigned int none;  // components it must not have
+	size_t seen;  // archetypes already looked at
+	std::vector<int> archetypes;  // matching ones
+};
+
+void clear_entity_world (EntityWorld& world);
+// New entity with the given components, zeroed (a mesh has node -1)
+EntityId create_entity (EntityWorld& world, unsigned int mask);
+void destroy_entity (EntityWorld& world, EntityId id);
+bool entity_alive (const EntityWorld& world, EntityId id);
+// Move the entity to the archetype for mask, keeping the components both have
+void set_entity_components (EntityWorld& world, EntityId id, unsigned int mask);
+// Where a live entity's components are
+Archetype& entity_archetype (EntityWorld& world, EntityId id, int& row);
+
+void create_entity_query (EntityQuery& query, unsigned int all, unsigned int none);
+// Pick up the archetypes made since the last refresh
+void refresh_entity_query (EntityQuery& query, const EntityWorld& world);
+// Entities the query matches right now
+int entity_query_count (const EntityQuery& query, const EntityWorld& world);
+
+#endif
@@ -0,0 +1,192 @@
+#include "frame_capture.h"
+#include <chrono>
+#include <string.h>
+
+typedef std::chrono::high_resolution_clock capture_clock;
+
+/*-----------------------------------WRITER THREAD------------------------------------*/
+
+static unsigned char clamp_byte (int v) {
+	return (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+// Full range BT.601 (what the y4m 420jpeg tag means), chroma averaged over 2x2 pixels
+static void rgba_to_yuv420 (const unsigned char* rgba, int width, int height, std::vector<unsigned char>& yuv) {
+	int chroma_width = width / 2, chroma_height = height / 2;
+	yuv.resize (width * height + 2 * chroma_width * chroma_height);
+	unsigned char* y_plane = &yuv[0];
+	unsigned char* u_plane = y_plane + width * height;
+	unsigned char* v_plane = u_plane + chroma_width * chroma_height;
+	for (int y = 0; y < height; y++) {
+		// GL rows start at the bottom, y4m rows at the top
+		const unsigned char* row = rgba + (size_t)(height - 1 - y) * width * 4;
+		for (int x = 0; x < width; x++) {
+			const unsigned char* p = row + x * 4;
+			y_plane[y * width + x] = clamp_byte ((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+		}
+	}
+	for (int y = 0; y < chroma_height; y++) {
+		const unsigned char* row0 = rgba + (size_t)(height - 1 - 2 * y) * width * 4;
+		const unsigned char* row1 = row0 - (size_t)width * 4;
+		for (int x = 0; x < chroma_width; x++) {
+			const unsigned char* p = row0 + x * 8;
+			const unsigned char* q = row1 + x * 8;
+			int r = p[0] + p[4] + q[0] + q[4];
+			int g = p[1] + p[5] + q[1] + q[5];
+			int b = p[2] + p[6] + q[2] + q[6];
+			u_plane[y * chroma_width + x] = clamp_byte (((-43 * r - 85 * g + 128 * b) / 4 + 32768 + 128) >> 8);
+			v_plane[y * chroma_width + x] = clamp_byte (((128 * r - 107 * g - 21 * b) / 4 + 32768 + 128) >> 8);
+		}
+	}
+}
+
+static void write_frames (FrameCapture* capture) {
+	std::vector<unsigned char> frame, yuv;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock (capture->mutex);
+			while (capture->queue.empty () && !capture->stopping) {
+				capture->wake_writer.wait (lock);
+			}
+			if (capture->queue.empty ()) {
+				return;
+			}
+			frame.swap (capture->queue.front ());
+			capture->queue.erase (capture->queue.begin ());
+		}
+		capture->wake_renderer.notify_one ();
+
+		rgba_to_yuv420 (&frame[0], capture->width, capture->height, yuv);
+		fputs ("FRAME\n", capture->file);
+		fwrite (&yuv[0], 1, yuv.size (), capture->file);
+
+		std::lock_guard<std::mutex> lock (capture->mutex);
+		capture->spare.push_back (std::vector<unsigned char> ());
+		capture->spare.back ().swap (frame);
+	}
+}
+
+/*-----------------------------------READBACK-----------------------------------------*/
+
+// Map a slot's finished readback and pass a copy to the writer
+static void retire_slot (FrameCapture& capture, int slot) {
+	GLsync fence = capture.fences[slot];
+	if (glClientWaitSync (fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+		capture.stats.fence_waits++;
+		while (glClientWaitSync (fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+		}
+	}
+	glDeleteSync (fence);
+	capture.fences[slot] = 0;
+
+	size_t size = (size_t)capture.width * capture.height * 4;
+	std::vector<unsigned char> frame;
+	{
+		std::unique_lock<std::mutex> lock (capture.mutex);
+		if (capture.queue.size () >= CAPTURE_QUEUE_LIMIT) {
+			capture.stats.queue_waits++;
+			while (capture.queue.size () >= CAPTURE_QUEUE_LIMIT) {
+				capture.wake_renderer.wait (lock);
+			}
+		}
+		if (!capture.spare.empty ()) {
+			frame.swap (capture.spare.back ());
+			capture.spare.pop_back ();
+		}
+	}
+	frame.resize (size);
+
+	glBindBuffer (GL_PIXEL_PACK_BUFFER, capture.buffers[slot]);
+	const void* pixels = glMapBufferRange (GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if (pixels) {
+		memcpy (&frame[0], pixels, size);
+	}
+	glUnmapBuffer (GL_PIXEL_PACK_BUFFER);
+
+	{
+		std::lock_guard<std::mutex> lock (capture.mutex);
+		capture.queue.push_back (std::vector<unsigned char> ());
+		capture.queue.back ().swap (frame);
+	}
+	capture.wake_writer.notify_one ();
+	capture.stats.written++;
+}
+
+bool start_frame_capture (FrameCapture& capture, const char* file_name, int width, int height, int fps) {
+	capture.active = false;
+	capture.file = fopen (file_name, "wb");
+	if (!capture.file) {
+		fprintf (stderr, "Could not open %s for capture\n", file_name);
+		return false;
+	}
+	capture.width = width & ~1;
+	capture.height = height & ~1;
+	fprintf (capture.file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", capture.width, capture.height, fps);
+
+	size_t size = (size_t)capture.width * capture.height * 4;
+	glGenBuffers (CAPTURE_RING_SIZE, capture.buffers);
+	for (int i = 0; i < CAPTURE_RING_SIZE; i++) {
+		glBindBuffer (GL_PIXEL_PACK_BUFFER, capture.buffers[i]);
+		glBufferData (GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		capture.fences[i] = 0;
+	}
+	glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+	capture.next = 0;
+
+	capture.queue.clear ();
+	capture.spare.clear ();
+	capture.stopping = false;
+	memset (&capture.stats, 0, sizeof (capture.stats));
+	capture.writer = std::thread (write_frames, &capture);
+	capture.active = true;
+	return true;
+}
+
+void capture_frame (FrameCapture& capture) {
+	if (!capture.active) {
+		return;
+	}
+	capture_clock::time_point start = capture_clock::now ();
+
+	// The slot about to be reused holds the frame from CAPTURE_RING_SIZE frames ago
+	int slot = capture.next;
+	if (capture.fences[slot]) {
+		retire_slot (capture, slot);
+	}
+
+	glBindBuffer (GL_PIXEL_PACK_BUFFER, capture.buffers[slot]);
+	glPixelStorei (GL_PACK_ALIGNMENT, 4);
+	glReadPixels (0, 0, capture.width, capture.height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+	capture.fences[slot] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	capture.next = (slot + 1) % CAPTURE_RING_SIZE;
+	capture.stats.frames++;
+
+	double ms = std::chrono::duration<double, std::milli> (capture_clock::now () - start).count ();
+	capture.stats.last_ms = ms;
+	capture.stats.total_ms += ms;
+	capture.stats.max_ms = ms > capture.stats.max_ms ? ms : capture.stats.max_ms;
+}
+
+void stop_frame_capture (FrameCapture& capture) {
+	if (!capture.active) {
+		return;
+	}
+	// Oldest first so the frames stay in order
+	for (int i = 0; i < CAPTURE_RING_SIZE; i++) {
+		int slot = (capture.next + i) % CAPTURE_RING_SIZE;
+		if (capture.fences[slot]) {
+			retire_slot (capture, slot);
+		}
+	}
+	glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+	{
+		std::lock_guard<std::mutex> lock (capture.mutex);
+		capture.stopping = true;
+	}
+	capture.wake_writer.notify_one ();
+	capture.writer.join ();
+	fclose (capture.file);
+	glDeleteBuffers (CAPTURE_RING_SIZE, capture.buffers);
+	capture.active = false;
+}
@@ -0,0 +1,62 @@
+#ifndef _FRAME_CAPTURE_H_
+#define _FRAME_CAPTURE_H_
+
+#include <GL/glew.h>
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+/*----------------------------------------------------------------------------
+                   FRAME CAPTURE
+  ----------------------------------------------------------------------------*/
+// Records the rendered frames to a YUV4MPEG2 (.y4m) file without stalling
+// the renderer. Each frame's glReadPixels goes into one of a ring of pixel
+// pack buffers and only queues a copy on the GPU. A fence marks when it is
+// done, and the buffer is mapped CAPTURE_RING_SIZE frames later, by which
+// time the copy has normally finished. The render thread only copies the
+// mapped pixels out; converting to YUV 4:2:0 and writing happen on a writer
+// thread.
+//
+// The file name can also be a named pipe, e.g. one ffmpeg is reading from.
+
+#define CAPTURE_RING_SIZE 3  // frames between a readback and its map
+#define CAPTURE_QUEUE_LIMIT 8  // frames waiting for the writer before the renderer blocks
+
+struct CaptureStats {
+	int frames;  // read back so far
+	int written;  // handed to the writer so far
+	int fence_waits;  // maps that had to wait for the GPU copy
+	int queue_waits;  // frames that waited for room in the writer's queue
+	double last_ms;  // render thread time in the last capture_frame
+	double total_ms, max_ms;
+};
+
+struct FrameCapture {
+	bool active;
+	int width, height;  // even, odd sizes lose their last row or column
+	FILE* file;
+	GLuint buffers[CAPTURE_RING_SIZE];  // GL_PIXEL_PACK_BUFFER, RGBA
+	GLsync fences[CAPTURE_RING_SIZE];  // 0 when the buffer holds nothing
+	int next;  // ring slot the next frame reads into
+
+	// Shared with the writer thread
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable wake_writer, wake_renderer;
+	std::vector<std::vector<unsigned char> > queue;  // RGBA frames, bottom row first
+	std::vector<std::vector<unsigned char> > spare;  // written frames kept for reuse
+	bool stopping;
+
+	CaptureStats stats;
+};
+
+// Open the file, write the y4m header and start the writer thread
+bool start_frame_capture (FrameCapture& capture, const char* file_name, int width, int height, int fps);
+// Read the current read framebuffer after a frame is drawn, before the swap
+void capture_frame (FrameCapture& capture);
+// Wait for the frames still in flight, then stop the writer and close the file
+void stop_frame_capture (FrameCapture& capture);
+
+#endif
@@ -0,0 +1,94 @@
+#include "frame_pacing.h"
+#include <math.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <mmsystem.h>
+#endif
+
+static double ms_between (pacing_clock::time_point a, pacing_clock::time_point b) {
+	return std::chrono::duration<double, std::milli> (b - a).count ();
+}
+
+void create_frame_pacer (FramePacer& pacer, double fps, bool vsync) {
+	pacer.period_ms = fps > 0.0 && !vsync ? 1000.0 / fps : 0.0;
+	pacer.vsync = vsync;
+	pacer.started = false;
+	pacer.samples = 0;
+	pacer.next_sample = 0;
+#ifdef _WIN32
+	// Sleep is only as fine as the system timer, 15.6 ms unless asked otherwise
+	if (pacer.period_ms > 0.0) {
+		timeBeginPeriod (1);
+	}
+#endif
+}
+
+void wait_for_next_frame (FramePacer& pacer) {
+	pacing_clock::time_point now = pacing_clock::now ();
+	if (!pacer.started) {
+		pacer.started = true;
+		pacer.deadline = now;
+		pacer.last_start = now;
+	}
+
+	double slept = 0.0;
+	if (pacer.period_ms > 0.0) {
+		double remaining = ms_between (now, pacer.deadline);
+		if (remaining > FRAME_SPIN_MARGIN_MS) {
+			pacing_clock::time_point before = now;
+			std::this_thread::sleep_for (std::chrono::duration<double, std::milli> (remaining - FRAME_SPIN_MARGIN_MS));
+			now = pacing_clock::now ();
+			slept = ms_between (before, now);
+		}
+		while (now < pacer.deadline) {
+			std::this_thread::yield ();
+			now = pacing_clock::now ();
+		}
+	}
+
+	int i = pacer.next_sample;
+	pacer.late_ms[i] = pacer.period_ms > 0.0 ? ms_between (pacer.deadline, now) : 0.0;
+	pacer.interval_ms[i] = ms_between (pacer.last_start, now);
+	pacer.slept_ms[i] = slept;
+	pacer.next_sample = (i + 1) % FRAME_STATS_WINDOW;
+	if (pacer.samples < FRAME_STATS_WINDOW) {
+		pacer.samples++;
+	}
+	pacer.last_start = now;
+
+	// Next deadline on the same grid, unless this frame missed a whole period
+	if (pacer.period_ms > 0.0) {
+		std::chrono::duration<double, std::milli> period (pacer.period_ms);
+		pacer.deadline += std::chrono::duration_cast<pacing_clock::duration> (period);
+		if (pacer.deadline < now) {
+			pacer.deadline = now + std::chrono::duration_cast<pacing_clock::duration> (period);
+		}
+	}
+}
+
+FramePacingStats frame_pacing_stats (const FramePacer& pacer) {
+	FramePacingStats stats = {};
+	int n = pacer.samples;
+	if (n == 0) {
+		return stats;
+	}
+	double late_sum = 0.0, interval_sum = 0.0, slept_sum = 0.0;
+	for (int i = 0; i < n; i++) {
+		late_sum += pacer.late_ms[i];
+		interval_sum += pacer.interval_ms[i];
+		slept_sum += pacer.slept_ms[i];
+		stats.late_max_ms = pacer.late_ms[i] > stats.late_max_ms ? pacer.late_ms[i] : stats.late_max_ms;
+	}
+	stats.late_avg_ms = late_sum / n;
+	stats.interval_avg_ms = interval_sum / n;
+	double variance = 0.0;
+	for (int i = 0; i < n; i++) {
+		double d = pacer.interval_ms[i] - stats.interval_avg_ms;
+		variance += d * d;
+	}
+	stats.interval_jitter_ms = sqrt (variance / n);
+	stats.sleep_fraction = interval_sum > 0.0 ? slept_sum / interval_sum : 0.0;
+	return stats;
+}
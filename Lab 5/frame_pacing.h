@@ -0,0 +1,50 @@
+#ifndef _FRAME_PACING_H_
+#define _FRAME_PACING_H_
+
+#include <chrono>
+
+/*----------------------------------------------------------------------------
+                   FRAME PACING
+  ----------------------------------------------------------------------------*/
+// Holds the main loop to a target frame rate instead of letting the idle
+// callback spin. Frames are due on a fixed grid of deadlines. The pacer
+// sleeps until just before the next one, FRAME_SPIN_MARGIN_MS early to
+// allow for the scheduler oversleeping, and yields in a loop for the rest.
+// A frame that comes in more than a whole period late starts a new grid
+// instead of rushing the missed frames out back to back.
+//
+// In vsync mode the swap interval is 1 and the pacer does not sleep: the
+// swap blocks until the display is ready, and only the timing is recorded.
+
+#define FRAME_SPIN_MARGIN_MS 2.0
+#define FRAME_STATS_WINDOW 120  // frames the jitter statistics cover
+
+typedef std::chrono::high_resolution_clock pacing_clock;
+
+struct FramePacingStats {
+	double late_avg_ms, late_max_ms;  // how long after its deadline each frame started
+	double interval_avg_ms, interval_jitter_ms;  // frame start to frame start, and its standard deviation
+	double sleep_fraction;  // of the wall time, spent asleep in the pacer
+};
+
+struct FramePacer {
+	double period_ms;  // 0 runs unpaced
+	bool vsync;
+	pacing_clock::time_point deadline;
+	pacing_clock::time_point last_start;
+	bool started;
+
+	// per frame over the last FRAME_STATS_WINDOW frames
+	double late_ms[FRAME_STATS_WINDOW];
+	double interval_ms[FRAME_STATS_WINDOW];
+	double slept_ms[FRAME_STATS_WINDOW];
+	int samples, next_sample;
+};
+
+// fps of 0 runs as fast as possible, vsync leaves the waiting to the swap
+void create_frame_pacer (FramePacer& pacer, double fps, bool vsync);
+// Block until the next frame is due, call at the top of each frame
+void wait_for_next_frame (FramePacer& pacer);
+FramePacingStats frame_pacing_stats (const FramePacer& pacer);
+
+#endif
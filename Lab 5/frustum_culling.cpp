@@ -0,0 +1,220 @@
+#include "frustum_culling.h"
+#include <math.h>
+#include <xmmintrin.h> // SSE
+#ifdef __AVX__
+#include <immintrin.h> // AVX, only when the compiler is allowed to use it (/arch:AVX)
+#endif
+
+/*-----------------------------------SPHERES------------------------------------------*/
+
+BoundingSphere compute_bounding_sphere (const std::vector<float>& vp, int vertex_count) {
+	BoundingSphere s;
+	s.center = vec3 (0.0f, 0.0f, 0.0f);
+	s.radius = 0.0f;
+	if (vertex_count <= 0) {
+		return s;
+	}
+	// centre of the bounding box, then the furthest vertex from it
+	float lo[3] = { vp[0], vp[1], vp[2] };
+	float hi[3] = { vp[0], vp[1], vp[2] };
+	for (int i = 1; i < vertex_count; i++) {
+		for (int c = 0; c < 3; c++) {
+			lo[c] = fmin (lo[c], vp[i * 3 + c]);
+			hi[c] = fmax (hi[c], vp[i * 3 + c]);
+		}
+	}
+	s.center = vec3 ((lo[0] + hi[0]) * 0.5f, (lo[1] + hi[1]) * 0.5f, (lo[2] + hi[2]) * 0.5f);
+	float r2 = 0.0f;
+	for (int i = 0; i < vertex_count; i++) {
+		float dx = vp[i * 3 + 0] - s.center.v[0];
+		float dy = vp[i * 3 + 1] - s.center.v[1];
+		float dz = vp[i * 3 + 2] - s.center.v[2];
+		r2 = fmax (r2, dx * dx + dy * dy + dz * dz);
+	}
+	s.radius = sqrt (r2);
+	return s;
+}
+
+BoundingSphere transform_sphere (const BoundingSphere& local, const mat4& model) {
+	const float* m = model.m;
+	const float* c = local.center.v;
+	BoundingSphere s;
+	s.center = vec3 (m[0] * c[0] + m[4] * c[1] + m[8] * c[2] + m[12],
+		m[1] * c[0] + m[5] * c[1] + m[9] * c[2] + m[13],
+		m[2] * c[0] + m[6] * c[1] + m[10] * c[2] + m[14]);
+	float sx = m[0] * m[0] + m[1] * m[1] + m[2] * m[2];
+	float sy = m[4] * m[4] + m[5] * m[5] + m[6] * m[6];
+	float sz = m[8] * m[8] + m[9] * m[9] + m[10] * m[10];
+	s.radius = local.radius * sqrt (fmax (sx, fmax (sy, sz)));
+	return s;
+}
+
+void clear_spheres (SphereSoA& spheres) {
+	spheres.x.clear ();
+	spheres.y.clear ();
+	spheres.z.clear ();
+	spheres.r.clear ();
+}
+
+void add_sphere (SphereSoA& spheres, const BoundingSphere& sphere) {
+	spheres.x.push_back (sphere.center.v[0]);
+	spheres.y.push_back (sphere.center.v[1]);
+	spheres.z.push_back (sphere.center.v[2]);
+	spheres.r.push_back (sphere.radius);
+}
+
+BoundingSphere sphere_at (const SphereSoA& spheres, int i) {
+	BoundingSphere s;
+	s.center = vec3 (spheres.x[i], spheres.y[i], spheres.z[i]);
+	s.radius = spheres.r[i];
+	return s;
+}
+
+/*-----------------------------------FRUSTUM------------------------------------------*/
+
+Frustum extract_frustum (const mat4& view_proj) {
+	const float* m = view_proj.m;
+	Frustum f;
+	// rows of the column major matrix
+	for (int i = 0; i < 4; i++) {
+		float row0 = m[i * 4 + 0];
+		float row1 = m[i * 4 + 1];
+		float row2 = m[i * 4 + 2];
+		float row3 = m[i * 4 + 3];
+		f.planes[0][i] = row3 + row0;  // left
+		f.planes[1][i] = row3 - row0;  // right
+		f.planes[2][i] = row3 + row1;  // bottom
+		f.planes[3][i] = row3 - row1;  // top
+		f.planes[4][i] = row3 + row2;  // near
+		f.planes[5][i] = row3 - row2;  // far
+	}
+	// normalise so plane distances are in world units and comparable to radii
+	for (int p = 0; p < 6; p++) {
+		float len = sqrt (f.planes[p][0] * f.planes[p][0] + f.planes[p][1] * f.planes[p][1] + f.planes[p][2] * f.planes[p][2]);
+		for (int i = 0; i < 4; i++) {
+			f.planes[p][i] /= len;
+		}
+	}
+	return f;
+}
+
+bool sphere_in_frustum (const Frustum& frustum, const BoundingSphere& sphere) {
+	for (int p = 0; p < 6; p++) {
+		const float* pl = frustum.planes[p];
+		float dist = pl[0] * sphere.center.v[0] + pl[1] * sphere.center.v[1] + pl[2] * sphere.center.v[2] + pl[3];
+		if (dist < -sphere.radius) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*-----------------------------------KERNELS------------------------------------------*/
+
+int cull_spheres_scalar (const Frustum& frustum, const SphereSoA& spheres, std::vector<unsigned int>& visible) {
+	int n = (int)spheres.r.size ();
+	visible.resize (n);
+	int count = 0;
+	for (int i = 0; i < n; i++) {
+		if (sphere_in_frustum (frustum, sphere_at (spheres, i))) {
+			visible[count++] = i;
+		}
+	}
+	visible.resize (count);
+	return count;
+}
+
+int cull_simd_width () {
+#ifdef __AVX__
+	return 8;
+#else
+	return 4;
+#endif
+}
+
+int cull_spheres (const Frustum& frustum, const SphereSoA& spheres, std::vector<unsigned int>& visible) {
+	int n = (int)spheres.r.size ();
+	visible.resize (n);
+	if (n == 0) {
+		return 0;
+	}
+	const float* xs = &spheres.x[0];
+	const float* ys = &spheres.y[0];
+	const float* zs = &spheres.z[0];
+	const float* rs = &spheres.r[0];
+	unsigned int* out = &visible[0];
+	int count = 0;
+	int i = 0;
+
+#ifdef __AVX__
+	__m256 planes8[6][4];
+	for (int p = 0; p < 6; p++) {
+		for (int c = 0; c < 4; c++) {
+			planes8[p][c] = _mm256_set1_ps (frustum.planes[p][c]);
+		}
+	}
+	for (; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_loadu_ps (xs + i);
+		__m256 y = _mm256_loadu_ps (ys + i);
+		__m256 z = _mm256_loadu_ps (zs + i);
+		__m256 neg_r = _mm256_sub_ps (_mm256_setzero_ps (), _mm256_loadu_ps (rs + i));
+		__m256 inside = _mm256_castsi256_ps (_mm256_set1_epi32 (-1));
+		for (int p = 0; p < 6; p++) {
+			__m256 dist = _mm256_add_ps (_mm256_add_ps (_mm256_mul_ps (planes8[p][0], x), _mm256_mul_ps (planes8[p][1], y)),
+				_mm256_add_ps (_mm256_mul_ps (planes8[p][2], z), planes8[p][3]));
+			inside = _mm256_and_ps (inside, _mm256_cmp_ps (dist, neg_r, _CMP_GE_OQ));
+		}
+		int mask = _mm256_movemask_ps (inside);
+		while (mask) {
+			int lane = 0;
+			while (!(mask & (1 << lane))) {
+				lane++;
+			}
+			mask &= mask - 1;
+			out[count++] = i + lane;
+		}
+	}
+#endif
+
+	__m128 planes4[6][4];
+	for (int p = 0; p < 6; p++) {
+		for (int c = 0; c < 4; c++) {
+			planes4[p][c] = _mm_set1_ps (frustum.planes[p][c]);
+		}
+	}
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps (xs + i);
+		__m128 y = _mm_loadu_ps (ys + i);
+		__m128 z = _mm_loadu_ps (zs + i);
+		__m128 neg_r = _mm_sub_ps (_mm_setzero_ps (), _mm_loadu_ps (rs + i));
+		// a sphere survives only if it is inside or straddling all six planes
+		__m128 inside = _mm_cmpeq_ps (x, x);
+		for (int p = 0; p < 6; p++) {
+			__m128 dist = _mm_add_ps (_mm_add_ps (_mm_mul_ps (planes4[p][0], x), _mm_mul_ps (planes4[p][1], y)),
+				_mm_add_ps (_mm_mul_ps (planes4[p][2], z), planes4[p][3]));
+			inside = _mm_and_ps (inside, _mm_cmpge_ps (dist, neg_r));
+		}
+		int mask = _mm_movemask_ps (inside);
+		// branch free compaction of the four lanes
+		out[count] = i;
+		count += mask & 1;
+		out[count] = i + 1;
+		count += (mask >> 1) & 1;
+		out[count] = i + 2;
+		count += (mask >> 2) & 1;
+		out[count] = i + 3;
+		count += (mask >> 3) & 1;
+	}
+
+	// leftovers one at a time
+	for (; i < n; i++) {
+		BoundingSphere s;
+		s.center = vec3 (xs[i], ys[i], zs[i]);
+		s.radius = rs[i];
+		if (sphere_in_frustum (frustum, s)) {
+			out[count++] = i;
+		}
+	}
+	visible.resize (count);
+	return count;
+}
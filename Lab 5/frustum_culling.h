@@ -0,0 +1,49 @@
+#ifndef _FRUSTUM_CULLING_H_
+#define _FRUSTUM_CULLING_H_
+
+#include <vector>
+#include "maths_funcs.h"
+
+/*----------------------------------------------------------------------------
+                   VIEW-FRUSTUM CULLING
+  ----------------------------------------------------------------------------*/
+// Every mesh gets a bounding sphere at load time, which is moved by each
+// instance's model matrix. Each frame the six frustum planes are pulled out
+// of proj * view and the spheres are tested in structure of arrays form,
+// four at a time with SSE (eight with AVX when the compiler targets it).
+
+struct BoundingSphere {
+	vec3 center;
+	float radius;
+};
+
+// Sphere centres and radii in separate arrays so the kernel can load them straight into registers
+struct SphereSoA {
+	std::vector<float> x, y, z, r;
+};
+
+// a*x + b*y + c*z + d >= 0 inside, normals point into the frustum
+struct Frustum {
+	float planes[6][4];
+};
+
+BoundingSphere compute_bounding_sphere (const std::vector<float>& vp, int vertex_count);
+// Move a local sphere by a model matrix, the radius grows with the largest axis scale
+BoundingSphere transform_sphere (const BoundingSphere& local, const mat4& model);
+
+void clear_spheres (SphereSoA& spheres);
+void add_sphere (SphereSoA& spheres, const BoundingSphere& sphere);
+BoundingSphere sphere_at (const SphereSoA& spheres, int i);
+
+// Gribb/Hartmann plane extraction, works on any projection * view matrix
+Frustum extract_frustum (const mat4& view_proj);
+bool sphere_in_frustum (const Frustum& frustum, const BoundingSphere& sphere);
+
+// Writes the index of every sphere touching the frustum to visible, returns how many
+int cull_spheres (const Frustum& frustum, const SphereSoA& spheres, std::vector<unsigned int>& visible);
+// One sphere at a time, for comparison in the benchmark
+int cull_spheres_scalar (const Frustum& frustum, const SphereSoA& spheres, std::vector<unsigned int>& visible);
+// Lanes tested per instruction by cull_spheres on this build
+int cull_simd_width ();
+
+#endif
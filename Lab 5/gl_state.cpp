@@ -0,0 +1,178 @@
+#include "gl_state.h"
+#include <map>
+
+/*-----------------------------------CACHED STATE-------------------------------------*/
+
+// 0 is a valid value for most of these, so every cached value has a known flag
+static bool program_known = false;
+static GLuint current_program = 0;
+static bool active_unit_known = false;
+static GLenum active_unit = GL_TEXTURE0;
+static bool vao_known = false;
+static GLuint current_vao = 0;
+static bool depth_func_known = false;
+static GLenum current_depth_func = GL_LESS;
+static bool depth_mask_known = false;
+static GLboolean current_depth_mask = GL_TRUE;
+static bool color_mask_known = false;
+static GLboolean current_color_mask = GL_TRUE;
+static bool clear_color_known = false;
+static GLfloat current_clear_color[4];
+
+static std::map<GLenum, bool> enabled_caps;
+// (texture unit << 16 | target) -> texture
+static std::map<unsigned int, GLuint> bound_textures;
+// (program << 32 | location) -> value
+static std::map<unsigned long long, GLint> uniform_ints;
+
+static GLStateCounters this_frame = { 0, 0 };
+static GLStateCounters last_frame = { 0, 0 };
+
+void gls_begin_frame () {
+	last_frame = this_frame;
+	this_frame.issued = 0;
+	this_frame.elided = 0;
+}
+
+GLStateCounters gls_last_frame () {
+	return last_frame;
+}
+
+GLStateCounters gls_this_frame () {
+	return this_frame;
+}
+
+void gls_invalidate () {
+	program_known = false;
+	active_unit_known = false;
+	vao_known = false;
+	depth_func_known = false;
+	depth_mask_known = false;
+	color_mask_known = false;
+	clear_color_known = false;
+	enabled_caps.clear ();
+	bound_textures.clear ();
+	uniform_ints.clear ();
+}
+
+// true if the call needs to be issued, and counts it either way
+static bool changed (bool differs) {
+	if (differs) {
+		this_frame.issued++;
+	}
+	else {
+		this_frame.elided++;
+	}
+	return differs;
+}
+
+/*-----------------------------------WRAPPERS-----------------------------------------*/
+
+void gls_use_program (GLuint program) {
+	if (changed (!program_known || current_program != program)) {
+		glUseProgram (program);
+		current_program = program;
+		program_known = true;
+	}
+}
+
+void gls_active_texture (GLenum unit) {
+	if (changed (!active_unit_known || active_unit != unit)) {
+		glActiveTexture (unit);
+		active_unit = unit;
+		active_unit_known = true;
+	}
+}
+
+void gls_bind_texture (GLenum target, GLuint texture) {
+	// an unknown active unit means the binding slot is unknown too
+	if (!active_unit_known) {
+		changed (true);
+		glBindTexture (target, texture);
+		return;
+	}
+	unsigned int key = ((active_unit - GL_TEXTURE0) << 16) | (target & 0xFFFF);
+	std::map<unsigned int, GLuint>::iterator it = bound_textures.find (key);
+	if (changed (it == bound_textures.end () || it->second != texture)) {
+		glBindTexture (target, texture);
+		bound_textures[key] = texture;
+	}
+}
+
+void gls_bind_vertex_array (GLuint vao) {
+	if (changed (!vao_known || current_vao != vao)) {
+		glBindVertexArray (vao);
+		current_vao = vao;
+		vao_known = true;
+	}
+}
+
+void gls_enable (GLenum cap) {
+	std::map<GLenum, bool>::iterator it = enabled_caps.find (cap);
+	if (changed (it == enabled_caps.end () || !it->second)) {
+		glEnable (cap);
+		enabled_caps[cap] = true;
+	}
+}
+
+void gls_disable (GLenum cap) {
+	std::map<GLenum, bool>::iterator it = enabled_caps.find (cap);
+	if (changed (it == enabled_caps.end () || it->second)) {
+		glDisable (cap);
+		enabled_caps[cap] = false;
+	}
+}
+
+void gls_depth_func (GLenum func) {
+	if (changed (!depth_func_known || current_depth_func != func)) {
+		glDepthFunc (func);
+		current_depth_func = func;
+		depth_func_known = true;
+	}
+}
+
+void gls_depth_mask (GLboolean flag) {
+	if (changed (!depth_mask_known || current_depth_mask != flag)) {
+		glDepthMask (flag);
+		current_depth_mask = flag;
+		depth_mask_known = true;
+	}
+}
+
+void gls_color_mask (GLboolean flag) {
+	if (changed (!color_mask_known || current_color_mask != flag)) {
+		glColorMask (flag, flag, flag, flag);
+		current_color_mask = flag;
+		color_mask_known = true;
+	}
+}
+
+void gls_clear_color (GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
+	bool differs = !clear_color_known || current_clear_color[0] != r || current_clear_color[1] != g ||
+		current_clear_color[2] != b || current_clear_color[3] != a;
+	if (changed (differs)) {
+		glClearColor (r, g, b, a);
+		current_clear_color[0] = r;
+		current_clear_color[1] = g;
+		current_clear_color[2] = b;
+		current_clear_color[3] = a;
+		clear_color_known = true;
+	}
+}
+
+void gls_uniform1i (GLint location, GLint value) {
+	if (location < 0) {
+		return;  // not an active uniform in this program, GL ignores it anyway
+	}
+	if (!program_known) {
+		changed (true);
+		glUniform1i (location, value);
+		return;
+	}
+	unsigned long long key = ((unsigned long long)current_program << 32) | (unsigned int)location;
+	std::map<unsigned long long, GLint>::iterator it = uniform_ints.find (key);
+	if (changed (it == uniform_ints.end () || it->second != value)) {
+		glUniform1i (location, value);
+		uniform_ints[key] = value;
+	}
+}
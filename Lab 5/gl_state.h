@@ -0,0 +1,40 @@
+#ifndef _GL_STATE_H_
+#define _GL_STATE_H_
+
+#include <GL/glew.h>
+
+/*----------------------------------------------------------------------------
+                   GL STATE CACHE
+  ----------------------------------------------------------------------------*/
+// Thin layer that remembers the last value set for each piece of GL state and
+// drops calls that would not change anything. All per-frame binds, enables and
+// material uniforms should go through here. Anything that changes GL state
+// behind its back (e.g. init code) must call gls_invalidate afterwards.
+
+struct GLStateCounters {
+	int issued;  // calls passed on to the driver
+	int elided;  // calls dropped because the state already matched
+};
+
+// Start counting a new frame, the previous frame's counts move to gls_last_frame
+void gls_begin_frame ();
+GLStateCounters gls_last_frame ();
+GLStateCounters gls_this_frame ();
+// Forget all cached state so the next call of each kind is always issued
+void gls_invalidate ();
+
+void gls_use_program (GLuint program);
+void gls_active_texture (GLenum unit);
+void gls_bind_texture (GLenum target, GLuint texture);
+void gls_bind_vertex_array (GLuint vao);
+void gls_enable (GLenum cap);
+void gls_disable (GLenum cap);
+void gls_depth_func (GLenum func);
+void gls_depth_mask (GLboolean flag);
+// All four channels together
+void gls_color_mask (GLboolean flag);
+void gls_clear_color (GLfloat r, GLfloat g, GLfloat b, GLfloat a);
+// Cached per program and location, the program must be the one in use
+void gls_uniform1i (GLint location, GLint value);
+
+#endif
@@ -0,0 +1,214 @@
+#include "gpu_culling.h"
+#include "gl_state.h"
+#include <stddef.h>
+
+/*-----------------------------------SETUP--------------------------------------------*/
+
+void create_gpu_culler (GPUCuller& culler, GLuint cull_program, GLuint reduce_program, int window_width, int window_height) {
+	culler.cull_program = cull_program;
+	culler.reduce_program = reduce_program;
+	glGenBuffers (1, &culler.source_buffer);
+	glGenBuffers (1, &culler.cull_draw_buffer);
+	culler.use_hiz = false;
+	culler.hiz_valid = false;
+	culler.submitted = 0;
+	glGenBuffers (GPU_CULL_READBACKS, culler.readback_buffers);
+	for (int i = 0; i < GPU_CULL_READBACKS; i++) {
+		culler.readback_fences[i] = 0;
+		culler.readback_draws[i] = 0;
+		culler.readback_capacity[i] = 0;
+	}
+	culler.readback_slot = 0;
+	culler.visible = 0;
+
+	// depth copy at window size, pyramid from half size down to 1x1
+	culler.window_width = window_width;
+	culler.window_height = window_height;
+	culler.source_width = window_width;
+	culler.source_height = window_height;
+	glGenTextures (1, &culler.depth_texture);
+	glBindTexture (GL_TEXTURE_2D, culler.depth_texture);
+	glTexStorage2D (GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, window_width, window_height);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+
+	culler.hiz_width = (window_width + 1) / 2;
+	culler.hiz_height = (window_height + 1) / 2;
+	culler.hiz_levels = 1;
+	for (int size = culler.hiz_width > culler.hiz_height ? culler.hiz_width : culler.hiz_height; size > 1; size /= 2) {
+		culler.hiz_levels++;
+	}
+	glGenTextures (1, &culler.hiz_texture);
+	glBindTexture (GL_TEXTURE_2D, culler.hiz_texture);
+	glTexStorage2D (GL_TEXTURE_2D, culler.hiz_levels, GL_R32F, culler.hiz_width, culler.hiz_height);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture (GL_TEXTURE_2D, 0);
+	gls_invalidate ();
+}
+
+/*-----------------------------------CULL---------------------------------------------*/
+
+// Sums the counts in a readback once the GPU is past its fence, never waits for it
+static void collect_readback (GPUCuller& culler, int slot) {
+	GLsync fence = culler.readback_fences[slot];
+	if (!fence || glClientWaitSync (fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+		return;
+	}
+	glDeleteSync (fence);
+	culler.readback_fences[slot] = 0;
+	GLsizeiptr size = culler.readback_draws[slot] * sizeof (DrawElementsIndirectCommand);
+	glBindBuffer (GL_COPY_READ_BUFFER, culler.readback_buffers[slot]);
+	const DrawElementsIndirectCommand* commands = (const DrawElementsIndirectCommand*)glMapBufferRange (GL_COPY_READ_BUFFER, 0, size, GL_MAP_READ_BIT);
+	if (commands) {
+		int visible = 0;
+		for (int i = 0; i < culler.readback_draws[slot]; i++) {
+			visible += commands[i].instance_count;
+		}
+		culler.visible = visible;
+		glUnmapBuffer (GL_COPY_READ_BUFFER);
+	}
+	glBindBuffer (GL_COPY_READ_BUFFER, 0);
+}
+
+// Copies the counts the cull just wrote into the next slot of the ring. A
+// slot the GPU hasn't got to yet is left alone and this frame goes uncounted.
+static void queue_readback (GPUCuller& culler, const IndirectFrame& frame) {
+	int slot = culler.readback_slot;
+	culler.readback_slot = (slot + 1) % GPU_CULL_READBACKS;
+	collect_readback (culler, slot);
+	if (culler.readback_fences[slot]) {
+		return;
+	}
+	int draws = (int)frame.commands.size ();
+	GLsizeiptr size = draws * sizeof (DrawElementsIndirectCommand);
+	glBindBuffer (GL_COPY_WRITE_BUFFER, culler.readback_buffers[slot]);
+	if (draws > culler.readback_capacity[slot]) {
+		glBufferData (GL_COPY_WRITE_BUFFER, size, NULL, GL_STREAM_READ);
+		culler.readback_capacity[slot] = draws;
+	}
+	glBindBuffer (GL_COPY_READ_BUFFER, frame.command_buffer);
+	glCopyBufferSubData (GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+	glBindBuffer (GL_COPY_READ_BUFFER, 0);
+	glBindBuffer (GL_COPY_WRITE_BUFFER, 0);
+	culler.readback_draws[slot] = draws;
+	culler.readback_fences[slot] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void cull_indirect_frame (GPUCuller& culler, IndirectFrame& frame, const mat4& view_proj, const Frustum& frustum, float near_plane) {
+	culler.submitted = (int)frame.instances.size ();
+	if (frame.commands.empty ()) {
+		culler.visible = 0;
+		return;
+	}
+
+	// same records as upload_indirect_frame, but every count starts at zero for the shader to fill
+	size_t draw_count = frame.commands.size ();
+	culler.zeroed_commands = frame.commands;
+	culler.cull_draws.resize (draw_count);
+	int max_instances = 0;
+	for (size_t i = 0; i < draw_count; i++) {
+		GPUCullDraw& d = culler.cull_draws[i];
+		const BoundingSphere& b = frame.draw_bounds[i];
+		d.sphere[0] = b.center.v[0];
+		d.sphere[1] = b.center.v[1];
+		d.sphere[2] = b.center.v[2];
+		d.sphere[3] = b.radius;
+		d.first_instance = frame.draw_data[i].first_instance;
+		d.instance_count = frame.commands[i].instance_count;
+		d.pad[0] = d.pad[1] = 0;
+		if ((int)d.instance_count > max_instances) {
+			max_instances = (int)d.instance_count;
+		}
+		culler.zeroed_commands[i].instance_count = 0;
+	}
+
+	glBindBuffer (GL_SHADER_STORAGE_BUFFER, frame.command_buffer);
+	glBufferData (GL_SHADER_STORAGE_BUFFER, draw_count * sizeof (DrawElementsIndirectCommand), &culler.zeroed_commands[0], GL_STREAM_DRAW);
+	glBindBuffer (GL_SHADER_STORAGE_BUFFER, frame.draw_data_buffer);
+	glBufferData (GL_SHADER_STORAGE_BUFFER, draw_count * sizeof (IndirectDrawData), &frame.draw_data[0], GL_STREAM_DRAW);
+	glBindBuffer (GL_SHADER_STORAGE_BUFFER, culler.cull_draw_buffer);
+	glBufferData (GL_SHADER_STORAGE_BUFFER, draw_count * sizeof (GPUCullDraw), &culler.cull_draws[0], GL_STREAM_DRAW);
+	glBindBuffer (GL_SHADER_STORAGE_BUFFER, culler.source_buffer);
+	glBufferData (GL_SHADER_STORAGE_BUFFER, frame.instances.size () * sizeof (InstanceData), &frame.instances[0], GL_STREAM_DRAW);
+	// the compacted output is what the vertex shader reads, same size as the input
+	glBindBuffer (GL_SHADER_STORAGE_BUFFER, frame.instance_buffer);
+	glBufferData (GL_SHADER_STORAGE_BUFFER, frame.instances.size () * sizeof (InstanceData), NULL, GL_STREAM_DRAW);
+	glBindBuffer (GL_SHADER_STORAGE_BUFFER, 0);
+
+	glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 1, frame.instance_buffer);
+	glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 2, culler.source_buffer);
+	glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 3, culler.cull_draw_buffer);
+	glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 4, frame.command_buffer);
+
+	GLuint program = culler.cull_program;
+	gls_use_program (program);
+	glUniform4fv (glGetUniformLocation (program, "frustum_planes"), 6, &frustum.planes[0][0]);
+	glUniformMatrix4fv (glGetUniformLocation (program, "view_proj"), 1, GL_FALSE, view_proj.m);
+	glUniform1f (glGetUniformLocation (program, "near_plane"), near_plane);
+	bool hiz = culler.use_hiz && culler.hiz_valid;
+	gls_uniform1i (glGetUniformLocation (program, "use_hiz"), hiz ? 1 : 0);
+	if (hiz) {
+		gls_active_texture (GL_TEXTURE0 + HIZ_TEXTURE_UNIT);
+		gls_bind_texture (GL_TEXTURE_2D, culler.hiz_texture);
+		gls_active_texture (GL_TEXTURE0);
+		gls_uniform1i (glGetUniformLocation (program, "hiz"), HIZ_TEXTURE_UNIT);
+		gls_uniform1i (glGetUniformLocation (program, "hiz_levels"), culler.hiz_levels);
+		glUniform2f (glGetUniformLocation (program, "window_size"), (float)culler.source_width, (float)culler.source_height);
+	}
+	// x runs over a command's instances, y over the commands
+	GLuint groups_x = (max_instances + GPU_CULL_GROUP_SIZE - 1) / GPU_CULL_GROUP_SIZE;
+	glDispatchCompute (groups_x, (GLuint)draw_count, 1);
+	// the counts are read as draw parameters and copied for the stats, the instances through the vertex shader's SSBO
+	glMemoryBarrier (GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+	queue_readback (culler, frame);
+}
+
+/*-----------------------------------HI-Z PYRAMID-------------------------------------*/
+
+void build_hiz (GPUCuller& culler, int width, int height) {
+	if (!culler.use_hiz) {
+		culler.hiz_valid = false;
+		return;
+	}
+	width = width < culler.window_width ? width : culler.window_width;
+	height = height < culler.window_height ? height : culler.window_height;
+	// Texels past the drawn corner are far, so the coarse levels straddling its edge never occlude
+	if (width < culler.window_width || height < culler.window_height) {
+		float far_depth = 1.0f;
+		glClearTexImage (culler.depth_texture, 0, GL_DEPTH_COMPONENT, GL_FLOAT, &far_depth);
+	}
+	culler.source_width = width;
+	culler.source_height = height;
+
+	// depth of the frame just drawn, from the read framebuffer
+	gls_active_texture (GL_TEXTURE0);
+	gls_bind_texture (GL_TEXTURE_2D, culler.depth_texture);
+	glCopyTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+
+	GLuint program = culler.reduce_program;
+	gls_use_program (program);
+	gls_uniform1i (glGetUniformLocation (program, "source"), 0);
+	GLint source_level = glGetUniformLocation (program, "source_level");
+	int w = culler.hiz_width, h = culler.hiz_height;
+	for (int level = 0; level < culler.hiz_levels; level++) {
+		// level 0 reduces the depth copy, every other level the one above it
+		if (level == 0) {
+			gls_bind_texture (GL_TEXTURE_2D, culler.depth_texture);
+			glUniform1i (source_level, 0);
+		}
+		else {
+			gls_bind_texture (GL_TEXTURE_2D, culler.hiz_texture);
+			glUniform1i (source_level, level - 1);
+		}
+		glBindImageTexture (0, culler.hiz_texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glDispatchCompute ((w + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, (h + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+		glMemoryBarrier (GL_TEXTURE_FETCH_BARRIER_BIT);
+		// GL rounds mip sizes down, the shader folds the odd texel into the last column/row
+		w = w > 1 ? w / 2 : 1;
+		h = h > 1 ? h / 2 : 1;
+	}
+	gls_bind_texture (GL_TEXTURE_2D, 0);
+	culler.hiz_valid = true;
+}
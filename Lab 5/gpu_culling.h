@@ -0,0 +1,76 @@
+#ifndef _GPU_CULLING_H_
+#define _GPU_CULLING_H_
+
+#include <GL/glew.h>
+#include "frustum_culling.h"
+#include "maths_funcs.h"
+#include "multi_draw.h"
+
+/*----------------------------------------------------------------------------
+                   GPU CULLING
+  ----------------------------------------------------------------------------*/
+// Compute shader version of the frustum (and optionally occlusion) culling
+// for the multi-draw indirect path. The CPU uploads every instance
+// uncompacted, with each command's instance_count set to 0. One invocation
+// per instance (CullComputeShader.txt) tests the instance's bounding sphere.
+// Survivors are appended to their command's range of the instance buffer
+// with atomicAdd on instance_count, and the CPU then issues the
+// glMultiDrawElementsIndirect without knowing how many instances survived.
+//
+// The occlusion test uses a Hi-Z pyramid: the max depth of the previous
+// frame's opaque pass, halved per mip (HiZReduceComputeShader.txt). It lags
+// one frame behind the camera, so it is off by default.
+//
+// How many instances survived is only for the stats. The command buffer is
+// copied into a small ring of readback buffers behind a fence and summed
+// once the fence has passed, a few frames later, so the CPU never waits on
+// the cull.
+
+#define GPU_CULL_GROUP_SIZE 64  // local_size_x in CullComputeShader.txt
+#define HIZ_GROUP_SIZE 8  // local_size_x and _y in HiZReduceComputeShader.txt
+#define HIZ_TEXTURE_UNIT 5  // after the light clusters and the texture array
+#define GPU_CULL_READBACKS 3  // frames the visible count can be behind
+
+// Mirrors CullDraw in CullComputeShader.txt (std430)
+struct GPUCullDraw {
+	float sphere[4];  // local centre and radius of the command's mesh
+	GLuint first_instance;
+	GLuint instance_count;
+	GLuint pad[2];
+};
+
+struct GPUCuller {
+	GLuint cull_program, reduce_program;
+	GLuint source_buffer;  // every instance, as submitted
+	GLuint cull_draw_buffer;
+	std::vector<GPUCullDraw> cull_draws;
+	std::vector<DrawElementsIndirectCommand> zeroed_commands;
+
+	// Hi-Z pyramid, level 0 is half the window size
+	bool use_hiz;
+	bool hiz_valid;  // false until a frame's depth has been captured
+	int window_width, window_height;
+	int source_width, source_height;  // corner of the depth copy that was drawn, smaller with dynamic resolution
+	int hiz_width, hiz_height, hiz_levels;
+	GLuint depth_texture, hiz_texture;
+
+	int submitted;  // instances sent to the cull shader last frame
+
+	// the surviving counts on their way back
+	GLuint readback_buffers[GPU_CULL_READBACKS];
+	GLsync readback_fences[GPU_CULL_READBACKS];  // 0 when the slot is free
+	int readback_draws[GPU_CULL_READBACKS];  // commands copied into each
+	int readback_capacity[GPU_CULL_READBACKS];  // commands each has room for
+	int readback_slot;
+	int visible;  // instances the cull kept, from the newest readback to come back
+};
+
+// Programs come from CompileComputeShader in main.cpp
+void create_gpu_culler (GPUCuller& culler, GLuint cull_program, GLuint reduce_program, int window_width, int window_height);
+// Upload the frame and cull it on the GPU, then draw it with issue_indirect_frame
+void cull_indirect_frame (GPUCuller& culler, IndirectFrame& frame, const mat4& view_proj, const Frustum& frustum, float near_plane);
+// Copy the bottom left width x height of the depth buffer just drawn and reduce it
+// into the Hi-Z pyramid. The rest of the copy is cleared to the far plane.
+void build_hiz (GPUCuller& culler, int width, int height);
+
+#endif
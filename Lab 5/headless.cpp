@@ -0,0 +1,181 @@
+#include "headless.h"
+#include "image_write.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#ifdef HEADLESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+/*-----------------------------------CONTEXT------------------------------------------*/
+
+#ifdef HEADLESS_EGL
+
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static EGLContext egl_context = EGL_NO_CONTEXT;
+static EGLSurface egl_surface = EGL_NO_SURFACE;
+
+static bool has_extension (const char* extensions, const char* name) {
+	if (!extensions) {
+		return false;
+	}
+	size_t length = strlen (name);
+	for (const char* p = strstr (extensions, name); p; p = strstr (p + length, name)) {
+		if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Surfaceless display when the platform exists, the default display otherwise
+static EGLDisplay open_display (bool& surfaceless) {
+	surfaceless = false;
+	const char* client_extensions = eglQueryString (EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (has_extension (client_extensions, "EGL_MESA_platform_surfaceless")) {
+		PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+			(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress ("eglGetPlatformDisplayEXT");
+		if (get_platform_display) {
+			EGLDisplay display = get_platform_display (EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			if (display != EGL_NO_DISPLAY && eglInitialize (display, NULL, NULL)) {
+				surfaceless = true;
+				return display;
+			}
+		}
+	}
+	EGLDisplay display = eglGetDisplay (EGL_DEFAULT_DISPLAY);
+	if (display != EGL_NO_DISPLAY && eglInitialize (display, NULL, NULL)) {
+		return display;
+	}
+	return EGL_NO_DISPLAY;
+}
+
+bool create_headless_context () {
+	bool surfaceless;
+	egl_display = open_display (surfaceless);
+	if (egl_display == EGL_NO_DISPLAY) {
+		fprintf (stderr, "Headless: no EGL display\n");
+		return false;
+	}
+	if (surfaceless && !has_extension (eglQueryString (egl_display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context")) {
+		surfaceless = false;
+	}
+
+	const EGLint config_attributes[] = {
+		EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint config_count = 0;
+	if (!eglChooseConfig (egl_display, config_attributes, &config, 1, &config_count) || config_count == 0) {
+		fprintf (stderr, "Headless: no EGL config with desktop OpenGL\n");
+		return false;
+	}
+	eglBindAPI (EGL_OPENGL_API);
+
+	// The renderer uses up to 4.5 and the compatibility profile (GLSL 330 with
+	// no core-only restrictions), older drivers get whatever they default to
+	const EGLint context_attributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+	egl_context = eglCreateContext (egl_display, config, EGL_NO_CONTEXT, context_attributes);
+	if (egl_context == EGL_NO_CONTEXT) {
+		egl_context = eglCreateContext (egl_display, config, EGL_NO_CONTEXT, NULL);
+	}
+	if (egl_context == EGL_NO_CONTEXT) {
+		fprintf (stderr, "Headless: could not create an OpenGL context (0x%x)\n", eglGetError ());
+		return false;
+	}
+
+	if (!surfaceless) {
+		const EGLint pbuffer_attributes[] = { EGL_WIDTH, 16, EGL_HEIGHT, 16, EGL_NONE };
+		egl_surface = eglCreatePbufferSurface (egl_display, config, pbuffer_attributes);
+		if (egl_surface == EGL_NO_SURFACE) {
+			fprintf (stderr, "Headless: could not create a pbuffer (0x%x)\n", eglGetError ());
+			return false;
+		}
+	}
+	if (!eglMakeCurrent (egl_display, egl_surface, egl_surface, egl_context)) {
+		fprintf (stderr, "Headless: could not make the context current (0x%x)\n", eglGetError ());
+		return false;
+	}
+	printf ("Headless: %s context on %s\n", surfaceless ? "surfaceless" : "pbuffer", eglQueryString (egl_display, EGL_VENDOR));
+	return true;
+}
+
+void destroy_headless_context () {
+	if (egl_display == EGL_NO_DISPLAY) {
+		return;
+	}
+	eglMakeCurrent (egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (egl_surface != EGL_NO_SURFACE) {
+		eglDestroySurface (egl_display, egl_surface);
+	}
+	if (egl_context != EGL_NO_CONTEXT) {
+		eglDestroyContext (egl_display, egl_context);
+	}
+	eglTerminate (egl_display);
+	egl_display = EGL_NO_DISPLAY;
+	egl_context = EGL_NO_CONTEXT;
+	egl_surface = EGL_NO_SURFACE;
+}
+
+#else
+
+bool create_headless_context () {
+	fprintf (stderr, "Headless mode needs a build with HEADLESS_EGL defined\n");
+	return false;
+}
+
+void destroy_headless_context () {
+}
+
+#endif
+
+/*-----------------------------------TARGET-------------------------------------------*/
+
+void create_headless_target (HeadlessTarget& target, int width, int height) {
+	target.width = width;
+	target.height = height;
+	glGenRenderbuffers (1, &target.colour);
+	glBindRenderbuffer (GL_RENDERBUFFER, target.colour);
+	glRenderbufferStorage (GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glGenRenderbuffers (1, &target.depth);
+	glBindRenderbuffer (GL_RENDERBUFFER, target.depth);
+	glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+	glBindRenderbuffer (GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers (1, &target.fbo);
+	glBindFramebuffer (GL_FRAMEBUFFER, target.fbo);
+	glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.colour);
+	glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, target.depth);
+	if (glCheckFramebufferStatus (GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf (stderr, "Headless framebuffer incomplete\n");
+	}
+	glViewport (0, 0, width, height);
+}
+
+bool save_headless_frame (const HeadlessTarget& target, const char* file_name, bool png) {
+	int w = target.width, h = target.height;
+	size_t row_bytes = (size_t)w * 3;
+	std::vector<unsigned char> pixels (row_bytes * h);
+	GLint previous_fbo;
+	glGetIntegerv (GL_READ_FRAMEBUFFER_BINDING, &previous_fbo);
+	glBindFramebuffer (GL_READ_FRAMEBUFFER, target.fbo);
+	glPixelStorei (GL_PACK_ALIGNMENT, 1);
+	glReadPixels (0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+	glBindFramebuffer (GL_READ_FRAMEBUFFER, previous_fbo);
+
+	// GL rows start at the bottom, the files start at the top
+	std::vector<unsigned char> flipped (pixels.size ());
+	for (int y = 0; y < h; y++) {
+		memcpy (&flipped[y * row_bytes], &pixels[(h - 1 - y) * row_bytes], row_bytes);
+	}
+	return png ? write_png (file_name, &flipped[0], w, h, 3) : write_ppm (file_name, &flipped[0], w, h);
+}
@@ -0,0 +1,33 @@
+#ifndef _HEADLESS_H_
+#define _HEADLESS_H_
+
+#include <GL/glew.h>
+
+/*----------------------------------------------------------------------------
+                   HEADLESS RENDERING
+  ----------------------------------------------------------------------------*/
+// A GL context with no window, for render farm and CI machines without a
+// display. The context comes from EGL, surfaceless when Mesa offers it
+// (llvmpipe does) and on a small pbuffer otherwise, so no X server is
+// needed. Frames are drawn into a HeadlessTarget framebuffer in place of the
+// window's back buffer.
+//
+// EGL is only compiled in when HEADLESS_EGL is defined, which the Linux
+// build (CMakeLists.txt at the top of the repository) does. Without it
+// create_headless_context reports that headless mode is not available.
+
+struct HeadlessTarget {
+	int width, height;
+	GLuint fbo;
+	GLuint colour, depth;  // renderbuffers
+};
+
+// Make a context current on this thread, call glewInit after it
+bool create_headless_context ();
+void destroy_headless_context ();
+// RGBA8 and depth 24 / stencil 8, left bound with the viewport covering it
+void create_headless_target (HeadlessTarget& target, int width, int height);
+// Read the target back and write it as PNG, or binary PPM when png is false
+bool save_headless_frame (const HeadlessTarget& target, const char* file_name, bool png);
+
+#endif
@@ -0,0 +1,107 @@
+#include "image_write.h"
+#include <stdio.h>
+#include <vector>
+
+/*-----------------------------------PNG----------------------------------------------*/
+
+static unsigned int crc32_update (unsigned int crc, const unsigned char* data, size_t length) {
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (int k = 0; k < 8; k++) {
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+		}
+	}
+	return ~crc;
+}
+
+static void put_u32_be (std::vector<unsigned char>& out, unsigned int v) {
+	out.push_back ((v >> 24) & 0xFF);
+	out.push_back ((v >> 16) & 0xFF);
+	out.push_back ((v >> 8) & 0xFF);
+	out.push_back (v & 0xFF);
+}
+
+static void write_chunk (FILE* f, const char* type, const std::vector<unsigned char>& data) {
+	std::vector<unsigned char> chunk (type, type + 4);
+	chunk.insert (chunk.end (), data.begin (), data.end ());
+	std::vector<unsigned char> header;
+	put_u32_be (header, (unsigned int)data.size ());
+	std::vector<unsigned char> footer;
+	put_u32_be (footer, crc32_update (0, &chunk[0], chunk.size ()));
+	fwrite (&header[0], 1, header.size (), f);
+	fwrite (&chunk[0], 1, chunk.size (), f);
+	fwrite (&footer[0], 1, footer.size (), f);
+}
+
+bool write_png (const char* file_name, const unsigned char* pixels, int width, int height, int channels) {
+	FILE* f = fopen (file_name, "wb");
+	if (!f) {
+		fprintf (stderr, "Could not write %s\n", file_name);
+		return false;
+	}
+	int w = width, h = height;
+	size_t row_bytes = (size_t)w * channels;
+	std::vector<unsigned char> raw;
+	raw.reserve ((row_bytes + 1) * h);
+	for (int y = 0; y < h; y++) {
+		raw.push_back (0);  // no filter
+		raw.insert (raw.end (), pixels + y * row_bytes, pixels + (y + 1) * row_bytes);
+	}
+
+	std::vector<unsigned char> ihdr;
+	put_u32_be (ihdr, w);
+	put_u32_be (ihdr, h);
+	ihdr.push_back (8);  // bit depth
+	ihdr.push_back (channels == 3 ? 2 : 0);  // truecolour or greyscale
+	ihdr.push_back (0);
+	ihdr.push_back (0);
+	ihdr.push_back (0);
+
+	// zlib stream made of stored deflate blocks
+	std::vector<unsigned char> idat;
+	idat.push_back (0x78);
+	idat.push_back (0x01);
+	size_t pos = 0;
+	do {
+		size_t len = raw.size () - pos;
+		if (len > 65535) {
+			len = 65535;
+		}
+		idat.push_back (pos + len == raw.size () ? 1 : 0);
+		idat.push_back (len & 0xFF);
+		idat.push_back ((len >> 8) & 0xFF);
+		idat.push_back (~len & 0xFF);
+		idat.push_back ((~len >> 8) & 0xFF);
+		idat.insert (idat.end (), raw.begin () + pos, raw.begin () + pos + len);
+		pos += len;
+	} while (pos < raw.size ());
+	unsigned int s1 = 1, s2 = 0;
+	for (size_t i = 0; i < raw.size (); i++) {
+		s1 = (s1 + raw[i]) % 65521;
+		s2 = (s2 + s1) % 65521;
+	}
+	put_u32_be (idat, (s2 << 16) | s1);
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	fwrite (signature, 1, 8, f);
+	write_chunk (f, "IHDR", ihdr);
+	write_chunk (f, "IDAT", idat);
+	write_chunk (f, "IEND", std::vector<unsigned char> ());
+	fclose (f);
+	return true;
+}
+
+/*-----------------------------------PPM----------------------------------------------*/
+
+bool write_ppm (const char* file_name, const unsigned char* pixels, int width, int height) {
+	FILE* f = fopen (file_name, "wb");
+	if (!f) {
+		fprintf (stderr, "Could not write %s\n", file_name);
+		return false;
+	}
+	fprintf (f, "P6\n%d %d\n255\n", width, height);
+	fwrite (pixels, 1, (size_t)width * height * 3, f);
+	fclose (f);
+	return true;
+}
@@ -0,0 +1,16 @@
+#ifndef _IMAGE_WRITE_H_
+#define _IMAGE_WRITE_H_
+
+/*----------------------------------------------------------------------------
+                   IMAGE WRITING
+  ----------------------------------------------------------------------------*/
+// There is no image writer in the project (stb_image only reads), so these
+// write the simplest valid files: PNG with stored (uncompressed) deflate
+// blocks, and binary PPM. Pixels are 8 bit, rows top to bottom.
+
+// channels: 1 for greyscale, 3 for RGB
+bool write_png (const char* file_name, const unsigned char* pixels, int width, int height, int channels);
+// RGB only
+bool write_ppm (const char* file_name, const unsigned char* pixels, int width, int height);
+
+#endif
@@ -0,0 +1,190 @@
+#include "impostors.h"
+#include "gl_state.h"
+#include <math.h>
+#include <stdio.h>
+
+// Macro for indexing vertex buffer
+#define BUFFER_OFFSET(i) ((char *)NULL + (i))
+
+/*-----------------------------------FRAME DIRECTIONS---------------------------------*/
+
+// Inverse of hemi_oct_encode in ImpostorVertexShader.txt: the unit square onto
+// the upper hemisphere, with the square's centre straight up
+static vec3 hemi_oct_decode (float u, float v) {
+	float px = u * 2.0f - 1.0f, py = v * 2.0f - 1.0f;
+	float x = (px + py) * 0.5f, z = (px - py) * 0.5f;
+	return normalise (vec3 (x, 1.0f - fabs (x) - fabs (z), z));
+}
+
+// Screen axes of a view looking back along d, same as frame_basis in the shader
+static void impostor_frame_basis (const vec3& d, vec3& right, vec3& up) {
+	vec3 reference = fabs (d.v[1]) > 0.999f ? vec3 (0.0f, 0.0f, -1.0f) : vec3 (0.0f, 1.0f, 0.0f);
+	right = normalise (cross (reference, d));
+	up = cross (d, right);
+}
+
+/*-----------------------------------BAKE---------------------------------------------*/
+
+static GLuint create_atlas_texture (int size) {
+	GLuint texture;
+	glGenTextures (1, &texture);
+	glBindTexture (GL_TEXTURE_2D, texture);
+	glTexStorage2D (GL_TEXTURE_2D, IMPOSTOR_MIP_LEVELS, GL_RGBA8, size, size);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	return texture;
+}
+
+bool create_impostor_atlas (ImpostorAtlas& atlas, GLuint bake_program, GLuint impostor_program,
+	const MeshPool& pool, int mesh, GLuint texture, const mat4& mesh_to_atlas) {
+	const PoolMesh& m = pool.meshes[mesh];
+	atlas.mesh_to_atlas = mesh_to_atlas;
+	vec4 center = atlas.mesh_to_atlas * vec4 (m.bounds.center, 1.0f);
+	atlas.center = vec3 (center.v[0], center.v[1], center.v[2]);
+	atlas.radius = m.bounds.radius;
+
+	int size = IMPOSTOR_GRID * IMPOSTOR_FRAME_SIZE;
+	atlas.color_texture = create_atlas_texture (size);
+	atlas.normal_depth_texture = create_atlas_texture (size);
+	GLint previous_fbo;
+	glGetIntegerv (GL_FRAMEBUFFER_BINDING, &previous_fbo);
+	GLuint depth_buffer, fbo;
+	glGenRenderbuffers (1, &depth_buffer);
+	glBindRenderbuffer (GL_RENDERBUFFER, depth_buffer);
+	glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+	glGenFramebuffers (1, &fbo);
+	glBindFramebuffer (GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, atlas.color_texture, 0);
+	glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, atlas.normal_depth_texture, 0);
+	glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth_buffer);
+	GLenum draw_buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers (2, draw_buffers);
+	bool complete = glCheckFramebufferStatus (GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+	if (complete) {
+		// the pool buffers with the bake shader's fixed attribute locations
+		GLuint vao;
+		glGenVertexArrays (1, &vao);
+		glBindVertexArray (vao);
+		glBindBuffer (GL_ARRAY_BUFFER, pool.vertex_buffer);
+		glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, pool.index_buffer);
+		GLsizei stride = 8 * sizeof (float);
+		for (int a = 0; a < 3; a++) {
+			glEnableVertexAttribArray (a);
+		}
+		glVertexAttribPointer (0, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (0));
+		glVertexAttribPointer (1, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (3 * sizeof (float)));
+		glVertexAttribPointer (2, 2, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (6 * sizeof (float)));
+
+		GLint viewport[4];
+		glGetIntegerv (GL_VIEWPORT, viewport);
+		glViewport (0, 0, size, size);
+		glClearColor (0.0f, 0.0f, 0.0f, 0.0f);
+		glEnable (GL_DEPTH_TEST);
+		glDepthFunc (GL_LESS);
+		glDepthMask (GL_TRUE);
+		glColorMask (GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		glUseProgram (bake_program);
+		glUniformMatrix4fv (glGetUniformLocation (bake_program, "mesh_to_atlas"), 1, GL_FALSE, mesh_to_atlas.m);
+		glUniform3fv (glGetUniformLocation (bake_program, "atlas_center"), 1, atlas.center.v);
+		glUniform1f (glGetUniformLocation (bake_program, "atlas_radius"), atlas.radius);
+		glUniform1i (glGetUniformLocation (bake_program, "texture_for_shader"), 0);
+		glActiveTexture (GL_TEXTURE0);
+		glBindTexture (GL_TEXTURE_2D, texture);
+		GLint dir_loc = glGetUniformLocation (bake_program, "frame_dir");
+		GLint right_loc = glGetUniformLocation (bake_program, "frame_right");
+		GLint up_loc = glGetUniformLocation (bake_program, "frame_up");
+		// frame (x, y) is the view from hemi_oct_decode (x, y) / (grid - 1), so the grid's edges are the horizon
+		for (int y = 0; y < IMPOSTOR_GRID; y++) {
+			for (int x = 0; x < IMPOSTOR_GRID; x++) {
+				vec3 d = hemi_oct_decode (x / (float)(IMPOSTOR_GRID - 1), y / (float)(IMPOSTOR_GRID - 1));
+				vec3 right, up;
+				impostor_frame_basis (d, right, up);
+				glUniform3fv (dir_loc, 1, d.v);
+				glUniform3fv (right_loc, 1, right.v);
+				glUniform3fv (up_loc, 1, up.v);
+				glViewport (x * IMPOSTOR_FRAME_SIZE, y * IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE, IMPOSTOR_FRAME_SIZE);
+				glDrawElementsBaseVertex (GL_TRIANGLES, m.index_count, GL_UNSIGNED_INT, BUFFER_OFFSET (m.first_index * sizeof (GLuint)), m.base_vertex);
+			}
+		}
+		glViewport (viewport[0], viewport[1], viewport[2], viewport[3]);
+		glBindVertexArray (0);
+		glDeleteVertexArrays (1, &vao);
+
+		glBindTexture (GL_TEXTURE_2D, atlas.color_texture);
+		glGenerateMipmap (GL_TEXTURE_2D);
+		glBindTexture (GL_TEXTURE_2D, atlas.normal_depth_texture);
+		glGenerateMipmap (GL_TEXTURE_2D);
+		glBindTexture (GL_TEXTURE_2D, 0);
+	}
+	else {
+		fprintf (stderr, "Impostor atlas framebuffer incomplete\n");
+	}
+	glBindFramebuffer (GL_FRAMEBUFFER, previous_fbo);
+	glDeleteFramebuffers (1, &fbo);
+	glDeleteRenderbuffers (1, &depth_buffer);
+
+	// two triangles, corners in -1..1
+	static const float corners[12] = { -1.0f, -1.0f, 1.0f, -1.0f, 1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, -1.0f, 1.0f };
+	GLuint quad_buffer;
+	glGenBuffers (1, &quad_buffer);
+	glBindBuffer (GL_ARRAY_BUFFER, quad_buffer);
+	glBufferData (GL_ARRAY_BUFFER, sizeof (corners), corners, GL_STATIC_DRAW);
+	glGenVertexArrays (1, &atlas.quad_vao);
+	glBindVertexArray (atlas.quad_vao);
+	GLint corner_loc = glGetAttribLocation (impostor_program, "corner");
+	glEnableVertexAttribArray (corner_loc);
+	glVertexAttribPointer (corner_loc, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	glBindVertexArray (0);
+
+	// everything above went around the state cache
+	gls_invalidate ();
+	return complete;
+}
+
+void set_impostor_uniforms (const ImpostorAtlas& atlas, GLuint program) {
+	mat4 atlas_to_mesh = inverse (atlas.mesh_to_atlas);
+	glUniformMatrix4fv (glGetUniformLocation (program, "atlas_to_mesh"), 1, GL_FALSE, atlas_to_mesh.m);
+	glUniform3fv (glGetUniformLocation (program, "atlas_center"), 1, atlas.center.v);
+	glUniform1f (glGetUniformLocation (program, "atlas_radius"), atlas.radius);
+	glUniform1i (glGetUniformLocation (program, "atlas_grid"), IMPOSTOR_GRID);
+	glUniform1i (glGetUniformLocation (program, "impostor_normal_depth"), IMPOSTOR_NORMAL_TEXTURE_UNIT);
+}
+
+void bind_impostor_atlas (const ImpostorAtlas& atlas) {
+	gls_active_texture (GL_TEXTURE0 + IMPOSTOR_NORMAL_TEXTURE_UNIT);
+	gls_bind_texture (GL_TEXTURE_2D, atlas.normal_depth_texture);
+	gls_active_texture (GL_TEXTURE0);
+}
+
+/*-----------------------------------DISTANCE SPLIT-----------------------------------*/
+
+void split_impostor_instances (ImpostorSplit& split, const InstanceData* instances, int count,
+	const vec3& camera, float start, float band) {
+	split.meshes.clear ();
+	split.impostors.clear ();
+	split.fading.clear ();
+	float start2 = start * start;
+	for (int i = 0; i < count; i++) {
+		const float* m = instances[i].model;
+		float dx = m[12] - camera.v[0], dy = m[13] - camera.v[1], dz = m[14] - camera.v[2];
+		float dist2 = dx * dx + dy * dy + dz * dz;
+		if (dist2 <= start2) {
+			split.meshes.push_back (instances[i]);
+			continue;
+		}
+		InstanceData d = instances[i];
+		float fade = (sqrt (dist2) - start) / band;
+		d.params[1] = fade < 1.0f ? fade : 1.0f;
+		if (fade < 1.0f) {
+			split.fading.push_back (d);
+		}
+		split.impostors.push_back (d);
+	}
+	split.near_count = (int)split.meshes.size ();
+	split.meshes.insert (split.meshes.end (), split.fading.begin (), split.fading.end ());
+}
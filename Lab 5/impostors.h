@@ -0,0 +1,64 @@
+#ifndef _IMPOSTORS_H_
+#define _IMPOSTORS_H_
+
+#include <GL/glew.h>
+#include <vector>
+#include "instancing.h"
+#include "maths_funcs.h"
+#include "multi_draw.h"
+
+/*----------------------------------------------------------------------------
+                   OCTAHEDRAL IMPOSTORS
+  ----------------------------------------------------------------------------*/
+// A distant tree is drawn as one camera-facing quad instead of its mesh. At
+// startup the mesh is rendered orthographically from IMPOSTOR_GRID squared
+// directions over the upper hemisphere into an atlas. The directions lie on
+// a hemi-octahedral grid, so neighbouring frames are neighbouring views. Each
+// frame stores the albedo and coverage in one texture, and the normal and
+// depth in another. The quad blends the four frames nearest to the current
+// view direction (ImpostorVertexShader.txt) and lights the result like the
+// mesh (ImpostorFragmentShader.txt).
+//
+// Instances between the start distance and the end of the fade band are
+// drawn both ways. The mesh drops a growing share of its pixels in an
+// ordered dither (ToonDitherFragmentShader.txt), and the impostor draws
+// exactly the pixels the mesh dropped. Both use the instance's params.y as
+// the fade.
+
+#define IMPOSTOR_GRID 8  // frames along each side of the atlas
+#define IMPOSTOR_FRAME_SIZE 128  // pixels along each side of a frame
+#define IMPOSTOR_MIP_LEVELS 5  // stops at 8 pixels a frame, before the frames bleed into each other
+#define IMPOSTOR_NORMAL_TEXTURE_UNIT 6  // after the Hi-Z pyramid
+
+struct ImpostorAtlas {
+	GLuint color_texture;  // rgb albedo, a coverage
+	GLuint normal_depth_texture;  // rgb atlas space normal, a depth towards the viewer
+	GLuint quad_vao;  // instance attributes are added by create_instance_batch
+	mat4 mesh_to_atlas;  // stands the mesh up with y as its vertical axis
+	vec3 center;  // bounding sphere in atlas space
+	float radius;
+};
+
+// This frame's instances, sorted by distance from the camera
+struct ImpostorSplit {
+	std::vector<InstanceData> meshes;  // near instances first, then the fading ones
+	int near_count;
+	std::vector<InstanceData> impostors;  // fading and far instances
+	std::vector<InstanceData> fading;  // scratch
+};
+
+// Bake one pool mesh and its texture into the atlas and make the quad VAO for
+// the impostor program. Returns false if the framebuffer can't be made.
+bool create_impostor_atlas (ImpostorAtlas& atlas, GLuint bake_program, GLuint impostor_program,
+	const MeshPool& pool, int mesh, GLuint texture, const mat4& mesh_to_atlas);
+// Uniforms that don't change per frame, the program must be in use
+void set_impostor_uniforms (const ImpostorAtlas& atlas, GLuint program);
+// Bind the normal/depth texture to its unit, the colour goes through the render queue
+void bind_impostor_atlas (const ImpostorAtlas& atlas);
+
+// Split instances by the distance of their origin from the camera. Those
+// past start + band are impostors only, those in the band are both.
+void split_impostor_instances (ImpostorSplit& split, const InstanceData* instances, int count,
+	const vec3& camera, float start, float band);
+
+#endif
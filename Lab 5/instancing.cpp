@@ -0,0 +1,141 @@
+#include "instancing.h"
+#include <chrono>
+#include <math.h>
+#include <string.h>
+
+// Macro for indexing vertex buffer
+#define BUFFER_OFFSET(i) ((char *)NULL + (i))
+
+// Point the instance attributes of the bound VAO at the bound GL_ARRAY_BUFFER
+static void set_instance_attributes (GLuint program) {
+	// a mat4 attribute takes four consecutive locations, one per column
+	GLint model_loc = glGetAttribLocation (program, "instance_model");
+	if (model_loc >= 0) {
+		for (int column = 0; column < 4; column++) {
+			glEnableVertexAttribArray (model_loc + column);
+			glVertexAttribPointer (model_loc + column, 4, GL_FLOAT, GL_FALSE, sizeof (InstanceData), BUFFER_OFFSET (column * 4 * sizeof (float)));
+			glVertexAttribDivisor (model_loc + column, 1);
+		}
+	}
+	GLint params_loc = glGetAttribLocation (program, "instance_params");
+	if (params_loc >= 0) {
+		glEnableVertexAttribArray (params_loc);
+		glVertexAttribPointer (params_loc, 4, GL_FLOAT, GL_FALSE, sizeof (InstanceData), BUFFER_OFFSET (16 * sizeof (float)));
+		glVertexAttribDivisor (params_loc, 1);
+	}
+}
+
+void create_instance_batch (InstanceBatch& batch, GLuint vao, int vertex_count, GLuint program, GLenum usage) {
+	batch.vao = vao;
+	batch.vertex_count = vertex_count;
+	batch.usage = usage;
+	batch.capacity = 0;
+	batch.dirty = true;
+	batch.instances.clear ();
+	batch.local_bounds.center = vec3 (0.0f, 0.0f, 0.0f);
+	batch.local_bounds.radius = 0.0f;
+	clear_spheres (batch.bounds);
+	batch.culled = false;
+	batch.depth_vao = 0;
+
+	glGenBuffers (1, &batch.buffer);
+	glBindVertexArray (vao);
+	glBindBuffer (GL_ARRAY_BUFFER, batch.buffer);
+	set_instance_attributes (program);
+	glBindVertexArray (0);
+}
+
+void attach_depth_vao (InstanceBatch& batch, GLuint depth_vao, GLuint depth_program) {
+	batch.depth_vao = depth_vao;
+	glBindVertexArray (depth_vao);
+	glBindBuffer (GL_ARRAY_BUFFER, batch.buffer);
+	set_instance_attributes (depth_program);
+	glBindVertexArray (0);
+}
+
+void clear_instances (InstanceBatch& batch) {
+	batch.instances.clear ();
+	clear_spheres (batch.bounds);
+	batch.culled = false;
+	batch.dirty = true;
+}
+
+void add_instance (InstanceBatch& batch, const mat4& model, float rotation_x_deg) {
+	InstanceData d;
+	memcpy (d.model, model.m, sizeof (d.model));
+	d.params[0] = rotation_x_deg;
+	d.params[1] = 0.0f;
+	d.params[2] = 0.0f;
+	d.params[3] = 0.0f;
+	batch.instances.push_back (d);
+
+	// the shader applies the x rotation first, so turn the sphere centre the same way
+	BoundingSphere local = batch.local_bounds;
+	if (rotation_x_deg != 0.0f) {
+		float rad = rotation_x_deg * ONE_DEG_IN_RAD;
+		float y = local.center.v[1], z = local.center.v[2];
+		local.center.v[1] = cos (rad) * y - sin (rad) * z;
+		local.center.v[2] = sin (rad) * y + cos (rad) * z;
+	}
+	add_sphere (batch.bounds, transform_sphere (local, model));
+	batch.dirty = true;
+}
+
+void cull_instances (InstanceBatch& batch, const Frustum* frustum, OcclusionBuffer* occlusion, CullStats& stats) {
+	if (frustum == NULL) {
+		if (batch.culled) {
+			batch.culled = false;
+			batch.dirty = true;
+		}
+		return;
+	}
+	auto start = std::chrono::high_resolution_clock::now ();
+	int visible = cull_spheres (*frustum, batch.bounds, batch.visible);
+	auto end = std::chrono::high_resolution_clock::now ();
+	stats.kernel_ms += std::chrono::duration<double, std::milli> (end - start).count ();
+	stats.tested += (int)batch.bounds.r.size ();
+	stats.visible += visible;
+	if (occlusion != NULL) {
+		visible = cull_occluded (*occlusion, batch.bounds, batch.visible);
+	}
+
+	batch.visible_instances.resize (visible);
+	for (int i = 0; i < visible; i++) {
+		batch.visible_instances[i] = batch.instances[batch.visible[i]];
+	}
+	batch.culled = true;
+	batch.dirty = true;  // the visible set follows the camera, even for static batches
+}
+
+const InstanceData* drawn_instances (const InstanceBatch& batch) {
+	const std::vector<InstanceData>& v = batch.culled ? batch.visible_instances : batch.instances;
+	return v.empty () ? NULL : &v[0];
+}
+
+int drawn_instance_count (const InstanceBatch& batch) {
+	return (int)(batch.culled ? batch.visible_instances.size () : batch.instances.size ());
+}
+
+void set_drawn_instances (InstanceBatch& batch, const std::vector<InstanceData>& instances) {
+	batch.visible_instances = instances;
+	batch.culled = true;
+	batch.dirty = true;
+}
+
+void upload_instances (InstanceBatch& batch) {
+	int count = drawn_instance_count (batch);
+	if (!batch.dirty || count == 0) {
+		return;
+	}
+	const InstanceData* data = drawn_instances (batch);
+	glBindBuffer (GL_ARRAY_BUFFER, batch.buffer);
+	if (count > batch.capacity || batch.usage != GL_STATIC_DRAW || batch.culled) {
+		// reallocating also orphans last frame's storage so streaming never waits on the GPU
+		glBufferData (GL_ARRAY_BUFFER, count * sizeof (InstanceData), data, batch.culled ? GL_STREAM_DRAW : batch.usage);
+		batch.capacity = count;
+	}
+	else {
+		glBufferSubData (GL_ARRAY_BUFFER, 0, count * sizeof (InstanceData), data);
+	}
+	batch.dirty = false;
+}
@@ -0,0 +1,69 @@
+#ifndef _INSTANCING_H_
+#define _INSTANCING_H_
+
+#include <GL/glew.h>
+#include <vector>
+#include "frustum_culling.h"
+#include "maths_funcs.h"
+#include "occlusion_culling.h"
+
+/*----------------------------------------------------------------------------
+                   HARDWARE INSTANCING
+  ----------------------------------------------------------------------------*/
+// Every copy of a mesh is one InstanceData in a per-mesh instance buffer that
+// is attached to the mesh's VAO with an attribute divisor of 1, so all copies
+// go out in a single glDrawArraysInstanced call. The vertex shader builds the
+// model matrix as instance_model * rotate_x(instance_params.x degrees), which
+// lets the snowman arms wave without rebuilding their matrices on the CPU.
+//
+// Each instance also carries a world space bounding sphere, so a batch can be
+// frustum culled (and optionally occlusion culled) before upload, and only
+// the surviving instances are drawn.
+
+struct InstanceData {
+	float model[16];
+	float params[4];  // x: local x rotation in degrees, y: impostor fade (see impostors.h), zw: unused
+};
+
+struct InstanceBatch {
+	GLuint vao;  // the mesh's VAO, instance attributes are added to it
+	GLuint depth_vao;  // position-only VAO for the depth pre-pass, 0 if there is none
+	GLuint buffer;
+	int vertex_count;
+	GLenum usage;  // GL_STATIC_DRAW for scenery, GL_STREAM_DRAW if refilled every frame
+	int capacity;  // instances the GPU buffer currently holds
+	bool dirty;
+	std::vector<InstanceData> instances;
+
+	BoundingSphere local_bounds;  // of the mesh, set before adding instances
+	SphereSoA bounds;  // world sphere of every instance
+	bool culled;  // only visible_instances are uploaded and drawn
+	std::vector<unsigned int> visible;
+	std::vector<InstanceData> visible_instances;
+};
+
+struct CullStats {
+	int tested;
+	int visible;
+	double kernel_ms;  // time spent in cull_spheres
+};
+
+// Create the instance buffer and attach it to an existing mesh VAO
+void create_instance_batch (InstanceBatch& batch, GLuint vao, int vertex_count, GLuint program, GLenum usage);
+// Attach the same instance buffer to the mesh's position-only VAO
+void attach_depth_vao (InstanceBatch& batch, GLuint depth_vao, GLuint depth_program);
+void clear_instances (InstanceBatch& batch);
+void add_instance (InstanceBatch& batch, const mat4& model, float rotation_x_deg = 0.0f);
+// Keep only the instances whose spheres touch the frustum, NULL draws them all.
+// With an occlusion buffer the survivors are also tested against its occluders.
+void cull_instances (InstanceBatch& batch, const Frustum* frustum, OcclusionBuffer* occlusion, CullStats& stats);
+// What will be drawn: every instance, or the survivors of the last cull
+const InstanceData* drawn_instances (const InstanceBatch& batch);
+int drawn_instance_count (const InstanceBatch& batch);
+// Draw a caller chosen set this frame instead, e.g. the share of the survivors
+// a level of detail keeps. The next cull_instances starts from every instance again.
+void set_drawn_instances (InstanceBatch& batch, const std::vector<InstanceData>& instances);
+// Copy the instances to the GPU if they changed since the last upload
+void upload_instances (InstanceBatch& batch);
+
+#endif
@@ -0,0 +1,281 @@
+#include "job_system.h"
+
+static thread_local int worker_index = 0;
+
+/*-----------------------------------DEQUES-------------------------------------------*/
+
+static void store_slot (JobSlot& slot, const Job& job) {
+	slot.run.store (job.run, std::memory_order_relaxed);
+	slot.data.store (job.data, std::memory_order_relaxed);
+	slot.begin.store (job.begin, std::memory_order_relaxed);
+	slot.end.store (job.end, std::memory_order_relaxed);
+	slot.done.store (job.done, std::memory_order_relaxed);
+}
+
+static void load_slot (const JobSlot& slot, Job& job) {
+	job.run = slot.run.load (std::memory_order_relaxed);
+	job.data = slot.data.load (std::memory_order_relaxed);
+	job.begin = slot.begin.load (std::memory_order_relaxed);
+	job.end = slot.end.load (std::memory_order_relaxed);
+	job.done = slot.done.load (std::memory_order_relaxed);
+}
+
+// Owner only. False when full.
+static bool push_job (JobDeque& deque, const Job& job) {
+	long long b = deque.bottom.load (std::memory_order_relaxed);
+	long long t = deque.top.load (std::memory_order_acquire);
+	if (b - t >= JOB_DEQUE_SIZE) {
+		return false;
+	}
+	store_slot (deque.jobs[b & (JOB_DEQUE_SIZE - 1)], job);
+	deque.bottom.store (b + 1, std::memory_order_release);
+	return true;
+}
+
+// Owner only, the newest job. Claiming bottom first means a thief can only
+// race the owner for the last job, which the compare and swap on top settles.
+static bool pop_job (JobDeque& deque, Job& job) {
+	long long b = deque.bottom.load (std::memory_order_relaxed) - 1;
+	deque.bottom.store (b, std::memory_order_relaxed);
+	std::atomic_thread_fence (std::memory_order_seq_cst);
+	long long t = deque.top.load (std::memory_order_relaxed);
+	if (t > b) {
+		deque.bottom.store (b + 1, std::memory_order_relaxed);
+		return false;
+	}
+	load_slot (deque.jobs[b & (JOB_DEQUE_SIZE - 1)], job);
+	if (t == b) {
+		bool won = deque.top.compare_exchange_strong (t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		deque.bottom.store (b + 1, std::memory_order_relaxed);
+		return won;
+	}
+	return true;
+}
+
+// Any other worker, the oldest job. The copy is only kept if the compare and
+// swap wins, a job read while the owner reused its slot is thrown away.
+static bool steal_job (JobDeque& deque, Job& job) {
+	long long t = deque.top.load (std::memory_order_acquire);
+	std::atomic_thread_fence (std::memory_order_seq_cst);
+	long long b = deque.bottom.load (std::memory_order_acquire);
+	if (t >= b) {
+		return false;
+	}
+	load_slot (deque.jobs[t & (JOB_DEQUE_SIZE - 1)], job);
+	return deque.top.compare_exchange_strong (t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+/*-----------------------------------RUNNING------------------------------------------*/
+
+static void run_job (JobSystem& system, const Job& job);
+
+// The job's counter is already counted up
+static void queue_job (JobSystem& system, const Job& job) {
+	if (!push_job (system.deques[worker_index], job)) {
+		run_job (system, job);
+		return;
+	}
+	system.queued.fetch_add (1);
+	if (system.sleeping.load () > 0) {
+		std::lock_guard<std::mutex> guard (system.sleep_lock);
+		system.wake.notify_one ();
+	}
+}
+
+static void run_job (JobSystem& system, const Job& job) {
+	job.run (job.data, job.begin, job.end);
+	system.deques[worker_index].run.fetch_add (1, std::memory_order_relaxed);
+	JobCounter* done = job.done;
+	if (!done) {
+		return;
+	}
+	// a waiter can return, and the counter go, once pending and finishing are both zero,
+	// a counter nobody waits on can't tell when this is done with it
+	done->finishing.fetch_add (1);
+	if (done->pending.fetch_sub (1) == 1) {
+		// last one, let go of whatever was waiting for it
+		std::vector<Job> released;
+		{
+			std::lock_guard<std::mutex> guard (done->lock);
+			released.swap (done->dependents);
+		}
+		for (size_t i = 0; i < released.size (); i++) {
+			queue_job (system, released[i]);
+		}
+	}
+	done->finishing.fetch_sub (1);
+}
+
+// Own deque first, then the others in turn starting after this one
+static bool take_job (JobSystem& system, Job& job) {
+	int self = worker_index;
+	bool found = pop_job (system.deques[self], job);
+	for (int k = 1; !found && k < system.worker_count; k++) {
+		int victim = (self + k) % system.worker_count;
+		if (steal_job (system.deques[victim], job)) {
+			system.deques[self].stolen.fetch_add (1, std::memory_order_relaxed);
+			found = true;
+		}
+	}
+	if (found) {
+		system.queued.fetch_sub (1);
+	}
+	return found;
+}
+
+static void worker_loop (JobSystem* system, int index) {
+	worker_index = index;
+	int idle = 0;
+	Job job;
+	while (system->running.load (std::memory_order_relaxed)) {
+		if (take_job (*system, job)) {
+			run_job (*system, job);
+			idle = 0;
+		}
+		else if (++idle < JOB_IDLE_SPINS) {
+			std::this_thread::yield ();
+		}
+		else {
+			// queue_job checks sleeping after counting the job, so either it sees this worker or this sees the job
+			std::unique_lock<std::mutex> lock (system->sleep_lock);
+			system->sleeping.fetch_add (1);
+			while (system->running.load () && system->queued.load () <= 0) {
+				system->wake.wait (lock);
+			}
+			system->sleeping.fetch_sub (1);
+			idle = 0;
+		}
+	}
+}
+
+/*-----------------------------------SYSTEM-------------------------------------------*/
+
+void create_job_system (JobSystem& system, int worker_count) {
+	if (worker_count < 1) {
+		worker_count = 1;
+	}
+	if (worker_count > JOB_MAX_WORKERS) {
+		worker_count = JOB_MAX_WORKERS;
+	}
+	system.worker_count = worker_count;
+	for (int w = 0; w < JOB_MAX_WORKERS; w++) {
+		system.deques[w].top.store (0);
+		system.deques[w].bottom.store (0);
+		system.deques[w].run.store (0);
+		system.deques[w].stolen.store (0);
+	}
+	system.queued.store (0);
+	system.sleeping.store (0);
+	system.running.store (true);
+	worker_index = 0;
+	for (int w = 1; w < worker_count; w++) {
+		system.threads.push_back (std::thread (worker_loop, &system, w));
+	}
+}
+
+void destroy_job_system (JobSystem& system) {
+	{
+		std::lock_guard<std::mutex> guard (system.sleep_lock);
+		system.running.store (false);
+		system.wake.notify_all ();
+	}
+	for (size_t i = 0; i < system.threads.size (); i++) {
+		system.threads[i].join ();
+	}
+	system.threads.clear ();
+	system.worker_count = 1;
+}
+
+void create_job_counter (JobCounter& counter) {
+	counter.pending.store (0);
+	counter.finishing.store (0);
+	counter.dependents.clear ();
+}
+
+void submit_job (JobSystem& system, const Job& job, JobCounter* done) {
+	Job counted = job;
+	counted.done = done;
+	if (done) {
+		done->pending.fetch_add (1, std::memory_order_relaxed);
+	}
+	queue_job (system, counted);
+}
+
+// run_job counts down before it takes the lock, so a counter seen above zero
+// here will have its dependents taken by whoever brings it to zero
+void submit_job_after (JobSystem& system, JobCounter& after, const Job& job, JobCounter* done) {
+	Job counted = job;
+	counted.done = done;
+	if (done) {
+		done->pending.fetch_add (1, std::memory_order_relaxed);
+	}
+	{
+		std::lock_guard<std::mutex> guard (after.lock);
+		if (after.pending.load (std::memory_order_acquire) > 0) {
+			after.dependents.push_back (counted);
+			return;
+		}
+	}
+	queue_job (system, counted);
+}
+
+void wait_for_counter (JobSystem& system, JobCounter& counter) {
+	Job job;
+	while (counter.pending.load () > 0 || counter.finishing.load () > 0) {
+		if (take_job (system, job)) {
+			run_job (system, job);
+		}
+		else {
+			std::this_thread::yield ();
+		}
+	}
+}
+
+/*-----------------------------------PARALLEL FOR-------------------------------------*/
+
+static void submit_ranges (JobSystem& system, JobCounter* after, int count, int grain, JobFunction run, void* data, JobCounter* done) {
+	if (grain < 1) {
+		grain = 1;
+	}
+	for (int begin = 0; begin < count; begin += grain) {
+		Job job;
+		job.run = run;
+		job.data = data;
+		job.begin = begin;
+		job.end = begin + grain < count ? begin + grain : count;
+		if (after) {
+			submit_job_after (system, *after, job, done);
+		}
+		else {
+			submit_job (system, job, done);
+		}
+	}
+}
+
+void parallel_for (JobSystem& system, int count, int grain, JobFunction run, void* data) {
+	JobCounter done;
+	create_job_counter (done);
+	submit_ranges (system, NULL, count, grain, run, data, &done);
+	wait_for_counter (system, done);
+}
+
+void submit_parallel_for (JobSystem& system, int count, int grain, JobFunction run, void* data, JobCounter* done) {
+	submit_ranges (system, NULL, count, grain, run, data, done);
+}
+
+void submit_parallel_for_after (JobSystem& system, JobCounter& after, int count, int grain, JobFunction run, void* data, JobCounter* done) {
+	submit_ranges (system, &after, count, grain, run, data, done);
+}
+
+int job_worker_index () {
+	return worker_index;
+}
+
+JobStats take_job_stats (JobSystem& system) {
+	JobStats stats = { 0, 0 };
+	for (int w = 0; w < system.worker_count; w++) {
+		stats.run += system.deques[w].run.exchange (0, std::memory_order_relaxed);
+		stats.stolen += system.deques[w].stolen.exchange (0, std::memory_order_relaxed);
+	}
+	return stats;
+}
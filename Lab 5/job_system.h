@@ -0,0 +1,112 @@
+#ifndef _JOB_SYSTEM_H_
+#define _JOB_SYSTEM_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*----------------------------------------------------------------------------
+                   JOB SYSTEM
+  ----------------------------------------------------------------------------*/
+// A fixed set of worker threads sharing out small jobs by work stealing.
+// Every worker has its own Chase-Lev deque: the owner pushes and pops at
+// the bottom with no atomic read-modify-write except when taking the last
+// job, while idle workers steal from the top with one compare and swap.
+// The thread that makes the system is worker 0 and has no thread of its
+// own, it runs jobs while it waits for them. Only that one thread outside
+// the workers may submit.
+//
+// A job is a function over a range [begin, end) of the caller's data. Each
+// can count down a counter when it has run, waiting on the counter runs
+// other jobs until it reaches zero. A job submitted after a counter is held
+// by the counter until it reaches zero, so one pass can follow another
+// without the submitting thread waiting in between. Every counter has to
+// be waited on before it goes, including one only followed by others: the
+// job that releases its dependents can still be touching it after they run.
+//
+// Idle workers spin briefly and then sleep until something is queued.
+
+#define JOB_MAX_WORKERS 16
+#define JOB_DEQUE_SIZE 1024  // power of two, a full deque runs the job on the spot
+#define JOB_IDLE_SPINS 64  // failed steals before a worker sleeps
+
+typedef void (*JobFunction) (void* data, int begin, int end);
+
+struct JobCounter;
+
+struct Job {
+	JobFunction run;
+	void* data;
+	int begin, end;
+	JobCounter* done;  // counted down once the job has run, or NULL
+};
+
+struct JobCounter {
+	std::atomic<int> pending;  // jobs still to run
+	std::atomic<int> finishing;  // jobs between counting down and letting go of the counter
+	std::mutex lock;  // guards dependents
+	std::vector<Job> dependents;  // submitted once pending reaches zero
+};
+
+// A deque slot. A thief can read one while the owner refills it, the read
+// is thrown away when the steal loses, but the fields have to be atomic
+// for the race to be defined at all. Relaxed loads and stores cost the
+// same as plain ones, bottom and top do the ordering.
+struct JobSlot {
+	std::atomic<JobFunction> run;
+	std::atomic<void*> data;
+	std::atomic<int> begin, end;
+	std::atomic<JobCounter*> done;
+};
+
+struct JobDeque {
+	alignas (64) std::atomic<long long> top;  // thieves take from here
+	alignas (64) std::atomic<long long> bottom;  // the owner pushes and pops here
+	JobSlot jobs[JOB_DEQUE_SIZE];
+	std::atomic<int> run, stolen;  // since the last stats reset
+};
+
+struct JobSystem {
+	int worker_count;  // including worker 0
+	JobDeque deques[JOB_MAX_WORKERS];
+	std::vector<std::thread> threads;
+	std::atomic<bool> running;
+	std::atomic<int> queued;  // jobs in the deques
+	std::atomic<int> sleeping;
+	std::mutex sleep_lock;
+	std::condition_variable wake;
+};
+
+struct JobStats {
+	int run;
+	int stolen;
+};
+
+// worker_count is clamped to 1..JOB_MAX_WORKERS, 1 runs everything on the calling thread
+void create_job_system (JobSystem& system, int worker_count);
+void destroy_job_system (JobSystem& system);
+
+void create_job_counter (JobCounter& counter);
+// done may be NULL
+void submit_job (JobSystem& system, const Job& job, JobCounter* done);
+// Held until after reaches zero, then submitted
+void submit_job_after (JobSystem& system, JobCounter& after, const Job& job, JobCounter* done);
+// Runs jobs until the counter reaches zero
+void wait_for_counter (JobSystem& system, JobCounter& counter);
+
+// run over [0, count) in jobs of grain, returns when they have all run
+void parallel_for (JobSystem& system, int count, int grain, JobFunction run, void* data);
+// Submits them counting down done, without waiting
+void submit_parallel_for (JobSystem& system, int count, int grain, JobFunction run, void* data, JobCounter* done);
+// The same, held until after reaches zero
+void submit_parallel_for_after (JobSystem& system, JobCounter& after, int count, int grain, JobFunction run, void* data, JobCounter* done);
+
+// Which worker the calling thread is, 0 outside the workers
+int job_worker_index ();
+
+// Jobs run and stolen since the last call, over every worker
+JobStats take_job_stats (JobSystem& system);
+
+#endif
@@ -1,8 +1,13 @@
 //Some Windows Headers (For Time, IO, etc.)
+#ifdef _WIN32
 #include <windows.h>
 #include <mmsystem.h>
+#endif
 #include <GL/glew.h>
 #include <GL/freeglut.h>
+#ifdef _WIN32
+#include <GL/wglew.h>
+#endif
 #include <iostream>
 #include "maths_funcs.h"
 
@@ -12,9 +17,39 @@
 #include <assimp/scene.h> // collects data
 #include <assimp/postprocess.h> // various extra operations
 #include <stdio.h>
+#include <string.h>
 
 #include <math.h>
 #include <vector> // STL dynamic memory.
+#include <map>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+#include "benchmarks.h"
+#include "clustered_lighting.h"
+#include "dynamic_resolution.h"
+#include "entities.h"
+#include "frame_capture.h"
+#include "frame_pacing.h"
+#include "frustum_culling.h"
+#include "gl_state.h"
+#include "gpu_culling.h"
+#include "headless.h"
+#include "impostors.h"
+#include "instancing.h"
+#include "job_system.h"
+#include "mesh_bvh.h"
+#include "multi_draw.h"
+#include "occlusion_culling.h"
+#include "particles.h"
+#include "projectiles.h"
+#include "render_queue.h"
+#include "scene_graph.h"
+#include "shadows.h"
+#include "sim_channels.h"
+#include "spatial_hash.h"
+#include "static_batching.h"
 
 // STB Image loader
 // https://github.com/nothings/stb/blob/master/stb_image.h
@@ -68,6 +103,11 @@ int skybox_vertex_count = 0;
 
 using namespace std;
 GLuint shaderProgramID;
+GLuint mdiProgramID;  // multi-draw indirect variant of the toon shader
+GLuint depthProgramID;  // vertex shader only, for the depth pre-pass
+GLuint mdiDepthProgramID;
+GLuint ditherProgramID;  // toon shader for meshes dithering out into their impostors
+GLuint impostorProgramID;
 
 unsigned int mesh_vao = 0;
 
@@ -98,33 +138,235 @@ GLfloat camerarotationy = 0.0f;
 GLfloat fire_value = 0.9f;
 bool fire_inc = true;
 
-// Snowman AI 
+// Snowman AI, the rest of it is in the entities' AIState
 bool armSwitch = true;
 GLfloat armAngle = 0.0f;
-GLfloat snowman1_rotationy = 0.0;
-GLfloat marchDistance = 0.0;
-bool marchOrder = true;
 bool fleeing = false;
 GLfloat fleeTime = 0.0;
 
-// Snowball parameters
-bool thrownSnowball = false;  // Has the snowball been thrown?
-vec3 snowballDir = vec3(0.0f, 0.0f, 0.0f);  // Direction to throw the snowball
-GLfloat snowballGravity = 0.0f;
-vec3 hitLocation = vec3(0.0f, 0.0f, 0.0f); 
-
-vec3 snowman1Pos = vec3(-10.0f, 0.0f, -10.0f);
-vec3 snowman2Pos = vec3(-5.0f, 0.0f, -10.0f);
-vec3 snowman3Pos = vec3(10.0f, 0.0f, 10.0f);
-vec3 tree1Pos = vec3(5.0f, 0.0f, -4.0f);
-vec3 tree2Pos = vec3(7.0f, 0.0f, 8.0f);
-vec3 tree3Pos = vec3(-5.0f, 0.0f, 8.0f);
-vec3 snowballPos = vec3(-10.0f, 10.0f, -5.0f);
+// Snowballs: every one in the air, the player's and the snowmen's, in one pool on the
+// simulation thread. Their hits go into a ring that the AI reads after the collisions.
+#define SNOWBALL_CAPACITY 8192
+#define SNOWBALL_SPEED 3.0f  // units per second, as the single snowball was thrown
+#define SNOWBALL_GRAVITY 0.037f  // units per second squared, lands about as far as the old arc did
+#define SNOWBALL_FLOOR -1.0f  // taken out of the air below this
+#define SNOWBALL_LIGHTS 8  // how many of the player's snowballs glow
+#define SNOWBALL_FIGHT_RANGE 25.0f
+#define SNOWMAN_HAND_HEIGHT 2.5f
+#define SNOWMAN_THROW_COOLDOWN 1.5f  // seconds, plus up to three more at random
+#define PLAYER_ID ENTITY_NONE  // the player is no entity, snowballs and their hits use this for them
+#define PLAYER_HIT_RADIUS 1.0f  // round the player's middle
+ProjectilePool snowballs;
+HitEventRing hitEvents;
+bool snowballFight = false;  // the crowd throw at each other
+double simulationTime = 0.0;  // seconds simulated
+int snowballHits = 0, playerHits = 0;
+double snowballCollideMs = 0.0;
+
+// The player, moved by the simulation thread. The camera below is the renderer's copy from the latest snapshot.
+vec3 playerPosition = vec3(0.0f, 2.0f, -15.0f);
+GLfloat playerRotation = 0.0f;
 
 vec3 cameraPosition = vec3(0.0f, 2.0f, -15.0f);
 vec3 cameraDirection = vec3(0.0f, 0.0f, 1.0f); // start direction depends on camerarotationy, not this vector
 vec3 cameraUpVector = vec3(0.0f, 1.0f, 0.0f);
 
+// Clustered point lights (fire, thrown snowball and lanterns)
+#define LANTERN_COUNT 200
+std::vector<PointLight> sceneLights;
+LightClusterGrid lightGrid;
+LightClusterGPU lightClusterGPU;
+vec3 lanternPos[LANTERN_COUNT];
+vec3 lanternColour[LANTERN_COUNT];
+GLfloat lanternTime = 0.0f;
+JobSystem renderJobs;  // the render thread's workers for the light binning, occluders and particles, it is worker 0
+
+// Draws are queued each frame and sorted to minimise state changes
+RenderQueue renderQueue;
+
+// Instanced meshes, plus an optional forest and crowd set from the command line
+InstanceBatch treeBatch;
+InstanceBatch snowmanBatch;
+InstanceBatch armBatch;
+InstanceBatch snowballBatch;
+int forestTreeCount = 0;
+int crowdSnowmanCount = 0;
+
+// Entities: the trees and snowmen, their components in dense arrays per archetype.
+// The simulation owns them once it starts, the renderer only sees the snapshots.
+enum EntityModel { MODEL_TREE, MODEL_SNOWMAN, MODEL_ARMED_SNOWMAN };
+EntityWorld entityWorld;
+EntityQuery walkerQuery;  // snowmen the AI moves
+EntityQuery spinnerQuery;  // snowmen the AI turns
+EntityQuery standingQuery;  // snowmen that never move, everything with AI is a snowman
+EntityQuery treeQuery;  // positioned but no AI
+EntityQuery movingMeshQuery;  // drawn entities that can move or turn, copied into each snapshot
+EntityQuery throwerQuery;  // snowmen, the ones with arms throw snowballs
+
+// Collision broadphase: snowmen and trees in spatial hashes over the ground. Trees and
+// standing snowmen are hashed once, the walkers are rehashed after they move each tick.
+#define COLLISION_CELL_SIZE 4.0f  // the widest reach is 3, a query touches at most 2x2 cells
+SpatialHash walkerGrid, standingGrid, treeGrid;
+
+// Snowball narrowphase: a BVH over the triangles of each mesh that can be hit, built at load
+// and shared by its instances. The hashes find what is near the flight, the ball is swept
+// against their triangles. The simulation thread only reads them.
+#define SNOWBALL_REACH 4.0f  // past the middle of the flight, wider than the biggest tree
+std::map<GLuint, MeshBVH> bvhForVAO;
+const MeshBVH* treeBVH = NULL;
+const MeshBVH* snowmanBVH = NULL;
+float snowballRadius = 0.2f;
+std::vector<EntityId> snowballCandidates[JOB_MAX_WORKERS];  // one per job worker
+
+// Transform hierarchy, only nodes that moved (and their children) get new world matrices
+SceneGraph sceneGraph;
+int groundNode, logsNode, flameNode, flameShapeNode, skyboxNode;
+std::vector<int> treeNodes;
+std::vector<int> snowmanNodes;  // every snowman body
+std::vector<int> armedSnowmanNodes;  // body node of each snowman with arms, its two arms follow it
+std::vector<float> armedSnowmanPhase;
+std::vector<unsigned char> armedSnowmanFlees;
+
+// Multi-draw indirect: the opaque scene as one glMultiDrawElementsIndirect
+bool useMultiDrawIndirect = false;
+MeshPool meshPool;
+IndirectFrame indirectFrame;
+GLuint textureArrayID;
+std::map<GLuint, int> poolMeshForVAO;
+std::map<GLuint, GLuint> layerForTexture;
+
+// Frustum culling: a bounding sphere per mesh, tested against this frame's frustum
+bool useFrustumCulling = true;
+std::map<GLuint, BoundingSphere> boundsForVAO;
+Frustum viewFrustum;
+CullStats cullStats;
+
+// Occlusion culling: nearby trees, snowmen and the ground drawn into a small CPU depth buffer
+#define OCCLUDER_DISTANCE 40.0f
+bool useOcclusionCulling = true;
+OcclusionBuffer occlusionBuffer;
+OccluderMesh treeOccluder;
+OccluderMesh snowmanOccluder;
+OccluderMesh groundOccluder;
+
+// GPU culling: with multi-draw indirect on, a compute shader culls the instances instead of the CPU
+bool useGPUCulling = false;
+bool useHiZ = false;  // also test against last frame's depth
+GPUCuller gpuCuller;
+
+// Depth pre-pass: opaques are drawn depth only first, then shaded with GL_EQUAL
+bool useDepthPrepass = false;
+std::map<GLuint, GLuint> depthVAOForVAO;  // position-only copy of each mesh VAO
+
+// Impostors: trees past impostorDistance are drawn as a single quad from a baked atlas
+#define IMPOSTOR_FADE_BAND 10.0f  // distance over which mesh and impostor cross-fade
+bool useImpostors = true;
+float impostorDistance = 60.0f;
+ImpostorAtlas treeImpostors;
+ImpostorSplit treeSplit;
+InstanceBatch impostorBatch;
+
+// Static batching: ground, logs and trees pre-transformed into merged buffers at init, one draw per cell and texture
+bool useStaticBatching = false;
+StaticBatch staticBatch;
+int staticCellsDrawn = 0;
+
+// Particles: flame, embers and smoke over the fire, and snow falling in a box that follows the camera
+#define SNOW_BOX_SIZE 120.0f
+#define SNOW_BOX_HEIGHT 30.0f
+bool useParticles = true;
+int snowParticleCount = 100000;
+GLuint particleProgramID;
+ParticlePool flameParticles, emberParticles, smokeParticles, snowParticles;
+ParticleEmitter flameEmitter, emberEmitter, smokeEmitter;
+
+// Shadows: moonlight with cascaded shadow maps, the static casters' layers are cached
+bool useShadows = true;
+CascadedShadows shadows;
+ShadowCasters staticCasters, dynamicCasters;
+
+// Dynamic resolution: the scene is drawn smaller when the GPU runs over its frame time, then upscaled to the window
+bool useDynamicResolution = false;
+float dynamicResTargetMs = 1000.0f / 60.0f;
+float dynamicResMinScale = 0.5f, dynamicResMaxScale = 1.0f;
+DynamicResolution dynamicRes;
+int renderWidth = width, renderHeight = height;  // what the scene is drawn at this frame
+
+// Fixed timestep: the simulation ticks at simulationHz whatever the frame rate, and display()
+// draws the moving objects blended between the last two ticks
+#define SIMULATION_REFERENCE_HZ 60.0f  // the per-tick steps in simulateStep were tuned at this rate
+#define MAX_FRAME_SECONDS 0.25f  // longer frames are simulated as this long, rather than ticking for ever to catch up
+#define HEADLESS_FRAME_SECONDS (1.0f / 60.0f)  // headless frames advance a fixed time so runs repeat
+struct SimulationState {
+	double time;
+	GLfloat armAngle, fireValue, lanternTime;
+	vec3 cameraPosition;
+	GLfloat cameraRotation;
+	bool fleeing;
+	std::vector<ProjectileFlight> snowballs;  // drawn where their arcs are at time
+	// scene node, position and rotation of every entity in movingMeshQuery
+	std::vector<int> moverNodes;
+	std::vector<vec3> moverPositions;
+	std::vector<float> moverRotations;
+};
+float simulationHz = 120.0f;
+float simulationAccumulator = 0.0f;  // seconds not simulated yet, under one tick (headless only)
+float simulationAlpha = 0.0f;  // how far the frame is from the previous tick to the latest
+SimulationState renderState;  // blended, what display() draws
+
+// Simulation thread: simulateStep runs on its own thread at simulationHz and publishes a
+// snapshot of the last two ticks after each one. Keys that move the player are queued for it.
+// Headless runs tick inline, one fixed frame time per frame, so they stay repeatable.
+struct WorldSnapshot {
+	SimulationState previous, current;
+	pacing_clock::time_point tick_time;  // when current was due
+	int tick;
+	double step_ms;  // how long simulateStep took
+	int entities, archetypes;
+	double broadphase_ms;  // rehashing the walkers
+	int snowballs, snowballs_launched, snowballs_fell, snowballs_refused, snowball_hits, player_hits;
+	double snowball_ms;  // sweeping the snowballs
+	int jobs_run, jobs_stolen;  // by the workers during the tick
+};
+bool useSimulationThread = true;
+std::thread simulationThread;
+// The simulation's per-snowman and per-snowball passes are shared out over these, the thread
+// that ticks is worker 0
+JobSystem simulationJobs;
+int simulationWorkers = 0;  // 0 for a worker per core but one, left for the renderer
+#define AI_JOB_GRAIN 256  // snowmen per job
+#define SNOWBALL_JOB_GRAIN 64  // snowballs swept per job
+std::atomic<bool> simulationStop(false);
+WorldSnapshot snapshots[3];
+TripleBuffer snapshotBuffer;
+InputQueue inputQueue;
+int simulationTick = 0;  // simulation side
+
+// Frame pacing: the idle loop sleeps until the next frame is due instead of spinning
+double targetFPS = 60.0;  // 0 for as fast as possible
+bool useVsync = false;  // let the swap wait for the display instead
+FramePacer framePacer;
+
+// Fragment shader invocations per frame, read a frame late so the query never stalls
+bool fragmentQueriesSupported = false;
+GLuint fragmentQueries[2];
+bool fragmentQueryIssued[2] = { false, false };
+int fragmentQueryIndex = 0;
+
+// Headless: no window, frames go to an offscreen framebuffer and can be saved to framesDirectory
+bool headlessMode = false;
+int headlessFrames = 100;
+const char* framesDirectory = NULL;
+bool framesAsPNG = true;
+HeadlessTarget headlessTarget;
+
+// Video capture: frames read back through a ring of pixel buffers and written to a y4m file on another thread
+#define CAPTURE_FPS 60
+const char* captureFile = "capture.y4m";
+bool captureOnStart = false;
+FrameCapture frameCapture;
+GLuint64 fragmentInvocations = 0;
+
 
 #pragma region MESH LOADING
 /*----------------------------------------------------------------------------
@@ -273,19 +515,23 @@ static void AddShader(GLuint ShaderProgram, const char* pShaderText, GLenum Shad
 }
 
 
-GLuint CompileShaders()
+GLuint CompileShaders(const char* vertexShader, const char* fragmentShader, const char* fragmentLibrary = NULL)
 {
 	//Start the process of setting up our shaders by creating a program ID
 	//Note: we will link all the shaders together into this ID
-    shaderProgramID = glCreateProgram();
+    GLuint shaderProgramID = glCreateProgram();
     if (shaderProgramID == 0) {
         fprintf(stderr, "Error creating shader program\n");
         exit(1);
     }
 
 	// Create two shader objects, one for the vertex, and one for the fragment shader
-    AddShader(shaderProgramID, "../Shaders/ToonVertexShader.txt", GL_VERTEX_SHADER);
-    AddShader(shaderProgramID, "../Shaders/ToonFragmentShader.txt", GL_FRAGMENT_SHADER);
+    AddShader(shaderProgramID, vertexShader, GL_VERTEX_SHADER);
+    AddShader(shaderProgramID, fragmentShader, GL_FRAGMENT_SHADER);
+	// functions shared between fragment shaders are linked in as a second object
+	if (fragmentLibrary != NULL) {
+		AddShader(shaderProgramID, fragmentLibrary, GL_FRAGMENT_SHADER);
+	}
 
     GLint Success = 0;
     GLchar ErrorLog[1024] = { 0 };
@@ -299,6 +545,12 @@ GLuint CompileShaders()
         exit(1);
 	}
 
+	// the light cluster buffers, texture array and shadow map use their own texture units, set them before validating
+	glUseProgram(shaderProgramID);
+	set_light_cluster_samplers(shaderProgramID);
+	glUniform1i(glGetUniformLocation(shaderProgramID, "texture_array"), TEXTURE_ARRAY_UNIT);
+	glUniform1i(glGetUniformLocation(shaderProgramID, "shadow_map"), SHADOW_TEXTURE_UNIT);
+
 	// program has been successfully linked but needs to be validated to check whether the program can execute given the current pipeline state
     glValidateProgram(shaderProgramID);
 	// check for program related errors using glGetProgramiv
@@ -313,6 +565,27 @@ GLuint CompileShaders()
     glUseProgram(shaderProgramID);
 	return shaderProgramID;
 }
+// A program with one stage only: a compute shader, or a vertex shader for depth only drawing
+GLuint CompileSingleShader(const char* shaderFile, GLenum shaderType)
+{
+	GLuint programID = glCreateProgram();
+	if (programID == 0) {
+		fprintf(stderr, "Error creating shader program\n");
+		exit(1);
+	}
+	AddShader(programID, shaderFile, shaderType);
+
+	GLint Success = 0;
+	GLchar ErrorLog[1024] = { 0 };
+	glLinkProgram(programID);
+	glGetProgramiv(programID, GL_LINK_STATUS, &Success);
+	if (Success == 0) {
+		glGetProgramInfoLog(programID, sizeof(ErrorLog), NULL, ErrorLog);
+		fprintf(stderr, "Error linking shader program: '%s'\n", ErrorLog);
+		exit(1);
+	}
+	return programID;
+}
 #pragma endregion SHADER_FUNCTIONS
 
 // VBO Functions - click on + to expand
@@ -361,6 +634,28 @@ void generateObjectBufferMesh(GLuint &vao, const char* meshname, int &count) {
 	glEnableVertexAttribArray (loc3);
 	glBindBuffer (GL_ARRAY_BUFFER, vt_vbo);
 	glVertexAttribPointer (loc3, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+
+	// The depth pre-pass only reads the positions
+	GLuint depth_vao = 0;
+	GLint depth_loc = glGetAttribLocation(depthProgramID, "vertex_position");
+	glGenVertexArrays(1, &depth_vao);
+	glBindVertexArray(depth_vao);
+	glEnableVertexAttribArray(depth_loc);
+	glBindBuffer(GL_ARRAY_BUFFER, vp_vbo);
+	glVertexAttribPointer(depth_loc, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	depthVAOForVAO[vao] = depth_vao;
+
+	boundsForVAO[vao] = compute_bounding_sphere(g_vp, count);
+	if (strcmp(meshname, GROUND_MESH) == 0) {
+		add_mesh_occluder(groundOccluder, g_vp, count);
+	}
+	if (strcmp(meshname, TREE_MESH) == 0 || strcmp(meshname, SNOWMAN_MESH) == 0) {
+		build_mesh_bvh(bvhForVAO[vao], g_vp, count);
+		printf("%s: BVH over %d triangles, %d nodes, built in %.1f ms\n", meshname, bvhForVAO[vao].triangle_count, (int)bvhForVAO[vao].nodes.size(), bvhForVAO[vao].build_ms);
+	}
+
+	// Also keep a copy in the shared pool used by the indirect path
+	poolMeshForVAO[vao] = add_pool_mesh(meshPool, g_vp, g_vn, g_vt, count);
 }
 
 #pragma endregion VBO_FUNCTIONS
@@ -392,49 +687,835 @@ GLfloat xz_length(const vec3& v) {
 	return sqrt(v.v[0] * v.v[0] +  v.v[2] * v.v[2]);
 }
 
+// Scatter the lanterns over the snow, keeping clear of the fire
+void initLanterns() {
+	for (int i = 0; i < LANTERN_COUNT; i++) {
+		float angle = (rand() % 3600) * 0.1f;
+		float dist = 6.0f + (rand() % 4000) * 0.01f;
+		lanternPos[i] = vec3(dist * sin(angle * ONE_DEG_IN_RAD), 0.6f, dist * cos(angle * ONE_DEG_IN_RAD));
+		// warm yellow through orange
+		lanternColour[i] = vec3(1.0f, 0.5f + (rand() % 40) * 0.01f, 0.2f + (rand() % 20) * 0.01f);
+	}
+}
+
+// Gather every light in the scene for this frame
+void collectSceneLights() {
+	sceneLights.clear();
+
+	// Fire at the centre, flickers with the flame
+	PointLight fire;
+	fire.position = vec3(0.0f, 1.0f, 0.0f);
+	fire.radius = 80.0f;
+	fire.colour = vec3(1.0f, 0.9f, 0.8f) * (0.8f + 0.4f * renderState.fireValue);
+	GLfloat lantern_time = renderState.lanternTime;
+	sceneLights.push_back(fire);
+
+	// The player's snowballs glow a cold blue, the first few of them
+	int glowing = 0;
+	for (size_t i = 0; i < renderState.snowballs.size() && glowing < SNOWBALL_LIGHTS; i++) {
+		if (renderState.snowballs[i].owner != PLAYER_ID) {
+			continue;
+		}
+		PointLight snowball;
+		snowball.position = flight_position(renderState.snowballs[i], SNOWBALL_GRAVITY, renderState.time);
+		snowball.radius = 6.0f;
+		snowball.colour = vec3(0.4f, 0.6f, 1.0f);
+		sceneLights.push_back(snowball);
+		glowing++;
+	}
+
+	for (int i = 0; i < LANTERN_COUNT; i++) {
+		PointLight lantern;
+		lantern.position = lanternPos[i];
+		lantern.position.v[1] += 0.1f * sin(lantern_time + i);  // gentle bob
+		lantern.radius = 4.0f;
+		lantern.colour = lanternColour[i] * (0.8f + 0.2f * sin(3.0f * lantern_time + 7.0f * i));
+		sceneLights.push_back(lantern);
+	}
+}
+
+// Random position in a ring between the world boundary and the far plane
+vec3 randomRingPosition(float inner, float outer) {
+	float angle = (rand() % 36000) * 0.01f * ONE_DEG_IN_RAD;
+	float dist = inner + (outer - inner) * (rand() % 10000) * 0.0001f;
+	return vec3(dist * sin(angle), 0.0f, dist * cos(angle));
+}
+
+// Trees are modelled z up, stand them up and scale them evenly
+int addTreeNode(vec3 position, float size) {
+	return add_scene_node(sceneGraph, -1, position, vec3(-90.0f, 0.0f, 0.0f), vec3(size, size, size));
+}
+
+// A snowman body with its right and left arm as the next two nodes. The arms
+// only carry the shoulder offset and scale, their swing is an instance parameter.
+int addSnowmanNodes(vec3 position) {
+	int body = add_scene_node(sceneGraph, -1, position, vec3(0.0f, 0.0f, 0.0f), vec3(1.0f, 1.0f, 1.0f));
+	add_scene_node(sceneGraph, body, vec3(0.8f, 2.5f, 0.0f), vec3(0.0f, 0.0f, 0.0f), vec3(0.2f, 0.2f, 0.2f));
+	add_scene_node(sceneGraph, body, vec3(-0.8f, 2.5f, 0.0f), vec3(0.0f, 0.0f, 0.0f), vec3(0.2f, 0.2f, 0.2f));
+	return body;
+}
+
+// Hash every entity a query matches at its position on the ground
+void buildCollisionGrid(SpatialHash& grid, const EntityQuery& query) {
+	begin_spatial_hash(grid);
+	for (size_t q = 0; q < query.archetypes.size(); q++) {
+		const Archetype& a = entityWorld.archetypes[query.archetypes[q]];
+		for (size_t i = 0; i < a.id.size(); i++) {
+			add_to_spatial_hash(grid, a.position[i].v[0], a.position[i].v[2], a.id[i]);
+		}
+	}
+	finish_spatial_hash(grid);
+}
+
+// A snowman within snowman_reach of p on the xz plane, or failing that a tree within tree_reach, other than ignore
+EntityId entityNear(const vec3& p, float snowman_reach, float tree_reach, EntityId ignore) {
+	EntityId snowman = first_in_spatial_hash(walkerGrid, p.v[0], p.v[2], snowman_reach, ignore);
+	if (snowman == ENTITY_NONE) {
+		snowman = first_in_spatial_hash(standingGrid, p.v[0], p.v[2], snowman_reach, ignore);
+	}
+	if (snowman != ENTITY_NONE) {
+		return snowman;
+	}
+	return first_in_spatial_hash(treeGrid, p.v[0], p.v[2], tree_reach, ignore);
+}
+
+// Where an entity's mesh is, placed the way its scene graph node places it
+mat4 entityModelMatrix(const Archetype& a, int row) {
+	float size = a.mesh[row].scale;
+	mat4 model = scale(identity_mat4(), vec3(size, size, size));
+	if (a.mesh[row].model == MODEL_TREE) {
+		model = rotate_x_deg(model, -90.0f);
+	}
+	if (a.mask & COMPONENT_ROTATION) {
+		model = rotate_y_deg(model, a.rotation[row]);
+	}
+	return translate(model, a.position[row]);
+}
+
+// The first snowman or tree other than ignore that a ball of radius touches flying from start
+// to end, where it touches and how far along (0 to 1) the flight
+EntityId snowballHit(vec3 start, vec3 end, float radius, EntityId ignore, vec3& contact, float& when) {
+	vec3 middle = (start + end) * 0.5f;
+	float reach = SNOWBALL_REACH + xz_length(end - start) * 0.5f + radius;
+	std::vector<EntityId>& candidates = snowballCandidates[job_worker_index()];
+	candidates.clear();
+	query_spatial_hash(walkerGrid, middle.v[0], middle.v[2], reach, candidates);
+	query_spatial_hash(standingGrid, middle.v[0], middle.v[2], reach, candidates);
+	query_spatial_hash(treeGrid, middle.v[0], middle.v[2], reach, candidates);
+	EntityId hit = ENTITY_NONE;
+	float first = 1.0f;
+	for (size_t i = 0; i < candidates.size(); i++) {
+		if (candidates[i] == ignore) {
+			continue;
+		}
+		int row;
+		const Archetype& a = entity_archetype(entityWorld, candidates[i], row);
+		const MeshBVH* bvh = a.mesh[row].model == MODEL_TREE ? treeBVH : snowmanBVH;
+		if (!bvh) {
+			continue;
+		}
+		mat4 model = entityModelMatrix(a, row);
+		BVHHit touch;
+		if (sweep_sphere_instance(*bvh, model, inverse(model), start, end, radius, touch) && touch.t <= first) {
+			first = touch.t;
+			hit = candidates[i];
+			contact = touch.point;
+		}
+	}
+	when = first;
+	return hit;
+}
+
+// The player is a sphere round their middle, a ball touches it at when (0 to 1) of its flight
+bool snowballHitsPlayer(vec3 start, vec3 end, float radius, float& when) {
+	vec3 middle = playerPosition;
+	middle.v[1] -= 0.8f;
+	vec3 d = end - start;
+	vec3 m = start - middle;
+	float reach = PLAYER_HIT_RADIUS + radius;
+	float a = dot(d, d), b = dot(m, d), c = dot(m, m) - reach * reach;
+	if (c <= 0.0f) {
+		when = 0.0f;
+		return true;
+	}
+	float disc = b * b - a * c;
+	if (b >= 0.0f || disc < 0.0f) {
+		return false;
+	}
+	when = (-b - sqrtf(disc)) / a;
+	return when <= 1.0f;
+}
+
+EntityId addTreeEntity(vec3 position, float size) {
+	EntityId tree = create_entity(entityWorld, COMPONENT_POSITION | COMPONENT_MESH);
+	int row;
+	Archetype& a = entity_archetype(entityWorld, tree, row);
+	a.position[row] = position;
+	a.mesh[row].model = MODEL_TREE;
+	a.mesh[row].scale = size;
+	return tree;
+}
+
+EntityId addSnowmanEntity(vec3 position, unsigned int components, EntityModel model, AIBehaviour behaviour) {
+	EntityId snowman = create_entity(entityWorld, COMPONENT_POSITION | COMPONENT_AI | COMPONENT_MESH | components);
+	int row;
+	Archetype& a = entity_archetype(entityWorld, snowman, row);
+	a.position[row] = position;
+	a.ai[row].behaviour = behaviour;
+	a.mesh[row].model = model;
+	return snowman;
+}
+
+// The trees and snowmen, plus the forest and crowd out past the world boundary
+void initEntities() {
+	clear_entity_world(entityWorld);
+	addTreeEntity(vec3(5.0f, 0.0f, -4.0f), 2.0f);
+	addTreeEntity(vec3(7.0f, 0.0f, 8.0f), 2.5f);
+	addTreeEntity(vec3(-5.0f, 0.0f, 8.0f), 2.5f);
+	for (int i = 0; i < forestTreeCount; i++) {
+		addTreeEntity(randomRingPosition(55.0f, 190.0f), 2.0f + (rand() % 100) * 0.01f);
+	}
+
+	// Snowman 1 marches and spins, snowman 2 stands about, both run when hit. Snowman 3 has no arms and never moves.
+	unsigned int walker = COMPONENT_ROTATION | COMPONENT_VELOCITY;
+	int row;
+	EntityId snowman1 = addSnowmanEntity(vec3(-10.0f, 0.0f, -10.0f), walker, MODEL_ARMED_SNOWMAN, AI_MARCH);
+	entity_archetype(entityWorld, snowman1, row).ai[row].flees = true;
+	entity_archetype(entityWorld, snowman1, row).ai[row].spin = 0.1f;
+	EntityId snowman2 = addSnowmanEntity(vec3(-5.0f, 0.0f, -10.0f), walker, MODEL_ARMED_SNOWMAN, AI_STAND);
+	entity_archetype(entityWorld, snowman2, row).ai[row].flees = true;
+	addSnowmanEntity(vec3(10.0f, 0.0f, 10.0f), 0, MODEL_SNOWMAN, AI_STAND);
+	for (int i = 0; i < crowdSnowmanCount; i++) {
+		EntityId member = addSnowmanEntity(randomRingPosition(55.0f, 190.0f), 0, MODEL_ARMED_SNOWMAN, AI_STAND);
+		entity_archetype(entityWorld, member, row).ai[row].wave_phase = (float)(rand() % 180);
+	}
+
+	create_entity_query(walkerQuery, COMPONENT_POSITION | COMPONENT_VELOCITY | COMPONENT_AI, 0);
+	create_entity_query(spinnerQuery, COMPONENT_ROTATION | COMPONENT_AI, 0);
+	create_entity_query(standingQuery, COMPONENT_POSITION | COMPONENT_AI, COMPONENT_VELOCITY);
+	create_entity_query(treeQuery, COMPONENT_POSITION, COMPONENT_AI);
+	create_entity_query(movingMeshQuery, COMPONENT_POSITION | COMPONENT_ROTATION | COMPONENT_MESH, 0);
+	create_entity_query(throwerQuery, COMPONENT_POSITION | COMPONENT_AI | COMPONENT_MESH, 0);
+	EntityQuery* queries[6] = { &walkerQuery, &spinnerQuery, &standingQuery, &treeQuery, &movingMeshQuery, &throwerQuery };
+	for (int i = 0; i < 6; i++) {
+		refresh_entity_query(*queries[i], entityWorld);
+	}
+	create_spatial_hash(walkerGrid, COLLISION_CELL_SIZE);
+	create_spatial_hash(standingGrid, COLLISION_CELL_SIZE);
+	create_spatial_hash(treeGrid, COLLISION_CELL_SIZE);
+	buildCollisionGrid(walkerGrid, walkerQuery);
+	buildCollisionGrid(standingGrid, standingQuery);
+	buildCollisionGrid(treeGrid, treeQuery);
+}
+
+// Every object that display() places, built depth-first once
+void initSceneGraph() {
+	clear_scene_graph(sceneGraph);
+	groundNode = add_scene_node(sceneGraph, -1, vec3(0.0f, 1.5f, 0.0f), vec3(-90.0f, 0.0f, 0.0f), vec3(30.0f, 30.0f, 15.0f));
+
+	// A node, or a body and two arms, for every entity with a mesh
+	treeNodes.clear();
+	snowmanNodes.clear();
+	armedSnowmanNodes.clear();
+	armedSnowmanPhase.clear();
+	armedSnowmanFlees.clear();
+	EntityQuery meshes;
+	create_entity_query(meshes, COMPONENT_POSITION | COMPONENT_MESH, 0);
+	refresh_entity_query(meshes, entityWorld);
+	for (size_t q = 0; q < meshes.archetypes.size(); q++) {
+		Archetype& a = entityWorld.archetypes[meshes.archetypes[q]];
+		for (size_t i = 0; i < a.id.size(); i++) {
+			MeshComponent& mesh = a.mesh[i];
+			if (mesh.model == MODEL_TREE) {
+				mesh.node = addTreeNode(a.position[i], mesh.scale);
+				treeNodes.push_back(mesh.node);
+			}
+			else if (mesh.model == MODEL_ARMED_SNOWMAN) {
+				mesh.node = addSnowmanNodes(a.position[i]);
+				snowmanNodes.push_back(mesh.node);
+				armedSnowmanNodes.push_back(mesh.node);
+				bool has_ai = (a.mask & COMPONENT_AI) != 0;
+				armedSnowmanPhase.push_back(has_ai ? a.ai[i].wave_phase : 0.0f);
+				armedSnowmanFlees.push_back(has_ai && a.ai[i].flees);
+			}
+			else {
+				mesh.node = add_scene_node(sceneGraph, -1, a.position[i], vec3(0.0f, 0.0f, 0.0f), vec3(mesh.scale, mesh.scale, mesh.scale));
+				snowmanNodes.push_back(mesh.node);
+			}
+		}
+	}
+
+	logsNode = add_scene_node(sceneGraph, -1, vec3(0.0f, 0.5f, 0.0f), vec3(-90.0f, 0.0f, 0.0f), vec3(0.7f, 0.7f, 0.7f));
+	// the flame's flicker scales it along the world axes after it has been tilted, so the tilt is a child
+	flameNode = add_scene_node(sceneGraph, -1, vec3(0.0f, 1.0f, 0.0f), vec3(0.0f, 0.0f, 0.0f), vec3(0.7f, 0.7f, 0.7f));
+	flameShapeNode = add_scene_node(sceneGraph, flameNode, vec3(0.0f, 0.0f, 0.0f), vec3(-45.0f, 0.0f, 35.0f), vec3(1.0f, 1.0f, 1.0f));
+	skyboxNode = add_scene_node(sceneGraph, -1, vec3(cameraPosition.v[0], 20.0f, cameraPosition.v[2]), vec3(90.0f, 0.0f, 0.0f), vec3(100.0f, 100.0f, 100.0f));
+	update_scene_graph(sceneGraph);
+}
+
+// Tree instances are static, build them once
+void initTreeInstances() {
+	clear_instances(treeBatch);
+	for (size_t i = 0; i < treeNodes.size(); i++) {
+		add_instance(treeBatch, sceneGraph.world[treeNodes[i]]);
+	}
+}
+
+// Ground, logs and every tree merged into world space buffers, once the scene graph has placed them
+void initStaticBatch() {
+	create_static_batch(staticBatch, STATIC_CELL_SIZE);
+	add_static_mesh(staticBatch, meshPool, poolMeshForVAO[GROUND_ID], sceneGraph.world[groundNode], GROUND_TEX_ID, MATERIAL_NO_SPECULAR);
+	add_static_mesh(staticBatch, meshPool, poolMeshForVAO[FIRELOGS_ID], sceneGraph.world[logsNode], SNOWMAN_ARM_TEX_ID, 0);
+	for (size_t i = 0; i < treeNodes.size(); i++) {
+		add_static_mesh(staticBatch, meshPool, poolMeshForVAO[TREE_ID], sceneGraph.world[treeNodes[i]], TREE_TEX_ID, 0);
+	}
+	build_static_batch(staticBatch, meshPool, shaderProgramID, depthProgramID);
+}
+
+// Ground, logs and trees cast into the cached layers, they never move
+void initShadowCasters() {
+	InstanceData instance;
+	instance.params[0] = instance.params[1] = instance.params[2] = instance.params[3] = 0.0f;
+	clear_shadow_casters(staticCasters);
+	memcpy(instance.model, sceneGraph.world[groundNode].m, sizeof(instance.model));
+	add_shadow_caster(staticCasters, meshPool, poolMeshForVAO[GROUND_ID], instance);
+	memcpy(instance.model, sceneGraph.world[logsNode].m, sizeof(instance.model));
+	add_shadow_caster(staticCasters, meshPool, poolMeshForVAO[FIRELOGS_ID], instance);
+	for (size_t i = 0; i < treeBatch.instances.size(); i++) {
+		add_shadow_caster(staticCasters, meshPool, poolMeshForVAO[TREE_ID], treeBatch.instances[i]);
+	}
+}
+
+// Snowmen, their arms and the snowballs are cast again every frame
+void collectDynamicCasters() {
+	clear_shadow_casters(dynamicCasters);
+	InstanceBatch* batches[3] = { &snowmanBatch, &armBatch, &snowballBatch };
+	for (int b = 0; b < 3; b++) {
+		int mesh = poolMeshForVAO[batches[b]->vao];
+		for (size_t i = 0; i < batches[b]->instances.size(); i++) {
+			add_shadow_caster(dynamicCasters, meshPool, mesh, batches[b]->instances[i]);
+		}
+	}
+}
+
+// Emitter with every range set, the caller fills in the rest
+ParticleEmitter makeEmitter(vec3 position, vec3 spread, vec3 velocity, vec3 velocity_spread, float life_min, float life_max, float size_min, float size_max, float rate) {
+	ParticleEmitter emitter;
+	emitter.position = position;
+	emitter.spread = spread;
+	emitter.velocity = velocity;
+	emitter.velocity_spread = velocity_spread;
+	emitter.life_min = life_min;
+	emitter.life_max = life_max;
+	emitter.size_min = size_min;
+	emitter.size_max = size_max;
+	emitter.rate = rate;
+	emitter.accumulator = 0.0f;
+	return emitter;
+}
+
+// Fire pools start empty and fill from their emitters, the snow box is filled once
+void initParticles() {
+	// flame: rises, slows down and shrinks as it cools
+	create_particle_pool(flameParticles, 1024);
+	flameParticles.gravity = vec3(0.0f, 1.0f, 0.0f);
+	flameParticles.drag = 1.0f;
+	flameParticles.colour_start = vec4(1.0f, 0.75f, 0.3f, 0.9f);
+	flameParticles.colour_end = vec4(0.9f, 0.15f, 0.0f, 0.0f);
+	flameParticles.size_growth = -0.5f;
+	flameParticles.blend = PARTICLE_BLEND_ADD;
+	flameEmitter = makeEmitter(vec3(0.0f, 0.9f, 0.0f), vec3(0.3f, 0.05f, 0.3f), vec3(0.0f, 1.2f, 0.0f), vec3(0.2f, 0.3f, 0.2f), 0.4f, 0.9f, 0.12f, 0.25f, 400.0f);
+
+	// embers: thrown up fast, then fall back
+	create_particle_pool(emberParticles, 256);
+	emberParticles.gravity = vec3(0.0f, -1.5f, 0.0f);
+	emberParticles.drag = 0.3f;
+	emberParticles.colour_start = vec4(1.0f, 0.6f, 0.2f, 1.0f);
+	emberParticles.colour_end = vec4(1.0f, 0.2f, 0.0f, 0.0f);
+	emberParticles.blend = PARTICLE_BLEND_ADD;
+	emberEmitter = makeEmitter(vec3(0.0f, 0.9f, 0.0f), vec3(0.3f, 0.1f, 0.3f), vec3(0.0f, 2.5f, 0.0f), vec3(0.6f, 0.8f, 0.6f), 1.0f, 2.5f, 0.02f, 0.04f, 25.0f);
+
+	// smoke: drifts off with the wind, spreading out as it fades
+	create_particle_pool(smokeParticles, 512);
+	smokeParticles.gravity = vec3(0.15f, 0.1f, 0.0f);
+	smokeParticles.drag = 0.2f;
+	smokeParticles.colour_start = vec4(0.25f, 0.25f, 0.25f, 0.35f);
+	smokeParticles.colour_end = vec4(0.6f, 0.6f, 0.6f, 0.0f);
+	smokeParticles.size_growth = 2.0f;
+	smokeParticles.blend = PARTICLE_BLEND_ALPHA;
+	smokeEmitter = makeEmitter(vec3(0.0f, 1.8f, 0.0f), vec3(0.2f, 0.2f, 0.2f), vec3(0.0f, 0.8f, 0.0f), vec3(0.2f, 0.1f, 0.2f), 3.0f, 5.0f, 0.3f, 0.5f, 30.0f);
+
+	// snow: never dies, wraps around the box instead
+	create_particle_pool(snowParticles, snowParticleCount);
+	snowParticles.wrap = true;
+	snowParticles.wrap_size = vec3(SNOW_BOX_SIZE, SNOW_BOX_HEIGHT, SNOW_BOX_SIZE);
+	snowParticles.colour_start = snowParticles.colour_end = vec4(0.95f, 0.95f, 1.0f, 1.0f);
+	vec3 box_center(cameraPosition.v[0], SNOW_BOX_HEIGHT * 0.5f, cameraPosition.v[2]);
+	ParticleEmitter snow = makeEmitter(box_center, snowParticles.wrap_size * 0.5f, vec3(0.3f, -1.5f, 0.1f), vec3(0.3f, 0.5f, 0.3f), 0.0f, 0.0f, 0.02f, 0.04f, 0.0f);
+	fill_particles(snowParticles, snow, snowParticleCount);
+
+	ParticlePool* pools[4] = { &flameParticles, &emberParticles, &smokeParticles, &snowParticles };
+	for (int i = 0; i < 4; i++) {
+		create_particle_buffers(*pools[i]);
+	}
+}
+
+// Two arm instances per armed snowman, waving out of step by their phase. The ones that flee throw their arms up while scared.
+void addArmInstances(InstanceBatch& arms, float angle, bool scared) {
+	for (size_t i = 0; i < armedSnowmanNodes.size(); i++) {
+		// same 0..90 degree back and forth as armAngle, shifted by the phase
+		float wave = fmod(angle + armedSnowmanPhase[i], 180.0f);
+		if (wave > 90.0f) {
+			wave = 180.0f - wave;
+		}
+		int node = armedSnowmanNodes[i];
+		bool flee = scared && armedSnowmanFlees[i];
+		add_instance(arms, sceneGraph.world[node + 1], flee ? 330 - wave : 90 - wave);
+		add_instance(arms, sceneGraph.world[node + 2], flee ? 240 + wave : wave);
+	}
+}
+
+// Copy the simulation's state into a snapshot, reusing its arrays
+void captureSimulationState(SimulationState& state) {
+	state.time = simulationTime;
+	state.armAngle = armAngle;
+	state.fireValue = fire_value;
+	state.lanternTime = lanternTime;
+	state.cameraPosition = playerPosition;
+	state.cameraRotation = playerRotation;
+	state.fleeing = fleeing;
+	capture_projectile_flights(snowballs, state.snowballs);
+	state.moverNodes.clear();
+	state.moverPositions.clear();
+	state.moverRotations.clear();
+	for (size_t q = 0; q < movingMeshQuery.archetypes.size(); q++) {
+		const Archetype& a = entityWorld.archetypes[movingMeshQuery.archetypes[q]];
+		for (size_t i = 0; i < a.id.size(); i++) {
+			state.moverNodes.push_back(a.mesh[i].node);
+		}
+		state.moverPositions.insert(state.moverPositions.end(), a.position.begin(), a.position.end());
+		state.moverRotations.insert(state.moverRotations.end(), a.rotation.begin(), a.rotation.end());
+	}
+}
+
+vec3 blendVec3(vec3 a, vec3 b, float t) {
+	return a + (b - a) * t;
+}
+
+void blendSimulationStates(const SimulationState& a, const SimulationState& b, float t, SimulationState& state) {
+	state.time = a.time + (b.time - a.time) * t;
+	state.armAngle = a.armAngle + (b.armAngle - a.armAngle) * t;
+	state.fireValue = a.fireValue + (b.fireValue - a.fireValue) * t;
+	state.lanternTime = a.lanternTime + (b.lanternTime - a.lanternTime) * t;
+	// The camera and the switches follow the latest tick, stepping keys should not lag
+	state.cameraPosition = b.cameraPosition;
+	state.cameraRotation = b.cameraRotation;
+	state.fleeing = b.fleeing;
+	// snowballs need no blending, their arcs give where they are at the blended time
+	state.snowballs = b.snowballs;
+	// Movers line up unless an entity came or went during the tick, then there is nothing to blend from
+	state.moverNodes = b.moverNodes;
+	state.moverPositions = b.moverPositions;
+	state.moverRotations = b.moverRotations;
+	if (a.moverNodes == b.moverNodes) {
+		for (size_t i = 0; i < state.moverNodes.size(); i++) {
+			state.moverPositions[i] = blendVec3(a.moverPositions[i], b.moverPositions[i], t);
+			state.moverRotations[i] = a.moverRotations[i] + (b.moverRotations[i] - a.moverRotations[i]) * t;
+		}
+	}
+}
+
+// Facing of a camera turned by rotation about y
+vec3 cameraDirectionFor(GLfloat rotation) {
+	return vec3(sin(rotation), 0.0f, cos(rotation));
+}
+
+// Where the player throws from, down and left a bit relative to the camera direction
+vec3 heldSnowballPosition(vec3 position, const vec3& direction) {
+	position.v[1] = position.v[1] - 0.3;
+	position.v[0] = position.v[0] - 0.4*direction.v[2];  // x1' = x1 + y2
+	position.v[2] = position.v[2] + 0.4*direction.v[0];  // y1' = y1 - x2
+	return position;
+}
+
+// Move the nodes that can change to where the simulation put them, blended between ticks
+void updateSceneNodes() {
+	for (size_t i = 0; i < renderState.moverNodes.size(); i++) {
+		set_node_translation(sceneGraph, renderState.moverNodes[i], renderState.moverPositions[i]);
+		set_node_rotation(sceneGraph, renderState.moverNodes[i], vec3(0.0f, renderState.moverRotations[i], 0.0f));
+	}
+	float fire = renderState.fireValue;
+	set_node_scale(sceneGraph, flameNode, vec3(0.7f + (0.7f * fire / 3.0f), 0.7f * fire, 0.7f + (0.7f * fire / 3.0f)));
+	set_node_translation(sceneGraph, skyboxNode, vec3(cameraPosition.v[0], 20.0f, cameraPosition.v[2]));
+	update_scene_graph(sceneGraph);
+}
+
+
+// Opaque draws go through the compute shader cull instead of the CPU tests
+bool gpuCullingActive() {
+	return useMultiDrawIndirect && useGPUCulling;
+}
+
+// Queue a draw of a whole mesh, depth is taken from the model's origin in view space
+void submitDraw(mat4& view, GLuint vao, int vertex_count, GLuint texture, unsigned int material, const mat4& model, RenderLayer layer = RENDER_LAYER_OPAQUE) {
+	// The sky surrounds the camera, everything else is skipped if it is out of view
+	if (useFrustumCulling && layer != RENDER_LAYER_SKY && !gpuCullingActive()) {
+		cullStats.tested++;
+		if (!sphere_in_frustum(viewFrustum, transform_sphere(boundsForVAO[vao], model))) {
+			return;
+		}
+		cullStats.visible++;
+	}
+	if (useMultiDrawIndirect && layer == RENDER_LAYER_OPAQUE) {
+		InstanceData instance;
+		memcpy(instance.model, model.m, sizeof(instance.model));
+		instance.params[0] = instance.params[1] = instance.params[2] = instance.params[3] = 0.0f;
+		add_indirect_draw(indirectFrame, meshPool, poolMeshForVAO[vao], layerForTexture[texture], material, &instance, 1);
+		return;
+	}
+	vec4 origin_eye = view * vec4(model.m[12], model.m[13], model.m[14], 1.0f);
+	DrawPacket packet;
+	packet.program = shaderProgramID;
+	packet.texture = texture;
+	packet.vao = vao;
+	packet.depth_vao = depthVAOForVAO[vao];
+	packet.first = 0;
+	packet.count = vertex_count;
+	packet.indexed = false;
+	packet.instance_count = 0;
+	packet.first_instance = 0;
+	packet.depth = -origin_eye.v[2];
+	packet.transform = push_transform(renderQueue, model);
+	packet.material = material;
+	packet.layer = layer;
+	submit_packet(renderQueue, packet);
+}
+
+
+// Print the per-frame counters roughly once a second
+void printFrameStats() {
+	static pacing_clock::time_point last_print;
+	pacing_clock::time_point now = pacing_clock::now();
+	if (std::chrono::duration<double, std::milli>(now - last_print).count() < 1000.0) {
+		return;
+	}
+	last_print = now;
+	GLStateCounters gl_calls = gls_last_frame();
+	printf("frame: %d packets, %d/%d state changes sorted/unsorted, GL state calls %d issued %d elided, %d lights visible, %d indirect draws\n",
+		renderQueue.stats.packets, renderQueue.stats.state_changes, renderQueue.stats.state_changes_unsorted,
+		gl_calls.issued, gl_calls.elided, lightGrid.lights_visible, (int)indirectFrame.commands.size());
+	printf("scene graph: %d of %d world matrices recomputed\n", sceneGraph.recomputed, (int)sceneGraph.world.size());
+	if (fragmentQueriesSupported) {
+		printf("fragments: %llu shader invocations, depth pre-pass %s\n", (unsigned long long)fragmentInvocations, useDepthPrepass ? "on" : "off");
+	}
+	if (frameCapture.active) {
+		const CaptureStats& cap = frameCapture.stats;
+		printf("capture: %d frames, %.3f ms per frame on the render thread (%.3f max), %d fence waits, %d queue waits\n",
+			cap.frames, cap.frames > 0 ? cap.total_ms / cap.frames : 0.0, cap.max_ms, cap.fence_waits, cap.queue_waits);
+	}
+	if (useDynamicResolution) {
+		printf("dynamic resolution: %dx%d (%.0f%% of the pixels), GPU %.2f ms for a %.2f ms target\n",
+			dynamicRes.width, dynamicRes.height, 100.0f * dynamicRes.width * dynamicRes.height / (width * height), dynamicRes.gpu_ms, dynamicRes.target_ms);
+	}
+	const WorldSnapshot& latest = snapshots[triple_buffer_read_slot(snapshotBuffer)];
+	printf("simulation: %.0f Hz %s, tick %d took %.3f ms (%.3f rehashing), drawn %.2f of the way to it, %d entities in %d archetypes\n",
+		simulationHz, useSimulationThread ? "on its own thread" : "inline", latest.tick, latest.step_ms, latest.broadphase_ms, simulationAlpha, latest.entities, latest.archetypes);
+	printf("snowballs: %d in the air, %d thrown, %d hits (%d on you), %d fell, %d refused for room, swept in %.3f ms\n",
+		latest.snowballs, latest.snowballs_launched, latest.snowball_hits, latest.player_hits, latest.snowballs_fell, latest.snowballs_refused, latest.snowball_ms);
+	printf("jobs: %d workers, %d jobs in the last tick, %d of them stolen\n", simulationJobs.worker_count, latest.jobs_run, latest.jobs_stolen);
+	if (framePacer.period_ms > 0.0 || framePacer.vsync) {
+		FramePacingStats pacing = frame_pacing_stats(framePacer);
+		printf("pacing: %.2f ms frames (target %.2f), %.3f ms jitter, started %.3f ms late on average (%.3f max), %.0f%% asleep\n",
+			pacing.interval_avg_ms, framePacer.period_ms, pacing.interval_jitter_ms, pacing.late_avg_ms, pacing.late_max_ms, 100.0 * pacing.sleep_fraction);
+	}
+	if (useShadows) {
+		printf("shadows: %d of %d cascades redrawn, %d static and %d dynamic casters drawn\n",
+			shadows.static_renders, SHADOW_CASCADES, shadows.static_drawn, shadows.dynamic_drawn);
+	}
+	if (useParticles) {
+		printf("particles: %d flame, %d embers, %d smoke, %d snow, update %.3f ms\n",
+			flameParticles.count, emberParticles.count, smokeParticles.count, snowParticles.count,
+			flameParticles.update_ms + emberParticles.update_ms + smokeParticles.update_ms + snowParticles.update_ms);
+	}
+	if (useStaticBatching) {
+		printf("static batching: %d of %d cells drawn, %d vertices merged\n", staticCellsDrawn, (int)staticBatch.draws.size(), staticBatch.vertex_count);
+	}
+	else if (useImpostors) {
+		int fading = (int)treeSplit.meshes.size() - treeSplit.near_count;
+		printf("trees: %d meshes, %d fading, %d impostors past %.0f\n",
+			treeSplit.near_count, fading, (int)treeSplit.impostors.size() - fading, impostorDistance);
+	}
+	if (gpuCullingActive()) {
+		printf("gpu culling: %d of %d instances drawn%s\n", gpuCuller.visible, gpuCuller.submitted, useHiZ ? " (Hi-Z on)" : "");
+	}
+	else if (useFrustumCulling) {
+		double us = cullStats.kernel_ms * 1000.0;
+		printf("culling: %d visible, %d culled, kernel %.3f ms (%.0f spheres/us)\n",
+			cullStats.visible, cullStats.tested - cullStats.visible, cullStats.kernel_ms, us > 0.0 ? cullStats.tested / us : 0.0);
+		if (useOcclusionCulling) {
+			const OcclusionStats& occ = occlusionBuffer.stats;
+			printf("occlusion: %d occluders, %d triangles, raster %.3f ms, %d of %d occluded\n",
+				occ.occluders, occ.triangles, occ.raster_ms, occ.occluded, occ.tested);
+		}
+	}
+}
+
+// Draw the occluder stand-ins of every tree and snowman near the camera, plus the ground
+void renderOccluders(const mat4& view_proj, const mat4& ground_matrix) {
+	begin_occlusion_frame(occlusionBuffer, view_proj);
+	add_occluder(occlusionBuffer, groundOccluder, ground_matrix);
+	InstanceBatch* batches[2] = { &treeBatch, &snowmanBatch };
+	OccluderMesh* meshes[2] = { &treeOccluder, &snowmanOccluder };
+	for (int b = 0; b < 2; b++) {
+		const InstanceBatch& batch = *batches[b];
+		for (size_t i = 0; i < batch.instances.size(); i++) {
+			BoundingSphere sphere = sphere_at(batch.bounds, (int)i);
+			vec3 offset = sphere.center - cameraPosition;
+			if (dot(offset, offset) > OCCLUDER_DISTANCE * OCCLUDER_DISTANCE || !sphere_in_frustum(viewFrustum, sphere)) {
+				continue;
+			}
+			mat4 model;
+			memcpy(model.m, batch.instances[i].model, sizeof(model.m));
+			add_occluder(occlusionBuffer, *meshes[b], model);
+		}
+	}
+	rasterize_occluders(occlusionBuffer);
+}
+
+// Cull a batch against this frame's frustum and occlusion buffer, unless the GPU culls it
+void cullInstanced(InstanceBatch& batch) {
+	bool frustum = useFrustumCulling && !gpuCullingActive();
+	bool occlusion = frustum && useOcclusionCulling;
+	cull_instances(batch, frustum ? &viewFrustum : NULL, occlusion ? &occlusionBuffer : NULL, cullStats);
+}
+
+// Queue one draw of count uploaded instances of a batch, starting at first
+void submitInstanceRange(InstanceBatch& batch, GLuint program, GLuint texture, unsigned int material, int first, int count, RenderLayer layer) {
+	DrawPacket packet;
+	packet.program = program;
+	packet.texture = texture;
+	packet.vao = batch.vao;
+	packet.depth_vao = batch.depth_vao;
+	packet.first = 0;
+	packet.count = batch.vertex_count;
+	packet.indexed = false;
+	packet.instance_count = (GLsizei)count;
+	packet.first_instance = (GLuint)first;
+	packet.depth = 0.0f;  // spread all over the scene, no single depth
+	packet.transform = 0;
+	packet.material = material;
+	packet.layer = layer;
+	submit_packet(renderQueue, packet);
+}
+
+// Upload a batch if needed and queue one draw for all of its instances
+void submitInstanced(InstanceBatch& batch, GLuint texture, unsigned int material) {
+	cullInstanced(batch);
+	int count = drawn_instance_count(batch);
+	if (count == 0) {
+		return;
+	}
+	if (useMultiDrawIndirect) {
+		add_indirect_draw(indirectFrame, meshPool, poolMeshForVAO[batch.vao], layerForTexture[texture], material, drawn_instances(batch), count);
+		return;
+	}
+	upload_instances(batch);
+	submitInstanceRange(batch, shaderProgramID, texture, material, 0, count, RENDER_LAYER_OPAQUE);
+}
+
+// The merged static scenery, each cell and texture frustum culled as a whole
+void submitStaticScenery(mat4& view) {
+	staticCellsDrawn = 0;
+	if (staticBatch.draws.empty()) {
+		return;
+	}
+	unsigned int transform = push_transform(renderQueue, identity_mat4());
+	for (size_t i = 0; i < staticBatch.draws.size(); i++) {
+		const StaticBatchDraw& draw = staticBatch.draws[i];
+		if (useFrustumCulling) {
+			cullStats.tested++;
+			if (!sphere_in_frustum(viewFrustum, draw.bounds)) {
+				continue;
+			}
+			cullStats.visible++;
+		}
+		staticCellsDrawn++;
+		vec4 center_eye = view * vec4(draw.bounds.center, 1.0f);
+		DrawPacket packet;
+		packet.program = shaderProgramID;
+		packet.texture = draw.texture;
+		packet.vao = staticBatch.vao;
+		packet.depth_vao = staticBatch.depth_vao;
+		packet.first = (GLint)draw.first_index;
+		packet.count = (GLsizei)draw.index_count;
+		packet.indexed = true;
+		packet.instance_count = 0;
+		packet.first_instance = 0;
+		packet.depth = -center_eye.v[2];
+		packet.transform = transform;
+		packet.material = draw.material;
+		packet.layer = RENDER_LAYER_OPAQUE;
+		submit_packet(renderQueue, packet);
+	}
+}
+
+// Trees near the camera are drawn as meshes, far ones as impostors, and the
+// ones in between as both with a dithered cross-fade
+void submitTrees() {
+	if (!useImpostors) {
+		submitInstanced(treeBatch, TREE_TEX_ID, 0);
+		return;
+	}
+	cullInstanced(treeBatch);
+	split_impostor_instances(treeSplit, drawn_instances(treeBatch), drawn_instance_count(treeBatch), cameraPosition, impostorDistance, IMPOSTOR_FADE_BAND);
+	set_drawn_instances(treeBatch, treeSplit.meshes);
+	set_drawn_instances(impostorBatch, treeSplit.impostors);
+	int near_count = treeSplit.near_count;
+	int fading_count = (int)treeSplit.meshes.size() - near_count;
+	int impostor_count = (int)treeSplit.impostors.size();
+
+	// solid meshes go wherever the other opaques go, the fading ones always through the queue
+	if (useMultiDrawIndirect && near_count > 0) {
+		add_indirect_draw(indirectFrame, meshPool, poolMeshForVAO[TREE_ID], layerForTexture[TREE_TEX_ID], 0, &treeSplit.meshes[0], near_count);
+	}
+	if (near_count + fading_count > 0) {
+		upload_instances(treeBatch);
+	}
+	if (!useMultiDrawIndirect && near_count > 0) {
+		submitInstanceRange(treeBatch, shaderProgramID, TREE_TEX_ID, 0, 0, near_count, RENDER_LAYER_OPAQUE);
+	}
+	if (fading_count > 0) {
+		submitInstanceRange(treeBatch, ditherProgramID, TREE_TEX_ID, 0, near_count, fading_count, RENDER_LAYER_CUTOUT);
+	}
+	if (impostor_count > 0) {
+		upload_instances(impostorBatch);
+		submitInstanceRange(impostorBatch, impostorProgramID, treeImpostors.color_texture, 0, 0, impostor_count, RENDER_LAYER_CUTOUT);
+	}
+}
+
+// Count fragment shader invocations over the frame. Each frame reads the
+// result of the query issued the frame before, which is ready by then.
+void beginFragmentQuery() {
+	if (fragmentQueriesSupported) {
+		glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB, fragmentQueries[fragmentQueryIndex]);
+	}
+}
+
+void endFragmentQuery() {
+	if (!fragmentQueriesSupported) {
+		return;
+	}
+	glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS_ARB);
+	fragmentQueryIssued[fragmentQueryIndex] = true;
+	fragmentQueryIndex = 1 - fragmentQueryIndex;
+	if (fragmentQueryIssued[fragmentQueryIndex]) {
+		glGetQueryObjectui64v(fragmentQueries[fragmentQueryIndex], GL_QUERY_RESULT, &fragmentInvocations);
+	}
+}
+
+
+// The cluster lookup divides gl_FragCoord by the size the scene is drawn at
+void setRenderSize(int w, int h) {
+	if (w == renderWidth && h == renderHeight) {
+		return;
+	}
+	renderWidth = w;
+	renderHeight = h;
+	GLuint toonPrograms[4] = { shaderProgramID, mdiProgramID, ditherProgramID, impostorProgramID };
+	for (int i = 0; i < 4; i++) {
+		gls_use_program(toonPrograms[i]);
+		set_light_cluster_uniforms(toonPrograms[i], lightGrid, w, h);
+	}
+}
 
 void display(){
 
+	gls_begin_frame();
+	if (useDynamicResolution) {
+		begin_dynamic_resolution(dynamicRes);
+		setRenderSize(dynamicRes.width, dynamicRes.height);
+	}
+	else {
+		setRenderSize(width, height);
+	}
+
 	// tell GL to only draw onto a pixel if the shape is closer to the viewer
-	glEnable (GL_DEPTH_TEST); // enable depth-testing
-	glDepthFunc (GL_LESS); // depth-testing interprets a smaller value as "closer"
-	glClearColor (0.2f, 0.5f, 0.7f, 1.0f);
+	gls_enable (GL_DEPTH_TEST); // enable depth-testing
+	gls_depth_func (GL_LESS); // depth-testing interprets a smaller value as "closer"
+	gls_depth_mask (GL_TRUE); // the depth buffer is only cleared where it can be written
+	gls_clear_color (0.2f, 0.5f, 0.7f, 1.0f);
 	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glUseProgram (shaderProgramID);
+	beginFragmentQuery();
+	gls_use_program (shaderProgramID);
 
 	//Declare your uniform variables that will be used in your shader
-	int matrix_location = glGetUniformLocation (shaderProgramID, "model");
 	int view_mat_location = glGetUniformLocation (shaderProgramID, "view");
 	int proj_mat_location = glGetUniformLocation (shaderProgramID, "proj");
-	int texture_location = glGetUniformLocation(shaderProgramID, "tex");
-	int no_specular = glGetUniformLocation(shaderProgramID, "no_specular");
-	int no_diffuse = glGetUniformLocation(shaderProgramID, "no_diffuse");
-	int full_ambient = glGetUniformLocation(shaderProgramID, "full_ambient");
+
+	// Moving objects between the last two ticks of the latest snapshot. On its own
+	// thread the simulation runs a tick ahead, so the frame is drawn one tick late.
+	const WorldSnapshot& snapshot = snapshots[triple_buffer_read_slot(snapshotBuffer)];
+	if (useSimulationThread) {
+		float since_tick = std::chrono::duration<float>(pacing_clock::now() - snapshot.tick_time).count();
+		simulationAlpha = since_tick * simulationHz;
+		simulationAlpha = simulationAlpha < 0.0f ? 0.0f : (simulationAlpha > 1.0f ? 1.0f : simulationAlpha);
+	}
+	blendSimulationStates(snapshot.previous, snapshot.current, simulationAlpha, renderState);
+	cameraPosition = renderState.cameraPosition;
+	camerarotationy = renderState.cameraRotation;
 
 	// Root of the Hierarchy
-	cameraDirection.v[0] = sin(camerarotationy);
-	cameraDirection.v[2] = cos(camerarotationy);
+	cameraDirection = cameraDirectionFor(camerarotationy);
 	mat4 view = look_at(cameraPosition, cameraPosition + cameraDirection, cameraUpVector);
 	mat4 persp_proj = perspective(45.0, (float)width/(float)height, 0.1, 200.0);
-	
 
 	glUniformMatrix4fv(proj_mat_location, 1, GL_FALSE, persp_proj.m);
 	glUniformMatrix4fv(view_mat_location, 1, GL_FALSE, view.m);
 
-	// GROUND 1 ------------------------
-	mat4 ground_matrix = identity_mat4 ();
-	ground_matrix = scale(ground_matrix, vec3(30.0, 30.0, 15.0));
-	ground_matrix = rotate_x_deg(ground_matrix, -90);
-	ground_matrix = translate(ground_matrix, vec3(0.0, 1.5, 0.0));
-	// update uniforms & draw
-	glUniformMatrix4fv (matrix_location, 1, GL_FALSE, ground_matrix.m);
-	glUniform1i(no_specular, 1);  // No specular component for ground
+	// The trees' dithered fade and impostors are queued with the same camera
+	GLuint cutoutPrograms[2] = { ditherProgramID, impostorProgramID };
+	for (int i = 0; i < 2; i++) {
+		gls_use_program(cutoutPrograms[i]);
+		glUniformMatrix4fv(glGetUniformLocation(cutoutPrograms[i], "proj"), 1, GL_FALSE, persp_proj.m);
+		glUniformMatrix4fv(glGetUniformLocation(cutoutPrograms[i], "view"), 1, GL_FALSE, view.m);
+	}
+	glUniform3fv(glGetUniformLocation(impostorProgramID, "camera_position"), 1, cameraPosition.v);
+	bind_impostor_atlas(treeImpostors);
+
+	// Every toon program samples the moon's shadow map, the cascades follow the camera
+	fit_shadow_cascades(shadows, view, 45.0f, (float)width / (float)height, 0.1f);
+	GLuint toonPrograms[4] = { shaderProgramID, mdiProgramID, ditherProgramID, impostorProgramID };
+	for (int i = 0; i < 4; i++) {
+		gls_use_program(toonPrograms[i]);
+		set_shadow_uniforms(shadows, toonPrograms[i], view, useShadows);
+	}
+	bind_shadow_map(shadows);
 
-	glBindTexture(GL_TEXTURE_2D, GROUND_TEX_ID);
-	glUniform1i(texture_location, 0);
+	// Planes for culling this frame's draws
+	mat4 view_proj = persp_proj * view;
+	viewFrustum = extract_frustum(view_proj);
+	cullStats.tested = cullStats.visible = 0;
+	cullStats.kernel_ms = 0.0;
 
-	glBindVertexArray(GROUND_ID);
-	glDrawArrays (GL_TRIANGLES, 0, ground_count);
+	// Bin this frame's lights into the cluster grid and hand it to the shader
+	collectSceneLights();
+	assign_lights_to_clusters(lightGrid, sceneLights, view, &renderJobs);
+	upload_light_clusters(lightGrid, sceneLights, lightClusterGPU);
+	bind_light_clusters(lightClusterGPU);
+
+	// Everything below is queued, then sorted by state and drawn in one go
+	// (or with multi-draw indirect on, the opaque part goes into indirectFrame)
+	clear_render_queue(renderQueue);
+	begin_indirect_frame(indirectFrame);
+
+	// World matrices of everything that moved since last frame
+	updateSceneNodes();
+
+	// GROUND 1 ------------------------
+	const mat4& ground_matrix = sceneGraph.world[groundNode];
+	if (!useStaticBatching) {
+		submitDraw(view, GROUND_ID, ground_count, GROUND_TEX_ID, MATERIAL_NO_SPECULAR, ground_matrix);  // No specular component for ground
+	}
 
 
 
@@ -445,41 +1526,8 @@ void display(){
 	//   /   \
 	//     |
 	// ----------------------------------------
-
-	//Declare your uniform variables that will be used in your shader
-	glBindTexture(GL_TEXTURE_2D, TREE_TEX_ID);
-	glUniform1i(texture_location, 0);
-
-	mat4 tree1_local = identity_mat4();
-	tree1_local = rotate_x_deg(tree1_local, -90);
-	tree1_local = scale(tree1_local, vec3(2.0, 2.0, 2.0));
-	tree1_local = translate(tree1_local, tree1Pos);
-	mat4 tree1_global = tree1_local;
-	// update uniforms & draw
-	glUniform1i(no_specular, 0);  // Specular component for rest of models
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, tree1_global.m);
-	glBindVertexArray(TREE_ID);
-	glDrawArrays(GL_TRIANGLES, 0, tree_vertex_count);
-
-	mat4 tree2_local = identity_mat4();
-	tree2_local = rotate_x_deg(tree2_local, -90);
-	tree2_local = scale(tree2_local, vec3(2.5, 2.5, 2.5));
-	tree2_local = translate(tree2_local, tree2Pos);
-	mat4 tree2_global = tree2_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, tree2_global.m);
-	glBindVertexArray(TREE_ID);
-	glDrawArrays(GL_TRIANGLES, 0, tree_vertex_count);
-
-	mat4 tree3_local = identity_mat4();
-	tree3_local = rotate_x_deg(tree3_local, -90);
-	tree3_local = scale(tree3_local, vec3(2.5, 2.5, 2.5));
-	tree3_local = translate(tree3_local, tree3Pos);
-	mat4 tree3_global = tree3_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, tree3_global.m);
-	glBindVertexArray(TREE_ID);
-	glDrawArrays(GL_TRIANGLES, 0, tree_vertex_count);
+	// Trees never move, their instances were built once in init() and are
+	// submitted with the snowmen once the occlusion buffer is ready
 	
 	// -----------------------------------------------------------
 	// SNOWMEN
@@ -487,60 +1535,22 @@ void display(){
 	//   ( )
 	//  (   )
 	// -----------------------------------------------------------
-	glBindTexture(GL_TEXTURE_2D, SNOWMAN_TEX_ID);
-	glUniform1i(texture_location, 0);
-
-	mat4 snowman1_local = identity_mat4();
-	snowman1_local = rotate_y_deg(snowman1_local, snowman1_rotationy);
-	snowman1_local = translate(snowman1_local,snowman1Pos);
-	mat4 snowman1_global = snowman1_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, snowman1_global.m);
-	glBindVertexArray(SNOWMAN_ID);
-	glDrawArrays(GL_TRIANGLES, 0, snowman_vertex_count);
-
-	mat4 snowman2_local = identity_mat4();
-	snowman2_local = translate(snowman2_local, snowman2Pos);
-	mat4 snowman2_global = snowman2_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, snowman2_global.m);
-	glDrawArrays(GL_TRIANGLES, 0, snowman_vertex_count);
-
-	mat4 snowman3_local = identity_mat4();
-	snowman3_local = translate(snowman3_local, snowman3Pos);
-	mat4 snowman3_global = snowman3_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, snowman3_global.m);
-	glDrawArrays(GL_TRIANGLES, 0, snowman_vertex_count);
+	clear_instances(snowmanBatch);
+	clear_instances(armBatch);
+	for (size_t i = 0; i < snowmanNodes.size(); i++) {
+		add_instance(snowmanBatch, sceneGraph.world[snowmanNodes[i]]);
+	}
 
 	// ------------------
-	// Snowball
+	// Snowballs
 	// 
 	//    o
 	// ------------------
-	mat4 snowball_local = identity_mat4();
-	snowball_local = scale(snowball_local, vec3(0.2, 0.2, 0.2));
-	snowball_local = translate(snowball_local, snowballPos);
-	mat4 snowball_global = snowball_local;
-	// update uniforms & draw
-	// Consider moving snowball logic to update loop, not draw loop
-	if (thrownSnowball == false) {
-		snowballPos = cameraPosition;
-		// Move snowball down and left a bit relative to camera direction
-		snowballPos.v[1] = snowballPos.v[1] - 0.3;
-		snowballPos.v[0] = snowballPos.v[0] - 0.4*cameraDirection.v[2];  // x1' = x1 + y2
-		snowballPos.v[2] = snowballPos.v[2] + 0.4*cameraDirection.v[0];  // y1' = y1 - x2
-	}
-	else if (snowballPos.v[1] > -1.0) {
-		snowballPos = snowballPos + snowballDir*0.01;
-		snowballDir.v[1] = snowballDir.v[1] - snowballGravity;  // Was changing snowball position
-		snowballGravity = snowballGravity + 0.000004f;
-		glUniformMatrix4fv(matrix_location, 1, GL_FALSE, snowball_global.m);
-		glBindVertexArray(SNOWBALL_ID);
-		glDrawArrays(GL_TRIANGLES, 0, snowball_vertex_count);
-	}
-	else {
-		thrownSnowball = false;
+	// Every one in the air, each where its arc is at the time being drawn
+	clear_instances(snowballBatch);
+	mat4 snowball_size = scale(identity_mat4(), vec3(0.2f, 0.2f, 0.2f));
+	for (size_t i = 0; i < renderState.snowballs.size(); i++) {
+		add_instance(snowballBatch, translate(snowball_size, flight_position(renderState.snowballs[i], SNOWBALL_GRAVITY, renderState.time)));
 	}
 	
 	// ------------------------
@@ -548,263 +1558,609 @@ void display(){
 	//  _____/_
 	//       \
 	// ------------------------
-	// ARMS FOR SNOWMAN 1
+	// The arm nodes follow their snowman, the arm's own rotate_x_deg is applied
+	// in the vertex shader from the instance parameters
+	// Snowmen 1 and 2 in step, the crowd waving out of step with each other
+	addArmInstances(armBatch, renderState.armAngle, renderState.fleeing);
+
+	// Everything that can hide something is placed, fill the occlusion buffer before culling against it
+	if (useFrustumCulling && useOcclusionCulling && !gpuCullingActive()) {
+		renderOccluders(view_proj, ground_matrix);
+	}
 
-	//Declare your uniform variables that will be used in your shader
-	glBindTexture(GL_TEXTURE_2D, SNOWMAN_ARM_TEX_ID);
-	glUniform1i(texture_location, 0);
+	// With static batching the ground, trees and logs all come from the merged cells
+	if (useStaticBatching) {
+		submitStaticScenery(view);
+	}
+	else {
+		submitTrees();
+	}
+	submitInstanced(snowmanBatch, SNOWMAN_TEX_ID, 0);
+	submitInstanced(armBatch, SNOWMAN_ARM_TEX_ID, 0);
+	// Snowballs are untextured, they keep the snowman texture they always inherited
+	submitInstanced(snowballBatch, SNOWMAN_TEX_ID, 0);
+
+	// Logs used to inherit the arm texture from the draw before them
+	if (!useStaticBatching) {
+		submitDraw(view, FIRELOGS_ID, firelogs_vertex_count, SNOWMAN_ARM_TEX_ID, 0, sceneGraph.world[logsNode]);
+	}
 
-	mat4 snowman_arm_11_local = identity_mat4();
-	if(fleeing)
-		snowman_arm_11_local = rotate_x_deg(snowman_arm_11_local, 330 - armAngle);
-	else
-		snowman_arm_11_local = rotate_x_deg(snowman_arm_11_local, 90 - armAngle);
-	snowman_arm_11_local = scale(snowman_arm_11_local, vec3(0.2, 0.2, 0.2));
-	snowman_arm_11_local = translate(snowman_arm_11_local, vec3(0.8f, 2.5f, 0.0f));
-	mat4 snowman_arm_11_global = snowman1_global * snowman_arm_11_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, snowman_arm_11_global.m);
-	glBindVertexArray(SNOWMAN_ARM_ID);
-	glDrawArrays(GL_TRIANGLES, 0, snowman_arm_vertex_count);
-
-	mat4 snowman_arm_12_local = identity_mat4();
-	if(fleeing)
-		snowman_arm_12_local = rotate_x_deg(snowman_arm_12_local, 240 + armAngle);
-	else
-		snowman_arm_12_local = rotate_x_deg(snowman_arm_12_local, armAngle);
-	snowman_arm_12_local = scale(snowman_arm_12_local, vec3(0.2, 0.2, 0.2));
-	snowman_arm_12_local = translate(snowman_arm_12_local, vec3(-0.8f, 2.5f, 0.0f));
-	mat4 snowman_arm_12_global = snowman1_global * snowman_arm_12_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, snowman_arm_12_global.m);
-	glBindVertexArray(SNOWMAN_ARM_ID);
-	glDrawArrays(GL_TRIANGLES, 0, snowman_arm_vertex_count);
-
-
-	// ARMS FOR SNOWMAN 2
-	mat4 snowman_arm_21_local = identity_mat4();
-	if (fleeing)
-		snowman_arm_21_local = rotate_x_deg(snowman_arm_21_local, 330 - armAngle);
-	else
-		snowman_arm_21_local = rotate_x_deg(snowman_arm_21_local, 90 - armAngle);
-	snowman_arm_21_local = scale(snowman_arm_21_local, vec3(0.2, 0.2, 0.2));
-	snowman_arm_21_local = translate(snowman_arm_21_local, vec3(0.8f, 2.5f, 0.0f));
-	mat4 snowman_arm_21_global = snowman2_global * snowman_arm_21_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, snowman_arm_21_global.m);
-	glBindVertexArray(SNOWMAN_ARM_ID);
-	glDrawArrays(GL_TRIANGLES, 0, snowman_arm_vertex_count);
-
-	mat4 snowman_arm_22_local = identity_mat4();
-	if (fleeing)
-		snowman_arm_22_local = rotate_x_deg(snowman_arm_22_local, 240 + armAngle);
-	else
-		snowman_arm_22_local = rotate_x_deg(snowman_arm_22_local, armAngle);
-	snowman_arm_22_local = scale(snowman_arm_22_local, vec3(0.2, 0.2, 0.2));
-	snowman_arm_22_local = translate(snowman_arm_22_local, vec3(-0.8f, 2.5f, 0.0f));
-	mat4 snowman_arm_22_global = snowman2_global * snowman_arm_22_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, snowman_arm_22_global.m);
-	glBindVertexArray(SNOWMAN_ARM_ID);
-	glDrawArrays(GL_TRIANGLES, 0, snowman_arm_vertex_count);
-
-	// Logs
-	mat4 logs_local = identity_mat4();
-	logs_local = rotate_x_deg(logs_local, -90);
-	logs_local = scale(logs_local, vec3(0.7, 0.7, 0.7));
-	logs_local = translate(logs_local, vec3(0, 0.5, 0));
-	mat4 logs_global = logs_local;
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, logs_global.m);
-	glBindVertexArray(FIRELOGS_ID);
-	glDrawArrays(GL_TRIANGLES, 0, firelogs_vertex_count);
-
-
-	// Flame
-	mat4 flame_local = identity_mat4();
-	flame_local = rotate_x_deg(flame_local, -45);
-	flame_local = rotate_z_deg(flame_local, 35);
-	flame_local = scale(flame_local, vec3(0.7 + (0.7 * fire_value / 3.0), 0.7 * fire_value, 0.7 + (0.7 * fire_value / 3.0)));
-	flame_local = translate(flame_local, vec3(0, 1.0, 0));
-	mat4 flame_global = flame_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, flame_global.m);
-
-	glBindTexture(GL_TEXTURE_2D, FIREFLAME_TEX_ID);
-	glUniform1i(texture_location, 0);
-
-	glUniform1i(no_specular, 1);  // No specular component for fire
-	glUniform1i(no_diffuse, 1);  // No diffuse for fire
-	glUniform1i(full_ambient, 1);
-
-	glBindVertexArray(FIREFLAME_ID);
-	glDrawArrays(GL_TRIANGLES, 0, fireflame_vertex_count);
-
-
-	mat4 skybox_local = identity_mat4();
-	skybox_local = scale(skybox_local, vec3(100.0, 100.0, 100.0));
-	skybox_local = rotate_x_deg(skybox_local, 90);
-	skybox_local = translate(skybox_local, vec3(cameraPosition.v[0], 20, cameraPosition.v[2]));
-
-	mat4 skybox_global = skybox_local;
-	// update uniforms & draw
-	glUniformMatrix4fv(matrix_location, 1, GL_FALSE, skybox_global.m);
-
-	glBindTexture(GL_TEXTURE_2D, SKYBOX_TEX_ID);
-	glUniform1i(texture_location, 0);
-
-	glBindVertexArray(SKYBOX_ID);
-	glDrawArrays(GL_TRIANGLES, 0, skybox_vertex_count);
-
-	glUniform1i(no_specular, 0);  // No specular component for fire
-	glUniform1i(no_diffuse, 0);  // No diffuse for fire
-	glUniform1i(full_ambient, 0);  // Full ambient reflection
-    glutSwapBuffers();
-}
-
-
-void updateScene() {	
-
-	// Placeholder code, if you want to work with framerate
-	// Wait until at least 16ms passed since start of last frame (Effectively caps framerate at ~60fps)
-	static DWORD  last_time = 0;
-	DWORD  curr_time = timeGetTime();
-	float  delta = (curr_time - last_time) * 0.001f;
-	if (delta > 0.03f)
-		delta = 0.03f;
-	last_time = curr_time;
+	// Flame, no specular or diffuse for fire, full ambient reflection (the particle flame replaces it)
+	if (!useParticles) {
+		submitDraw(view, FIREFLAME_ID, fireflame_vertex_count, FIREFLAME_TEX_ID, MATERIAL_NO_SPECULAR | MATERIAL_NO_DIFFUSE | MATERIAL_FULL_AMBIENT, sceneGraph.world[flameShapeNode]);
+	}
+
+	// Skybox was drawn straight after the fire so it kept the fire's lighting toggles
+	submitDraw(view, SKYBOX_ID, skybox_vertex_count, SKYBOX_TEX_ID, MATERIAL_NO_SPECULAR | MATERIAL_NO_DIFFUSE | MATERIAL_FULL_AMBIENT, sceneGraph.world[skyboxNode], RENDER_LAYER_SKY);
+
+	// Everything has been placed, bring the shadow map up to date before anything samples it
+	if (useShadows) {
+		collectDynamicCasters();
+		render_shadows(shadows, meshPool, staticCasters, dynamicCasters);
+	}
+
+	if (useMultiDrawIndirect) {
+		if (gpuCullingActive()) {
+			gpuCuller.use_hiz = useHiZ;
+			cull_indirect_frame(gpuCuller, indirectFrame, view_proj, viewFrustum, 0.1f);
+		}
+		else {
+			upload_indirect_frame(indirectFrame);
+		}
+		if (useDepthPrepass) {
+			gls_use_program(mdiDepthProgramID);
+			glUniformMatrix4fv(glGetUniformLocation(mdiDepthProgramID, "proj"), 1, GL_FALSE, persp_proj.m);
+			glUniformMatrix4fv(glGetUniformLocation(mdiDepthProgramID, "view"), 1, GL_FALSE, view.m);
+			gls_color_mask(GL_FALSE);
+			issue_indirect_frame(indirectFrame, meshPool.depth_vao);
+			gls_color_mask(GL_TRUE);
+			gls_depth_func(GL_EQUAL);
+			gls_depth_mask(GL_FALSE);
+		}
+		gls_use_program(mdiProgramID);
+		glUniformMatrix4fv(glGetUniformLocation(mdiProgramID, "proj"), 1, GL_FALSE, persp_proj.m);
+		glUniformMatrix4fv(glGetUniformLocation(mdiProgramID, "view"), 1, GL_FALSE, view.m);
+		issue_indirect_frame(indirectFrame, meshPool.vao);
+		// Next frame's occlusion test reads the opaque depth, taken before the sky is drawn
+		if (gpuCullingActive()) {
+			build_hiz(gpuCuller, renderWidth, renderHeight);
+		}
+	}
+
+	sort_render_queue(renderQueue);
+	// Opaques in the queue (everything when multi-draw indirect is off) get their own pre-pass
+	if (useDepthPrepass && !useMultiDrawIndirect) {
+		gls_use_program(depthProgramID);
+		glUniformMatrix4fv(glGetUniformLocation(depthProgramID, "proj"), 1, GL_FALSE, persp_proj.m);
+		glUniformMatrix4fv(glGetUniformLocation(depthProgramID, "view"), 1, GL_FALSE, view.m);
+		execute_depth_prepass(renderQueue, depthProgramID);
+	}
+	execute_render_queue(renderQueue);
+
+	// Particles after the scene: snow writes depth, the blended pools only test it
+	if (useParticles) {
+		gls_use_program(particleProgramID);
+		glUniformMatrix4fv(glGetUniformLocation(particleProgramID, "proj"), 1, GL_FALSE, persp_proj.m);
+		glUniformMatrix4fv(glGetUniformLocation(particleProgramID, "view"), 1, GL_FALSE, view.m);
+		draw_particles(snowParticles, particleProgramID);
+		draw_particles(smokeParticles, particleProgramID);
+		draw_particles(flameParticles, particleProgramID);
+		draw_particles(emberParticles, particleProgramID);
+	}
+	endFragmentQuery();
+	if (useDynamicResolution) {
+		end_dynamic_resolution(dynamicRes);
+	}
+
+	printFrameStats();
+	capture_frame(frameCapture);
+	if (!headlessMode) {
+		glutSwapBuffers();
+	}
+}
+
+
+// Snowballs begin to end of the pool swept from where they were to where they are now, each
+// recording what it hits first. Runs on any job worker, the hit ring takes events from them all.
+std::vector<char> snowballStruck;
+void sweepSnowballs(void*, int begin, int end) {
+	for (int i = begin; i < end; i++) {
+		vec3 from = vec3(snowballs.previous_x[i], snowballs.previous_y[i], snowballs.previous_z[i]);
+		vec3 to = vec3(snowballs.x[i], snowballs.y[i], snowballs.z[i]);
+		EntityId thrower = snowballs.owner[i];
+		HitEvent event;
+		float when, player_when;
+		event.target = snowballHit(from, to, snowballs.radius, thrower, event.point, when);
+		bool hit = event.target != ENTITY_NONE;
+		if (thrower != PLAYER_ID && snowballHitsPlayer(from, to, snowballs.radius, player_when) && (!hit || player_when < when)) {
+			event.target = PLAYER_ID;
+			event.point = from + (to - from) * player_when;
+			hit = true;
+		}
+		if (hit) {
+			event.thrower = thrower;
+			record_hit_event(hitEvents, event);
+		}
+		snowballStruck[i] = hit;
+	}
+}
+
+// Sweep every snowball in parallel, then take the ones that hit something out of the air.
+// Backwards, so the snowball moved into a removed one's row is one that hit nothing.
+void collideSnowballs() {
+	pacing_clock::time_point start = pacing_clock::now();
+	snowballStruck.resize(snowballs.count);
+	parallel_for(simulationJobs, snowballs.count, SNOWBALL_JOB_GRAIN, sweepSnowballs, NULL);
+	for (int i = snowballs.count - 1; i >= 0; i--) {
+		if (snowballStruck[i]) {
+			remove_projectile(snowballs, i);
+		}
+	}
+	snowballCollideMs = std::chrono::duration<double, std::milli>(pacing_clock::now() - start).count();
+}
+
+// The AI's side of the hits: the player hitting a snowman scares the snowmen, and a snowman
+// with arms throws back at whoever hit it
+void reactToHits() {
+	HitEvent event;
+	while (take_hit_event(hitEvents, event)) {
+		snowballHits++;
+		if (event.target == PLAYER_ID) {
+			playerHits++;
+			continue;
+		}
+		if (event.thrower == PLAYER_ID) {
+			printf("x: %f y: %f z: %f ", event.point.v[0], event.point.v[1], event.point.v[2]);
+		}
+		int row;
+		Archetype& a = entity_archetype(entityWorld, event.target, row);
+		if (!(a.mask & COMPONENT_AI)) {
+			continue;
+		}
+		if (event.thrower == PLAYER_ID) {
+			fleeing = true;
+		}
+		if (a.mesh[row].model == MODEL_ARMED_SNOWMAN) {
+			a.ai[row].retaliating = true;
+			a.ai[row].throw_at = event.thrower;
+		}
+	}
+}
+
+// Where to aim at someone, their middle rather than their feet or eyes
+vec3 snowballTarget(EntityId target) {
+	if (target == PLAYER_ID) {
+		return playerPosition - vec3(0.0f, 0.8f, 0.0f);
+	}
+	int row;
+	return entity_archetype(entityWorld, target, row).position[row] + vec3(0.0f, 1.5f, 0.0f);
+}
+
+// One archetype's rows for a parallel AI pass, and what the throwers decided
+enum ThrowDecision { THROW_NONE, THROW_MISSED, THROW_LAUNCH };
+struct ThrowOrder {
+	int decision;
+	vec3 hand, velocity;
+};
+struct AIPass {
+	Archetype* archetype;
+	float ticks, dt;
+	ThrowOrder* orders;  // a row each, throwers only
+};
+std::vector<AIPass> aiPasses;
+std::vector<ThrowOrder> throwOrders;
+
+// Each walker picks its velocity for this tick
+void walkerVelocities(void* data, int begin, int end) {
+	AIPass& pass = *(AIPass*)data;
+	Archetype& a = *pass.archetype;
+	for (int i = begin; i < end; i++) {
+		AIState& ai = a.ai[i];
+		vec3 away = a.position[i] - playerPosition;
+		away.v[1] = 0;  // Project to xz plane
+		vec3 velocity = vec3(0.0f, 0.0f, 0.0f);
+		if (ai.behaviour == AI_MARCH) {
+			if (xz_length(away) < 10.0) {
+				velocity = normalise(away) * 0.003;  // back away from the player
+			}
+			else {
+				velocity.v[2] = ai.march_forward ? 0.002f : -0.002f;
+				ai.march_distance += velocity.v[2] * pass.ticks;
+				if (ai.march_distance > 20) {
+					ai.march_forward = false;
+				}
+				if (ai.march_distance < 0) {
+					ai.march_forward = true;
+				}
+			}
+		}
+		if (fleeing && ai.flees) {
+			velocity = velocity + normalise(away) * 0.01;
+		}
+		a.velocity[i] = velocity;
+	}
+}
+
+// Walkers step unless that takes them into a tree, another snowman or over the world boundary.
+// Everyone is checked against the walker hash, where the others were at the start of the step.
+void walkerMoves(void* data, int begin, int end) {
+	AIPass& pass = *(AIPass*)data;
+	Archetype& a = *pass.archetype;
+	for (int i = begin; i < end; i++) {
+		vec3 moved = a.position[i] + a.velocity[i] * pass.ticks;
+		if (abs(moved.v[0]) > 50 || abs(moved.v[2]) > 50) {
+			continue;
+		}
+		if (entityNear(moved, 2.0f, 3.0f, a.id[i]) == ENTITY_NONE) {
+			a.position[i] = moved;
+		}
+	}
+}
+
+void spinSnowmen(void* data, int begin, int end) {
+	AIPass& pass = *(AIPass*)data;
+	Archetype& a = *pass.archetype;
+	for (int i = begin; i < end; i++) {
+		a.rotation[i] += a.ai[i].spin * pass.ticks;
+	}
+}
+
+// Snowmen with arms throw back at whoever hit them, and in a snowball fight the ones standing
+// about throw at the nearest other snowman standing about, each once its cooldown is over.
+// Only decides, the pool is filled afterwards on one thread.
+void decideThrows(void* data, int begin, int end) {
+	AIPass& pass = *(AIPass*)data;
+	Archetype& a = *pass.archetype;
+	for (int i = begin; i < end; i++) {
+		AIState& ai = a.ai[i];
+		ThrowOrder& order = pass.orders[i];
+		order.decision = THROW_NONE;
+		if (a.mesh[i].model != MODEL_ARMED_SNOWMAN) {
+			continue;
+		}
+		ai.throw_cooldown -= pass.dt;
+		if (ai.throw_cooldown > 0.0f) {
+			continue;
+		}
+		EntityId target = ENTITY_NONE;
+		bool aimed = false;
+		if (ai.retaliating) {
+			ai.retaliating = false;
+			target = ai.throw_at;
+			aimed = target == PLAYER_ID || entity_alive(entityWorld, target);
+		}
+		else if (snowballFight && !(a.mask & COMPONENT_VELOCITY)) {
+			target = nearest_in_spatial_hash(standingGrid, a.position[i].v[0], a.position[i].v[2], SNOWBALL_FIGHT_RANGE, a.id[i], NULL);
+			aimed = target != ENTITY_NONE;
+		}
+		if (!aimed) {
+			continue;
+		}
+		order.hand = a.position[i] + vec3(0.0f, SNOWMAN_HAND_HEIGHT, 0.0f);
+		bool reaches = aim_projectile(order.hand, snowballTarget(target), SNOWBALL_SPEED, SNOWBALL_GRAVITY, order.velocity);
+		order.decision = reaches ? THROW_LAUNCH : THROW_MISSED;
+	}
+}
+
+// Shares a pass over every archetype the query matches out to the job workers, counting down done.
+// The passes stay in aiPasses until the next call.
+void submitAIPass(EntityQuery& query, JobFunction run, float dt, JobCounter* after, JobCounter& done) {
+	for (size_t q = 0; q < query.archetypes.size(); q++) {
+		AIPass pass;
+		pass.archetype = &entityWorld.archetypes[query.archetypes[q]];
+		pass.ticks = dt * SIMULATION_REFERENCE_HZ;
+		pass.dt = dt;
+		pass.orders = NULL;
+		aiPasses.push_back(pass);
+	}
+	size_t first = aiPasses.size() - query.archetypes.size();
+	for (size_t p = first; p < aiPasses.size(); p++) {
+		int count = (int)aiPasses[p].archetype->id.size();
+		if (after) {
+			submit_parallel_for_after(simulationJobs, *after, count, AI_JOB_GRAIN, run, &aiPasses[p], &done);
+		}
+		else {
+			submit_parallel_for(simulationJobs, count, AI_JOB_GRAIN, run, &aiPasses[p], &done);
+		}
+	}
+}
+
+// Throws decided in parallel, launched here in row order so the pool fills the same way every run
+void throwSnowballs(float dt) {
+	size_t rows = 0;
+	for (size_t q = 0; q < throwerQuery.archetypes.size(); q++) {
+		rows += entityWorld.archetypes[throwerQuery.archetypes[q]].id.size();
+	}
+	throwOrders.resize(rows);
+	aiPasses.clear();
+	rows = 0;
+	for (size_t q = 0; q < throwerQuery.archetypes.size(); q++) {
+		AIPass pass;
+		pass.archetype = &entityWorld.archetypes[throwerQuery.archetypes[q]];
+		pass.ticks = dt * SIMULATION_REFERENCE_HZ;
+		pass.dt = dt;
+		pass.orders = throwOrders.data() + rows;
+		aiPasses.push_back(pass);
+		rows += pass.archetype->id.size();
+	}
+	for (size_t p = 0; p < aiPasses.size(); p++) {
+		parallel_for(simulationJobs, (int)aiPasses[p].archetype->id.size(), AI_JOB_GRAIN, decideThrows, &aiPasses[p]);
+	}
+	for (size_t p = 0; p < aiPasses.size(); p++) {
+		Archetype& a = *aiPasses[p].archetype;
+		for (size_t i = 0; i < a.id.size(); i++) {
+			const ThrowOrder& order = aiPasses[p].orders[i];
+			if (order.decision == THROW_NONE) {
+				continue;
+			}
+			if (order.decision == THROW_LAUNCH) {
+				launch_projectile(snowballs, order.hand, order.velocity, a.id[i], simulationTime);
+			}
+			a.ai[i].throw_cooldown = SNOWMAN_THROW_COOLDOWN + (rand() % 100) * 0.03f;
+		}
+	}
+}
+
+// One fixed tick of dt seconds. The steps were per idle call, they are now
+// scaled by ticks, the number of SIMULATION_REFERENCE_HZ frames dt covers.
+void simulateStep(float dt) {
+	float ticks = dt * SIMULATION_REFERENCE_HZ;
 
 	// Arm movement
 	if (armSwitch == true) {
-		armAngle = armAngle + 0.1;
+		armAngle = armAngle + 0.1 * ticks;
 		if (armAngle > 90) {
 			armSwitch = false;
 		}
 	}
 	else if (armSwitch == false) {
-		armAngle = armAngle - 0.1;
+		armAngle = armAngle - 0.1 * ticks;
 		if (armAngle < 0) {
 			armSwitch = true;
 		}
 	}
 
-	// Basic Snowman AI
-	vec3 oldSnowman1Pos = snowman1Pos;
-	vec3 oldSnowman2Pos = snowman2Pos;
-	vec3 vectorToSnowman1 = snowman1Pos - cameraPosition;
-	vec3 vectorToSnowman2 = snowman2Pos - cameraPosition;
-	vectorToSnowman1.v[1] = 0;  // Project to xz plane
-	vectorToSnowman2.v[1] = 0;  // Project to xz plane
-	GLfloat snowman1Collision = xz_length(vectorToSnowman1);
-	GLfloat snowman2Collision = xz_length(vectorToSnowman2);
-	
-	// BASIC AI CALCULATIONS
-	if (snowman1Collision < 10.0) {
-		snowman1Pos = snowman1Pos + (normalise(vectorToSnowman1)*0.003);
-	}
-	else {
-		if (marchOrder == true) {
-			marchDistance += 0.002;
-			snowman1Pos.v[2] = snowman1Pos.v[2] + 0.002;
-		}
-		if (marchOrder == false) {
-			marchDistance -= 0.002;
-			snowman1Pos.v[2] = snowman1Pos.v[2] - 0.002;
-		}
-		if (marchDistance > 20) {
-			marchOrder = false;
-		}
-		if (marchDistance < 0) {
-			marchOrder = true;
-		}
-	}	
-
 	// Flame size random generation
 	if (fire_value > 0.99) {
-		fire_value = fire_value - 0.0005 * (rand() % 100);
+		fire_value = fire_value - 0.0005 * ticks * (rand() % 100);
 	}
 	if (fire_value < 0.85) {
-		fire_value = fire_value + 0.0005 * (rand() % 100);
+		fire_value = fire_value + 0.0005 * ticks * (rand() % 100);
 	}
 	else {
-		fire_value = fire_value + 0.0005 * (rand() % 100 - 50);
+		fire_value = fire_value + 0.0005 * ticks * (rand() % 100 - 50);
 	}
 	
 
-	// Snowball Collision
-	GLfloat SbSnowman1Coll = xz_length(snowballPos - snowman1Pos);
-	GLfloat SbSnowman2Coll = xz_length(snowballPos - snowman2Pos);
-	GLfloat SbSnowman3Coll = xz_length(snowballPos - snowman3Pos);
-	GLfloat Sbtree1Collision = xz_length(snowballPos - tree1Pos);
-	GLfloat Sbtree2Collision = xz_length(snowballPos - tree2Pos);
-	GLfloat Sbtree3Collision = xz_length(snowballPos - tree3Pos);
-	// Collision with snowmen
-	if (SbSnowman1Coll < 1.0 || SbSnowman2Coll < 1.0 || SbSnowman3Coll < 1.0) {
-		thrownSnowball = false;
-		hitLocation = snowballPos;
-		printf("x: %f z: %f ", hitLocation.v[0], hitLocation.v[2]);
-		fleeing = true;
-	}
-	// Collision with trees
-	else if (Sbtree1Collision  < 1.5 || Sbtree2Collision < 1.5 || Sbtree3Collision < 1.5) {
-		thrownSnowball = false;
-		hitLocation = snowballPos;
-		printf("x: %f z: %f ", hitLocation.v[0], hitLocation.v[2]);
-	}
-
+	// Snowball flight, every snowball in the air moves to where its arc is at the end of the tick
+	simulationTime += dt;
+	step_projectiles(snowballs, simulationTime, SNOWBALL_FLOOR);
+
+	// Snowball Collision, this tick's flights swept against the trees, snowmen and player, then the AI hears of the hits
+	collideSnowballs();
+	reactToHits();
+
+	// BASIC AI CALCULATIONS, in chunks over the job workers: the walkers' velocities, then their
+	// steps once every velocity is in, with the spinning snowmen turning alongside
+	JobCounter velocitiesDone, aiDone;
+	create_job_counter(velocitiesDone);
+	create_job_counter(aiDone);
+	aiPasses.clear();
+	aiPasses.reserve(2 * walkerQuery.archetypes.size() + spinnerQuery.archetypes.size());
+	submitAIPass(walkerQuery, walkerVelocities, dt, NULL, velocitiesDone);
+	submitAIPass(walkerQuery, walkerMoves, dt, &velocitiesDone, aiDone);
+	submitAIPass(spinnerQuery, spinSnowmen, dt, NULL, aiDone);
+	wait_for_counter(simulationJobs, aiDone);
+	// the moves can finish before the last velocity job lets go of its counter
+	wait_for_counter(simulationJobs, velocitiesDone);
 	if (fleeing) {
-		snowman1Pos = snowman1Pos + (normalise(vectorToSnowman1)*0.01);
-		snowman2Pos = snowman2Pos + (normalise(vectorToSnowman2)*0.01);
-		fleeTime += 0.0002;
+		fleeTime += 0.0002 * ticks;
 		if (fleeTime > 1.0) {
 			fleeing = false;
 			fleeTime = 0.0;
 		}
 	}
 
-	// Snowman1 - Tree Collision and world boundary collision
-	GLfloat snowman1ToTree1 = xz_length(snowman1Pos - tree1Pos);
-	GLfloat snowman1ToTree2 = xz_length(snowman1Pos - tree2Pos);
-	GLfloat snowman1ToTree3 = xz_length(snowman1Pos - tree3Pos);
-	GLfloat snowman1Tosnow2 = xz_length(snowman1Pos - snowman2Pos);
-	GLfloat snowman1Tosnow3 = xz_length(snowman1Pos - snowman3Pos);
-	if (snowman1ToTree1 < 3.0 || snowman1ToTree2 < 3.0 || snowman1ToTree3 < 3.0) {
-		snowman1Pos = oldSnowman1Pos;
+	buildCollisionGrid(walkerGrid, walkerQuery);
+
+	throwSnowballs(dt);
+
+	// Lantern flicker
+	lanternTime += 0.002f * ticks;
+}
+
+// Keys that move the player or throw, applied on the simulation's side
+void applyInput(const InputEvent& event) {
+	unsigned char key = event.key;
+	vec3 direction = cameraDirectionFor(playerRotation);
+	vec3 oldPlayerPosition = playerPosition;  // Store in case of collision
+
+	if (key == 'w') {
+		playerPosition = playerPosition + direction;  // Move forward in direction of camera
 	}
-	if (snowman1Tosnow2 < 2.0 || snowman1Tosnow3 < 2.0) {
-		snowman1Pos = oldSnowman1Pos;
+	if (key == 's') {
+		playerPosition = playerPosition - direction;  // Move backward in direction of camera
 	}
-	if (abs(snowman1Pos.v[0]) > 50 || abs(snowman1Pos.v[2]) > 50) {
-		snowman1Pos = oldSnowman1Pos;
+	if (key == 'a') {
+		// Move left relative to camera direction (in direction 90 deg left of camera direction) 
+		playerPosition.v[0] = playerPosition.v[0] + direction.v[2];  // x1' = x1 + y2
+		playerPosition.v[2] = playerPosition.v[2] - direction.v[0];  // y1' = y1 - x2
+	}
+	if (key == 'd') {
+		// Move right relative to camera direction (in direction 90 deg right of camera direction) 
+		playerPosition.v[0] = playerPosition.v[0] - direction.v[2];  // x1' = x1 - y2
+		playerPosition.v[2] = playerPosition.v[2] + direction.v[0];  // y1' = y1 + x2
+	}
+	if (key == 'q') {
+		// Rotate counter-clockwise about y-axis (turn left)
+		playerRotation += 0.030f;
+	}
+	if (key == 'e') {
+		// Rotate clockwise aboutengl y-axis (turn right)
+		playerRotation -= 0.030f;
+	}
+	if (key == 'r') {
+		// Every press throws another, straight ahead
+		launch_projectile(snowballs, heldSnowballPosition(playerPosition, direction), normalise(direction) * SNOWBALL_SPEED, PLAYER_ID, simulationTime);
 	}
 
-	// Snowman2 - Tree Collision and world boundary collision
-	GLfloat snowman2ToTree1 = xz_length(snowman2Pos - tree1Pos);
-	GLfloat snowman2ToTree2 = xz_length(snowman2Pos - tree2Pos);
-	GLfloat snowman2ToTree3 = xz_length(snowman2Pos - tree3Pos);
-	GLfloat snowman2Tosnow1 = xz_length(snowman2Pos - snowman1Pos);
-	GLfloat snowman2Tosnow3 = xz_length(snowman2Pos - snowman3Pos);
-	if (snowman2ToTree1 < 3.0 || snowman2ToTree2 < 3.0 || snowman2ToTree3 < 3.0) {
-		snowman2Pos = oldSnowman2Pos;
+	// CAMERA COLLISION CALCULATIONS
+	// Collision with snowmen and trees
+	if (entityNear(playerPosition, 2.0f, 3.0f, ENTITY_NONE) != ENTITY_NONE) {
+		playerPosition = oldPlayerPosition;
 	}
-	if (snowman2Tosnow1 < 2.0 || snowman2Tosnow3 < 2.0) {
-		snowman2Pos = oldSnowman2Pos;
+	// collision with world boundary
+	else if (abs(playerPosition.v[0]) > 50.0 || abs(playerPosition.v[2]) > 50.0) {
+		playerPosition = oldPlayerPosition;
 	}
-	if (abs(snowman2Pos.v[0]) > 50 || abs(snowman2Pos.v[2]) > 50) {
-		snowman2Pos = oldSnowman2Pos;
+}
+
+// Apply the queued input, run one tick and publish the last two ticks
+void tickSimulation(float dt, pacing_clock::time_point tick_time) {
+	InputEvent event;
+	while (pop_input(inputQueue, event)) {
+		applyInput(event);
 	}
+	WorldSnapshot& snapshot = snapshots[triple_buffer_write_slot(snapshotBuffer)];
+	captureSimulationState(snapshot.previous);
+	pacing_clock::time_point start = pacing_clock::now();
+	simulateStep(dt);
+	simulationTick++;
+
+	captureSimulationState(snapshot.current);
+	snapshot.tick_time = tick_time;
+	snapshot.tick = simulationTick;
+	snapshot.step_ms = std::chrono::duration<double, std::milli>(pacing_clock::now() - start).count();
+	snapshot.entities = entityWorld.live;
+	snapshot.archetypes = (int)entityWorld.archetypes.size();
+	snapshot.broadphase_ms = walkerGrid.build_ms;
+	snapshot.snowballs = snowballs.count;
+	snapshot.snowballs_launched = snowballs.launched;
+	snapshot.snowballs_fell = snowballs.fell;
+	snapshot.snowballs_refused = snowballs.full;
+	snapshot.snowball_hits = snowballHits;
+	snapshot.player_hits = playerHits;
+	snapshot.snowball_ms = snowballCollideMs;
+	JobStats job_stats = take_job_stats(simulationJobs);
+	snapshot.jobs_run = job_stats.run;
+	snapshot.jobs_stolen = job_stats.stolen;
+	publish_triple_buffer(snapshotBuffer);
+}
 
-	// Spin snowman 1
-	snowman1_rotationy += 0.1;
+// Ticks on a fixed grid of deadlines, dropping ticks rather than bursting when it falls behind
+void runSimulationThread() {
+	std::chrono::duration<float> step(1.0f / simulationHz);
+	pacing_clock::duration tick = std::chrono::duration_cast<pacing_clock::duration>(step);
+	pacing_clock::time_point next_tick = pacing_clock::now();
+	while (!simulationStop.load(std::memory_order_relaxed)) {
+		std::this_thread::sleep_until(next_tick);
+		tickSimulation(step.count(), next_tick);
+		next_tick += tick;
+		pacing_clock::time_point now = pacing_clock::now();
+		if (now - next_tick > std::chrono::duration_cast<pacing_clock::duration>(std::chrono::duration<float>(MAX_FRAME_SECONDS))) {
+			next_tick = now;
+		}
+	}
+}
+
+// Every snapshot holds the starting state until the first tick, after the scene graph has given the entities their nodes
+void initSimulation() {
+	create_triple_buffer(snapshotBuffer);
+	create_input_queue(inputQueue);
+	create_projectile_pool(snowballs, SNOWBALL_CAPACITY, SNOWBALL_GRAVITY, snowballRadius);
+	create_hit_event_ring(hitEvents);
+	int workers = simulationWorkers > 0 ? simulationWorkers : (int)std::thread::hardware_concurrency() - 1;
+	create_job_system(simulationJobs, workers);
+	for (int i = 0; i < 3; i++) {
+		captureSimulationState(snapshots[i].previous);
+		captureSimulationState(snapshots[i].current);
+		snapshots[i].tick_time = pacing_clock::now();
+		snapshots[i].tick = 0;
+		snapshots[i].step_ms = 0.0;
+		snapshots[i].entities = entityWorld.live;
+		snapshots[i].archetypes = (int)entityWorld.archetypes.size();
+		snapshots[i].broadphase_ms = 0.0;
+		snapshots[i].snowballs = snapshots[i].snowballs_launched = snapshots[i].snowballs_fell = snapshots[i].snowballs_refused = 0;
+		snapshots[i].snowball_hits = snapshots[i].player_hits = 0;
+		snapshots[i].snowball_ms = 0.0;
+		snapshots[i].jobs_run = snapshots[i].jobs_stolen = 0;
+	}
+}
+
+void startSimulationThread() {
+	if (useSimulationThread) {
+		simulationThread = std::thread(runSimulationThread);
+	}
+}
+
+// Stops the thread if there is one, then the job workers
+void stopSimulationThread() {
+	if (simulationThread.joinable()) {
+		simulationStop.store(true);
+		simulationThread.join();
+	}
+	destroy_job_system(simulationJobs);
+}
+
+void updateScene() {
+
+	// Sleep until the next frame is due
+	wait_for_next_frame(framePacer);
+	static pacing_clock::time_point last_time = pacing_clock::now();
+	pacing_clock::time_point now = pacing_clock::now();
+	float frame_seconds = std::chrono::duration<float>(now - last_time).count();
+	last_time = now;
+	if (headlessMode) {
+		frame_seconds = HEADLESS_FRAME_SECONDS;
+	}
+	if (frame_seconds > MAX_FRAME_SECONDS) {
+		frame_seconds = MAX_FRAME_SECONDS;
+	}
+
+	// Without the thread, simulate up to now here
+	if (!useSimulationThread) {
+		float step = 1.0f / simulationHz;
+		simulationAccumulator += frame_seconds;
+		while (simulationAccumulator >= step) {
+			tickSimulation(step, now);
+			simulationAccumulator -= step;
+		}
+		simulationAlpha = simulationAccumulator / step;
+	}
+
+	// Particles are only for show, they move with the frames on this thread, the snow box centred on the camera
+	if (useParticles) {
+		emit_particles(flameParticles, flameEmitter, frame_seconds);
+		emit_particles(emberParticles, emberEmitter, frame_seconds);
+		emit_particles(smokeParticles, smokeEmitter, frame_seconds);
+		snowParticles.wrap_min = vec3(cameraPosition.v[0] - SNOW_BOX_SIZE * 0.5f, 0.0f, cameraPosition.v[2] - SNOW_BOX_SIZE * 0.5f);
+		ParticlePool* pools[4] = { &flameParticles, &emberParticles, &smokeParticles, &snowParticles };
+		for (int i = 0; i < 4; i++) {
+			update_particles(*pools[i], frame_seconds, &renderJobs);
+		}
+	}
 
 	// Draw the next frame
-	glutPostRedisplay();
+	if (!headlessMode) {
+		glutPostRedisplay();
+	}
 }
 
 
 void init()
 {
 	// Set up the shaders
-	GLuint shaderProgramID = CompileShaders();
+	mdiProgramID = CompileShaders("../Shaders/ToonMDIVertexShader.txt", "../Shaders/ToonFragmentShader.txt", "../Shaders/ToonLibraryShader.txt");
+	shaderProgramID = CompileShaders("../Shaders/ToonVertexShader.txt", "../Shaders/ToonFragmentShader.txt", "../Shaders/ToonLibraryShader.txt");
+	ditherProgramID = CompileShaders("../Shaders/ToonVertexShader.txt", "../Shaders/ToonDitherFragmentShader.txt", "../Shaders/ToonLibraryShader.txt");
+	impostorProgramID = CompileShaders("../Shaders/ImpostorVertexShader.txt", "../Shaders/ImpostorFragmentShader.txt", "../Shaders/ToonLibraryShader.txt");
+	GLuint impostorBakeProgramID = CompileShaders("../Shaders/ImpostorBakeVertexShader.txt", "../Shaders/ImpostorBakeFragmentShader.txt");
+	depthProgramID = CompileSingleShader("../Shaders/DepthVertexShader.txt", GL_VERTEX_SHADER);
+	mdiDepthProgramID = CompileSingleShader("../Shaders/DepthMDIVertexShader.txt", GL_VERTEX_SHADER);
+	GLuint cullProgramID = CompileSingleShader("../Shaders/CullComputeShader.txt", GL_COMPUTE_SHADER);
+	particleProgramID = CompileShaders("../Shaders/ParticleVertexShader.txt", "../Shaders/ParticleFragmentShader.txt");
+	GLuint hizProgramID = CompileSingleShader("../Shaders/HiZReduceComputeShader.txt", GL_COMPUTE_SHADER);
+	GLuint upscaleProgramID = CompileShaders("../Shaders/UpscaleVertexShader.txt", "../Shaders/UpscaleFragmentShader.txt");
 	// load mesh into a vertex buffer array
 	generateObjectBufferMesh(GROUND_ID, GROUND_MESH, ground_count);
 	generateObjectBufferMesh(TREE_ID, TREE_MESH, tree_vertex_count);
@@ -814,6 +2170,9 @@ void init()
 	generateObjectBufferMesh(FIRELOGS_ID, FIRELOGS_MESH, firelogs_vertex_count);
 	generateObjectBufferMesh(FIREFLAME_ID, FIREFLAME_MESH, fireflame_vertex_count);
 	generateObjectBufferMesh(SKYBOX_ID, SKYBOX_MESH, skybox_vertex_count);
+	treeBVH = &bvhForVAO[TREE_ID];
+	snowmanBVH = &bvhForVAO[SNOWMAN_ID];
+	snowballRadius = boundsForVAO[SNOWBALL_ID].radius * 0.2f;  // drawn at a fifth of its size
 
 	loadTextures(GROUND_TEX_ID, GROUND_TEXTURE);
 	loadTextures(TREE_TEX_ID, TREE_TEXTURE);
@@ -821,75 +2180,334 @@ void init()
 	loadTextures(SNOWMAN_ARM_TEX_ID, SNOWMAN_ARM_TEXTURE);
 	loadTextures(FIREFLAME_TEX_ID, FIREFLAME_TEXTURE);
 	loadTextures(SKYBOX_TEX_ID, SKYBOX_TEXTURE);
+
+	// Same meshes and textures again, shared buffers for the indirect path
+	create_mesh_pool_buffers(meshPool, mdiProgramID, mdiDepthProgramID);
+	const char* textureFiles[] = { GROUND_TEXTURE, TREE_TEXTURE, SNOWMAN_TEXTURE, SNOWMAN_ARM_TEXTURE, FIREFLAME_TEXTURE, SKYBOX_TEXTURE };
+	GLuint textureIDs[] = { GROUND_TEX_ID, TREE_TEX_ID, SNOWMAN_TEX_ID, SNOWMAN_ARM_TEX_ID, FIREFLAME_TEX_ID, SKYBOX_TEX_ID };
+	textureArrayID = load_texture_array(textureFiles, 6);
+	for (int i = 0; i < 6; i++) {
+		layerForTexture[textureIDs[i]] = i;
+	}
+	create_indirect_frame(indirectFrame);
+	create_gpu_culler(gpuCuller, cullProgramID, hizProgramID, width, height);
+	create_cascaded_shadows(shadows, mdiDepthProgramID);
+	create_dynamic_resolution(dynamicRes, upscaleProgramID, width, height, dynamicResMinScale, dynamicResMaxScale, dynamicResTargetMs);
+	set_shadow_light(shadows, vec3(0.5f, 0.6f, 0.3f));
+
+	// Bake the tree's impostor atlas from the pool copy of its mesh, stood upright like addTreeNode does
+	if (!create_impostor_atlas(treeImpostors, impostorBakeProgramID, impostorProgramID, meshPool, poolMeshForVAO[TREE_ID], TREE_TEX_ID, rotate_x_deg(identity_mat4(), -90))) {
+		useImpostors = false;
+	}
+	glUseProgram(impostorProgramID);
+	set_impostor_uniforms(treeImpostors, impostorProgramID);
+
+	// Counting fragment shader invocations needs ARB_pipeline_statistics_query (core in 4.6)
+	fragmentQueriesSupported = GLEW_ARB_pipeline_statistics_query != 0;
+	if (fragmentQueriesSupported) {
+		glGenQueries(2, fragmentQueries);
+	}
+
+	// Clustered lighting, grid must match the projection used in display()
+	initLanterns();
+	build_cluster_bounds(lightGrid, 45.0f, (float)width / (float)height, 0.1f, 200.0f);
+	create_light_cluster_buffers(lightClusterGPU);
+	glUseProgram(mdiProgramID);
+	set_light_cluster_uniforms(mdiProgramID, lightGrid, width, height);
+	glUseProgram(ditherProgramID);
+	set_light_cluster_uniforms(ditherProgramID, lightGrid, width, height);
+	glUseProgram(impostorProgramID);
+	set_light_cluster_uniforms(impostorProgramID, lightGrid, width, height);
+	glUseProgram(shaderProgramID);
+	set_light_cluster_uniforms(shaderProgramID, lightGrid, width, height);
+	create_job_system(renderJobs, (int)std::thread::hardware_concurrency());
+
+	renderQueue.far_plane = 200.0f;
+
+	// Instance buffers hang off the mesh VAOs
+	create_instance_batch(treeBatch, TREE_ID, tree_vertex_count, shaderProgramID, GL_STATIC_DRAW);
+	create_instance_batch(snowmanBatch, SNOWMAN_ID, snowman_vertex_count, shaderProgramID, GL_STREAM_DRAW);
+	create_instance_batch(armBatch, SNOWMAN_ARM_ID, snowman_arm_vertex_count, shaderProgramID, GL_STREAM_DRAW);
+	create_instance_batch(impostorBatch, treeImpostors.quad_vao, 6, impostorProgramID, GL_STREAM_DRAW);
+	create_instance_batch(snowballBatch, SNOWBALL_ID, snowball_vertex_count, shaderProgramID, GL_STREAM_DRAW);
+	attach_depth_vao(treeBatch, depthVAOForVAO[TREE_ID], depthProgramID);
+	attach_depth_vao(snowmanBatch, depthVAOForVAO[SNOWMAN_ID], depthProgramID);
+	attach_depth_vao(armBatch, depthVAOForVAO[SNOWMAN_ARM_ID], depthProgramID);
+	attach_depth_vao(snowballBatch, depthVAOForVAO[SNOWBALL_ID], depthProgramID);
+	treeBatch.local_bounds = boundsForVAO[TREE_ID];
+	snowmanBatch.local_bounds = boundsForVAO[SNOWMAN_ID];
+	armBatch.local_bounds = boundsForVAO[SNOWMAN_ARM_ID];
+	snowballBatch.local_bounds = boundsForVAO[SNOWBALL_ID];
+	initEntities();
+	initSceneGraph();
+	initSimulation();
+	initTreeInstances();
+	if (useStaticBatching) {
+		initStaticBatch();
+	}
+
+	initParticles();
+	initShadowCasters();
+
+	// Occlusion buffer at a quarter of the window resolution
+	create_occlusion_buffer(occlusionBuffer, width / 4, height / 4, 0.1f, &renderJobs);
+	make_tree_occluder(treeOccluder);
+	make_snowman_occluder(snowmanOccluder);
+
+	// init bound textures and buffers directly, start the cache from a clean slate
+	gls_invalidate();
+}
+
+// Flushes the frames still in the PBO ring and joins the writer thread
+void stopCapture() {
+	if (!frameCapture.active) {
+		return;
+	}
+	stop_frame_capture(frameCapture);
+	const CaptureStats& cap = frameCapture.stats;
+	printf("Captured %d frames to %s, %.3f ms per frame on the render thread (%.3f max), %d fence waits, %d queue waits\n",
+		cap.written, captureFile, cap.frames > 0 ? cap.total_ms / cap.frames : 0.0, cap.max_ms, cap.fence_waits, cap.queue_waits);
+}
+
+// freeglut destroys the context before glutMainLoop returns, so the capture is finished here while it is still current
+void windowClosed() {
+	stopCapture();
 }
 
-// Placeholder code for the keypress
 void processNormalKeys(unsigned char key, int x, int y)
 {
-	vec3 oldCameraPosition = cameraPosition;  // Store in case of collision
-
+	// Moving and throwing belong to the simulation, they reach it through the input queue
+	if (strchr("wsadqer", key)) {
+		InputEvent event;
+		event.key = key;
+		push_input(inputQueue, event);
+	}
 	if (key == 'i') {
 		translate_y = translate_y + 0.1;
 	}
-	if (key == 'w') {
-		cameraPosition = cameraPosition + cameraDirection;  // Move forward in direction of camera
+	if (key == 'm') {
+		// Toggle multi-draw indirect for the opaque scene
+		useMultiDrawIndirect = !useMultiDrawIndirect;
 	}
-	if (key == 's') {
-		cameraPosition = cameraPosition - cameraDirection;  // Move backward in direction of camera
+	if (key == 'c') {
+		// Toggle frustum culling
+		useFrustumCulling = !useFrustumCulling;
 	}
-	if (key == 'a') {
-		// Move left relative to camera direction (in direction 90 deg left of camera direction) 
-		cameraPosition.v[0] = cameraPosition.v[0] + cameraDirection.v[2];  // x1' = x1 + y2
-		cameraPosition.v[2] = cameraPosition.v[2] - cameraDirection.v[0];  // y1' = y1 - x2
+	if (key == 'o') {
+		// Toggle occlusion culling
+		useOcclusionCulling = !useOcclusionCulling;
 	}
-	if (key == 'd') {
-		// Move right relative to camera direction (in direction 90 deg right of camera direction) 
-		cameraPosition.v[0] = cameraPosition.v[0] - cameraDirection.v[2];  // x1' = x1 - y2
-		cameraPosition.v[2] = cameraPosition.v[2] + cameraDirection.v[0];  // y1' = y1 + x2
+	if (key == 'p') {
+		// Save what the occlusion culling saw last frame
+		if (write_occlusion_png(occlusionBuffer, "occlusion.png", OCCLUSION_DUMP_DEPTH)) {
+			printf("Wrote occlusion.png\n");
+		}
 	}
-	if (key == 'q') {
-		// Rotate counter-clockwise about y-axis (turn left)
-		camerarotationy += 0.030f;
+	if (key == 'g') {
+		// Toggle culling in a compute shader, only used with multi-draw indirect
+		useGPUCulling = !useGPUCulling;
 	}
-	if (key == 'e') {
-		// Rotate clockwise aboutengl y-axis (turn right)
-		camerarotationy -= 0.030f;
+	if (key == 'h') {
+		// Toggle the Hi-Z occlusion test of the GPU culling
+		useHiZ = !useHiZ;
 	}
-	if (key == 'r') {
-		if (thrownSnowball == false) {
-			snowballGravity = 0.0f;
-			snowballDir = normalise(cameraDirection) * 5;
-			thrownSnowball = true;
+	if (key == 'z') {
+		// Toggle the depth-only pre-pass before the opaque colour pass
+		useDepthPrepass = !useDepthPrepass;
+	}
+	if (key == 'b') {
+		// Toggle impostors for distant trees
+		useImpostors = !useImpostors;
+	}
+	if (key == 'v') {
+		// Start or stop recording to captureFile
+		if (frameCapture.active) {
+			stopCapture();
 		}
+		else if (start_frame_capture(frameCapture, captureFile, width, height, CAPTURE_FPS)) {
+			printf("Capturing to %s\n", captureFile);
+		}
+	}
+	if (key == 'u') {
+		// Toggle dynamic resolution, off draws straight to the window again
+		useDynamicResolution = !useDynamicResolution;
 	}
+	if (key == 'n') {
+		// Toggle the moon's shadows, the moonlight itself stays
+		useShadows = !useShadows;
+	}
+	if (key == 'f') {
+		// Toggle the particle fire and snow (the flame mesh comes back when off)
+		useParticles = !useParticles;
+	}
+	glutPostRedisplay();
+}
 
-	// CAMERA COLLISION CALCULATIONS
-	GLfloat snowman1Collision = xz_length(cameraPosition - snowman1Pos);
-	GLfloat snowman2Collision = xz_length(cameraPosition - snowman2Pos);
-	GLfloat snowman3Collision = xz_length(cameraPosition - snowman3Pos);
-	GLfloat tree1Collision = xz_length(cameraPosition - tree1Pos);
-	GLfloat tree2Collision = xz_length(cameraPosition - tree2Pos);
-	GLfloat tree3Collision = xz_length(cameraPosition - tree3Pos);
-	// Collision with snowmen
-	if (snowman1Collision < 2.0 || snowman2Collision < 2.0 || snowman3Collision < 2.0) {
-		cameraPosition = oldCameraPosition;
-	}
-	// Collision with trees
-	else if (tree1Collision < 3.0 || tree2Collision < 3.0 || tree3Collision < 3.0) {
-		cameraPosition = oldCameraPosition;
+// Render headlessFrames frames into the offscreen target with no window, saving
+// them when framesDirectory is set, then print how long the frames took
+int runHeadless() {
+	if (!create_headless_context()) {
+		return 1;
 	}
-	// collision with world boundary
-	else if (abs(cameraPosition.v[0]) > 50.0 || abs(cameraPosition.v[2]) > 50.0) {
-		cameraPosition = oldCameraPosition;
+	glewExperimental = GL_TRUE;
+	GLenum res = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	// GLEW built for GLX complains with no X display but the entry points still load
+	if (res == GLEW_ERROR_NO_GLX_DISPLAY) {
+		res = GLEW_OK;
 	}
+#endif
+	if (res != GLEW_OK) {
+		fprintf(stderr, "Error: '%s'\n", glewGetErrorString(res));
+		return 1;
+	}
+	printf("Headless: %s, OpenGL %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
 
-	// Player position check (debug)
-	// printf("x: %f z: %f ", cameraPosition.v[0], cameraPosition.v[2]);
-	glutPostRedisplay();
+	// Everything draws into this framebuffer in place of the window
+	create_headless_target(headlessTarget, width, height);
+	init();
+	gls_invalidate();
+	if (captureOnStart) {
+		start_frame_capture(frameCapture, captureFile, width, height, CAPTURE_FPS);
+	}
+
+	typedef std::chrono::high_resolution_clock headless_clock;
+	double total_ms = 0.0, min_ms = 1e30, max_ms = 0.0;
+	for (int frame = 0; frame < headlessFrames; frame++) {
+		headless_clock::time_point start = headless_clock::now();
+		updateScene();
+		display();
+		glFinish();
+		double ms = std::chrono::duration<double, std::milli>(headless_clock::now() - start).count();
+		total_ms += ms;
+		min_ms = ms < min_ms ? ms : min_ms;
+		max_ms = ms > max_ms ? ms : max_ms;
+
+		// Saving is outside the timed part
+		if (framesDirectory) {
+			char file_name[512];
+			snprintf(file_name, sizeof(file_name), "%s/frame_%04d.%s", framesDirectory, frame, framesAsPNG ? "png" : "ppm");
+			save_headless_frame(headlessTarget, file_name, framesAsPNG);
+		}
+	}
+	stopCapture();
+	stopSimulationThread();
+	destroy_job_system(renderJobs);
+	GLenum error = glGetError();
+	if (error != GL_NO_ERROR) {
+		fprintf(stderr, "Headless: GL error 0x%x\n", error);
+	}
+	printf("Headless: %d frames at %dx%d, %.2f ms average, %.2f min, %.2f max, %.1f fps\n",
+		headlessFrames, width, height, total_ms / headlessFrames, min_ms, max_ms, 1000.0 * headlessFrames / total_ms);
+	destroy_headless_context();
+	return 0;
 }
 
 int main(int argc, char** argv){
 
+	// Headless benchmarks exit before any window is made, except instancing, which goes on to draw its
+	// forest and crowd offscreen for the frame time: --bench-instancing [trees] [snowmen], --headless <frames> for more
+	bool benchInstancing = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--bench-instancing") == 0) {
+			benchInstancing = true;
+			bool hasTrees = i + 1 < argc && atoi(argv[i + 1]) > 0;
+			forestTreeCount = hasTrees ? atoi(argv[i + 1]) : 50000;
+			crowdSnowmanCount = hasTrees && i + 2 < argc && atoi(argv[i + 2]) > 0 ? atoi(argv[i + 2]) : 10000;
+			headlessMode = true;
+		}
+	}
+	if (run_benchmark(argc, argv) && !benchInstancing) {
+		return 0;
+	}
+
+	// Optional extra scenery: --forest <trees> --crowd <snowmen> --snow <particles>, where impostors start: --impostor-distance <d>,
+	// offscreen runs: --headless <frames> --frames-out <dir>, recording from the first frame: --capture <file.y4m>,
+	// a frame rate to hold by scaling the resolution: --dynamic-resolution <fps> --min-scale <s> --max-scale <s>,
+	// the frame rate cap: --fps <n> (0 for none) or --vsync, the simulation rate: --sim-hz <n> and its workers: --jobs <n>,
+	// and the crowd throwing snowballs at each other: --snowball-fight
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--forest") == 0) {
+			forestTreeCount = atoi(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--crowd") == 0) {
+			crowdSnowmanCount = atoi(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--snow") == 0) {
+			snowParticleCount = atoi(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--impostor-distance") == 0) {
+			impostorDistance = (float)atof(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--headless") == 0) {
+			headlessMode = true;
+			headlessFrames = atoi(argv[i + 1]);
+			if (headlessFrames < 1) {
+				headlessFrames = 1;
+			}
+		}
+		if (strcmp(argv[i], "--frames-out") == 0) {
+			framesDirectory = argv[i + 1];
+		}
+		if (strcmp(argv[i], "--dynamic-resolution") == 0) {
+			useDynamicResolution = true;
+			dynamicResTargetMs = 1000.0f / (float)atof(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--min-scale") == 0) {
+			dynamicResMinScale = (float)atof(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--max-scale") == 0) {
+			dynamicResMaxScale = (float)atof(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--sim-hz") == 0 && atof(argv[i + 1]) > 0.0) {
+			simulationHz = (float)atof(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--jobs") == 0) {
+			simulationWorkers = atoi(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--fps") == 0) {
+			targetFPS = atof(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "--capture") == 0) {
+			captureFile = argv[i + 1];
+			captureOnStart = true;
+		}
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--mdi") == 0) {
+			useMultiDrawIndirect = true;
+		}
+		if (strcmp(argv[i], "--gpu-culling") == 0) {
+			useMultiDrawIndirect = true;
+			useGPUCulling = true;
+		}
+		if (strcmp(argv[i], "--hiz") == 0) {
+			useHiZ = true;
+		}
+		if (strcmp(argv[i], "--depth-prepass") == 0) {
+			useDepthPrepass = true;
+		}
+		if (strcmp(argv[i], "--static-batching") == 0) {
+			useStaticBatching = true;
+		}
+		if (strcmp(argv[i], "--raw") == 0) {
+			framesAsPNG = false;
+		}
+		if (strcmp(argv[i], "--vsync") == 0) {
+			useVsync = true;
+		}
+		if (strcmp(argv[i], "--snowball-fight") == 0) {
+			snowballFight = true;
+		}
+	}
+
+	// No window at all: --headless <frames> [--frames-out <dir>] [--raw], frames run back to back
+	if (headlessMode) {
+		create_frame_pacer(framePacer, 0.0, false);
+		useSimulationThread = false;
+		return runHeadless();
+	}
+
 	// Set up the window
 	glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE|GLUT_RGB);
@@ -900,6 +2518,7 @@ int main(int argc, char** argv){
 	glutDisplayFunc(display);
 	glutIdleFunc(updateScene);
 	glutKeyboardFunc(processNormalKeys);
+	glutCloseFunc(windowClosed);
 
 	 // A call to glewInit() must be done after glut is initialized!
     GLenum res = glewInit();
@@ -910,8 +2529,22 @@ int main(int argc, char** argv){
     }
 	// Set up your objects and shaders
 	init();
-	// Begin infinite event loop
+#ifdef _WIN32
+	// The pacer sleeps between frames, the driver should not also wait for vsync unless asked to
+	if (WGLEW_EXT_swap_control) {
+		wglSwapIntervalEXT(useVsync ? 1 : 0);
+	}
+#endif
+	create_frame_pacer(framePacer, targetFPS, useVsync);
+	startSimulationThread();
+	if (captureOnStart) {
+		start_frame_capture(frameCapture, captureFile, width, height, CAPTURE_FPS);
+	}
+	// Closing the window returns from the loop so the simulation thread and job workers are stopped
+	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
 	glutMainLoop();
+	stopSimulationThread();
+	destroy_job_system(renderJobs);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,693 @@
+#include "mesh_bvh.h"
+#include <algorithm>
+#include <chrono>
+#include <float.h>
+#include <math.h>
+#include <xmmintrin.h> // SSE
+
+#define TRAVERSAL_COST 1.0f  // of testing a node's four boxes, against one triangle
+
+static void sub3 (const float* a, const float* b, float* out) {
+	out[0] = a[0] - b[0];
+	out[1] = a[1] - b[1];
+	out[2] = a[2] - b[2];
+}
+
+static float dot3 (const float* a, const float* b) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static void cross3 (const float* a, const float* b, float* out) {
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// a + b * s
+static void madd3 (const float* a, const float* b, float s, float* out) {
+	out[0] = a[0] + b[0] * s;
+	out[1] = a[1] + b[1] * s;
+	out[2] = a[2] + b[2] * s;
+}
+
+/*-----------------------------------BUILD--------------------------------------------*/
+
+struct BuildTriangle {
+	float lo[3], hi[3], centre[3];
+};
+
+struct BuildNode {
+	float lo[3], hi[3];
+	int left, right;  // -1 for a leaf
+	int first, count;  // a leaf's range of the build order
+};
+
+static float half_area (const float* lo, const float* hi) {
+	float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+	return dx * dy + dy * dz + dz * dx;
+}
+
+static void empty_box (float* lo, float* hi) {
+	lo[0] = lo[1] = lo[2] = FLT_MAX;
+	hi[0] = hi[1] = hi[2] = -FLT_MAX;
+}
+
+static void grow_box (float* lo, float* hi, const float* other_lo, const float* other_hi) {
+	for (int c = 0; c < 3; c++) {
+		lo[c] = fminf (lo[c], other_lo[c]);
+		hi[c] = fmaxf (hi[c], other_hi[c]);
+	}
+}
+
+static int build_binary (std::vector<BuildNode>& nodes, const std::vector<BuildTriangle>& tris, std::vector<int>& order, int first, int count, int depth) {
+	BuildNode node;
+	float centre_lo[3], centre_hi[3];
+	empty_box (node.lo, node.hi);
+	empty_box (centre_lo, centre_hi);
+	for (int i = first; i < first + count; i++) {
+		const BuildTriangle& tri = tris[order[i]];
+		grow_box (node.lo, node.hi, tri.lo, tri.hi);
+		grow_box (centre_lo, centre_hi, tri.centre, tri.centre);
+	}
+	node.left = node.right = -1;
+	node.first = first;
+	node.count = count;
+	int index = (int)nodes.size ();
+	nodes.push_back (node);
+	if (count <= BVH_LEAF_TRIANGLES || depth >= BVH_MAX_DEPTH) {
+		return index;
+	}
+
+	// bin the centroids on each axis, the split with the least area times triangles on each side wins
+	float best_cost = FLT_MAX;
+	int best_axis = -1, best_bin = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		float extent = centre_hi[axis] - centre_lo[axis];
+		if (extent <= 0.0f) {
+			continue;
+		}
+		float bin_lo[BVH_SAH_BINS][3], bin_hi[BVH_SAH_BINS][3];
+		int bin_count[BVH_SAH_BINS] = { 0 };
+		for (int b = 0; b < BVH_SAH_BINS; b++) {
+			empty_box (bin_lo[b], bin_hi[b]);
+		}
+		float scale = BVH_SAH_BINS / extent;
+		for (int i = first; i < first + count; i++) {
+			const BuildTriangle& tri = tris[order[i]];
+			int b = std::min (BVH_SAH_BINS - 1, (int)((tri.centre[axis] - centre_lo[axis]) * scale));
+			bin_count[b]++;
+			grow_box (bin_lo[b], bin_hi[b], tri.lo, tri.hi);
+		}
+		// right hand sides swept from the far end, then the left hand sides meet them
+		float right_area[BVH_SAH_BINS];
+		int right_count[BVH_SAH_BINS];
+		float lo[3], hi[3];
+		empty_box (lo, hi);
+		int n = 0;
+		for (int b = BVH_SAH_BINS - 1; b > 0; b--) {
+			grow_box (lo, hi, bin_lo[b], bin_hi[b]);
+			n += bin_count[b];
+			right_area[b] = n > 0 ? half_area (lo, hi) : 0.0f;
+			right_count[b] = n;
+		}
+		empty_box (lo, hi);
+		n = 0;
+		for (int b = 0; b < BVH_SAH_BINS - 1; b++) {
+			grow_box (lo, hi, bin_lo[b], bin_hi[b]);
+			n += bin_count[b];
+			if (n == 0 || right_count[b + 1] == 0) {
+				continue;
+			}
+			float cost = n * half_area (lo, hi) + right_count[b + 1] * right_area[b + 1];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	int mid;
+	float area = half_area (node.lo, node.hi);
+	if (best_axis < 0) {
+		// every centroid in the same place, nothing to choose between
+		if (count <= BVH_MAX_LEAF_TRIANGLES) {
+			return index;
+		}
+		mid = first + count / 2;
+	}
+	else {
+		if (TRAVERSAL_COST * area + best_cost >= count * area && count <= BVH_MAX_LEAF_TRIANGLES) {
+			return index;
+		}
+		// bins up to best_bin to the front, the same binning as above so the counts agree
+		float scale = BVH_SAH_BINS / (centre_hi[best_axis] - centre_lo[best_axis]);
+		int i = first, j = first + count - 1;
+		while (i <= j) {
+			int b = std::min (BVH_SAH_BINS - 1, (int)((tris[order[i]].centre[best_axis] - centre_lo[best_axis]) * scale));
+			if (b <= best_bin) {
+				i++;
+			}
+			else {
+				std::swap (order[i], order[j--]);
+			}
+		}
+		mid = i;
+	}
+	int left = build_binary (nodes, tris, order, first, mid - first, depth + 1);
+	int right = build_binary (nodes, tris, order, mid, first + count - mid, depth + 1);
+	nodes[index].left = left;
+	nodes[index].right = right;
+	return index;
+}
+
+static void set_lane (BVHNode4& node, int lane, const BuildNode* from) {
+	if (!from) {
+		// inverted box, every slab test misses it
+		node.min_x[lane] = node.min_y[lane] = node.min_z[lane] = FLT_MAX;
+		node.max_x[lane] = node.max_y[lane] = node.max_z[lane] = -FLT_MAX;
+		node.child[lane] = 0;
+		node.count[lane] = -1;
+		return;
+	}
+	node.min_x[lane] = from->lo[0];
+	node.min_y[lane] = from->lo[1];
+	node.min_z[lane] = from->lo[2];
+	node.max_x[lane] = from->hi[0];
+	node.max_y[lane] = from->hi[1];
+	node.max_z[lane] = from->hi[2];
+	node.child[lane] = from->left < 0 ? from->first : 0;
+	node.count[lane] = from->left < 0 ? from->count : 0;
+}
+
+// Pull grandchildren up into a four wide node, opening the biggest inner child first
+static int collapse (MeshBVH& bvh, const std::vector<BuildNode>& nodes, int binary, int depth) {
+	int lanes[4];
+	int n = 0;
+	lanes[n++] = nodes[binary].left;
+	lanes[n++] = nodes[binary].right;
+	while (n < 4) {
+		int pick = -1;
+		float pick_area = -1.0f;
+		for (int i = 0; i < n; i++) {
+			const BuildNode& lane = nodes[lanes[i]];
+			if (lane.left >= 0 && half_area (lane.lo, lane.hi) > pick_area) {
+				pick = i;
+				pick_area = half_area (lane.lo, lane.hi);
+			}
+		}
+		if (pick < 0) {
+			break;
+		}
+		int opened = lanes[pick];
+		lanes[pick] = nodes[opened].left;
+		lanes[n++] = nodes[opened].right;
+	}
+
+	int index = (int)bvh.nodes.size ();
+	bvh.nodes.push_back (BVHNode4 ());
+	bvh.depth = std::max (bvh.depth, depth);
+	for (int lane = 0; lane < 4; lane++) {
+		set_lane (bvh.nodes[index], lane, lane < n ? &nodes[lanes[lane]] : NULL);
+	}
+	for (int lane = 0; lane < n; lane++) {
+		if (nodes[lanes[lane]].left >= 0) {
+			// collapse grows the node array, index it again afterwards
+			int child = collapse (bvh, nodes, lanes[lane], depth + 1);
+			bvh.nodes[index].child[lane] = child;
+		}
+	}
+	return index;
+}
+
+void build_mesh_bvh (MeshBVH& bvh, const std::vector<float>& vp, int vertex_count) {
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now ();
+	int count = vertex_count / 3;
+	std::vector<BuildTriangle> tris (count);
+	std::vector<int> order (count);
+	for (int t = 0; t < count; t++) {
+		BuildTriangle& tri = tris[t];
+		const float* corner = &vp[t * 9];
+		empty_box (tri.lo, tri.hi);
+		for (int k = 0; k < 3; k++) {
+			grow_box (tri.lo, tri.hi, corner + k * 3, corner + k * 3);
+		}
+		for (int c = 0; c < 3; c++) {
+			tri.centre[c] = (tri.lo[c] + tri.hi[c]) * 0.5f;
+		}
+		order[t] = t;
+	}
+
+	std::vector<BuildNode> nodes;
+	bvh.nodes.clear ();
+	bvh.depth = 1;
+	bvh.triangle_count = count;
+	if (count > 0) {
+		nodes.reserve (count * 2);
+		build_binary (nodes, tris, order, 0, count, 1);
+	}
+	if (nodes.empty () || nodes[0].left < 0) {
+		// small enough for one leaf, which still needs a node to sit in
+		bvh.nodes.push_back (BVHNode4 ());
+		for (int lane = 0; lane < 4; lane++) {
+			set_lane (bvh.nodes[0], lane, lane == 0 && !nodes.empty () ? &nodes[0] : NULL);
+		}
+	}
+	else {
+		collapse (bvh, nodes, 0, 1);
+	}
+
+	// triangles in leaf order, so a leaf's are next to each other
+	bvh.triangles.resize (count * 9);
+	bvh.source.resize (count);
+	for (int i = 0; i < count; i++) {
+		std::copy (vp.begin () + order[i] * 9, vp.begin () + order[i] * 9 + 9, bvh.triangles.begin () + i * 9);
+		bvh.source[i] = order[i];
+	}
+	if (count > 0) {
+		bvh.bounds_min = vec3 (nodes[0].lo[0], nodes[0].lo[1], nodes[0].lo[2]);
+		bvh.bounds_max = vec3 (nodes[0].hi[0], nodes[0].hi[1], nodes[0].hi[2]);
+	}
+	else {
+		bvh.bounds_min = bvh.bounds_max = vec3 (0.0f, 0.0f, 0.0f);
+	}
+	bvh.build_ms = std::chrono::duration<double, std::milli> (std::chrono::high_resolution_clock::now () - start).count ();
+}
+
+/*-----------------------------------TRIANGLES----------------------------------------*/
+
+// Moller-Trumbore, either side of the triangle
+static bool ray_triangle (const float* tri, const float* o, const float* d, float max_t, float& t) {
+	float e1[3], e2[3], p[3], s[3], q[3];
+	sub3 (tri + 3, tri, e1);
+	sub3 (tri + 6, tri, e2);
+	cross3 (d, e2, p);
+	float det = dot3 (e1, p);
+	if (fabsf (det) < 1e-12f) {
+		return false;
+	}
+	float inv_det = 1.0f / det;
+	sub3 (o, tri, s);
+	float u = dot3 (s, p) * inv_det;
+	if (u < 0.0f || u > 1.0f) {
+		return false;
+	}
+	cross3 (s, e1, q);
+	float v = dot3 (d, q) * inv_det;
+	if (v < 0.0f || u + v > 1.0f) {
+		return false;
+	}
+	t = dot3 (e2, q) * inv_det;
+	return t >= 0.0f && t < max_t;
+}
+
+// q on the triangle's plane, n its normal
+static bool inside_triangle (const float* tri, const float* n, const float* q) {
+	for (int k = 0; k < 3; k++) {
+		const float* a = tri + k * 3;
+		const float* b = tri + ((k + 1) % 3) * 3;
+		float edge[3], to_q[3], c[3];
+		sub3 (b, a, edge);
+		sub3 (q, a, to_q);
+		cross3 (edge, to_q, c);
+		if (dot3 (c, n) < 0.0f) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Sphere centre from p along d meeting a sphere of radius r round the corner c
+static bool sweep_corner (const float* p, const float* d, const float* c, float r, float max_t, float& t) {
+	float m[3];
+	sub3 (p, c, m);
+	float a = dot3 (d, d), b = dot3 (m, d), cc = dot3 (m, m) - r * r;
+	if (cc <= 0.0f) {
+		t = 0.0f;
+		return true;
+	}
+	float disc = b * b - a * cc;
+	if (b >= 0.0f || disc < 0.0f || a <= 0.0f) {
+		return false;
+	}
+	t = (-b - sqrtf (disc)) / a;
+	return t < max_t;
+}
+
+// The same against a cylinder of radius r round the edge e0 to e1, touching between the ends
+static bool sweep_edge (const float* p, const float* d, const float* e0, const float* e1, float r, float max_t, float& t, float* touch) {
+	float e[3], m[3], d_perp[3], m_perp[3];
+	sub3 (e1, e0, e);
+	sub3 (p, e0, m);
+	float ee = dot3 (e, e);
+	if (ee <= 0.0f) {
+		return false;
+	}
+	float md = dot3 (m, e), de = dot3 (d, e);
+	madd3 (d, e, -de / ee, d_perp);
+	madd3 (m, e, -md / ee, m_perp);
+	float a = dot3 (d_perp, d_perp), b = dot3 (m_perp, d_perp), c = dot3 (m_perp, m_perp) - r * r;
+	if (c <= 0.0f) {
+		t = 0.0f;
+	}
+	else {
+		// moving along the edge never reaches its side, the corners catch the ends
+		float disc = b * b - a * c;
+		if (a < 1e-12f || b >= 0.0f || disc < 0.0f) {
+			return false;
+		}
+		t = (-b - sqrtf (disc)) / a;
+		if (t >= max_t) {
+			return false;
+		}
+	}
+	float s = (md + de * t) / ee;
+	if (s < 0.0f || s > 1.0f) {
+		return false;
+	}
+	madd3 (e0, e, s, touch);
+	return true;
+}
+
+// First time before max_t a sphere of radius r moving from p along d touches the triangle
+static bool sweep_triangle (const float* tri, const float* p, const float* d, float r, float max_t, float& t, float* touch) {
+	float e1[3], e2[3], n[3];
+	sub3 (tri + 3, tri, e1);
+	sub3 (tri + 6, tri, e2);
+	cross3 (e1, e2, n);
+	float len = sqrtf (dot3 (n, n));
+	if (len > 1e-12f) {
+		n[0] /= len;
+		n[1] /= len;
+		n[2] /= len;
+		float to_p[3], q[3];
+		sub3 (p, tri, to_p);
+		float dist = dot3 (to_p, n), dn = dot3 (d, n);
+		// the face first, if the sphere meets it inside the edges nothing else can come sooner
+		if (fabsf (dist) <= r) {
+			madd3 (p, n, -dist, q);
+			if (inside_triangle (tri, n, q)) {
+				t = 0.0f;
+				touch[0] = q[0];
+				touch[1] = q[1];
+				touch[2] = q[2];
+				return true;
+			}
+		}
+		else if (dist * dn < 0.0f) {
+			float side = dist > 0.0f ? 1.0f : -1.0f;
+			float face_t = (side * r - dist) / dn;
+			if (face_t >= max_t) {
+				return false;
+			}
+			madd3 (p, d, face_t, q);
+			madd3 (q, n, -side * r, q);
+			if (inside_triangle (tri, n, q)) {
+				t = face_t;
+				touch[0] = q[0];
+				touch[1] = q[1];
+				touch[2] = q[2];
+				return true;
+			}
+		}
+		else {
+			// outside the plane's reach and moving away from it
+			return false;
+		}
+	}
+	bool found = false;
+	float best = max_t, edge_t, edge_touch[3];
+	for (int k = 0; k < 3; k++) {
+		const float* a = tri + k * 3;
+		const float* b = tri + ((k + 1) % 3) * 3;
+		if (sweep_edge (p, d, a, b, r, best, edge_t, edge_touch)) {
+			best = edge_t;
+			std::copy (edge_touch, edge_touch + 3, touch);
+			found = true;
+		}
+		if (sweep_corner (p, d, a, r, best, edge_t)) {
+			best = edge_t;
+			std::copy (a, a + 3, touch);
+			found = true;
+		}
+	}
+	t = best;
+	return found;
+}
+
+/*-----------------------------------TRAVERSAL----------------------------------------*/
+
+struct BVHQuery {
+	float origin[3], direction[3], inv[3];
+	float inflate;  // grows every box, the sweep's radius
+	__m128 ox, oy, oz, ix, iy, iz;
+};
+
+static void make_query (BVHQuery& q, const vec3& origin, const vec3& direction, float inflate) {
+	for (int c = 0; c < 3; c++) {
+		q.origin[c] = origin.v[c];
+		q.direction[c] = direction.v[c];
+		// no zero divides, a tiny component keeps the slab maths finite
+		float d = direction.v[c];
+		if (fabsf (d) < 1e-20f) {
+			d = d < 0.0f ? -1e-20f : 1e-20f;
+		}
+		q.inv[c] = 1.0f / d;
+	}
+	q.inflate = inflate;
+	q.ox = _mm_set1_ps (q.origin[0]);
+	q.oy = _mm_set1_ps (q.origin[1]);
+	q.oz = _mm_set1_ps (q.origin[2]);
+	q.ix = _mm_set1_ps (q.inv[0]);
+	q.iy = _mm_set1_ps (q.inv[1]);
+	q.iz = _mm_set1_ps (q.inv[2]);
+}
+
+// Mask of the node's boxes the query enters before max_t, and where it enters them
+static int hit_boxes_simd (const BVHNode4& node, const BVHQuery& q, float max_t, float* t_near) {
+	__m128 grow = _mm_set1_ps (q.inflate);
+	__m128 x0 = _mm_mul_ps (_mm_sub_ps (_mm_sub_ps (_mm_loadu_ps (node.min_x), grow), q.ox), q.ix);
+	__m128 x1 = _mm_mul_ps (_mm_sub_ps (_mm_add_ps (_mm_loadu_ps (node.max_x), grow), q.ox), q.ix);
+	__m128 y0 = _mm_mul_ps (_mm_sub_ps (_mm_sub_ps (_mm_loadu_ps (node.min_y), grow), q.oy), q.iy);
+	__m128 y1 = _mm_mul_ps (_mm_sub_ps (_mm_add_ps (_mm_loadu_ps (node.max_y), grow), q.oy), q.iy);
+	__m128 z0 = _mm_mul_ps (_mm_sub_ps (_mm_sub_ps (_mm_loadu_ps (node.min_z), grow), q.oz), q.iz);
+	__m128 z1 = _mm_mul_ps (_mm_sub_ps (_mm_add_ps (_mm_loadu_ps (node.max_z), grow), q.oz), q.iz);
+	__m128 enter = _mm_max_ps (_mm_max_ps (_mm_min_ps (x0, x1), _mm_min_ps (y0, y1)), _mm_max_ps (_mm_min_ps (z0, z1), _mm_setzero_ps ()));
+	__m128 leave = _mm_min_ps (_mm_min_ps (_mm_max_ps (x0, x1), _mm_max_ps (y0, y1)), _mm_min_ps (_mm_max_ps (z0, z1), _mm_set1_ps (max_t)));
+	_mm_storeu_ps (t_near, enter);
+	return _mm_movemask_ps (_mm_cmple_ps (enter, leave));
+}
+
+static int hit_boxes_scalar (const BVHNode4& node, const BVHQuery& q, float max_t, float* t_near) {
+	int mask = 0;
+	for (int lane = 0; lane < 4; lane++) {
+		const float lo[3] = { node.min_x[lane] - q.inflate, node.min_y[lane] - q.inflate, node.min_z[lane] - q.inflate };
+		const float hi[3] = { node.max_x[lane] + q.inflate, node.max_y[lane] + q.inflate, node.max_z[lane] + q.inflate };
+		float enter = 0.0f, leave = max_t;
+		for (int c = 0; c < 3; c++) {
+			float t0 = (lo[c] - q.origin[c]) * q.inv[c];
+			float t1 = (hi[c] - q.origin[c]) * q.inv[c];
+			enter = fmaxf (enter, fminf (t0, t1));
+			leave = fminf (leave, fmaxf (t0, t1));
+		}
+		t_near[lane] = enter;
+		if (enter <= leave) mask |= 1 << lane;
+	}
+	return mask;
+}
+
+struct StackEntry {
+	int node;
+	float t;  // where the query enters its box
+};
+
+// Nearest first traversal shared by rays and sweeps: a ray when radius is
+// zero, otherwise a sphere of that radius. Returns the triangle in leaf
+// order and the touching point for a sweep.
+static int traverse (const MeshBVH& bvh, const BVHQuery& q, float radius, float max_t, bool simd, float& best_t, float* touch) {
+	int best = -1;
+	best_t = max_t;
+	StackEntry stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top].node = 0;
+	stack[top].t = 0.0f;
+	top++;
+	while (top > 0) {
+		top--;
+		if (stack[top].t > best_t) {
+			continue;
+		}
+		const BVHNode4& node = bvh.nodes[stack[top].node];
+		float t_near[4];
+		int mask = simd ? hit_boxes_simd (node, q, best_t, t_near) : hit_boxes_scalar (node, q, best_t, t_near);
+		if (!mask) {
+			continue;
+		}
+		// the boxes hit, nearest first
+		int lanes[4];
+		int n = 0;
+		for (int lane = 0; lane < 4; lane++) {
+			if (mask & (1 << lane)) {
+				int i = n++;
+				for (; i > 0 && t_near[lanes[i - 1]] > t_near[lane]; i--) {
+					lanes[i] = lanes[i - 1];
+				}
+				lanes[i] = lane;
+			}
+		}
+		// leaves now, so their hits can rule out the nodes before they are pushed
+		for (int i = 0; i < n; i++) {
+			int lane = lanes[i];
+			if (node.count[lane] <= 0 || t_near[lane] > best_t) {
+				continue;
+			}
+			for (int tri = node.child[lane]; tri < node.child[lane] + node.count[lane]; tri++) {
+				float t, tri_touch[3];
+				bool hit = radius > 0.0f
+					? sweep_triangle (&bvh.triangles[tri * 9], q.origin, q.direction, radius, best_t, t, tri_touch)
+					: ray_triangle (&bvh.triangles[tri * 9], q.origin, q.direction, best_t, t);
+				if (hit) {
+					best_t = t;
+					best = tri;
+					if (radius > 0.0f) {
+						std::copy (tri_touch, tri_touch + 3, touch);
+					}
+				}
+			}
+		}
+		// nodes furthest first, so the nearest comes off the stack next
+		for (int i = n - 1; i >= 0; i--) {
+			int lane = lanes[i];
+			if (node.count[lane] != 0 || t_near[lane] > best_t) {
+				continue;
+			}
+			if (top == BVH_STACK_SIZE) {
+				// the build's depth cap keeps the tree inside the stack, a tree from anywhere else stops here
+				break;
+			}
+			stack[top].node = node.child[lane];
+			stack[top].t = t_near[lane];
+			top++;
+		}
+	}
+	return best;
+}
+
+static void triangle_normal (const MeshBVH& bvh, int tri, float* n) {
+	float e1[3], e2[3];
+	sub3 (&bvh.triangles[tri * 9 + 3], &bvh.triangles[tri * 9], e1);
+	sub3 (&bvh.triangles[tri * 9 + 6], &bvh.triangles[tri * 9], e2);
+	cross3 (e1, e2, n);
+}
+
+static void set_hit (BVHHit& hit, const MeshBVH& bvh, int tri, float t, const float* point, const float* normal) {
+	float len = sqrtf (dot3 (normal, normal));
+	if (len <= 0.0f) {
+		len = 1.0f;
+	}
+	hit.t = t;
+	hit.triangle = bvh.source[tri];
+	hit.point = vec3 (point[0], point[1], point[2]);
+	hit.normal = vec3 (normal[0] / len, normal[1] / len, normal[2] / len);
+}
+
+static bool raycast (const MeshBVH& bvh, const vec3& origin, const vec3& direction, float max_t, BVHHit& hit, bool simd) {
+	BVHQuery q;
+	make_query (q, origin, direction, 0.0f);
+	float t;
+	int tri = traverse (bvh, q, 0.0f, max_t, simd, t, NULL);
+	if (tri < 0) {
+		return false;
+	}
+	float point[3], n[3];
+	madd3 (q.origin, q.direction, t, point);
+	triangle_normal (bvh, tri, n);
+	if (dot3 (n, q.direction) > 0.0f) {
+		n[0] = -n[0];
+		n[1] = -n[1];
+		n[2] = -n[2];
+	}
+	set_hit (hit, bvh, tri, t, point, n);
+	return true;
+}
+
+bool raycast_bvh (const MeshBVH& bvh, const vec3& origin, const vec3& direction, float max_t, BVHHit& hit) {
+	return raycast (bvh, origin, direction, max_t, hit, true);
+}
+
+bool raycast_bvh_scalar (const MeshBVH& bvh, const vec3& origin, const vec3& direction, float max_t, BVHHit& hit) {
+	return raycast (bvh, origin, direction, max_t, hit, false);
+}
+
+bool sweep_sphere_bvh (const MeshBVH& bvh, const vec3& start, const vec3& end, float radius, BVHHit& hit) {
+	BVHQuery q;
+	vec3 direction (end.v[0] - start.v[0], end.v[1] - start.v[1], end.v[2] - start.v[2]);
+	make_query (q, start, direction, radius);
+	float t, touch[3];
+	int tri = traverse (bvh, q, radius, 1.0f, true, t, touch);
+	if (tri < 0) {
+		return false;
+	}
+	// from the touch out to the centre, or the face's normal when the centre is on it
+	float centre[3], n[3];
+	madd3 (q.origin, q.direction, t, centre);
+	if (radius <= 0.0f) {
+		// no radius is a ray, which touches where the centre is
+		std::copy (centre, centre + 3, touch);
+	}
+	sub3 (centre, touch, n);
+	if (dot3 (n, n) < 1e-12f) {
+		triangle_normal (bvh, tri, n);
+	}
+	set_hit (hit, bvh, tri, t, touch, n);
+	return true;
+}
+
+/*-----------------------------------INSTANCES----------------------------------------*/
+
+// m is column major, see maths_funcs.h
+static vec3 transform_point (const mat4& m, const vec3& p) {
+	return vec3 (m.m[0] * p.v[0] + m.m[4] * p.v[1] + m.m[8] * p.v[2] + m.m[12],
+		m.m[1] * p.v[0] + m.m[5] * p.v[1] + m.m[9] * p.v[2] + m.m[13],
+		m.m[2] * p.v[0] + m.m[6] * p.v[1] + m.m[10] * p.v[2] + m.m[14]);
+}
+
+static vec3 transform_vector (const mat4& m, const vec3& d) {
+	return vec3 (m.m[0] * d.v[0] + m.m[4] * d.v[1] + m.m[8] * d.v[2],
+		m.m[1] * d.v[0] + m.m[5] * d.v[1] + m.m[9] * d.v[2],
+		m.m[2] * d.v[0] + m.m[6] * d.v[1] + m.m[10] * d.v[2]);
+}
+
+// Normals go through the inverse transpose, so scaling one axis still leaves them at right angles to the surface
+static vec3 transform_normal (const mat4& inverse_model, const vec3& n) {
+	const float* m = inverse_model.m;
+	vec3 out (m[0] * n.v[0] + m[1] * n.v[1] + m[2] * n.v[2],
+		m[4] * n.v[0] + m[5] * n.v[1] + m[6] * n.v[2],
+		m[8] * n.v[0] + m[9] * n.v[1] + m[10] * n.v[2]);
+	return normalise (out);
+}
+
+// Points along the query map across unchanged in t, only the hit needs moving back
+bool raycast_instance (const MeshBVH& bvh, const mat4& model, const mat4& inverse_model, const vec3& origin, const vec3& direction, float max_t, BVHHit& hit) {
+	if (!raycast_bvh (bvh, transform_point (inverse_model, origin), transform_vector (inverse_model, direction), max_t, hit)) {
+		return false;
+	}
+	hit.point = transform_point (model, hit.point);
+	hit.normal = transform_normal (inverse_model, hit.normal);
+	return true;
+}
+
+bool sweep_sphere_instance (const MeshBVH& bvh, const mat4& model, const mat4& inverse_model, const vec3& start, const vec3& end, float radius, BVHHit& hit) {
+	float scale = sqrtf (model.m[0] * model.m[0] + model.m[1] * model.m[1] + model.m[2] * model.m[2]);
+	if (!sweep_sphere_bvh (bvh, transform_point (inverse_model, start), transform_point (inverse_model, end), radius / scale, hit)) {
+		return false;
+	}
+	hit.point = transform_point (model, hit.point);
+	hit.normal = transform_normal (inverse_model, hit.normal);
+	return true;
+}
+
+// The nodes are four wide, so SSE whether or not AVX is allowed
+int bvh_simd_width () {
+	return 4;
+}
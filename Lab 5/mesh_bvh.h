@@ -0,0 +1,74 @@
+#ifndef _MESH_BVH_H_
+#define _MESH_BVH_H_
+
+#include <vector>
+#include "maths_funcs.h"
+
+/*----------------------------------------------------------------------------
+                   MESH BVH
+  ----------------------------------------------------------------------------*/
+// Bounding volume hierarchy over one mesh's triangles, for exact hits
+// against its shape rather than a circle on the ground. Built once when the
+// mesh is loaded and shared by every instance: queries in world space are
+// moved into the mesh's space by the instance's inverse model matrix.
+//
+// The build is top down with the surface area heuristic, binning triangle
+// centroids into BVH_SAH_BINS slots per axis and taking the cheapest split.
+// The binary tree is then collapsed to four children per node, with the
+// four boxes stored side by side so one SSE slab test covers them all.
+// Traversal visits the children it hits nearest first and skips any child
+// further than the closest hit so far.
+//
+// Rays return the closest hit. Swept spheres move a sphere along a segment
+// and return the first touch, testing boxes grown by the radius and then
+// the triangle's face, edges and corners.
+
+#define BVH_LEAF_TRIANGLES 4  // stop splitting at this many
+#define BVH_MAX_LEAF_TRIANGLES 16  // unless splitting costs more, up to this many
+#define BVH_SAH_BINS 12
+#define BVH_MAX_DEPTH 40  // binary levels, a node this deep stays a leaf however many triangles it has
+#define BVH_STACK_SIZE (3 * BVH_MAX_DEPTH + 1)  // nodes waiting during a traversal, three per level at most
+
+struct BVHNode4 {
+	float min_x[4], min_y[4], min_z[4];
+	float max_x[4], max_y[4], max_z[4];
+	int child[4];  // node index, or a leaf's first triangle
+	int count[4];  // a leaf's triangles, 0 for a node, -1 for an empty lane
+};
+
+struct MeshBVH {
+	std::vector<BVHNode4> nodes;  // the root is nodes[0]
+	std::vector<float> triangles;  // three corners of three floats each, in leaf order
+	std::vector<int> source;  // each triangle's index in the mesh
+	vec3 bounds_min, bounds_max;
+	int triangle_count;
+	int depth;
+	double build_ms;
+};
+
+struct BVHHit {
+	float t;  // along the query, in units of its direction (0 to 1 for a sweep)
+	int triangle;  // index in the mesh
+	vec3 point;  // where the ray meets the triangle, or where the sphere touches it
+	vec3 normal;  // of the triangle facing the query, or from the touch to the sphere's centre
+};
+
+// vp holds vertex_count positions, every three a triangle
+void build_mesh_bvh (MeshBVH& bvh, const std::vector<float>& vp, int vertex_count);
+
+// Closest triangle the ray from origin along direction meets before max_t
+bool raycast_bvh (const MeshBVH& bvh, const vec3& origin, const vec3& direction, float max_t, BVHHit& hit);
+// The same, testing the boxes one at a time, for comparison in the benchmark
+bool raycast_bvh_scalar (const MeshBVH& bvh, const vec3& origin, const vec3& direction, float max_t, BVHHit& hit);
+// First triangle a sphere of radius touches moving from start to end
+bool sweep_sphere_bvh (const MeshBVH& bvh, const vec3& start, const vec3& end, float radius, BVHHit& hit);
+
+// The same against an instance, everything in and out in world space. The
+// sweep expects a model matrix with the same scale on every axis.
+bool raycast_instance (const MeshBVH& bvh, const mat4& model, const mat4& inverse_model, const vec3& origin, const vec3& direction, float max_t, BVHHit& hit);
+bool sweep_sphere_instance (const MeshBVH& bvh, const mat4& model, const mat4& inverse_model, const vec3& start, const vec3& end, float radius, BVHHit& hit);
+
+// Boxes tested per instruction by raycast_bvh
+int bvh_simd_width ();
+
+#endif
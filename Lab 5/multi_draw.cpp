@@ -0,0 +1,208 @@
+#include "multi_draw.h"
+#include "gl_state.h"
+#include "stb_image.h"
+#include <map>
+#include <string.h>
+
+// Macro for indexing vertex buffer
+#define BUFFER_OFFSET(i) ((char *)NULL + (i))
+
+/*-----------------------------------MESH POOL----------------------------------------*/
+
+// identical vertices are merged, so compare all eight floats
+struct PoolVertex {
+	float v[8];
+	bool operator< (const PoolVertex& rhs) const {
+		return memcmp (v, rhs.v, sizeof (v)) < 0;
+	}
+};
+
+int add_pool_mesh (MeshPool& pool, const std::vector<float>& vp, const std::vector<float>& vn, const std::vector<float>& vt, int vertex_count) {
+	PoolMesh mesh;
+	mesh.first_index = (GLuint)pool.indices.size ();
+	mesh.index_count = vertex_count;
+	mesh.base_vertex = (GLint)(pool.vertices.size () / 8);
+	mesh.bounds = compute_bounding_sphere (vp, vertex_count);
+
+	std::map<PoolVertex, GLuint> welded;
+	GLuint next_index = 0;
+	for (int i = 0; i < vertex_count; i++) {
+		PoolVertex pv;
+		for (int c = 0; c < 3; c++) {
+			pv.v[c] = vp[i * 3 + c];
+			pv.v[3 + c] = vn.empty () ? 0.0f : vn[i * 3 + c];
+		}
+		pv.v[6] = vt.empty () ? 0.0f : vt[i * 2 + 0];
+		pv.v[7] = vt.empty () ? 0.0f : vt[i * 2 + 1];
+
+		std::map<PoolVertex, GLuint>::iterator it = welded.find (pv);
+		if (it == welded.end ()) {
+			it = welded.insert (std::make_pair (pv, next_index++)).first;
+			pool.vertices.insert (pool.vertices.end (), pv.v, pv.v + 8);
+		}
+		// indices are relative to the mesh, base_vertex moves them into the pool
+		pool.indices.push_back (it->second);
+	}
+	mesh.vertex_count = next_index;
+	pool.meshes.push_back (mesh);
+	return (int)pool.meshes.size () - 1;
+}
+
+void create_mesh_pool_buffers (MeshPool& pool, GLuint program, GLuint depth_program) {
+	glGenVertexArrays (1, &pool.vao);
+	glBindVertexArray (pool.vao);
+
+	glGenBuffers (1, &pool.vertex_buffer);
+	glBindBuffer (GL_ARRAY_BUFFER, pool.vertex_buffer);
+	glBufferData (GL_ARRAY_BUFFER, pool.vertices.size () * sizeof (float), &pool.vertices[0], GL_STATIC_DRAW);
+	glGenBuffers (1, &pool.index_buffer);
+	glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, pool.index_buffer);
+	glBufferData (GL_ELEMENT_ARRAY_BUFFER, pool.indices.size () * sizeof (GLuint), &pool.indices[0], GL_STATIC_DRAW);
+
+	GLsizei stride = 8 * sizeof (float);
+	GLint position_loc = glGetAttribLocation (program, "vertex_position");
+	GLint normal_loc = glGetAttribLocation (program, "vertex_normal");
+	GLint texture_loc = glGetAttribLocation (program, "vertex_texture");
+	if (position_loc >= 0) {
+		glEnableVertexAttribArray (position_loc);
+		glVertexAttribPointer (position_loc, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (0));
+	}
+	if (normal_loc >= 0) {
+		glEnableVertexAttribArray (normal_loc);
+		glVertexAttribPointer (normal_loc, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (3 * sizeof (float)));
+	}
+	if (texture_loc >= 0) {
+		glEnableVertexAttribArray (texture_loc);
+		glVertexAttribPointer (texture_loc, 2, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (6 * sizeof (float)));
+	}
+
+	// same buffers, but the depth pre-pass only fetches positions
+	glGenVertexArrays (1, &pool.depth_vao);
+	glBindVertexArray (pool.depth_vao);
+	glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, pool.index_buffer);
+	position_loc = glGetAttribLocation (depth_program, "vertex_position");
+	if (position_loc >= 0) {
+		glEnableVertexAttribArray (position_loc);
+		glVertexAttribPointer (position_loc, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (0));
+	}
+	glBindVertexArray (0);
+}
+
+/*-----------------------------------TEXTURE ARRAY------------------------------------*/
+
+// Bilinear resample of an RGB image to TEXTURE_ARRAY_SIZE squared
+static void resample_rgb (const unsigned char* src, int w, int h, std::vector<unsigned char>& dst) {
+	const int size = TEXTURE_ARRAY_SIZE;
+	dst.resize (size * size * 3);
+	for (int y = 0; y < size; y++) {
+		float fy = (y + 0.5f) * h / size - 0.5f;
+		int y0 = fy < 0.0f ? 0 : (int)fy;
+		int y1 = y0 + 1 < h ? y0 + 1 : h - 1;
+		float ty = fy - y0 < 0.0f ? 0.0f : fy - y0;
+		for (int x = 0; x < size; x++) {
+			float fx = (x + 0.5f) * w / size - 0.5f;
+			int x0 = fx < 0.0f ? 0 : (int)fx;
+			int x1 = x0 + 1 < w ? x0 + 1 : w - 1;
+			float tx = fx - x0 < 0.0f ? 0.0f : fx - x0;
+			for (int c = 0; c < 3; c++) {
+				float top = src[(y0 * w + x0) * 3 + c] * (1.0f - tx) + src[(y0 * w + x1) * 3 + c] * tx;
+				float bottom = src[(y1 * w + x0) * 3 + c] * (1.0f - tx) + src[(y1 * w + x1) * 3 + c] * tx;
+				dst[(y * size + x) * 3 + c] = (unsigned char)(top * (1.0f - ty) + bottom * ty + 0.5f);
+			}
+		}
+	}
+}
+
+GLuint load_texture_array (const char** file_names, int count) {
+	GLuint tex;
+	glGenTextures (1, &tex);
+	glActiveTexture (GL_TEXTURE0 + TEXTURE_ARRAY_UNIT);
+	glBindTexture (GL_TEXTURE_2D_ARRAY, tex);
+	glTexImage3D (GL_TEXTURE_2D_ARRAY, 0, GL_RGB, TEXTURE_ARRAY_SIZE, TEXTURE_ARRAY_SIZE, count, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+	std::vector<unsigned char> layer;
+	for (int i = 0; i < count; i++) {
+		int img_width, img_height, n;
+		unsigned char* loaded_image = stbi_load (file_names[i], &img_width, &img_height, &n, STBI_rgb);
+		if (!loaded_image) {
+			fprintf (stderr, "ERROR: reading texture %s\n", file_names[i]);
+			continue;
+		}
+		resample_rgb (loaded_image, img_width, img_height, layer);
+		stbi_image_free (loaded_image);
+		glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+		glTexSubImage3D (GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, TEXTURE_ARRAY_SIZE, TEXTURE_ARRAY_SIZE, 1, GL_RGB, GL_UNSIGNED_BYTE, &layer[0]);
+	}
+
+	glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glGenerateMipmap (GL_TEXTURE_2D_ARRAY);
+	glActiveTexture (GL_TEXTURE0);
+	return tex;
+}
+
+/*-----------------------------------INDIRECT FRAME-----------------------------------*/
+
+void create_indirect_frame (IndirectFrame& frame) {
+	glGenBuffers (1, &frame.command_buffer);
+	glGenBuffers (1, &frame.draw_data_buffer);
+	glGenBuffers (1, &frame.instance_buffer);
+}
+
+void begin_indirect_frame (IndirectFrame& frame) {
+	frame.commands.clear ();
+	frame.draw_data.clear ();
+	frame.instances.clear ();
+	frame.draw_bounds.clear ();
+}
+
+void add_indirect_draw (IndirectFrame& frame, const MeshPool& pool, int mesh, GLuint texture_layer, GLuint material, const InstanceData* instances, int count) {
+	if (count <= 0) {
+		return;
+	}
+	const PoolMesh& m = pool.meshes[mesh];
+	DrawElementsIndirectCommand cmd;
+	cmd.count = m.index_count;
+	cmd.instance_count = count;
+	cmd.first_index = m.first_index;
+	cmd.base_vertex = m.base_vertex;
+	cmd.base_instance = 0;  // the shader finds its instances through DrawData instead
+	frame.commands.push_back (cmd);
+
+	IndirectDrawData data;
+	data.first_instance = (GLuint)frame.instances.size ();
+	data.texture_layer = texture_layer;
+	data.material = material;
+	data.pad = 0;
+	frame.draw_data.push_back (data);
+	frame.draw_bounds.push_back (m.bounds);
+
+	frame.instances.insert (frame.instances.end (), instances, instances + count);
+}
+
+void upload_indirect_frame (IndirectFrame& frame) {
+	if (frame.commands.empty ()) {
+		return;
+	}
+	// orphan and refill, the buffers are rebuilt every frame
+	glBindBuffer (GL_DRAW_INDIRECT_BUFFER, frame.command_buffer);
+	glBufferData (GL_DRAW_INDIRECT_BUFFER, frame.commands.size () * sizeof (DrawElementsIndirectCommand), &frame.commands[0], GL_STREAM_DRAW);
+	glBindBuffer (GL_SHADER_STORAGE_BUFFER, frame.draw_data_buffer);
+	glBufferData (GL_SHADER_STORAGE_BUFFER, frame.draw_data.size () * sizeof (IndirectDrawData), &frame.draw_data[0], GL_STREAM_DRAW);
+	glBindBuffer (GL_SHADER_STORAGE_BUFFER, frame.instance_buffer);
+	glBufferData (GL_SHADER_STORAGE_BUFFER, frame.instances.size () * sizeof (InstanceData), &frame.instances[0], GL_STREAM_DRAW);
+	glBindBuffer (GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void issue_indirect_frame (const IndirectFrame& frame, GLuint vao) {
+	if (frame.commands.empty ()) {
+		return;
+	}
+	glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 0, frame.draw_data_buffer);
+	glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 1, frame.instance_buffer);
+	glBindBuffer (GL_DRAW_INDIRECT_BUFFER, frame.command_buffer);
+	gls_bind_vertex_array (vao);
+	glMultiDrawElementsIndirect (GL_TRIANGLES, GL_UNSIGNED_INT, NULL, (GLsizei)frame.commands.size (), 0);
+}
@@ -0,0 +1,79 @@
+#ifndef _MULTI_DRAW_H_
+#define _MULTI_DRAW_H_
+
+#include <GL/glew.h>
+#include <vector>
+#include "instancing.h"
+
+/*----------------------------------------------------------------------------
+                   MULTI-DRAW INDIRECT SUBMISSION
+  ----------------------------------------------------------------------------*/
+// All meshes live in one shared vertex/index buffer (the MeshPool) and all
+// textures in one texture array, so nothing needs rebinding between meshes.
+// A frame is then a list of DrawElementsIndirectCommand records plus, per
+// command, a DrawData entry that ToonMDIVertexShader.txt fetches with
+// gl_DrawIDARB. The whole list goes out in one glMultiDrawElementsIndirect.
+
+#define TEXTURE_ARRAY_UNIT 4
+#define TEXTURE_ARRAY_SIZE 1024  // every layer is resampled to this width and height
+
+struct PoolMesh {
+	GLuint first_index;
+	GLuint index_count;
+	GLint base_vertex;
+	GLuint vertex_count;  // welded vertices from base_vertex on
+	BoundingSphere bounds;  // local space, for culling on the GPU
+};
+
+struct MeshPool {
+	GLuint vao, vertex_buffer, index_buffer;
+	GLuint depth_vao;  // positions only, for the depth pre-pass
+	std::vector<float> vertices;  // position(3) normal(3) texcoord(2), interleaved
+	std::vector<GLuint> indices;
+	std::vector<PoolMesh> meshes;
+};
+
+// Layout fixed by the GL spec
+struct DrawElementsIndirectCommand {
+	GLuint count;
+	GLuint instance_count;
+	GLuint first_index;
+	GLint base_vertex;
+	GLuint base_instance;
+};
+
+// Mirrors DrawData in ToonMDIVertexShader.txt (std430)
+struct IndirectDrawData {
+	GLuint first_instance;
+	GLuint texture_layer;
+	GLuint material;
+	GLuint pad;
+};
+
+struct IndirectFrame {
+	std::vector<DrawElementsIndirectCommand> commands;
+	std::vector<IndirectDrawData> draw_data;
+	std::vector<InstanceData> instances;  // mirrors InstanceData in the shader
+	std::vector<BoundingSphere> draw_bounds;  // mesh bounds of every command
+	GLuint command_buffer, draw_data_buffer, instance_buffer;
+};
+
+// Weld a non-indexed triangle list into the pool, returns the pool mesh index
+int add_pool_mesh (MeshPool& pool, const std::vector<float>& vp, const std::vector<float>& vn, const std::vector<float>& vt, int vertex_count);
+// Upload the pool once every mesh has been added, with a VAO for each program
+void create_mesh_pool_buffers (MeshPool& pool, GLuint program, GLuint depth_program);
+
+// Load image files into the layers of one GL_TEXTURE_2D_ARRAY
+GLuint load_texture_array (const char** file_names, int count);
+
+void create_indirect_frame (IndirectFrame& frame);
+void begin_indirect_frame (IndirectFrame& frame);
+// Queue one command drawing count instances of a pool mesh
+void add_indirect_draw (IndirectFrame& frame, const MeshPool& pool, int mesh, GLuint texture_layer, GLuint material, const InstanceData* instances, int count);
+void upload_indirect_frame (IndirectFrame& frame);
+// Issue the uploaded (or GPU culled) frame as a single glMultiDrawElementsIndirect
+// with the program in use, from pool.vao or pool.depth_vao. Can be repeated,
+// e.g. for the colour pass after a depth pre-pass.
+void issue_indirect_frame (const IndirectFrame& frame, GLuint vao);
+
+#endif
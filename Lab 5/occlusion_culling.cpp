@@ -0,0 +1,329 @@
+#include "occlusion_culling.h"
+#include "image_write.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <xmmintrin.h> // SSE
+
+/*-----------------------------------OCCLUDER MESHES----------------------------------*/
+
+static void push_vertex (OccluderMesh& mesh, float x, float y, float z) {
+	mesh.positions.push_back (x);
+	mesh.positions.push_back (y);
+	mesh.positions.push_back (z);
+}
+
+void add_box_occluder (OccluderMesh& mesh, const vec3& lo, const vec3& hi) {
+	float c[8][3];
+	for (int i = 0; i < 8; i++) {
+		c[i][0] = (i & 1) ? hi.v[0] : lo.v[0];
+		c[i][1] = (i & 2) ? hi.v[1] : lo.v[1];
+		c[i][2] = (i & 4) ? hi.v[2] : lo.v[2];
+	}
+	// two triangles per face, winding does not matter to the rasterizer
+	static const int faces[6][4] = {
+		{ 0, 1, 3, 2 }, { 4, 5, 7, 6 }, { 0, 1, 5, 4 },
+		{ 2, 3, 7, 6 }, { 0, 2, 6, 4 }, { 1, 3, 7, 5 }
+	};
+	for (int f = 0; f < 6; f++) {
+		const int* q = faces[f];
+		int tris[6] = { q[0], q[1], q[2], q[0], q[2], q[3] };
+		for (int v = 0; v < 6; v++) {
+			push_vertex (mesh, c[tris[v]][0], c[tris[v]][1], c[tris[v]][2]);
+		}
+	}
+}
+
+void add_mesh_occluder (OccluderMesh& mesh, const std::vector<float>& vp, int vertex_count) {
+	mesh.positions.insert (mesh.positions.end (), vp.begin (), vp.begin () + vertex_count * 3);
+}
+
+// basicTree.dae is z up: a trunk of radius 0.27 under three stacked cones.
+// Each box fits inside the cross section at the top of its slab.
+void make_tree_occluder (OccluderMesh& mesh) {
+	mesh.positions.clear ();
+	add_box_occluder (mesh, vec3 (-0.19f, -0.19f, 0.0f), vec3 (0.19f, 0.19f, 0.47f));
+	add_box_occluder (mesh, vec3 (-0.27f, -0.27f, 0.47f), vec3 (0.27f, 0.27f, 0.86f));
+	add_box_occluder (mesh, vec3 (-0.24f, -0.24f, 0.86f), vec3 (0.24f, 0.24f, 1.23f));
+	add_box_occluder (mesh, vec3 (-0.2f, -0.2f, 1.23f), vec3 (0.2f, 0.2f, 1.6f));
+}
+
+// UVSnowman.obj is y up, three balls centred on (-0.02, y, -0.01). A cube fits
+// in a ball when its half size is under radius / sqrt(3).
+void make_snowman_occluder (OccluderMesh& mesh) {
+	mesh.positions.clear ();
+	const float centres[3] = { 1.0f, 2.3f, 3.4f };
+	const float halves[3] = { 0.52f, 0.38f, 0.27f };
+	for (int i = 0; i < 3; i++) {
+		vec3 c (-0.02f, centres[i], -0.01f);
+		vec3 h (halves[i], halves[i], halves[i]);
+		add_box_occluder (mesh, c - h, c + h);
+	}
+}
+
+/*-----------------------------------SETUP--------------------------------------------*/
+
+void create_occlusion_buffer (OcclusionBuffer& buffer, int width, int height, float near_plane, JobSystem* jobs) {
+	buffer.width = (width + 3) & ~3;
+	buffer.height = height;
+	buffer.near_plane = near_plane;
+	buffer.jobs = jobs;
+	buffer.view_proj = identity_mat4 ();
+	buffer.depth.assign (buffer.width * buffer.height, 0.0f);
+	buffer.triangles.clear ();
+}
+
+void begin_occlusion_frame (OcclusionBuffer& buffer, const mat4& view_proj) {
+	buffer.view_proj = view_proj;
+	buffer.triangles.clear ();
+	buffer.stats.occluders = 0;
+	buffer.stats.triangles = 0;
+	buffer.stats.raster_ms = 0.0;
+	buffer.stats.tested = 0;
+	buffer.stats.occluded = 0;
+}
+
+struct ClipVertex {
+	float x, y, w;
+};
+
+static void emit_triangle (OcclusionBuffer& buffer, const ClipVertex& a, const ClipVertex& b, const ClipVertex& c) {
+	const ClipVertex* v[3] = { &a, &b, &c };
+	for (int i = 0; i < 3; i++) {
+		float iw = 1.0f / v[i]->w;
+		buffer.triangles.push_back ((v[i]->x * iw * 0.5f + 0.5f) * buffer.width);
+		buffer.triangles.push_back ((0.5f - v[i]->y * iw * 0.5f) * buffer.height);
+		buffer.triangles.push_back (iw);
+	}
+	buffer.stats.triangles++;
+}
+
+void add_occluder (OcclusionBuffer& buffer, const OccluderMesh& mesh, const mat4& model) {
+	mat4 mvp = buffer.view_proj * model;
+	const float* m = mvp.m;
+	const float* p = mesh.positions.empty () ? NULL : &mesh.positions[0];
+	int vertex_count = (int)mesh.positions.size () / 3;
+	float near_w = buffer.near_plane;
+
+	for (int t = 0; t + 3 <= vertex_count; t += 3) {
+		ClipVertex in[3];
+		int behind = 0;
+		for (int i = 0; i < 3; i++) {
+			const float* v = p + (t + i) * 3;
+			in[i].x = m[0] * v[0] + m[4] * v[1] + m[8] * v[2] + m[12];
+			in[i].y = m[1] * v[0] + m[5] * v[1] + m[9] * v[2] + m[13];
+			in[i].w = m[3] * v[0] + m[7] * v[1] + m[11] * v[2] + m[15];
+			behind += in[i].w < near_w ? 1 : 0;
+		}
+		if (behind == 3) {
+			continue;
+		}
+		if (behind == 0) {
+			emit_triangle (buffer, in[0], in[1], in[2]);
+			continue;
+		}
+		// clip against w = near, a triangle becomes a triangle or a quad
+		ClipVertex out[4];
+		int n = 0;
+		for (int i = 0; i < 3; i++) {
+			const ClipVertex& a = in[i];
+			const ClipVertex& b = in[(i + 1) % 3];
+			bool a_in = a.w >= near_w, b_in = b.w >= near_w;
+			if (a_in) {
+				out[n++] = a;
+			}
+			if (a_in != b_in) {
+				float s = (near_w - a.w) / (b.w - a.w);
+				out[n].x = a.x + (b.x - a.x) * s;
+				out[n].y = a.y + (b.y - a.y) * s;
+				out[n].w = near_w;
+				n++;
+			}
+		}
+		emit_triangle (buffer, out[0], out[1], out[2]);
+		if (n == 4) {
+			emit_triangle (buffer, out[0], out[2], out[3]);
+		}
+	}
+	buffer.stats.occluders++;
+}
+
+/*-----------------------------------RASTERIZER---------------------------------------*/
+
+// Fill rows [row_first, row_last) with every triangle that overlaps them.
+// Pixels are sampled at their centres, four at a time along a row.
+static void rasterize_rows (OcclusionBuffer* buffer, int row_first, int row_last) {
+	int width = buffer->width;
+	float* depth = &buffer->depth[0];
+	const float* tris = buffer->triangles.empty () ? NULL : &buffer->triangles[0];
+	int tri_count = (int)buffer->triangles.size () / 9;
+	const __m128 lane_offsets = _mm_set_ps (3.5f, 2.5f, 1.5f, 0.5f);
+
+	for (int t = 0; t < tri_count; t++) {
+		const float* v = tris + t * 9;
+		float x0 = v[0], y0 = v[1], z0 = v[2];
+		float x1 = v[3], y1 = v[4], z1 = v[5];
+		float x2 = v[6], y2 = v[7], z2 = v[8];
+
+		float area = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+		if (fabs (area) < 1e-8f) {
+			continue;
+		}
+		// bounding box in pixels, clamped to this thread's band
+		int min_x = (int)floor (fmin (x0, fmin (x1, x2)));
+		int max_x = (int)ceil (fmax (x0, fmax (x1, x2)));
+		int min_y = (int)floor (fmin (y0, fmin (y1, y2)));
+		int max_y = (int)ceil (fmax (y0, fmax (y1, y2)));
+		if (min_x < 0) min_x = 0;
+		if (max_x > width) max_x = width;
+		if (min_y < row_first) min_y = row_first;
+		if (max_y > row_last) max_y = row_last;
+		if (min_x >= max_x || min_y >= max_y) {
+			continue;
+		}
+		min_x &= ~3;
+
+		// edge functions e(x, y) = a * x + b * y + c, made positive inside
+		float sign = area > 0.0f ? 1.0f : -1.0f;
+		float a0 = (y1 - y2) * sign, b0 = (x2 - x1) * sign, c0 = (x1 * y2 - x2 * y1) * sign;
+		float a1 = (y2 - y0) * sign, b1 = (x0 - x2) * sign, c1 = (x2 * y0 - x0 * y2) * sign;
+		float a2 = (y0 - y1) * sign, b2 = (x1 - x0) * sign, c2 = (x0 * y1 - x1 * y0) * sign;
+		// 1/w as a plane over the screen
+		float inv_area = 1.0f / (area * sign);
+		float dz_dx = (a0 * z0 + a1 * z1 + a2 * z2) * inv_area;
+		float dz_dy = (b0 * z0 + b1 * z1 + b2 * z2) * inv_area;
+		float z_c = (c0 * z0 + c1 * z1 + c2 * z2) * inv_area;
+
+		__m128 step_e0 = _mm_set1_ps (a0 * 4.0f), step_e1 = _mm_set1_ps (a1 * 4.0f), step_e2 = _mm_set1_ps (a2 * 4.0f);
+		__m128 step_z = _mm_set1_ps (dz_dx * 4.0f);
+		__m128 xs = _mm_add_ps (_mm_set1_ps ((float)min_x), lane_offsets);
+		__m128 zero = _mm_setzero_ps ();
+
+		for (int y = min_y; y < max_y; y++) {
+			float py = y + 0.5f;
+			__m128 e0 = _mm_add_ps (_mm_mul_ps (_mm_set1_ps (a0), xs), _mm_set1_ps (b0 * py + c0));
+			__m128 e1 = _mm_add_ps (_mm_mul_ps (_mm_set1_ps (a1), xs), _mm_set1_ps (b1 * py + c1));
+			__m128 e2 = _mm_add_ps (_mm_mul_ps (_mm_set1_ps (a2), xs), _mm_set1_ps (b2 * py + c2));
+			__m128 z = _mm_add_ps (_mm_mul_ps (_mm_set1_ps (dz_dx), xs), _mm_set1_ps (dz_dy * py + z_c));
+			float* row = depth + y * width;
+			for (int x = min_x; x < max_x; x += 4) {
+				__m128 inside = _mm_and_ps (_mm_and_ps (_mm_cmpge_ps (e0, zero), _mm_cmpge_ps (e1, zero)), _mm_cmpge_ps (e2, zero));
+				if (_mm_movemask_ps (inside)) {
+					__m128 old = _mm_loadu_ps (row + x);
+					__m128 nearer = _mm_max_ps (old, z);
+					_mm_storeu_ps (row + x, _mm_or_ps (_mm_and_ps (inside, nearer), _mm_andnot_ps (inside, old)));
+				}
+				e0 = _mm_add_ps (e0, step_e0);
+				e1 = _mm_add_ps (e1, step_e1);
+				e2 = _mm_add_ps (e2, step_e2);
+				z = _mm_add_ps (z, step_z);
+			}
+		}
+	}
+}
+
+static void rasterize_band_job (void* data, int begin, int end) {
+	rasterize_rows ((OcclusionBuffer*)data, begin, end);
+}
+
+void rasterize_occluders (OcclusionBuffer& buffer) {
+	auto start = std::chrono::high_resolution_clock::now ();
+
+	std::fill (buffer.depth.begin (), buffer.depth.end (), 0.0f);
+	// a few occluders are not worth waking the workers for
+	if (!buffer.jobs || buffer.jobs->worker_count == 1 || buffer.stats.triangles < 256) {
+		rasterize_rows (&buffer, 0, buffer.height);
+	}
+	else {
+		// two bands per worker, so a worker with an empty band can steal
+		int band = buffer.height / (2 * buffer.jobs->worker_count);
+		parallel_for (*buffer.jobs, buffer.height, band > 1 ? band : 1, rasterize_band_job, &buffer);
+	}
+
+	auto end = std::chrono::high_resolution_clock::now ();
+	buffer.stats.raster_ms = std::chrono::duration<double, std::milli> (end - start).count ();
+}
+
+/*-----------------------------------OCCLUDEE TESTS-----------------------------------*/
+
+bool sphere_occluded (const OcclusionBuffer& buffer, const BoundingSphere& sphere) {
+	const float* m = buffer.view_proj.m;
+	const float* c = sphere.center.v;
+	float r = sphere.radius;
+	float min_x = 1e30f, max_x = -1e30f, min_y = 1e30f, max_y = -1e30f;
+	float nearest = 0.0f;  // largest 1/w of the box
+	// project the corners of the sphere's bounding box
+	for (int i = 0; i < 8; i++) {
+		float px = c[0] + ((i & 1) ? r : -r);
+		float py = c[1] + ((i & 2) ? r : -r);
+		float pz = c[2] + ((i & 4) ? r : -r);
+		float w = m[3] * px + m[7] * py + m[11] * pz + m[15];
+		if (w < buffer.near_plane) {
+			return false;  // reaches the camera, keep it
+		}
+		float iw = 1.0f / w;
+		float sx = ((m[0] * px + m[4] * py + m[8] * pz + m[12]) * iw * 0.5f + 0.5f) * buffer.width;
+		float sy = (0.5f - (m[1] * px + m[5] * py + m[9] * pz + m[13]) * iw * 0.5f) * buffer.height;
+		min_x = fmin (min_x, sx);
+		max_x = fmax (max_x, sx);
+		min_y = fmin (min_y, sy);
+		max_y = fmax (max_y, sy);
+		nearest = fmax (nearest, iw);
+	}
+	int x0 = (int)floor (min_x), x1 = (int)ceil (max_x);
+	int y0 = (int)floor (min_y), y1 = (int)ceil (max_y);
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > buffer.width) x1 = buffer.width;
+	if (y1 > buffer.height) y1 = buffer.height;
+	if (x0 >= x1 || y0 >= y1) {
+		return false;  // off screen, that is the frustum test's call
+	}
+
+	// visible as soon as one covered pixel is not nearer than the box
+	const float* depth = &buffer.depth[0];
+	__m128 ref = _mm_set1_ps (nearest);
+	__m128 lanes = _mm_set_ps (3.0f, 2.0f, 1.0f, 0.0f);
+	__m128 first = _mm_set1_ps ((float)x0 - 0.5f), last = _mm_set1_ps ((float)x1 - 0.5f);
+	int start = x0 & ~3;
+	for (int y = y0; y < y1; y++) {
+		const float* row = depth + y * buffer.width;
+		for (int x = start; x < x1; x += 4) {
+			__m128 xs = _mm_add_ps (_mm_set1_ps ((float)x), lanes);
+			__m128 in_range = _mm_and_ps (_mm_cmpgt_ps (xs, first), _mm_cmplt_ps (xs, last));
+			__m128 not_hidden = _mm_cmple_ps (_mm_loadu_ps (row + x), ref);
+			if (_mm_movemask_ps (_mm_and_ps (in_range, not_hidden))) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int cull_occluded (OcclusionBuffer& buffer, const SphereSoA& spheres, std::vector<unsigned int>& visible) {
+	int count = 0;
+	for (size_t i = 0; i < visible.size (); i++) {
+		unsigned int s = visible[i];
+		if (!sphere_occluded (buffer, sphere_at (spheres, s))) {
+			visible[count++] = s;
+		}
+	}
+	buffer.stats.tested += (int)visible.size ();
+	buffer.stats.occluded += (int)visible.size () - count;
+	visible.resize (count);
+	return count;
+}
+
+/*-----------------------------------DEBUG DUMP---------------------------------------*/
+
+bool write_occlusion_png (const OcclusionBuffer& buffer, const char* file_name, float max_depth) {
+	int w = buffer.width, h = buffer.height;
+	std::vector<unsigned char> grey (w * h);
+	for (int i = 0; i < w * h; i++) {
+		float d = buffer.depth[i];
+		float g = d > 0.0f ? 1.0f - fmin (1.0f, (1.0f / d) / max_depth) : 0.0f;
+		grey[i] = (unsigned char)(g * 255.0f);
+	}
+	return write_png (file_name, &grey[0], w, h, 1);
+}
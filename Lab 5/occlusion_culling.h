@@ -0,0 +1,70 @@
+#ifndef _OCCLUSION_CULLING_H_
+#define _OCCLUSION_CULLING_H_
+
+#include <vector>
+#include "frustum_culling.h"
+#include "job_system.h"
+#include "maths_funcs.h"
+
+/*----------------------------------------------------------------------------
+                   SOFTWARE OCCLUSION CULLING
+  ----------------------------------------------------------------------------*/
+// Big nearby objects are drawn as cheap stand-in meshes (boxes that fit
+// inside the real mesh) into a small depth buffer on the CPU. Each job
+// fills a band of rows, four pixels at a time with SSE. Each instance's
+// bounding sphere then becomes a screen rectangle at the sphere's nearest
+// depth, and the instance is skipped if every pixel under the rectangle
+// already holds something nearer.
+//
+// The buffer stores 1/w, which is linear in screen space and grows towards
+// the camera, so 0 means nothing has been drawn there.
+
+// Distance drawn as black in the debug PNG, occluders are only used up close
+#define OCCLUSION_DUMP_DEPTH 50.0f
+
+// Triangle list in the mesh's local space, 3 floats per vertex
+struct OccluderMesh {
+	std::vector<float> positions;
+};
+
+struct OcclusionStats {
+	int occluders;
+	int triangles;  // after near plane clipping
+	double raster_ms;
+	int tested;
+	int occluded;
+};
+
+struct OcclusionBuffer {
+	int width, height;  // width is a multiple of 4
+	float near_plane;
+	JobSystem* jobs;  // the rasterizer's workers, NULL for the calling thread
+	mat4 view_proj;
+	std::vector<float> depth;  // 1/w per pixel, row 0 is the top of the screen
+
+	// screen space triangles waiting for rasterize_occluders: x, y, 1/w per vertex
+	std::vector<float> triangles;
+	OcclusionStats stats;
+};
+
+void add_box_occluder (OccluderMesh& mesh, const vec3& lo, const vec3& hi);
+void add_mesh_occluder (OccluderMesh& mesh, const std::vector<float>& vp, int vertex_count);
+// Stand-ins for basicTree.dae (trunk plus the core of each cone) and UVSnowman.obj (two balls)
+void make_tree_occluder (OccluderMesh& mesh);
+void make_snowman_occluder (OccluderMesh& mesh);
+
+void create_occlusion_buffer (OcclusionBuffer& buffer, int width, int height, float near_plane, JobSystem* jobs);
+void begin_occlusion_frame (OcclusionBuffer& buffer, const mat4& view_proj);
+// Transform, near clip and set up an occluder's triangles
+void add_occluder (OcclusionBuffer& buffer, const OccluderMesh& mesh, const mat4& model);
+// Draw all added occluders, spread over the buffer's job workers
+void rasterize_occluders (OcclusionBuffer& buffer);
+
+bool sphere_occluded (const OcclusionBuffer& buffer, const BoundingSphere& sphere);
+// Drop the occluded entries from a list of sphere indices, returns how many are left
+int cull_occluded (OcclusionBuffer& buffer, const SphereSoA& spheres, std::vector<unsigned int>& visible);
+
+// Greyscale PNG of the buffer, fading from white at the camera to black at max_depth
+bool write_occlusion_png (const OcclusionBuffer& buffer, const char* file_name, float max_depth);
+
+#endif
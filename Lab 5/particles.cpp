@@ -0,0 +1,325 @@
+#include "particles.h"
+#include "gl_state.h"
+#include <chrono>
+#include <xmmintrin.h> // SSE
+#ifdef __AVX__
+#include <immintrin.h> // AVX, only when the compiler is allowed to use it (/arch:AVX)
+#endif
+
+// Macro for indexing vertex buffer
+#define BUFFER_OFFSET(i) ((char *)NULL + (i))
+
+/*-----------------------------------POOL---------------------------------------------*/
+
+void create_particle_pool (ParticlePool& pool, int capacity) {
+	capacity = (capacity + 7) & ~7;
+	pool.capacity = capacity;
+	pool.count = 0;
+	std::vector<float>* arrays[9] = { &pool.x, &pool.y, &pool.z, &pool.vx, &pool.vy, &pool.vz, &pool.age, &pool.age_rate, &pool.size };
+	for (int a = 0; a < 9; a++) {
+		arrays[a]->assign (capacity, 0.0f);
+	}
+	pool.gravity = vec3 (0.0f, 0.0f, 0.0f);
+	pool.drag = 0.0f;
+	pool.wrap = false;
+	pool.wrap_min = vec3 (0.0f, 0.0f, 0.0f);
+	pool.wrap_size = vec3 (1.0f, 1.0f, 1.0f);
+	pool.colour_start = pool.colour_end = vec4 (1.0f, 1.0f, 1.0f, 1.0f);
+	pool.size_growth = 0.0f;
+	pool.blend = PARTICLE_BLEND_NONE;
+	pool.seed = 0x9E3779B9u ^ (unsigned int)capacity;
+	pool.vao = pool.quad_buffer = pool.stream_buffer = 0;
+	pool.update_ms = 0.0;
+}
+
+// xorshift32, the scene's rand () sequence is left alone
+static float random_unit (unsigned int& seed) {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return (seed >> 8) * (1.0f / 16777216.0f);
+}
+
+static float random_range (unsigned int& seed, float lo, float hi) {
+	return lo + (hi - lo) * random_unit (seed);
+}
+
+static void spawn_particle (ParticlePool& pool, const ParticleEmitter& e) {
+	int i = pool.count++;
+	unsigned int& s = pool.seed;
+	pool.x[i] = e.position.v[0] + random_range (s, -e.spread.v[0], e.spread.v[0]);
+	pool.y[i] = e.position.v[1] + random_range (s, -e.spread.v[1], e.spread.v[1]);
+	pool.z[i] = e.position.v[2] + random_range (s, -e.spread.v[2], e.spread.v[2]);
+	pool.vx[i] = e.velocity.v[0] + random_range (s, -e.velocity_spread.v[0], e.velocity_spread.v[0]);
+	pool.vy[i] = e.velocity.v[1] + random_range (s, -e.velocity_spread.v[1], e.velocity_spread.v[1]);
+	pool.vz[i] = e.velocity.v[2] + random_range (s, -e.velocity_spread.v[2], e.velocity_spread.v[2]);
+	float life = random_range (s, e.life_min, e.life_max);
+	pool.age[i] = 0.0f;
+	pool.age_rate[i] = life > 0.0f ? 1.0f / life : 0.0f;
+	pool.size[i] = random_range (s, e.size_min, e.size_max);
+}
+
+void emit_particles (ParticlePool& pool, ParticleEmitter& emitter, float dt) {
+	emitter.accumulator += emitter.rate * dt;
+	int n = (int)emitter.accumulator;
+	emitter.accumulator -= n;
+	for (int i = 0; i < n && pool.count < pool.capacity; i++) {
+		spawn_particle (pool, emitter);
+	}
+}
+
+void fill_particles (ParticlePool& pool, const ParticleEmitter& emitter, int count) {
+	for (int i = 0; i < count && pool.count < pool.capacity; i++) {
+		spawn_particle (pool, emitter);
+	}
+}
+
+/*-----------------------------------KERNELS------------------------------------------*/
+
+int particle_simd_width () {
+#ifdef __AVX__
+	return 8;
+#else
+	return 4;
+#endif
+}
+
+// Per-pool constants of one update, already multiplied by dt
+struct ParticleStep {
+	float dt, damp;
+	float gravity_dt[3];
+	bool wrap;
+	float wrap_min[3], wrap_max[3], wrap_size[3];
+};
+
+static inline float wrap_scalar (float p, float lo, float hi, float size) {
+	if (p < lo) {
+		p += size;
+	}
+	else if (p >= hi) {
+		p -= size;
+	}
+	return p;
+}
+
+// Move particles [begin, end), sets *died if any of them reached age 1
+static void update_range (ParticlePool* pool, const ParticleStep* step, int begin, int end, int* died) {
+	float* pos[3] = { &pool->x[0], &pool->y[0], &pool->z[0] };
+	float* vel[3] = { &pool->vx[0], &pool->vy[0], &pool->vz[0] };
+	float* ages = &pool->age[0];
+	const float* rates = &pool->age_rate[0];
+	int dead_mask = 0;
+	int i = begin;
+
+#ifdef __AVX__
+	__m256 dt8 = _mm256_set1_ps (step->dt);
+	__m256 damp8 = _mm256_set1_ps (step->damp);
+	__m256 one8 = _mm256_set1_ps (1.0f);
+	for (; i + 8 <= end; i += 8) {
+		for (int c = 0; c < 3; c++) {
+			__m256 v = _mm256_mul_ps (_mm256_add_ps (_mm256_loadu_ps (vel[c] + i), _mm256_set1_ps (step->gravity_dt[c])), damp8);
+			_mm256_storeu_ps (vel[c] + i, v);
+			__m256 p = _mm256_add_ps (_mm256_loadu_ps (pos[c] + i), _mm256_mul_ps (v, dt8));
+			if (step->wrap) {
+				// add the box size where below it, take it off where past it
+				__m256 size = _mm256_set1_ps (step->wrap_size[c]);
+				__m256 below = _mm256_cmp_ps (p, _mm256_set1_ps (step->wrap_min[c]), _CMP_LT_OQ);
+				__m256 above = _mm256_cmp_ps (p, _mm256_set1_ps (step->wrap_max[c]), _CMP_GE_OQ);
+				p = _mm256_sub_ps (_mm256_add_ps (p, _mm256_and_ps (below, size)), _mm256_and_ps (above, size));
+			}
+			_mm256_storeu_ps (pos[c] + i, p);
+		}
+		__m256 a = _mm256_add_ps (_mm256_loadu_ps (ages + i), _mm256_mul_ps (_mm256_loadu_ps (rates + i), dt8));
+		_mm256_storeu_ps (ages + i, a);
+		dead_mask |= _mm256_movemask_ps (_mm256_cmp_ps (a, one8, _CMP_GE_OQ));
+	}
+#endif
+
+	__m128 dt4 = _mm_set1_ps (step->dt);
+	__m128 damp4 = _mm_set1_ps (step->damp);
+	__m128 one4 = _mm_set1_ps (1.0f);
+	for (; i + 4 <= end; i += 4) {
+		for (int c = 0; c < 3; c++) {
+			__m128 v = _mm_mul_ps (_mm_add_ps (_mm_loadu_ps (vel[c] + i), _mm_set1_ps (step->gravity_dt[c])), damp4);
+			_mm_storeu_ps (vel[c] + i, v);
+			__m128 p = _mm_add_ps (_mm_loadu_ps (pos[c] + i), _mm_mul_ps (v, dt4));
+			if (step->wrap) {
+				__m128 size = _mm_set1_ps (step->wrap_size[c]);
+				__m128 below = _mm_cmplt_ps (p, _mm_set1_ps (step->wrap_min[c]));
+				__m128 above = _mm_cmpge_ps (p, _mm_set1_ps (step->wrap_max[c]));
+				p = _mm_sub_ps (_mm_add_ps (p, _mm_and_ps (below, size)), _mm_and_ps (above, size));
+			}
+			_mm_storeu_ps (pos[c] + i, p);
+		}
+		__m128 a = _mm_add_ps (_mm_loadu_ps (ages + i), _mm_mul_ps (_mm_loadu_ps (rates + i), dt4));
+		_mm_storeu_ps (ages + i, a);
+		dead_mask |= _mm_movemask_ps (_mm_cmpge_ps (a, one4));
+	}
+
+	for (; i < end; i++) {
+		for (int c = 0; c < 3; c++) {
+			vel[c][i] = (vel[c][i] + step->gravity_dt[c]) * step->damp;
+			pos[c][i] += vel[c][i] * step->dt;
+			if (step->wrap) {
+				pos[c][i] = wrap_scalar (pos[c][i], step->wrap_min[c], step->wrap_max[c], step->wrap_size[c]);
+			}
+		}
+		ages[i] += rates[i] * step->dt;
+		dead_mask |= ages[i] >= 1.0f;
+	}
+	*died = dead_mask != 0;
+}
+
+static ParticleStep make_step (const ParticlePool& pool, float dt) {
+	ParticleStep step;
+	step.dt = dt;
+	step.damp = 1.0f - pool.drag * dt;
+	if (step.damp < 0.0f) {
+		step.damp = 0.0f;
+	}
+	step.wrap = pool.wrap;
+	for (int c = 0; c < 3; c++) {
+		step.gravity_dt[c] = pool.gravity.v[c] * dt;
+		step.wrap_min[c] = pool.wrap_min.v[c];
+		step.wrap_size[c] = pool.wrap_size.v[c];
+		step.wrap_max[c] = pool.wrap_min.v[c] + pool.wrap_size.v[c];
+	}
+	return step;
+}
+
+// Fill each dead particle's slot with the last live one
+static void remove_dead (ParticlePool& pool) {
+	std::vector<float>* arrays[9] = { &pool.x, &pool.y, &pool.z, &pool.vx, &pool.vy, &pool.vz, &pool.age, &pool.age_rate, &pool.size };
+	int i = 0;
+	while (i < pool.count) {
+		if (pool.age[i] < 1.0f) {
+			i++;
+			continue;
+		}
+		int last = --pool.count;
+		for (int a = 0; a < 9; a++) {
+			(*arrays[a])[i] = (*arrays[a])[last];
+		}
+	}
+}
+
+struct ParticleJob {
+	ParticlePool* pool;
+	const ParticleStep* step;
+	std::vector<int> died;  // one per job
+};
+
+static void update_range_job (void* data, int begin, int end) {
+	ParticleJob* job = (ParticleJob*)data;
+	update_range (job->pool, job->step, begin, end, &job->died[begin / PARTICLE_JOB_GRAIN]);
+}
+
+void update_particles (ParticlePool& pool, float dt, JobSystem* jobs) {
+	auto start = std::chrono::high_resolution_clock::now ();
+	ParticleStep step = make_step (pool, dt);
+	int count = pool.count;
+	bool any_died = false;
+	if (!jobs || jobs->worker_count == 1 || count < PARTICLE_THREAD_MIN) {
+		int died = 0;
+		update_range (&pool, &step, 0, count, &died);
+		any_died = died != 0;
+	}
+	else {
+		// jobs stay a multiple of 8 so only the last one has a scalar tail
+		ParticleJob job;
+		job.pool = &pool;
+		job.step = &step;
+		job.died.assign ((count + PARTICLE_JOB_GRAIN - 1) / PARTICLE_JOB_GRAIN, 0);
+		parallel_for (*jobs, count, PARTICLE_JOB_GRAIN, update_range_job, &job);
+		for (size_t i = 0; i < job.died.size (); i++) {
+			any_died = any_died || job.died[i] != 0;
+		}
+	}
+	if (any_died) {
+		remove_dead (pool);
+	}
+
+	auto end = std::chrono::high_resolution_clock::now ();
+	pool.update_ms = std::chrono::duration<double, std::milli> (end - start).count ();
+}
+
+void update_particles_scalar (ParticlePool& pool, float dt) {
+	ParticleStep step = make_step (pool, dt);
+	bool any_died = false;
+	for (int i = 0; i < pool.count; i++) {
+		for (int c = 0; c < 3; c++) {
+			float* v = c == 0 ? &pool.vx[i] : c == 1 ? &pool.vy[i] : &pool.vz[i];
+			float* p = c == 0 ? &pool.x[i] : c == 1 ? &pool.y[i] : &pool.z[i];
+			*v = (*v + step.gravity_dt[c]) * step.damp;
+			*p += *v * step.dt;
+			if (step.wrap) {
+				*p = wrap_scalar (*p, step.wrap_min[c], step.wrap_max[c], step.wrap_size[c]);
+			}
+		}
+		pool.age[i] += pool.age_rate[i] * step.dt;
+		any_died = any_died || pool.age[i] >= 1.0f;
+	}
+	if (any_died) {
+		remove_dead (pool);
+	}
+}
+
+/*-----------------------------------DRAWING------------------------------------------*/
+
+void create_particle_buffers (ParticlePool& pool) {
+	// two triangles, corners in [-1, 1]
+	float corners[12] = { -1.0f, -1.0f, 1.0f, -1.0f, 1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, -1.0f, 1.0f };
+	glGenVertexArrays (1, &pool.vao);
+	glBindVertexArray (pool.vao);
+	glGenBuffers (1, &pool.quad_buffer);
+	glBindBuffer (GL_ARRAY_BUFFER, pool.quad_buffer);
+	glBufferData (GL_ARRAY_BUFFER, sizeof (corners), corners, GL_STATIC_DRAW);
+	glEnableVertexAttribArray (0);
+	glVertexAttribPointer (0, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET (0));
+
+	// x, y, z, size and age one after the other, each capacity floats long
+	glGenBuffers (1, &pool.stream_buffer);
+	glBindBuffer (GL_ARRAY_BUFFER, pool.stream_buffer);
+	glBufferData (GL_ARRAY_BUFFER, 5 * pool.capacity * sizeof (float), NULL, GL_STREAM_DRAW);
+	for (int a = 0; a < 5; a++) {
+		GLuint location = 1 + a;
+		glEnableVertexAttribArray (location);
+		glVertexAttribPointer (location, 1, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET (a * pool.capacity * sizeof (float)));
+		glVertexAttribDivisor (location, 1);
+	}
+	glBindVertexArray (0);
+	gls_invalidate ();
+}
+
+void draw_particles (ParticlePool& pool, GLuint program) {
+	if (pool.count == 0) {
+		return;
+	}
+	// orphan last frame's copy so the driver does not wait for it
+	size_t bytes = pool.count * sizeof (float);
+	glBindBuffer (GL_ARRAY_BUFFER, pool.stream_buffer);
+	glBufferData (GL_ARRAY_BUFFER, 5 * pool.capacity * sizeof (float), NULL, GL_STREAM_DRAW);
+	const float* arrays[5] = { &pool.x[0], &pool.y[0], &pool.z[0], &pool.size[0], &pool.age[0] };
+	for (int a = 0; a < 5; a++) {
+		glBufferSubData (GL_ARRAY_BUFFER, a * pool.capacity * sizeof (float), bytes, arrays[a]);
+	}
+
+	gls_use_program (program);
+	glUniform4fv (glGetUniformLocation (program, "colour_start"), 1, pool.colour_start.v);
+	glUniform4fv (glGetUniformLocation (program, "colour_end"), 1, pool.colour_end.v);
+	glUniform1f (glGetUniformLocation (program, "size_growth"), pool.size_growth);
+	if (pool.blend == PARTICLE_BLEND_NONE) {
+		gls_disable (GL_BLEND);
+		gls_depth_mask (GL_TRUE);
+	}
+	else {
+		// blended particles are tested against the scene but do not hide each other
+		gls_enable (GL_BLEND);
+		glBlendFunc (GL_SRC_ALPHA, pool.blend == PARTICLE_BLEND_ADD ? GL_ONE : GL_ONE_MINUS_SRC_ALPHA);
+		gls_depth_mask (GL_FALSE);
+	}
+	gls_bind_vertex_array (pool.vao);
+	glDrawArraysInstanced (GL_TRIANGLES, 0, 6, pool.count);
+	gls_disable (GL_BLEND);
+	gls_depth_mask (GL_TRUE);
+}
@@ -0,0 +1,86 @@
+#ifndef _PARTICLES_H_
+#define _PARTICLES_H_
+
+#include <GL/glew.h>
+#include <vector>
+#include "job_system.h"
+#include "maths_funcs.h"
+
+/*----------------------------------------------------------------------------
+                   PARTICLES
+  ----------------------------------------------------------------------------*/
+// Each kind of particle (flame, embers, smoke, snow) lives in its own pool,
+// stored as structure of arrays. Live particles are packed at the front, a
+// dead one is replaced by the last live one. The update kernel moves eight
+// particles at a time with AVX (four with SSE), with big pools such as the
+// snow split into jobs.
+//
+// Particles are drawn as camera facing quads, one instance each. The
+// position, size and age arrays are copied as they are into one stream
+// buffer, each array feeding its own instance attribute, so nothing is
+// repacked for upload.
+//
+// Age runs from 0 at birth to 1 at death. Particles with an age rate of 0
+// never die: the snow keeps falling and wraps around a box that follows the
+// camera.
+
+#define PARTICLE_THREAD_MIN 16384  // fewer particles than this are updated on one thread
+#define PARTICLE_JOB_GRAIN 8192  // particles per job, a multiple of 8
+
+enum ParticleBlend {
+	PARTICLE_BLEND_NONE = 0,  // hard discs that write depth, for snow
+	PARTICLE_BLEND_ADD = 1,  // glowing, for flames and embers
+	PARTICLE_BLEND_ALPHA = 2  // for smoke
+};
+
+// Where and how new particles start, every range is picked uniformly
+struct ParticleEmitter {
+	vec3 position;
+	vec3 spread;  // half extents of the box around position
+	vec3 velocity;
+	vec3 velocity_spread;
+	float life_min, life_max;  // seconds, 0 for particles that never die
+	float size_min, size_max;
+	float rate;  // particles per second
+	float accumulator;  // fraction of a particle carried to the next frame
+};
+
+struct ParticlePool {
+	int capacity;  // a multiple of 8
+	int count;  // live particles, packed at the front
+	std::vector<float> x, y, z, vx, vy, vz;
+	std::vector<float> age, age_rate, size;  // age_rate is 1 / lifetime
+
+	// the same for every particle in the pool
+	vec3 gravity;
+	float drag;  // fraction of the velocity lost per second
+	bool wrap;  // wrap positions around the box instead of letting them leave
+	vec3 wrap_min, wrap_size;
+	vec4 colour_start, colour_end;  // faded between over the age
+	float size_growth;  // drawn size is size * (1 + size_growth * age)
+	ParticleBlend blend;
+
+	unsigned int seed;  // xorshift state for emission
+	GLuint vao, quad_buffer, stream_buffer;
+	double update_ms;  // last update_particles
+};
+
+void create_particle_pool (ParticlePool& pool, int capacity);
+// Start rate * dt particles (plus the carried fraction), as many as still fit
+void emit_particles (ParticlePool& pool, ParticleEmitter& emitter, float dt);
+// Start count particles at once, e.g. to fill the snow box
+void fill_particles (ParticlePool& pool, const ParticleEmitter& emitter, int count);
+// Move every particle and remove the dead ones, the kernel is spread over the job workers (NULL for the calling thread)
+void update_particles (ParticlePool& pool, float dt, JobSystem* jobs);
+// One particle at a time, for comparison in the benchmark
+void update_particles_scalar (ParticlePool& pool, float dt);
+// Lanes moved per instruction by update_particles on this build
+int particle_simd_width ();
+
+// Quad and stream buffer, with the attribute locations of ParticleVertexShader.txt
+void create_particle_buffers (ParticlePool& pool);
+// Copy the live particles to the stream buffer and draw them. Expects view and
+// proj to already be set on the program; leaves blending off and depth writes on.
+void draw_particles (ParticlePool& pool, GLuint program);
+
+#endif
@@ -0,0 +1,172 @@
+#include "projectiles.h"
+#include <math.h>
+
+/*-----------------------------------POOL---------------------------------------------*/
+
+void create_projectile_pool (ProjectilePool& pool, int capacity, float gravity, float radius) {
+	pool.capacity = capacity;
+	pool.count = 0;
+	pool.gravity = gravity;
+	pool.radius = radius;
+	std::vector<float>* columns[12] = { &pool.launch_x, &pool.launch_y, &pool.launch_z, &pool.velocity_x, &pool.velocity_y, &pool.velocity_z,
+		&pool.x, &pool.y, &pool.z, &pool.previous_x, &pool.previous_y, &pool.previous_z };
+	for (int c = 0; c < 12; c++) {
+		columns[c]->assign (capacity, 0.0f);
+	}
+	pool.launch_time.assign (capacity, 0.0);
+	pool.owner.assign (capacity, 0);
+	pool.launched = pool.fell = pool.full = 0;
+}
+
+int launch_projectile (ProjectilePool& pool, const vec3& position, const vec3& velocity, unsigned int owner, double time) {
+	if (pool.count == pool.capacity) {
+		pool.full++;
+		return -1;
+	}
+	int row = pool.count++;
+	pool.launch_x[row] = pool.x[row] = pool.previous_x[row] = position.v[0];
+	pool.launch_y[row] = pool.y[row] = pool.previous_y[row] = position.v[1];
+	pool.launch_z[row] = pool.z[row] = pool.previous_z[row] = position.v[2];
+	pool.velocity_x[row] = velocity.v[0];
+	pool.velocity_y[row] = velocity.v[1];
+	pool.velocity_z[row] = velocity.v[2];
+	pool.launch_time[row] = time;
+	pool.owner[row] = owner;
+	pool.launched++;
+	return row;
+}
+
+void remove_projectile (ProjectilePool& pool, int row) {
+	int last = --pool.count;
+	if (row == last) {
+		return;
+	}
+	pool.launch_x[row] = pool.launch_x[last];
+	pool.launch_y[row] = pool.launch_y[last];
+	pool.launch_z[row] = pool.launch_z[last];
+	pool.velocity_x[row] = pool.velocity_x[last];
+	pool.velocity_y[row] = pool.velocity_y[last];
+	pool.velocity_z[row] = pool.velocity_z[last];
+	pool.launch_time[row] = pool.launch_time[last];
+	pool.x[row] = pool.x[last];
+	pool.y[row] = pool.y[last];
+	pool.z[row] = pool.z[last];
+	pool.previous_x[row] = pool.previous_x[last];
+	pool.previous_y[row] = pool.previous_y[last];
+	pool.previous_z[row] = pool.previous_z[last];
+	pool.owner[row] = pool.owner[last];
+}
+
+void step_projectiles (ProjectilePool& pool, double time, float floor_y) {
+	// straight loops over the columns, nothing here stops the compiler vectorising them
+	float half_g = -0.5f * pool.gravity;
+	for (int i = 0; i < pool.count; i++) {
+		float age = (float)(time - pool.launch_time[i]);
+		pool.previous_x[i] = pool.x[i];
+		pool.previous_y[i] = pool.y[i];
+		pool.previous_z[i] = pool.z[i];
+		pool.x[i] = pool.launch_x[i] + pool.velocity_x[i] * age;
+		pool.y[i] = pool.launch_y[i] + (pool.velocity_y[i] + half_g * age) * age;
+		pool.z[i] = pool.launch_z[i] + pool.velocity_z[i] * age;
+	}
+	// backwards, so the row moved into a hole has already been checked
+	for (int i = pool.count - 1; i >= 0; i--) {
+		if (pool.y[i] < floor_y) {
+			remove_projectile (pool, i);
+			pool.fell++;
+		}
+	}
+}
+
+// With d the distance across the ground and h the rise to the target,
+// the launch angle satisfies g d^2 tan^2 - 2 v^2 d tan + (g d^2 + 2 h v^2) = 0
+bool aim_projectile (const vec3& from, const vec3& target, float speed, float gravity, vec3& velocity) {
+	float dx = target.v[0] - from.v[0], dz = target.v[2] - from.v[2];
+	float h = target.v[1] - from.v[1];
+	float d = sqrtf (dx * dx + dz * dz);
+	float v2 = speed * speed;
+	if (d < 1e-4f) {
+		velocity = vec3 (0.0f, h >= 0.0f ? speed : -speed, 0.0f);
+		return true;
+	}
+	float disc = v2 * v2 - gravity * (gravity * d * d + 2.0f * h * v2);
+	if (disc < 0.0f) {
+		return false;
+	}
+	float tan_angle = (v2 - sqrtf (disc)) / (gravity * d);
+	float cos_angle = 1.0f / sqrtf (1.0f + tan_angle * tan_angle);
+	float across = speed * cos_angle;
+	velocity = vec3 (dx / d * across, across * tan_angle, dz / d * across);
+	return true;
+}
+
+void capture_projectile_flights (const ProjectilePool& pool, std::vector<ProjectileFlight>& flights) {
+	flights.resize (pool.count);
+	for (int i = 0; i < pool.count; i++) {
+		ProjectileFlight& flight = flights[i];
+		flight.launch = vec3 (pool.launch_x[i], pool.launch_y[i], pool.launch_z[i]);
+		flight.velocity = vec3 (pool.velocity_x[i], pool.velocity_y[i], pool.velocity_z[i]);
+		flight.launch_time = pool.launch_time[i];
+		flight.owner = pool.owner[i];
+	}
+}
+
+vec3 flight_position (const ProjectileFlight& flight, float gravity, double time) {
+	float age = (float)(time - flight.launch_time);
+	if (age < 0.0f) {
+		age = 0.0f;
+	}
+	return vec3 (flight.launch.v[0] + flight.velocity.v[0] * age,
+		flight.launch.v[1] + (flight.velocity.v[1] - 0.5f * gravity * age) * age,
+		flight.launch.v[2] + flight.velocity.v[2] * age);
+}
+
+/*-----------------------------------HIT EVENTS---------------------------------------*/
+
+// A slot whose sequence equals the producers' position is free, one past it has an event in
+void create_hit_event_ring (HitEventRing& ring) {
+	for (unsigned i = 0; i < HIT_EVENT_RING_SIZE; i++) {
+		ring.sequence[i].store (i, std::memory_order_relaxed);
+	}
+	ring.tail.store (0, std::memory_order_relaxed);
+	ring.head.store (0, std::memory_order_relaxed);
+	ring.dropped.store (0, std::memory_order_relaxed);
+}
+
+bool record_hit_event (HitEventRing& ring, const HitEvent& event) {
+	unsigned pos = ring.tail.load (std::memory_order_relaxed);
+	for (;;) {
+		unsigned seq = ring.sequence[pos & (HIT_EVENT_RING_SIZE - 1)].load (std::memory_order_acquire);
+		int lap = (int)(seq - pos);
+		if (lap == 0) {
+			// free, claim it unless another producer got there first (which reloads pos)
+			if (ring.tail.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (lap < 0) {
+			// still holding an event from the last lap, the ring is full
+			ring.dropped.fetch_add (1, std::memory_order_relaxed);
+			return false;
+		}
+		else {
+			pos = ring.tail.load (std::memory_order_relaxed);
+		}
+	}
+	ring.events[pos & (HIT_EVENT_RING_SIZE - 1)] = event;
+	ring.sequence[pos & (HIT_EVENT_RING_SIZE - 1)].store (pos + 1, std::memory_order_release);
+	return true;
+}
+
+bool take_hit_event (HitEventRing& ring, HitEvent& event) {
+	unsigned pos = ring.head.load (std::memory_order_relaxed);
+	unsigned slot = pos & (HIT_EVENT_RING_SIZE - 1);
+	if (ring.sequence[slot].load (std::memory_order_acquire) != pos + 1) {
+		return false;
+	}
+	event = ring.events[slot];
+	// free for the producers' next lap
+	ring.sequence[slot].store (pos + HIT_EVENT_RING_SIZE, std::memory_order_release);
+	ring.head.store (pos + 1, std::memory_order_relaxed);
+	return true;
+}
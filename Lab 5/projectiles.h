@@ -0,0 +1,92 @@
+#ifndef _PROJECTILES_H_
+#define _PROJECTILES_H_
+
+#include <atomic>
+#include <vector>
+#include "maths_funcs.h"
+
+/*----------------------------------------------------------------------------
+                   PROJECTILES
+  ----------------------------------------------------------------------------*/
+// Every snowball in the air, from the player or the snowmen, in one pool of
+// fixed capacity held as structure of arrays. The live projectiles are the
+// first count rows, removing one moves the last row into its place.
+//
+// Flight is not integrated step by step. A projectile keeps where and when
+// it was launched and its launch velocity, and its position at any time is
+// the ballistic arc launch + velocity * age + gravity * age^2 / 2. Steps of
+// any length land exactly on the arc, and the renderer can draw a snowball
+// at any time between ticks from the same three values.
+//
+// Each step keeps the previous position as well, so the caller can sweep a
+// sphere from one to the other and nothing is skipped however fast it flies.
+// The collision itself is the caller's, it knows what can be hit.
+//
+// Hits go into a hit event ring for whoever reacts to them: any number of
+// threads can record into it while one consumer takes them out, with no
+// locks. Each slot has a sequence number saying whether it is free for the
+// producers' current lap or filled for the consumer's, a producer claims a
+// slot by advancing the shared tail with a compare and swap, and a full ring
+// drops the event rather than wait.
+
+#define HIT_EVENT_RING_SIZE 4096  // power of two
+
+struct ProjectilePool {
+	int capacity;
+	int count;  // live projectiles are rows [0, count)
+	float gravity;  // downwards, units per second squared
+	float radius;
+
+	// the arc
+	std::vector<float> launch_x, launch_y, launch_z;
+	std::vector<float> velocity_x, velocity_y, velocity_z;
+	std::vector<double> launch_time;
+	// where the last step put it, and where the one before did
+	std::vector<float> x, y, z;
+	std::vector<float> previous_x, previous_y, previous_z;
+	std::vector<unsigned int> owner;  // the caller's id for the thrower
+
+	int launched, fell, full;  // since creation: launches, removed by the floor, refused for want of room
+};
+
+// What the renderer needs to draw one in flight, at any time
+struct ProjectileFlight {
+	vec3 launch, velocity;
+	double launch_time;
+	unsigned int owner;
+};
+
+struct HitEvent {
+	unsigned int target;  // the caller's ids
+	unsigned int thrower;
+	vec3 point;
+};
+
+struct HitEventRing {
+	HitEvent events[HIT_EVENT_RING_SIZE];
+	std::atomic<unsigned> sequence[HIT_EVENT_RING_SIZE];
+	alignas (64) std::atomic<unsigned> tail;  // next slot to claim, shared by the producers
+	alignas (64) std::atomic<unsigned> head;  // next to take, consumer only
+	std::atomic<int> dropped;
+};
+
+void create_projectile_pool (ProjectilePool& pool, int capacity, float gravity, float radius);
+// New projectile at position at time, returns its row or -1 when the pool is full
+int launch_projectile (ProjectilePool& pool, const vec3& position, const vec3& velocity, unsigned int owner, double time);
+void remove_projectile (ProjectilePool& pool, int row);
+// Move everything to where its arc is at time, removing what has fallen below floor_y
+void step_projectiles (ProjectilePool& pool, double time, float floor_y);
+
+// Launch velocity at speed that lands on target, the flatter of the two arcs. False when target is out of reach.
+bool aim_projectile (const vec3& from, const vec3& target, float speed, float gravity, vec3& velocity);
+
+void capture_projectile_flights (const ProjectilePool& pool, std::vector<ProjectileFlight>& flights);
+vec3 flight_position (const ProjectileFlight& flight, float gravity, double time);
+
+void create_hit_event_ring (HitEventRing& ring);
+// Any thread, false when the ring is full and the event was dropped
+bool record_hit_event (HitEventRing& ring, const HitEvent& event);
+// Consumer only, false when there is nothing recorded
+bool take_hit_event (HitEventRing& ring, HitEvent& event);
+
+#endif
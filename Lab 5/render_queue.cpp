@@ -0,0 +1,275 @@
+#include "render_queue.h"
+#include "gl_state.h"
+#include <chrono>
+
+/*-----------------------------------SUBMISSION---------------------------------------*/
+
+void clear_render_queue (RenderQueue& queue) {
+	queue.transforms.clear ();
+	queue.packets.clear ();
+}
+
+unsigned int push_transform (RenderQueue& queue, const mat4& model) {
+	queue.transforms.push_back (model);
+	return (unsigned int)queue.transforms.size () - 1;
+}
+
+void submit_packet (RenderQueue& queue, const DrawPacket& packet) {
+	queue.packets.push_back (packet);
+}
+
+/*-----------------------------------SORT KEYS----------------------------------------*/
+
+unsigned long long make_sort_key (const DrawPacket& packet, float far_plane) {
+	float d = packet.depth / far_plane;
+	if (d < 0.0f) {
+		d = 0.0f;
+	}
+	if (d > 1.0f) {
+		d = 1.0f;
+	}
+	unsigned long long depth = (unsigned long long)(d * 0xFFFFFF) & 0xFFFFFF;
+	// GL names are small integers in practice, anything wider just shares a bucket
+	unsigned long long state = ((unsigned long long)(packet.program & 0xFF) << 24) |
+		((unsigned long long)(packet.texture & 0x3FF) << 14) |
+		((unsigned long long)(packet.vao & 0x3FF) << 4) |
+		(unsigned long long)(packet.material & 0xF);
+	unsigned long long layer = (unsigned long long)(packet.layer & 0xF) << 60;
+
+	if (packet.layer == RENDER_LAYER_TRANSPARENT) {
+		// back to front, state only breaks ties
+		return layer | ((0xFFFFFF - depth) << 36) | (state << 4);
+	}
+	return layer | (state << 28) | (depth << 4);
+}
+
+/*-----------------------------------RADIX SORT---------------------------------------*/
+
+// LSD radix sort of (key, index) pairs, 8 bits per pass. Passes where every
+// key has the same digit are skipped, which with only a handful of distinct
+// programs/textures is most of them.
+static void radix_sort (std::vector<unsigned long long>& keys, std::vector<unsigned int>& order,
+	std::vector<unsigned long long>& keys_scratch, std::vector<unsigned int>& order_scratch) {
+	size_t n = keys.size ();
+	keys_scratch.resize (n);
+	order_scratch.resize (n);
+
+	// histograms for all eight digits in one sweep
+	unsigned int histogram[8][256] = {};
+	for (size_t i = 0; i < n; i++) {
+		unsigned long long k = keys[i];
+		for (int pass = 0; pass < 8; pass++) {
+			histogram[pass][(k >> (pass * 8)) & 0xFF]++;
+		}
+	}
+
+	unsigned long long* src_keys = &keys[0];
+	unsigned int* src_order = &order[0];
+	unsigned long long* dst_keys = &keys_scratch[0];
+	unsigned int* dst_order = &order_scratch[0];
+	for (int pass = 0; pass < 8; pass++) {
+		unsigned int* h = histogram[pass];
+		if (h[(src_keys[0] >> (pass * 8)) & 0xFF] == n) {
+			continue;  // all keys share this digit
+		}
+		unsigned int offset = 0;
+		for (int b = 0; b < 256; b++) {
+			unsigned int c = h[b];
+			h[b] = offset;
+			offset += c;
+		}
+		for (size_t i = 0; i < n; i++) {
+			unsigned int dst = h[(src_keys[i] >> (pass * 8)) & 0xFF]++;
+			dst_keys[dst] = src_keys[i];
+			dst_order[dst] = src_order[i];
+		}
+		unsigned long long* tk = src_keys; src_keys = dst_keys; dst_keys = tk;
+		unsigned int* to = src_order; src_order = dst_order; dst_order = to;
+	}
+	// odd number of passes leaves the result in the scratch buffers
+	if (src_keys != &keys[0]) {
+		keys.swap (keys_scratch);
+		order.swap (order_scratch);
+	}
+}
+
+void sort_render_queue (RenderQueue& queue) {
+	auto start = std::chrono::high_resolution_clock::now ();
+
+	size_t n = queue.packets.size ();
+	queue.keys.resize (n);
+	queue.order.resize (n);
+	for (size_t i = 0; i < n; i++) {
+		queue.keys[i] = make_sort_key (queue.packets[i], queue.far_plane);
+		queue.order[i] = (unsigned int)i;
+	}
+	if (n > 1) {
+		radix_sort (queue.keys, queue.order, queue.keys_scratch, queue.order_scratch);
+	}
+
+	auto end = std::chrono::high_resolution_clock::now ();
+	queue.stats.sort_ms = std::chrono::duration<double, std::milli> (end - start).count ();
+	queue.stats.packets = (int)n;
+}
+
+/*-----------------------------------EXECUTION----------------------------------------*/
+
+// NULL order walks the packets as they were submitted
+static int count_changes (const RenderQueue& queue, const unsigned int* order, size_t count) {
+	int changes = 0;
+	GLuint program = 0, texture = 0, vao = 0;
+	unsigned int material = 0xFFFFFFFF;
+	for (size_t i = 0; i < count; i++) {
+		const DrawPacket& p = queue.packets[order ? order[i] : i];
+		if (p.program != program) {
+			program = p.program;
+			material = 0xFFFFFFFF;  // material uniforms are per program
+			changes++;
+		}
+		if (p.texture != texture) {
+			texture = p.texture;
+			changes++;
+		}
+		if (p.vao != vao) {
+			vao = p.vao;
+			changes++;
+		}
+		if (p.material != material) {
+			material = p.material;
+			changes++;
+		}
+	}
+	return changes;
+}
+
+int count_state_changes (const RenderQueue& queue, const std::vector<unsigned int>& order) {
+	return count_changes (queue, order.empty () ? NULL : &order[0], order.size ());
+}
+
+int count_unsorted_state_changes (const RenderQueue& queue) {
+	return count_changes (queue, NULL, queue.packets.size ());
+}
+
+static const RenderQueueProgram& find_program (RenderQueue& queue, GLuint program) {
+	for (size_t i = 0; i < queue.programs.size (); i++) {
+		if (queue.programs[i].program == program) {
+			return queue.programs[i];
+		}
+	}
+	RenderQueueProgram p;
+	p.program = program;
+	p.model = glGetUniformLocation (program, "model");
+	p.no_specular = glGetUniformLocation (program, "no_specular");
+	p.no_diffuse = glGetUniformLocation (program, "no_diffuse");
+	p.full_ambient = glGetUniformLocation (program, "full_ambient");
+	p.use_instancing = glGetUniformLocation (program, "use_instancing");
+	p.at_far_plane = glGetUniformLocation (program, "at_far_plane");
+	queue.programs.push_back (p);
+	return queue.programs.back ();
+}
+
+// Depth test and write for each layer, opaques only test for equality after a pre-pass
+static void set_layer_depth_state (const RenderQueue& queue, RenderLayer layer) {
+	if (layer == RENDER_LAYER_OPAQUE && queue.depth_prepass) {
+		gls_depth_func (GL_EQUAL);
+		gls_depth_mask (GL_FALSE);
+	}
+	else if (layer == RENDER_LAYER_SKY) {
+		// at the far plane, only where the cleared depth is still 1
+		gls_depth_func (GL_LEQUAL);
+		gls_depth_mask (GL_FALSE);
+	}
+	else {
+		gls_depth_func (GL_LESS);
+		gls_depth_mask (GL_TRUE);
+	}
+}
+
+// The draw call itself, shared by the depth pre-pass and the colour pass
+static void draw_packet (const RenderQueue& queue, const RenderQueueProgram& locations, const DrawPacket& p) {
+	if (p.instance_count > 0) {
+		gls_uniform1i (locations.use_instancing, 1);
+		glDrawArraysInstancedBaseInstance (GL_TRIANGLES, p.first, p.count, p.instance_count, p.first_instance);
+	}
+	else {
+		gls_uniform1i (locations.use_instancing, 0);
+		glUniformMatrix4fv (locations.model, 1, GL_FALSE, queue.transforms[p.transform].m);
+		if (p.indexed) {
+			glDrawElements (GL_TRIANGLES, p.count, GL_UNSIGNED_INT, (const GLvoid*)(p.first * sizeof (GLuint)));
+		}
+		else {
+			glDrawArrays (GL_TRIANGLES, p.first, p.count);
+		}
+	}
+}
+
+// Expects view/proj to already be set on the depth program
+void execute_depth_prepass (RenderQueue& queue, GLuint depth_program) {
+	RenderQueueProgram locations = find_program (queue, depth_program);
+	gls_use_program (depth_program);
+	gls_color_mask (GL_FALSE);
+	gls_depth_func (GL_LESS);
+	gls_depth_mask (GL_TRUE);
+	GLuint vao = 0;
+	for (size_t i = 0; i < queue.order.size (); i++) {
+		const DrawPacket& p = queue.packets[queue.order[i]];
+		if (p.layer != RENDER_LAYER_OPAQUE) {
+			break;  // the layer is the top of the key
+		}
+		if (p.depth_vao != vao) {
+			vao = p.depth_vao;
+			gls_bind_vertex_array (vao);
+		}
+		draw_packet (queue, locations, p);
+	}
+	gls_color_mask (GL_TRUE);
+	queue.depth_prepass = true;
+}
+
+// Expects view/proj to already be set on every program used and unit 0 to be the active texture unit
+void execute_render_queue (RenderQueue& queue) {
+	// the unsorted count is for the stats only
+	queue.stats.state_changes_unsorted = count_unsorted_state_changes (queue);
+	queue.stats.state_changes = 0;
+
+	GLuint program = 0, texture = 0, vao = 0;
+	unsigned int material = 0xFFFFFFFF;
+	RenderQueueProgram locations = {};
+	int layer = -1;
+	for (size_t i = 0; i < queue.order.size (); i++) {
+		const DrawPacket& p = queue.packets[queue.order[i]];
+		if (p.layer != layer) {
+			layer = p.layer;
+			set_layer_depth_state (queue, p.layer);
+		}
+		if (p.program != program) {
+			program = p.program;
+			locations = find_program (queue, program);
+			gls_use_program (program);
+			material = 0xFFFFFFFF;
+			queue.stats.state_changes++;
+		}
+		if (p.texture != texture) {
+			texture = p.texture;
+			gls_bind_texture (GL_TEXTURE_2D, texture);
+			queue.stats.state_changes++;
+		}
+		if (p.vao != vao) {
+			vao = p.vao;
+			gls_bind_vertex_array (vao);
+			queue.stats.state_changes++;
+		}
+		if (p.material != material) {
+			material = p.material;
+			gls_uniform1i (locations.no_specular, (material & MATERIAL_NO_SPECULAR) ? 1 : 0);
+			gls_uniform1i (locations.no_diffuse, (material & MATERIAL_NO_DIFFUSE) ? 1 : 0);
+			gls_uniform1i (locations.full_ambient, (material & MATERIAL_FULL_AMBIENT) ? 1 : 0);
+			queue.stats.state_changes++;
+		}
+		gls_uniform1i (locations.at_far_plane, p.layer == RENDER_LAYER_SKY ? 1 : 0);
+		draw_packet (queue, locations, p);
+	}
+	// leave depth writes on, glClear only clears the depth buffer through the mask
+	set_layer_depth_state (queue, RENDER_LAYER_TRANSPARENT);
+	queue.depth_prepass = false;
+}
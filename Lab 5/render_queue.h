@@ -0,0 +1,102 @@
+#ifndef _RENDER_QUEUE_H_
+#define _RENDER_QUEUE_H_
+
+#include <GL/glew.h>
+#include <vector>
+#include "maths_funcs.h"
+
+/*----------------------------------------------------------------------------
+                   SORTED RENDER QUEUE
+  ----------------------------------------------------------------------------*/
+// Scene code submits one DrawPacket per draw instead of talking to GL
+// directly. Every packet gets a 64 bit key, the keys are radix sorted and
+// the packets are then executed in key order, only touching GL state that
+// actually differs from the previous packet.
+//
+// Key layout, most significant bits first:
+//   opaque / cutout / sky:  layer(4) program(8) texture(10) vao(10) material(4) depth(24) -(4)
+//   transparent:            layer(4) inverted depth(24) program(8) texture(10) vao(10) material(4) -(4)
+// so opaque draws are grouped by state and front to back within a group,
+// and transparent draws are strictly back to front.
+//
+// With a depth pre-pass the opaque packets are drawn twice: first depth
+// only, from a position-only VAO with no fragment shader, then in colour
+// with GL_EQUAL so every pixel is shaded once. The sky is moved to the far
+// plane and drawn after the opaques with GL_LEQUAL, so it only shades the
+// pixels nothing else covered. Cut-out draws (discarding fragments, e.g.
+// dithered impostor fades) stay out of the pre-pass and test as usual.
+
+enum RenderLayer {
+	RENDER_LAYER_OPAQUE = 0,
+	RENDER_LAYER_CUTOUT = 1,  // opaque but discards fragments, never in the depth pre-pass
+	RENDER_LAYER_SKY = 2,  // after opaques so it only shades what is left uncovered
+	RENDER_LAYER_TRANSPARENT = 3
+};
+
+// Material flags, mirror the toggles in ToonFragmentShader.txt
+#define MATERIAL_NO_SPECULAR 1
+#define MATERIAL_NO_DIFFUSE 2
+#define MATERIAL_FULL_AMBIENT 4
+
+struct DrawPacket {
+	GLuint program;
+	GLuint texture;
+	GLuint vao;
+	GLuint depth_vao;  // positions (and instance attributes) only, for the depth pre-pass
+	GLint first;
+	GLsizei count;
+	bool indexed;  // first and count index the VAO's element buffer (plain draws only)
+	GLsizei instance_count;  // 0 for a plain draw, otherwise drawn from the VAO's instance buffer
+	GLuint first_instance;
+	float depth;  // view space distance from the camera
+	unsigned int transform;  // index into RenderQueue::transforms
+	unsigned int material;  // MATERIAL_* flags
+	RenderLayer layer;
+};
+
+struct RenderQueueStats {
+	int packets;
+	int state_changes;  // program, texture, vao and material changes actually issued
+	int state_changes_unsorted;  // what submission order would have issued
+	double sort_ms;
+};
+
+// uniform locations looked up once per program
+struct RenderQueueProgram {
+	GLuint program;
+	GLint model, no_specular, no_diffuse, full_ambient, use_instancing, at_far_plane;
+};
+
+struct RenderQueue {
+	float far_plane;  // depth is quantised over [0, far_plane]
+	bool depth_prepass;  // opaques are already in the depth buffer, execute tests GL_EQUAL
+	std::vector<mat4> transforms;
+	std::vector<DrawPacket> packets;
+
+	// sort state, kept between frames to avoid reallocating
+	std::vector<unsigned long long> keys, keys_scratch;
+	std::vector<unsigned int> order, order_scratch;
+
+	std::vector<RenderQueueProgram> programs;
+	RenderQueueStats stats;
+};
+
+void clear_render_queue (RenderQueue& queue);
+// Store a model matrix and return its transform index
+unsigned int push_transform (RenderQueue& queue, const mat4& model);
+void submit_packet (RenderQueue& queue, const DrawPacket& packet);
+
+unsigned long long make_sort_key (const DrawPacket& packet, float far_plane);
+// Build the keys and radix sort them, fills queue.order
+void sort_render_queue (RenderQueue& queue);
+// Number of state changes needed to draw the packets in the given order
+int count_state_changes (const RenderQueue& queue, const std::vector<unsigned int>& order);
+// The same in submission order
+int count_unsorted_state_changes (const RenderQueue& queue);
+// Lay down the depth of the sorted opaque packets, set queue.depth_prepass
+// for the following execute_render_queue
+void execute_depth_prepass (RenderQueue& queue, GLuint depth_program);
+// Issue the GL calls for the sorted packets
+void execute_render_queue (RenderQueue& queue);
+
+#endif
@@ -0,0 +1,85 @@
+#include "scene_graph.h"
+#include <assert.h>
+#include <string.h>
+
+void clear_scene_graph (SceneGraph& graph) {
+	graph.parent.clear ();
+	graph.translation.clear ();
+	graph.rotation_deg.clear ();
+	graph.scale.clear ();
+	graph.world.clear ();
+	graph.dirty.clear ();
+	graph.recomputed = 0;
+}
+
+int add_scene_node (SceneGraph& graph, int parent, const vec3& translation, const vec3& rotation_deg, const vec3& scale) {
+	int node = (int)graph.parent.size ();
+	assert (parent < node);
+	graph.parent.push_back (parent);
+	graph.translation.push_back (translation);
+	graph.rotation_deg.push_back (rotation_deg);
+	graph.scale.push_back (scale);
+	graph.world.push_back (identity_mat4 ());
+	graph.dirty.push_back (1);
+	return node;
+}
+
+static bool same_vec3 (const vec3& a, const vec3& b) {
+	return a.v[0] == b.v[0] && a.v[1] == b.v[1] && a.v[2] == b.v[2];
+}
+
+void set_node_translation (SceneGraph& graph, int node, const vec3& translation) {
+	if (!same_vec3 (graph.translation[node], translation)) {
+		graph.translation[node] = translation;
+		graph.dirty[node] = 1;
+	}
+}
+
+void set_node_rotation (SceneGraph& graph, int node, const vec3& rotation_deg) {
+	if (!same_vec3 (graph.rotation_deg[node], rotation_deg)) {
+		graph.rotation_deg[node] = rotation_deg;
+		graph.dirty[node] = 1;
+	}
+}
+
+void set_node_scale (SceneGraph& graph, int node, const vec3& scale) {
+	if (!same_vec3 (graph.scale[node], scale)) {
+		graph.scale[node] = scale;
+		graph.dirty[node] = 1;
+	}
+}
+
+static mat4 local_matrix (const SceneGraph& graph, int node) {
+	const vec3& r = graph.rotation_deg[node];
+	mat4 m = scale (identity_mat4 (), graph.scale[node]);
+	if (r.v[0] != 0.0f) {
+		m = rotate_x_deg (m, r.v[0]);
+	}
+	if (r.v[1] != 0.0f) {
+		m = rotate_y_deg (m, r.v[1]);
+	}
+	if (r.v[2] != 0.0f) {
+		m = rotate_z_deg (m, r.v[2]);
+	}
+	return translate (m, graph.translation[node]);
+}
+
+void update_scene_graph (SceneGraph& graph) {
+	int count = (int)graph.parent.size ();
+	graph.recomputed = 0;
+	for (int i = 0; i < count; i++) {
+		int p = graph.parent[i];
+		// parents come first, so a moved parent has already passed its flag down to here
+		if (p >= 0 && graph.dirty[p]) {
+			graph.dirty[i] = 1;
+		}
+		if (!graph.dirty[i]) {
+			continue;
+		}
+		graph.world[i] = p >= 0 ? graph.world[p] * local_matrix (graph, i) : local_matrix (graph, i);
+		graph.recomputed++;
+	}
+	if (count > 0) {
+		memset (&graph.dirty[0], 0, count);
+	}
+}
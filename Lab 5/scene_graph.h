@@ -0,0 +1,43 @@
+#ifndef _SCENE_GRAPH_H_
+#define _SCENE_GRAPH_H_
+
+#include <vector>
+#include "maths_funcs.h"
+
+/*----------------------------------------------------------------------------
+                   SCENE GRAPH
+  ----------------------------------------------------------------------------*/
+// Transform hierarchy with cached world matrices. Each node keeps its local
+// translation, rotation and scale, and its world matrix is
+//   parent world * translate * rotate_z * rotate_y * rotate_x * scale
+// i.e. the same chain display() used to build by hand: scale first, then
+// rotate about x, y and z, then translate.
+//
+// Nodes live in parallel arrays in depth-first order, so a parent always
+// comes before its children. Changing a local marks the node dirty, and
+// update_scene_graph walks the arrays once, rebuilding only dirty nodes and
+// everything below them. Setting a local to the value it already has does
+// not mark anything, so per-frame code can set every moving node
+// unconditionally.
+
+struct SceneGraph {
+	std::vector<int> parent;  // -1 for a root, otherwise a lower index
+	std::vector<vec3> translation;
+	std::vector<vec3> rotation_deg;  // about x, then y, then z
+	std::vector<vec3> scale;
+	std::vector<mat4> world;
+	std::vector<unsigned char> dirty;  // local changed since the last update
+	int recomputed;  // world matrices rebuilt by the last update
+};
+
+void clear_scene_graph (SceneGraph& graph);
+// Append a node, returns its index. Add each node's whole subtree before its
+// next sibling to keep the depth-first layout.
+int add_scene_node (SceneGraph& graph, int parent, const vec3& translation, const vec3& rotation_deg, const vec3& scale);
+void set_node_translation (SceneGraph& graph, int node, const vec3& translation);
+void set_node_rotation (SceneGraph& graph, int node, const vec3& rotation_deg);
+void set_node_scale (SceneGraph& graph, int node, const vec3& scale);
+// Rebuild the world matrices of dirty nodes and their descendants
+void update_scene_graph (SceneGraph& graph);
+
+#endif
@@ -0,0 +1,271 @@
+#include "shadows.h"
+#include "gl_state.h"
+#include <math.h>
+
+/*-----------------------------------SETUP--------------------------------------------*/
+
+static GLuint create_depth_array (bool compare) {
+	GLuint texture;
+	glGenTextures (1, &texture);
+	glBindTexture (GL_TEXTURE_2D_ARRAY, texture);
+	glTexStorage3D (GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT32F, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, SHADOW_CASCADES);
+	// linear filtering of a compare texture gives 2x2 PCF for free
+	GLint filter = compare ? GL_LINEAR : GL_NEAREST;
+	glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filter);
+	glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filter);
+	glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	if (compare) {
+		glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri (GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	}
+	return texture;
+}
+
+void create_cascaded_shadows (CascadedShadows& shadows, GLuint program) {
+	shadows.program = program;
+	shadows.static_texture = create_depth_array (false);
+	shadows.texture = create_depth_array (true);
+	glBindTexture (GL_TEXTURE_2D_ARRAY, 0);
+
+	// depth only, the layer is attached per pass
+	GLint previous_fbo = 0;
+	glGetIntegerv (GL_FRAMEBUFFER_BINDING, &previous_fbo);
+	glGenFramebuffers (1, &shadows.fbo);
+	glBindFramebuffer (GL_FRAMEBUFFER, shadows.fbo);
+	glDrawBuffer (GL_NONE);
+	glReadBuffer (GL_NONE);
+	glBindFramebuffer (GL_FRAMEBUFFER, previous_fbo);
+
+	create_indirect_frame (shadows.frame);
+	shadows.light_direction = vec3 (0.0f, 1.0f, 0.0f);
+	for (int c = 0; c < SHADOW_CASCADES; c++) {
+		shadows.cascades[c].static_valid = false;
+		shadows.cascades[c].radius = 0.0f;
+	}
+	shadows.static_renders = shadows.static_drawn = shadows.dynamic_drawn = 0;
+	gls_invalidate ();
+}
+
+void clear_shadow_casters (ShadowCasters& casters) {
+	casters.meshes.clear ();
+	casters.instances.clear ();
+	casters.bounds.clear ();
+}
+
+void add_shadow_caster (ShadowCasters& casters, const MeshPool& pool, int mesh, const InstanceData& instance) {
+	mat4 model;
+	for (int i = 0; i < 16; i++) {
+		model.m[i] = instance.model[i];
+	}
+	BoundingSphere sphere = transform_sphere (pool.meshes[mesh].bounds, model);
+	if (instance.params[0] != 0.0f) {
+		// the shader turns the mesh about its origin first, so the sphere can be anywhere around it
+		vec3 origin (model.m[12], model.m[13], model.m[14]);
+		sphere.radius += length (sphere.center - origin);
+		sphere.center = origin;
+	}
+	casters.meshes.push_back (mesh);
+	casters.instances.push_back (instance);
+	casters.bounds.push_back (sphere);
+}
+
+void set_shadow_light (CascadedShadows& shadows, const vec3& towards_light) {
+	shadows.light_direction = normalise (towards_light);
+	for (int c = 0; c < SHADOW_CASCADES; c++) {
+		shadows.cascades[c].static_valid = false;
+	}
+}
+
+/*-----------------------------------FITTING------------------------------------------*/
+
+// Right and up of the light's view, the same ones look_at builds
+static void light_basis (const vec3& towards_light, vec3& right, vec3& up) {
+	vec3 forward (-towards_light.v[0], -towards_light.v[1], -towards_light.v[2]);
+	vec3 world_up = fabs (towards_light.v[1]) > 0.99f ? vec3 (0.0f, 0.0f, 1.0f) : vec3 (0.0f, 1.0f, 0.0f);
+	right = normalise (cross (forward, world_up));
+	up = normalise (cross (right, forward));
+}
+
+void fit_shadow_cascades (CascadedShadows& shadows, const mat4& view, float fovy, float aspect, float near_plane) {
+	// practical split: halfway between uniform and logarithmic
+	float splits[SHADOW_CASCADES + 1];
+	for (int c = 0; c <= SHADOW_CASCADES; c++) {
+		float t = (float)c / SHADOW_CASCADES;
+		float logarithmic = near_plane * pow (SHADOW_DISTANCE / near_plane, t);
+		float uniform = near_plane + (SHADOW_DISTANCE - near_plane) * t;
+		splits[c] = 0.5f * logarithmic + 0.5f * uniform;
+	}
+
+	mat4 camera = inverse (view);
+	vec3 eye (camera.m[12], camera.m[13], camera.m[14]);
+	vec3 forward (-camera.m[8], -camera.m[9], -camera.m[10]);
+	float tan_y = tan (fovy * ONE_DEG_IN_RAD * 0.5f);
+	float tan_x = tan_y * aspect;
+	vec3 right, up;
+	light_basis (shadows.light_direction, right, up);
+	vec3 dir = shadows.light_direction;
+
+	for (int c = 0; c < SHADOW_CASCADES; c++) {
+		ShadowCascade& cascade = shadows.cascades[c];
+		cascade.split_near = splits[c];
+		cascade.split_far = splits[c + 1];
+
+		// sphere around the slice: centred on the view axis where it is equally far
+		// from the near and far corners, so it does not change as the camera turns
+		float n = splits[c], f = splits[c + 1];
+		float n2 = n * n * (1.0f + tan_x * tan_x + tan_y * tan_y);
+		float f2 = f * f * (1.0f + tan_x * tan_x + tan_y * tan_y);
+		float d = (f2 - n2) / (2.0f * (f - n));
+		if (d > f) {
+			d = f;
+		}
+		float slice_radius = sqrt (f2 - 2.0f * f * d + d * d);
+		vec3 center = eye + forward * d;
+
+		// pad by the snapping step so the snapped box still holds the slice
+		float radius = ceil (slice_radius * 4.0f / 3.0f);
+		float step = radius * 0.25f;
+		float x = floor (dot (center, right) / step + 0.5f) * step;
+		float y = floor (dot (center, up) / step + 0.5f) * step;
+		float z = floor (dot (center, dir) / step + 0.5f) * step;
+		vec3 snapped = right * x + up * y + dir * z;
+		if (radius != cascade.radius || length2 (snapped - cascade.center) > 1e-6f) {
+			cascade.static_valid = false;
+		}
+		cascade.radius = radius;
+		cascade.center = snapped;
+
+		// casters up to SHADOW_CASTER_DISTANCE in front of the box are clamped onto its near plane
+		vec3 light_eye = snapped + dir * radius;
+		cascade.view = look_at (light_eye, snapped, fabs (dir.v[1]) > 0.99f ? vec3 (0.0f, 0.0f, 1.0f) : vec3 (0.0f, 1.0f, 0.0f));
+		cascade.proj = orthographic (-radius, radius, -radius, radius, 0.0f, 2.0f * radius);
+	}
+}
+
+/*-----------------------------------RENDERING----------------------------------------*/
+
+// Queue the casters that overlap the cascade's box, one command per run of the same mesh
+static int add_cascade_casters (IndirectFrame& frame, const MeshPool& pool, const ShadowCascade& cascade, const ShadowCasters& casters) {
+	const mat4& v = cascade.view;
+	float far_z = -2.0f * cascade.radius;
+	float near_z = SHADOW_CASTER_DISTANCE;
+	int added = 0;
+	int run_mesh = -1;
+	std::vector<InstanceData> run;
+	for (size_t i = 0; i <= casters.meshes.size (); i++) {
+		bool inside = false;
+		if (i < casters.meshes.size ()) {
+			const BoundingSphere& s = casters.bounds[i];
+			const float* p = s.center.v;
+			float x = v.m[0] * p[0] + v.m[4] * p[1] + v.m[8] * p[2] + v.m[12];
+			float y = v.m[1] * p[0] + v.m[5] * p[1] + v.m[9] * p[2] + v.m[13];
+			float z = v.m[2] * p[0] + v.m[6] * p[1] + v.m[10] * p[2] + v.m[14];
+			float reach = cascade.radius + s.radius;
+			inside = fabs (x) <= reach && fabs (y) <= reach && z - s.radius <= near_z && z + s.radius >= far_z;
+		}
+		// flush the run when the mesh changes or the list ends
+		if (!run.empty () && (i == casters.meshes.size () || (inside && casters.meshes[i] != run_mesh))) {
+			add_indirect_draw (frame, pool, run_mesh, 0, 0, &run[0], (int)run.size ());
+			added += (int)run.size ();
+			run.clear ();
+		}
+		if (inside) {
+			run_mesh = casters.meshes[i];
+			run.push_back (casters.instances[i]);
+		}
+	}
+	return added;
+}
+
+// Draw the casters into one layer of an array with the cascade's matrices
+static int draw_cascade_layer (CascadedShadows& shadows, const MeshPool& pool, const ShadowCascade& cascade, GLuint texture, int layer, bool clear, const ShadowCasters& casters) {
+	glFramebufferTextureLayer (GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, layer);
+	if (clear) {
+		glClear (GL_DEPTH_BUFFER_BIT);
+	}
+	begin_indirect_frame (shadows.frame);
+	int added = add_cascade_casters (shadows.frame, pool, cascade, casters);
+	upload_indirect_frame (shadows.frame);
+	issue_indirect_frame (shadows.frame, pool.depth_vao);
+	return added;
+}
+
+void render_shadows (CascadedShadows& shadows, const MeshPool& pool, const ShadowCasters& static_casters, const ShadowCasters& dynamic_casters) {
+	GLint previous_fbo = 0;
+	GLint previous_viewport[4];
+	glGetIntegerv (GL_FRAMEBUFFER_BINDING, &previous_fbo);
+	glGetIntegerv (GL_VIEWPORT, previous_viewport);
+	glBindFramebuffer (GL_FRAMEBUFFER, shadows.fbo);
+	glViewport (0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+
+	gls_use_program (shadows.program);
+	gls_depth_func (GL_LESS);
+	gls_depth_mask (GL_TRUE);
+	gls_enable (GL_DEPTH_CLAMP);  // casters in front of the near plane still land on it
+	gls_enable (GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset (2.0f, 4.0f);
+	GLint view_location = glGetUniformLocation (shadows.program, "view");
+	GLint proj_location = glGetUniformLocation (shadows.program, "proj");
+
+	shadows.static_renders = shadows.static_drawn = shadows.dynamic_drawn = 0;
+	for (int c = 0; c < SHADOW_CASCADES; c++) {
+		ShadowCascade& cascade = shadows.cascades[c];
+		glUniformMatrix4fv (view_location, 1, GL_FALSE, cascade.view.m);
+		glUniformMatrix4fv (proj_location, 1, GL_FALSE, cascade.proj.m);
+		if (!cascade.static_valid) {
+			shadows.static_drawn += draw_cascade_layer (shadows, pool, cascade, shadows.static_texture, c, true, static_casters);
+			cascade.static_valid = true;
+			shadows.static_renders++;
+		}
+		glCopyImageSubData (shadows.static_texture, GL_TEXTURE_2D_ARRAY, 0, 0, 0, c,
+			shadows.texture, GL_TEXTURE_2D_ARRAY, 0, 0, 0, c, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 1);
+		shadows.dynamic_drawn += draw_cascade_layer (shadows, pool, cascade, shadows.texture, c, false, dynamic_casters);
+	}
+
+	glPolygonOffset (0.0f, 0.0f);
+	gls_disable (GL_POLYGON_OFFSET_FILL);
+	gls_disable (GL_DEPTH_CLAMP);
+	glBindFramebuffer (GL_FRAMEBUFFER, previous_fbo);
+	glViewport (previous_viewport[0], previous_viewport[1], previous_viewport[2], previous_viewport[3]);
+}
+
+/*-----------------------------------SAMPLING-----------------------------------------*/
+
+void set_shadow_uniforms (const CascadedShadows& shadows, GLuint program, const mat4& view, bool enabled) {
+	// from the camera's view space straight to the map's [0, 1] texture space
+	mat4 bias = identity_mat4 ();
+	bias.m[0] = bias.m[5] = bias.m[10] = 0.5f;
+	bias.m[12] = bias.m[13] = bias.m[14] = 0.5f;
+	mat4 view_to_world = inverse (view);
+	float matrices[SHADOW_CASCADES * 16];
+	float far_distances[SHADOW_CASCADES];
+	float texel_sizes[SHADOW_CASCADES];
+	for (int c = 0; c < SHADOW_CASCADES; c++) {
+		ShadowCascade cascade = shadows.cascades[c];  // a copy, mat4's operator* is not const
+		mat4 m = bias * cascade.proj * cascade.view * view_to_world;
+		for (int i = 0; i < 16; i++) {
+			matrices[c * 16 + i] = m.m[i];
+		}
+		far_distances[c] = cascade.split_far;
+		texel_sizes[c] = 2.0f * cascade.radius / SHADOW_MAP_SIZE;
+	}
+	glUniformMatrix4fv (glGetUniformLocation (program, "shadow_matrices"), SHADOW_CASCADES, GL_FALSE, matrices);
+	glUniform1fv (glGetUniformLocation (program, "cascade_far"), SHADOW_CASCADES, far_distances);
+	glUniform1fv (glGetUniformLocation (program, "shadow_texel"), SHADOW_CASCADES, texel_sizes);
+	gls_uniform1i (glGetUniformLocation (program, "use_shadows"), enabled ? 1 : 0);
+	gls_uniform1i (glGetUniformLocation (program, "shadow_map"), SHADOW_TEXTURE_UNIT);
+
+	// the moon's direction in the camera's view space
+	vec3 d = shadows.light_direction;
+	vec3 d_eye (view.m[0] * d.v[0] + view.m[4] * d.v[1] + view.m[8] * d.v[2],
+		view.m[1] * d.v[0] + view.m[5] * d.v[1] + view.m[9] * d.v[2],
+		view.m[2] * d.v[0] + view.m[6] * d.v[1] + view.m[10] * d.v[2]);
+	glUniform3fv (glGetUniformLocation (program, "moon_direction_eye"), 1, d_eye.v);
+}
+
+void bind_shadow_map (const CascadedShadows& shadows) {
+	gls_active_texture (GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+	gls_bind_texture (GL_TEXTURE_2D_ARRAY, shadows.texture);
+	gls_active_texture (GL_TEXTURE0);
+}
@@ -0,0 +1,77 @@
+#ifndef _SHADOWS_H_
+#define _SHADOWS_H_
+
+#include <GL/glew.h>
+#include <vector>
+#include "frustum_culling.h"
+#include "maths_funcs.h"
+#include "multi_draw.h"
+
+/*----------------------------------------------------------------------------
+                   CACHED CASCADED SHADOW MAPS
+  ----------------------------------------------------------------------------*/
+// The moon is a directional light. The camera frustum out to
+// SHADOW_DISTANCE is cut into SHADOW_CASCADES slices, and each slice gets
+// one layer of a depth texture array, seen along the light from an
+// orthographic box around the slice's bounding sphere.
+//
+// Static casters (ground, logs, trees) are drawn into a second array that
+// works as a cache. A cascade's static layer is only redrawn when the light
+// or the cascade's box moves. The box is snapped to a grid of a quarter of
+// its width and padded by the same amount, so walking around only redraws a
+// cascade every few steps. Every frame the cached layer is copied into the
+// sampled array and the dynamic casters (snowmen, arms, the snowball) are
+// drawn on top.
+//
+// Casters go through the multi-draw indirect path from the MeshPool, one
+// glMultiDrawElementsIndirect per layer with DepthMDIVertexShader.txt.
+
+#define SHADOW_CASCADES 3  // also in ToonLibraryShader.txt
+#define SHADOW_MAP_SIZE 1024
+#define SHADOW_DISTANCE 80.0f  // no shadows past this far from the camera
+#define SHADOW_CASTER_DISTANCE 60.0f  // how far towards the light casters are looked for
+#define SHADOW_TEXTURE_UNIT 7  // after the impostor normals
+
+// Casters and their world spheres, one instance of one pool mesh each
+struct ShadowCasters {
+	std::vector<int> meshes;
+	std::vector<InstanceData> instances;
+	std::vector<BoundingSphere> bounds;
+};
+
+struct ShadowCascade {
+	float split_near, split_far;  // view space distances
+	float radius;  // of the box, half its width
+	vec3 center;  // snapped to the cascade's grid
+	mat4 view, proj;
+	bool static_valid;  // the cached layer matches center, radius and the light
+};
+
+struct CascadedShadows {
+	GLuint program;  // DepthMDIVertexShader.txt
+	GLuint fbo;
+	GLuint static_texture;  // cache of the static casters
+	GLuint texture;  // static plus dynamic, sampled with depth compare
+	IndirectFrame frame;
+	vec3 light_direction;  // world space, from the scene towards the light
+	ShadowCascade cascades[SHADOW_CASCADES];
+
+	// last frame
+	int static_renders;  // cascades whose cache was redrawn
+	int static_drawn, dynamic_drawn;  // caster instances over all cascades
+};
+
+void create_cascaded_shadows (CascadedShadows& shadows, GLuint program);
+void clear_shadow_casters (ShadowCasters& casters);
+void add_shadow_caster (ShadowCasters& casters, const MeshPool& pool, int mesh, const InstanceData& instance);
+// Point the light somewhere else, every cached layer is redrawn
+void set_shadow_light (CascadedShadows& shadows, const vec3& towards_light);
+// Fit the cascades to the camera, marking the ones whose box moved
+void fit_shadow_cascades (CascadedShadows& shadows, const mat4& view, float fovy, float aspect, float near_plane);
+// Redraw the stale static layers, then build this frame's layers with the dynamic casters
+void render_shadows (CascadedShadows& shadows, const MeshPool& pool, const ShadowCasters& static_casters, const ShadowCasters& dynamic_casters);
+// Shadow matrices, cascade ranges and the map for ToonLibraryShader.txt, program must be in use
+void set_shadow_uniforms (const CascadedShadows& shadows, GLuint program, const mat4& view, bool enabled);
+void bind_shadow_map (const CascadedShadows& shadows);
+
+#endif
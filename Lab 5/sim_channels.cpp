@@ -0,0 +1,55 @@
+#include "sim_channels.h"
+
+/*-----------------------------------TRIPLE BUFFER------------------------------------*/
+
+void create_triple_buffer (TripleBuffer& buffer) {
+	buffer.write_slot = 0;
+	buffer.shared.store (1);
+	buffer.read_slot = 2;
+}
+
+int triple_buffer_write_slot (const TripleBuffer& buffer) {
+	return buffer.write_slot;
+}
+
+void publish_triple_buffer (TripleBuffer& buffer) {
+	// release so the reader sees the slot's contents, acquire so the slot we
+	// get back is no longer being read
+	int previous = buffer.shared.exchange (buffer.write_slot | TRIPLE_BUFFER_FRESH, std::memory_order_acq_rel);
+	buffer.write_slot = previous & 3;
+}
+
+int triple_buffer_read_slot (TripleBuffer& buffer) {
+	if (buffer.shared.load (std::memory_order_relaxed) & TRIPLE_BUFFER_FRESH) {
+		int previous = buffer.shared.exchange (buffer.read_slot, std::memory_order_acq_rel);
+		buffer.read_slot = previous & 3;
+	}
+	return buffer.read_slot;
+}
+
+/*-----------------------------------INPUT QUEUE--------------------------------------*/
+
+void create_input_queue (InputQueue& queue) {
+	queue.head.store (0);
+	queue.tail.store (0);
+}
+
+bool push_input (InputQueue& queue, const InputEvent& event) {
+	unsigned tail = queue.tail.load (std::memory_order_relaxed);
+	if (tail - queue.head.load (std::memory_order_acquire) == INPUT_QUEUE_SIZE) {
+		return false;
+	}
+	queue.events[tail & (INPUT_QUEUE_SIZE - 1)] = event;
+	queue.tail.store (tail + 1, std::memory_order_release);
+	return true;
+}
+
+bool pop_input (InputQueue& queue, InputEvent& event) {
+	unsigned head = queue.head.load (std::memory_order_relaxed);
+	if (head == queue.tail.load (std::memory_order_acquire)) {
+		return false;
+	}
+	event = queue.events[head & (INPUT_QUEUE_SIZE - 1)];
+	queue.head.store (head + 1, std::memory_order_release);
+	return true;
+}
@@ -0,0 +1,56 @@
+#ifndef _SIM_CHANNELS_H_
+#define _SIM_CHANNELS_H_
+
+#include <atomic>
+
+/*----------------------------------------------------------------------------
+                   SIMULATION CHANNELS
+  ----------------------------------------------------------------------------*/
+// The two lock free links between the GLUT thread and the simulation thread.
+//
+// World snapshots go from the simulation to the renderer through a triple
+// buffer. The writer always has a slot of its own to fill, the reader
+// always has a slot of its own to draw from, and the third is swapped with
+// either side by a single atomic exchange. Neither side ever waits, the
+// reader just keeps the snapshot it has until a newer one is published.
+// The buffer only hands out slot indices, the caller owns the three
+// snapshots.
+//
+// Input goes the other way through a fixed size single producer, single
+// consumer ring. Each side only stores its own index, so a push and a pop
+// never touch the same variable.
+
+#define TRIPLE_BUFFER_FRESH 4  // set on the shared slot until the reader takes it
+#define INPUT_QUEUE_SIZE 64  // power of two
+
+struct TripleBuffer {
+	int write_slot;  // writer only
+	int read_slot;  // reader only
+	std::atomic<int> shared;  // the third slot, plus TRIPLE_BUFFER_FRESH
+};
+
+struct InputEvent {
+	unsigned char key;
+};
+
+struct InputQueue {
+	InputEvent events[INPUT_QUEUE_SIZE];
+	alignas (64) std::atomic<unsigned> head;  // next to pop, consumer only
+	alignas (64) std::atomic<unsigned> tail;  // next to push, producer only
+};
+
+void create_triple_buffer (TripleBuffer& buffer);
+// Slot for the writer to fill before publishing
+int triple_buffer_write_slot (const TripleBuffer& buffer);
+// Make the filled slot the latest, the writer gets a free one back
+void publish_triple_buffer (TripleBuffer& buffer);
+// Latest published slot, or the one the reader already had if nothing newer came
+int triple_buffer_read_slot (TripleBuffer& buffer);
+
+void create_input_queue (InputQueue& queue);
+// False when the queue is full and the event was dropped
+bool push_input (InputQueue& queue, const InputEvent& event);
+// False when there is nothing to pop
+bool pop_input (InputQueue& queue, InputEvent& event);
+
+#endif
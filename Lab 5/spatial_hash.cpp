@@ -0,0 +1,153 @@
+#include "spatial_hash.h"
+#include <chrono>
+#include <math.h>
+
+static int cell_of (const SpatialHash& hash, float v) {
+	return (int)floorf (v * hash.inv_cell_size);
+}
+
+static unsigned int bucket_of (const SpatialHash& hash, int cx, int cz) {
+	return ((unsigned int)cx * 73856093u ^ (unsigned int)cz * 19349663u) & hash.bucket_mask;
+}
+
+void create_spatial_hash (SpatialHash& hash, float cell_size) {
+	hash.cell_size = cell_size;
+	hash.inv_cell_size = 1.0f / cell_size;
+	hash.bucket_mask = SPATIAL_HASH_MIN_BUCKETS - 1;
+	hash.bucket_start.assign (SPATIAL_HASH_MIN_BUCKETS + 1, 0);
+	hash.x.clear ();
+	hash.z.clear ();
+	hash.value.clear ();
+	begin_spatial_hash (hash);
+	hash.build_ms = 0.0;
+}
+
+/*-----------------------------------BUILD--------------------------------------------*/
+
+void begin_spatial_hash (SpatialHash& hash) {
+	hash.add_x.clear ();
+	hash.add_z.clear ();
+	hash.add_value.clear ();
+}
+
+void add_to_spatial_hash (SpatialHash& hash, float x, float z, unsigned int value) {
+	hash.add_x.push_back (x);
+	hash.add_z.push_back (z);
+	hash.add_value.push_back (value);
+}
+
+void finish_spatial_hash (SpatialHash& hash) {
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now ();
+	size_t count = hash.add_x.size ();
+	unsigned int buckets = SPATIAL_HASH_MIN_BUCKETS;
+	while (buckets < count * 2) {
+		buckets *= 2;
+	}
+	hash.bucket_mask = buckets - 1;
+
+	// count the points in each bucket, then turn the counts into start offsets
+	hash.bucket_start.assign (buckets + 1, 0);
+	hash.add_bucket.resize (count);
+	for (size_t i = 0; i < count; i++) {
+		unsigned int b = bucket_of (hash, cell_of (hash, hash.add_x[i]), cell_of (hash, hash.add_z[i]));
+		hash.add_bucket[i] = b;
+		hash.bucket_start[b + 1]++;
+	}
+	for (unsigned int b = 0; b < buckets; b++) {
+		hash.bucket_start[b + 1] += hash.bucket_start[b];
+	}
+
+	// scatter, counting each bucket's fill up from its start
+	hash.x.resize (count);
+	hash.z.resize (count);
+	hash.value.resize (count);
+	std::vector<int>& fill = hash.bucket_start;
+	for (size_t i = 0; i < count; i++) {
+		int slot = fill[hash.add_bucket[i]]++;
+		hash.x[slot] = hash.add_x[i];
+		hash.z[slot] = hash.add_z[i];
+		hash.value[slot] = hash.add_value[i];
+	}
+	// every start has moved up to the next bucket's, shift them back
+	for (unsigned int b = buckets; b > 0; b--) {
+		fill[b] = fill[b - 1];
+	}
+	fill[0] = 0;
+	hash.build_ms = std::chrono::duration<double, std::milli> (std::chrono::high_resolution_clock::now () - start).count ();
+}
+
+/*-----------------------------------QUERIES------------------------------------------*/
+
+int query_spatial_hash (const SpatialHash& hash, float x, float z, float radius, std::vector<unsigned int>& found) {
+	int added = 0;
+	float radius_sq = radius * radius;
+	int cx0 = cell_of (hash, x - radius), cx1 = cell_of (hash, x + radius);
+	int cz0 = cell_of (hash, z - radius), cz1 = cell_of (hash, z + radius);
+	for (int cz = cz0; cz <= cz1; cz++) {
+		for (int cx = cx0; cx <= cx1; cx++) {
+			unsigned int b = bucket_of (hash, cx, cz);
+			for (int i = hash.bucket_start[b]; i < hash.bucket_start[b + 1]; i++) {
+				float dx = hash.x[i] - x, dz = hash.z[i] - z;
+				if (dx * dx + dz * dz < radius_sq && cell_of (hash, hash.x[i]) == cx && cell_of (hash, hash.z[i]) == cz) {
+					found.push_back (hash.value[i]);
+					added++;
+				}
+			}
+		}
+	}
+	return added;
+}
+
+unsigned int first_in_spatial_hash (const SpatialHash& hash, float x, float z, float radius, unsigned int ignore) {
+	float radius_sq = radius * radius;
+	int cx0 = cell_of (hash, x - radius), cx1 = cell_of (hash, x + radius);
+	int cz0 = cell_of (hash, z - radius), cz1 = cell_of (hash, z + radius);
+	for (int cz = cz0; cz <= cz1; cz++) {
+		for (int cx = cx0; cx <= cx1; cx++) {
+			unsigned int b = bucket_of (hash, cx, cz);
+			for (int i = hash.bucket_start[b]; i < hash.bucket_start[b + 1]; i++) {
+				float dx = hash.x[i] - x, dz = hash.z[i] - z;
+				// no need to check the cell, a point found twice is still a point in range
+				if (dx * dx + dz * dz < radius_sq && hash.value[i] != ignore) {
+					return hash.value[i];
+				}
+			}
+		}
+	}
+	return SPATIAL_HASH_NONE;
+}
+
+// Rings of cells outwards from the query's cell. A point in ring k is at
+// least (k - 1) cells away, so the search stops once the best so far is
+// closer than that.
+unsigned int nearest_in_spatial_hash (const SpatialHash& hash, float x, float z, float max_radius, unsigned int ignore, float* distance) {
+	unsigned int best = SPATIAL_HASH_NONE;
+	float best_sq = max_radius * max_radius;
+	int qx = cell_of (hash, x), qz = cell_of (hash, z);
+	int rings = (int)ceilf (max_radius * hash.inv_cell_size);
+	for (int k = 0; k <= rings; k++) {
+		float ring_min = (k - 1) * hash.cell_size;
+		if (k > 0 && ring_min * ring_min >= best_sq) {
+			break;
+		}
+		for (int cz = qz - k; cz <= qz + k; cz++) {
+			// the middle rows only have the two cells at the ends
+			int step = (cz == qz - k || cz == qz + k) ? 1 : 2 * k;
+			for (int cx = qx - k; cx <= qx + k; cx += step) {
+				unsigned int b = bucket_of (hash, cx, cz);
+				for (int i = hash.bucket_start[b]; i < hash.bucket_start[b + 1]; i++) {
+					float dx = hash.x[i] - x, dz = hash.z[i] - z;
+					float d_sq = dx * dx + dz * dz;
+					if (d_sq < best_sq && hash.value[i] != ignore) {
+						best_sq = d_sq;
+						best = hash.value[i];
+					}
+				}
+			}
+		}
+	}
+	if (distance) {
+		*distance = best == SPATIAL_HASH_NONE ? max_radius : sqrtf (best_sq);
+	}
+	return best;
+}
@@ -0,0 +1,57 @@
+#ifndef _SPATIAL_HASH_H_
+#define _SPATIAL_HASH_H_
+
+#include <vector>
+
+/*----------------------------------------------------------------------------
+                   SPATIAL HASH
+  ----------------------------------------------------------------------------*/
+// Broadphase for everything that collides on the ground: points on the XZ
+// plane in a uniform grid of square cells, with the cells hashed into a
+// power of two number of buckets so the grid needs no bounds.
+//
+// The hash is rebuilt rather than updated: points are added to a staging
+// list, then finish_spatial_hash counting-sorts them by bucket into one
+// packed array (x, z and value as structure of arrays). Rebuilding is two
+// passes over the points, cheaper than tracking moves for anything that
+// moves every tick, and points that never move only need building once.
+//
+// A query visits the buckets of the cells its circle overlaps. Different
+// cells can share a bucket, so every point is checked against the cell
+// being visited as well as the radius, and nothing is reported twice.
+// Queries only read the hash, any number of threads can run them at once.
+
+#define SPATIAL_HASH_NONE 0xffffffffu  // same as ENTITY_NONE
+#define SPATIAL_HASH_MIN_BUCKETS 64
+
+struct SpatialHash {
+	float cell_size, inv_cell_size;
+	unsigned int bucket_mask;  // bucket count - 1
+	std::vector<int> bucket_start;  // bucket b is [bucket_start[b], bucket_start[b + 1])
+	std::vector<float> x, z;  // sorted by bucket
+	std::vector<unsigned int> value;
+
+	// staging, between begin_spatial_hash and finish_spatial_hash
+	std::vector<float> add_x, add_z;
+	std::vector<unsigned int> add_value;
+	std::vector<unsigned int> add_bucket;
+
+	double build_ms;  // last finish_spatial_hash
+};
+
+// Cells should be at least as wide as the usual query radius
+void create_spatial_hash (SpatialHash& hash, float cell_size);
+// Start a rebuild, the hash keeps answering queries with the old points until it is finished
+void begin_spatial_hash (SpatialHash& hash);
+void add_to_spatial_hash (SpatialHash& hash, float x, float z, unsigned int value);
+// Sort the added points into the buckets, about two buckets per point
+void finish_spatial_hash (SpatialHash& hash);
+
+// Append the value of every point closer than radius to found, returns how many were added
+int query_spatial_hash (const SpatialHash& hash, float x, float z, float radius, std::vector<unsigned int>& found);
+// Value of any point closer than radius other than ignore, or SPATIAL_HASH_NONE
+unsigned int first_in_spatial_hash (const SpatialHash& hash, float x, float z, float radius, unsigned int ignore);
+// Value of the closest point within max_radius other than ignore, or SPATIAL_HASH_NONE
+unsigned int nearest_in_spatial_hash (const SpatialHash& hash, float x, float z, float max_radius, unsigned int ignore, float* distance);
+
+#endif
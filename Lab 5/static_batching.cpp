@@ -0,0 +1,142 @@
+#include "static_batching.h"
+#include <algorithm>
+#include <math.h>
+
+// Macro for indexing vertex buffer
+#define BUFFER_OFFSET(i) ((char *)NULL + (i))
+
+void create_static_batch (StaticBatch& batch, float cell_size) {
+	batch.cell_size = cell_size;
+	batch.items.clear ();
+	batch.draws.clear ();
+	batch.vao = batch.depth_vao = 0;
+	batch.vertex_buffer = batch.index_buffer = 0;
+	batch.vertex_count = batch.index_count = 0;
+}
+
+void add_static_mesh (StaticBatch& batch, const MeshPool& pool, int mesh, const mat4& model, GLuint texture, unsigned int material) {
+	StaticBatchItem item;
+	item.mesh = mesh;
+	item.model = model;
+	item.texture = texture;
+	item.material = material;
+	BoundingSphere world = transform_sphere (pool.meshes[mesh].bounds, model);
+	item.cell_x = (int)floor (world.center.v[0] / batch.cell_size);
+	item.cell_z = (int)floor (world.center.v[2] / batch.cell_size);
+	batch.items.push_back (item);
+}
+
+// Cell first so a cell's draws sit together, then the state the render queue sorts on
+static bool item_order (const StaticBatchItem& a, const StaticBatchItem& b) {
+	if (a.cell_x != b.cell_x) {
+		return a.cell_x < b.cell_x;
+	}
+	if (a.cell_z != b.cell_z) {
+		return a.cell_z < b.cell_z;
+	}
+	if (a.texture != b.texture) {
+		return a.texture < b.texture;
+	}
+	return a.material < b.material;
+}
+
+static bool same_draw (const StaticBatchItem& item, const StaticBatchDraw& draw) {
+	return item.cell_x == draw.cell_x && item.cell_z == draw.cell_z && item.texture == draw.texture && item.material == draw.material;
+}
+
+// Sphere around the box of a draw's world space vertices
+static BoundingSphere draw_bounds (const std::vector<float>& vertices, const std::vector<GLuint>& indices, GLuint first, GLuint count) {
+	vec3 lo (1e30f, 1e30f, 1e30f), hi (-1e30f, -1e30f, -1e30f);
+	for (GLuint i = first; i < first + count; i++) {
+		const float* p = &vertices[indices[i] * 8];
+		for (int c = 0; c < 3; c++) {
+			lo.v[c] = std::min (lo.v[c], p[c]);
+			hi.v[c] = std::max (hi.v[c], p[c]);
+		}
+	}
+	BoundingSphere sphere;
+	sphere.center = (lo + hi) * 0.5f;
+	sphere.radius = 0.0f;
+	for (GLuint i = first; i < first + count; i++) {
+		const float* p = &vertices[indices[i] * 8];
+		vec3 offset = vec3 (p[0], p[1], p[2]) - sphere.center;
+		sphere.radius = std::max (sphere.radius, dot (offset, offset));
+	}
+	sphere.radius = sqrt (sphere.radius);
+	return sphere;
+}
+
+void build_static_batch (StaticBatch& batch, const MeshPool& pool, GLuint program, GLuint depth_program) {
+	std::stable_sort (batch.items.begin (), batch.items.end (), item_order);
+	std::vector<float> vertices;
+	std::vector<GLuint> indices;
+	batch.draws.clear ();
+	for (size_t i = 0; i < batch.items.size (); i++) {
+		StaticBatchItem& item = batch.items[i];
+		if (batch.draws.empty () || !same_draw (item, batch.draws.back ())) {
+			StaticBatchDraw draw;
+			draw.cell_x = item.cell_x;
+			draw.cell_z = item.cell_z;
+			draw.texture = item.texture;
+			draw.material = item.material;
+			draw.first_index = (GLuint)indices.size ();
+			draw.index_count = 0;
+			batch.draws.push_back (draw);
+		}
+
+		// positions and normals to world space, normals the way ToonVertexShader.txt moves them
+		const PoolMesh& mesh = pool.meshes[item.mesh];
+		GLuint base = (GLuint)(vertices.size () / 8);
+		for (GLuint v = 0; v < mesh.vertex_count; v++) {
+			const float* src = &pool.vertices[(mesh.base_vertex + v) * 8];
+			vec4 p = item.model * vec4 (src[0], src[1], src[2], 1.0f);
+			vec4 n = item.model * vec4 (src[3], src[4], src[5], 0.0f);
+			float out[8] = { p.v[0], p.v[1], p.v[2], n.v[0], n.v[1], n.v[2], src[6], src[7] };
+			vertices.insert (vertices.end (), out, out + 8);
+		}
+		for (GLuint k = 0; k < mesh.index_count; k++) {
+			indices.push_back (base + pool.indices[mesh.first_index + k]);
+		}
+		batch.draws.back ().index_count += mesh.index_count;
+	}
+	for (size_t d = 0; d < batch.draws.size (); d++) {
+		StaticBatchDraw& draw = batch.draws[d];
+		draw.bounds = draw_bounds (vertices, indices, draw.first_index, draw.index_count);
+	}
+	batch.items.clear ();
+	batch.vertex_count = (int)(vertices.size () / 8);
+	batch.index_count = (int)indices.size ();
+	if (indices.empty ()) {
+		return;
+	}
+
+	// same interleaved layout as the MeshPool
+	glGenVertexArrays (1, &batch.vao);
+	glBindVertexArray (batch.vao);
+	glGenBuffers (1, &batch.vertex_buffer);
+	glBindBuffer (GL_ARRAY_BUFFER, batch.vertex_buffer);
+	glBufferData (GL_ARRAY_BUFFER, vertices.size () * sizeof (float), &vertices[0], GL_STATIC_DRAW);
+	glGenBuffers (1, &batch.index_buffer);
+	glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, batch.index_buffer);
+	glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices.size () * sizeof (GLuint), &indices[0], GL_STATIC_DRAW);
+
+	GLsizei stride = 8 * sizeof (float);
+	GLint position_loc = glGetAttribLocation (program, "vertex_position");
+	GLint normal_loc = glGetAttribLocation (program, "vertex_normal");
+	GLint texture_loc = glGetAttribLocation (program, "vertex_texture");
+	glEnableVertexAttribArray (position_loc);
+	glVertexAttribPointer (position_loc, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (0));
+	glEnableVertexAttribArray (normal_loc);
+	glVertexAttribPointer (normal_loc, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (3 * sizeof (float)));
+	glEnableVertexAttribArray (texture_loc);
+	glVertexAttribPointer (texture_loc, 2, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (6 * sizeof (float)));
+
+	glGenVertexArrays (1, &batch.depth_vao);
+	glBindVertexArray (batch.depth_vao);
+	glBindBuffer (GL_ARRAY_BUFFER, batch.vertex_buffer);
+	glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, batch.index_buffer);
+	position_loc = glGetAttribLocation (depth_program, "vertex_position");
+	glEnableVertexAttribArray (position_loc);
+	glVertexAttribPointer (position_loc, 3, GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET (0));
+	glBindVertexArray (0);
+}
@@ -0,0 +1,54 @@
+#ifndef _STATIC_BATCHING_H_
+#define _STATIC_BATCHING_H_
+
+#include <GL/glew.h>
+#include <vector>
+#include "frustum_culling.h"
+#include "maths_funcs.h"
+#include "multi_draw.h"
+
+/*----------------------------------------------------------------------------
+                   STATIC BATCHING
+  ----------------------------------------------------------------------------*/
+// Scenery that never moves is baked once at init. Each placed mesh is copied
+// out of the MeshPool, its vertices moved to world space by its model
+// matrix, and the result merged into one vertex/index buffer. The copies are
+// grouped by a square cell of the ground plane, then by texture and
+// material. Each group is one contiguous index range with a world bounding
+// sphere, so it can be frustum culled and drawn with one glDrawElements and
+// an identity model matrix.
+
+#define STATIC_CELL_SIZE 40.0f  // world units along x and z
+
+struct StaticBatchDraw {
+	int cell_x, cell_z;
+	GLuint texture;
+	unsigned int material;  // MATERIAL_* flags
+	GLuint first_index, index_count;
+	BoundingSphere bounds;  // world space
+};
+
+// One placed mesh waiting for build_static_batch
+struct StaticBatchItem {
+	int mesh;  // in the pool
+	mat4 model;
+	GLuint texture;
+	unsigned int material;
+	int cell_x, cell_z;
+};
+
+struct StaticBatch {
+	float cell_size;
+	std::vector<StaticBatchItem> items;
+	std::vector<StaticBatchDraw> draws;
+	GLuint vao, depth_vao, vertex_buffer, index_buffer;
+	int vertex_count, index_count;
+};
+
+void create_static_batch (StaticBatch& batch, float cell_size);
+// Queue a copy of a pool mesh, placed in the cell under its bounding sphere's centre
+void add_static_mesh (StaticBatch& batch, const MeshPool& pool, int mesh, const mat4& model, GLuint texture, unsigned int material);
+// Merge the queued meshes and upload them, with a VAO for each program
+void build_static_batch (StaticBatch& batch, const MeshPool& pool, GLuint program, GLuint depth_program);
+
+#endif